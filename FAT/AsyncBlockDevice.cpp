@@ -0,0 +1,476 @@
+/*! \file    AsyncBlockDevice.cpp
+    \brief   Simulated block device that supports asynchronous operations.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+
+The io_uring backend talks to the kernel directly with the io_uring_setup and io_uring_enter
+system calls rather than using liburing. That avoids an external dependency. The shared ring
+buffers are accessed with the gcc atomic built-ins, so that backend is only compiled with gcc
+(and compatible compilers) on Linux.
+*/
+
+#include "environ.hpp"
+
+#if eOPSYS == ePOSIX
+
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__) && eCOMPILER == eGCC
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "AsyncBlockDevice.hpp"
+
+//=================================
+//           io_uring
+//=================================
+
+//
+// This structure holds pointers into the rings shared with the kernel. The submission ring
+// holds indices into the array of submission queue entries (sqes). The completion ring holds
+// the completion queue entries directly.
+//
+struct AsyncBlockDevice::ring_state {
+    int       ring_fd;
+    void     *sq_memory;
+    size_t    sq_size;
+    void     *cq_memory;
+    size_t    cq_size;
+    void     *sqe_memory;
+    size_t    sqe_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+
+    #if defined(HAVE_IO_URING)
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    #endif
+};
+
+
+//
+// AsyncBlockDevice::start_ring
+//
+// Returns false if io_uring can't be used (for example because the kernel is too old or
+// because a container's security policy forbids it).
+//
+bool AsyncBlockDevice::start_ring()
+{
+    #if defined(HAVE_IO_URING)
+    io_uring_params parameters;
+    std::memset(&parameters, 0, sizeof(parameters));
+
+    int ring_fd = syscall(__NR_io_uring_setup, depth, &parameters);
+    if (ring_fd < 0) return false;
+
+    // IORING_OP_READ and IORING_OP_WRITE appeared (in Linux 5.6) at the same time as this
+    // feature flag. Older kernels would fail every operation, so use the thread pool there.
+    #if defined(IORING_FEAT_RW_CUR_POS)
+    if ((parameters.features & IORING_FEAT_RW_CUR_POS) == 0) {
+        close(ring_fd);
+        return false;
+    }
+    #else
+    close(ring_fd);
+    return false;
+    #endif
+
+    ring = new ring_state;
+    ring->ring_fd  = ring_fd;
+    ring->sq_size  = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+    ring->cq_size  = parameters.cq_off.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+    ring->sqe_size = parameters.sq_entries * sizeof(io_uring_sqe);
+
+    // Newer kernels map both rings with a single mmap.
+    bool single = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+
+    ring->sq_memory = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    ring->cq_memory = single ? ring->sq_memory :
+                      mmap(0, ring->cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    ring->sqe_memory = mmap(0, ring->sqe_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if (ring->sq_memory == MAP_FAILED || ring->cq_memory == MAP_FAILED ||
+        ring->sqe_memory == MAP_FAILED) {
+        if (ring->sq_memory  != MAP_FAILED) munmap(ring->sq_memory, ring->sq_size);
+        if (!single && ring->cq_memory != MAP_FAILED) munmap(ring->cq_memory, ring->cq_size);
+        if (ring->sqe_memory != MAP_FAILED) munmap(ring->sqe_memory, ring->sqe_size);
+        close(ring_fd);
+        delete ring;
+        ring = 0;
+        return false;
+    }
+
+    char *sq = static_cast<char *>(ring->sq_memory);
+    char *cq = static_cast<char *>(ring->cq_memory);
+    ring->sq_head  = reinterpret_cast<unsigned *>(sq + parameters.sq_off.head);
+    ring->sq_tail  = reinterpret_cast<unsigned *>(sq + parameters.sq_off.tail);
+    ring->sq_mask  = reinterpret_cast<unsigned *>(sq + parameters.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned *>(sq + parameters.sq_off.array);
+    ring->cq_head  = reinterpret_cast<unsigned *>(cq + parameters.cq_off.head);
+    ring->cq_tail  = reinterpret_cast<unsigned *>(cq + parameters.cq_off.tail);
+    ring->cq_mask  = reinterpret_cast<unsigned *>(cq + parameters.cq_off.ring_mask);
+    ring->sqes     = static_cast<io_uring_sqe *>(ring->sqe_memory);
+    ring->cqes     = reinterpret_cast<io_uring_cqe *>(cq + parameters.cq_off.cqes);
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+
+//
+// AsyncBlockDevice::stop_ring
+//
+void AsyncBlockDevice::stop_ring()
+{
+    #if defined(HAVE_IO_URING)
+    if (ring->cq_memory != ring->sq_memory) munmap(ring->cq_memory, ring->cq_size);
+    munmap(ring->sq_memory, ring->sq_size);
+    munmap(ring->sqe_memory, ring->sqe_size);
+    close(ring->ring_fd);
+    delete ring;
+    ring = 0;
+    #endif
+}
+
+
+//====================================
+//           Thread Pool
+//====================================
+
+//
+// AsyncBlockDevice::do_operation
+//
+// Does one operation synchronously. The thread pool workers use this. Short transfers are
+// treated as failures since the backing file is always a whole number of blocks.
+//
+void AsyncBlockDevice::do_operation(io_request *request)
+{
+    off_t   offset = static_cast<off_t>(request->block_number) * blk_size();
+    ssize_t result;
+
+    if (request->is_write) result = pwrite(fd, request->buffer, blk_size(), offset);
+    else result = pread(fd, request->buffer, blk_size(), offset);
+    request->failed = (result != blk_size());
+}
+
+
+//
+// AsyncBlockDevice::worker
+//
+// Each worker thread waits for requests to appear on the pending queue, does them, and puts
+// them on the done queue.
+//
+void *AsyncBlockDevice::worker(void *argument)
+{
+    AsyncBlockDevice *device = static_cast<AsyncBlockDevice *>(argument);
+
+    pthread_mutex_lock(&device->lock);
+    while (1) {
+        while (device->pending.empty() && !device->shutting_down)
+            pthread_cond_wait(&device->work_ready, &device->lock);
+        if (device->pending.empty()) break;
+
+        io_request *request = device->pending.front();
+        device->pending.pop_front();
+
+        // Don't hold the lock while doing I/O or there is no point in having threads.
+        pthread_mutex_unlock(&device->lock);
+        device->do_operation(request);
+        pthread_mutex_lock(&device->lock);
+
+        device->done.push_back(request);
+        pthread_cond_signal(&device->work_done);
+    }
+    pthread_mutex_unlock(&device->lock);
+    return 0;
+}
+
+
+//
+// AsyncBlockDevice::start_pool
+//
+// There is no point in having more threads than operations that can be in progress. On the
+// other hand, a few dozen threads is plenty to saturate any device.
+//
+void AsyncBlockDevice::start_pool()
+{
+    const int MAX_WORKERS = 16;
+
+    worker_count  = (depth < MAX_WORKERS) ? depth : MAX_WORKERS;
+    shutting_down = false;
+    workers       = new pthread_t[worker_count];
+
+    pthread_mutex_init(&lock, 0);
+    pthread_cond_init(&work_ready, 0);
+    pthread_cond_init(&work_done, 0);
+
+    for (int i = 0; i < worker_count; ++i) {
+        if (pthread_create(&workers[i], 0, worker, this) != 0) {
+            worker_count = i;
+            stop_pool();
+            throw "AsyncBlockDevice: Unable to create worker threads";
+        }
+    }
+}
+
+
+//
+// AsyncBlockDevice::stop_pool
+//
+// The workers finish any pending requests before they exit.
+//
+void AsyncBlockDevice::stop_pool()
+{
+    pthread_mutex_lock(&lock);
+    shutting_down = true;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_join(workers[i], 0);
+    }
+    delete [] workers;
+    workers = 0;
+
+    pthread_cond_destroy(&work_done);
+    pthread_cond_destroy(&work_ready);
+    pthread_mutex_destroy(&lock);
+}
+
+
+//=========================================
+//           AsyncBlockDevice
+//=========================================
+
+//
+// AsyncBlockDevice::AsyncBlockDevice
+//
+// The backing file is handled the same way as BlockDevice handles it. If it does not exist it
+// is created with the right size. Extending the file with ftruncate() fills it with zeros
+// without having to write them.
+//
+AsyncBlockDevice::AsyncBlockDevice(
+    const char *name, int size, int count, int queue_size, bool allow_io_uring) :
+    BlockDevice(size, count),
+    fd(-1), depth(queue_size), outstanding(0), ring(0), workers(0), worker_count(0)
+{
+    struct stat file_info;
+    off_t       required_size = static_cast<off_t>(size) * count;
+
+    if (depth < 1) depth = 1;
+
+    if (stat(name, &file_info) == 0) {
+        if (file_info.st_size != required_size)
+            throw "Bad backing file selected. Size of file is wrong";
+
+        if ((fd = open(name, O_RDWR)) == -1)
+            throw "Unable to open the backing file. Cause unknown";
+    }
+    else {
+        if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+            throw "Unable to create the backing file. Cause unknown";
+
+        if (ftruncate(fd, required_size) == -1) {
+            close(fd);
+            throw "Unable to create the backing file. Insufficient disk space?";
+        }
+    }
+
+    // Use io_uring if we can. Otherwise fall back on the thread pool.
+    if (allow_io_uring && start_ring()) backend = IO_URING;
+    else {
+        backend = THREAD_POOL;
+        try {
+            start_pool();
+        }
+        catch (...) {
+            close(fd);
+            throw;
+        }
+    }
+}
+
+
+//
+// AsyncBlockDevice::~AsyncBlockDevice
+//
+AsyncBlockDevice::~AsyncBlockDevice()
+{
+    // Don't let the kernel or the workers touch buffers after we are gone. If the ring can't be
+    // waited on there is nothing better to do than close it below, which makes the kernel
+    // cancel or finish what is left. A destructor must not throw.
+    try {
+        while (outstanding > 0) complete();
+    }
+    catch (...) { }
+
+    if (backend == IO_URING) stop_ring();
+    else stop_pool();
+    close(fd);
+}
+
+
+//
+// AsyncBlockDevice::read
+//
+void AsyncBlockDevice::read(int block_number, char *block_buffer)
+{
+    // Is this block on the disk?
+    if (block_number < 0 || block_number >= blk_count())
+        throw "Attempt to read an invalid block by a block device";
+
+    off_t offset = static_cast<off_t>(block_number) * blk_size();
+    if (pread(fd, block_buffer, blk_size(), offset) != blk_size())
+        throw "Unable to read a block from the backing file";
+}
+
+
+//
+// AsyncBlockDevice::write
+//
+void AsyncBlockDevice::write(int block_number, const char *block_buffer)
+{
+    // Is this block on the disk?
+    if (block_number < 0 || block_number >= blk_count())
+        throw "Attempt to write an invalid block by a block device";
+
+    off_t offset = static_cast<off_t>(block_number) * blk_size();
+    if (pwrite(fd, block_buffer, blk_size(), offset) != blk_size())
+        throw "Unable to write a block to the backing file";
+}
+
+
+//
+// AsyncBlockDevice::submit
+//
+// Requests for blocks that are not on the disk are not given to the backend as real operations.
+// They still go through the queue so that they are returned by complete() like any other.
+//
+void AsyncBlockDevice::submit(io_request *request)
+{
+    if (outstanding == depth)
+        throw "AsyncBlockDevice::submit() -- Too many operations in progress";
+
+    bool valid = (request->block_number >= 0 && request->block_number < blk_count());
+
+    #if defined(HAVE_IO_URING)
+    if (backend == IO_URING) {
+        unsigned      tail  = *ring->sq_tail;
+        unsigned      index = tail & *ring->sq_mask;
+        io_uring_sqe *entry = &ring->sqes[index];
+
+        std::memset(entry, 0, sizeof(*entry));
+        if (!valid) {
+            // A no-op completes with a result of zero. That counts as a failure.
+            entry->opcode = IORING_OP_NOP;
+        }
+        else {
+            entry->opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+            entry->fd     = fd;
+            entry->addr   = reinterpret_cast<unsigned long>(request->buffer);
+            entry->len    = blk_size();
+            entry->off    = static_cast<unsigned long long>(request->block_number) * blk_size();
+        }
+        entry->user_data = reinterpret_cast<unsigned long>(request);
+        ring->sq_array[index] = index;
+
+        // The entry must be visible to the kernel before the new tail is.
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        long submitted;
+        do {
+            submitted = syscall(__NR_io_uring_enter, ring->ring_fd, 1, 0, 0, 0, 0);
+        } while (submitted < 0 && errno == EINTR);
+
+        // If the kernel did not take the entry, withdraw it. Otherwise it would be submitted by
+        // the next call without being counted in outstanding.
+        if (submitted != 1) {
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+            throw "AsyncBlockDevice::submit() -- io_uring_enter failed";
+        }
+        ++outstanding;
+        return;
+    }
+    #endif
+
+    pthread_mutex_lock(&lock);
+    if (!valid) {
+        request->failed = true;
+        done.push_back(request);
+    }
+    else {
+        pending.push_back(request);
+        pthread_cond_signal(&work_ready);
+    }
+    pthread_mutex_unlock(&lock);
+    ++outstanding;
+}
+
+
+//
+// AsyncBlockDevice::complete
+//
+BlockDevice::io_request *AsyncBlockDevice::complete()
+{
+    if (outstanding == 0) return 0;
+
+    io_request *request = 0;
+
+    #if defined(HAVE_IO_URING)
+    if (backend == IO_URING) {
+        while (1) {
+            unsigned head = __atomic_load_n(ring->cq_head, __ATOMIC_RELAXED);
+            unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            if (head != tail) {
+                io_uring_cqe *entry = &ring->cqes[head & *ring->cq_mask];
+                request = reinterpret_cast<io_request *>(entry->user_data);
+                request->failed = (entry->res != blk_size());
+                __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+                break;
+            }
+
+            // Nothing finished yet. Sleep in the kernel until something does.
+            if (syscall(__NR_io_uring_enter, ring->ring_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+                throw "AsyncBlockDevice::complete() -- io_uring_enter failed";
+        }
+        --outstanding;
+        return request;
+    }
+    #endif
+
+    pthread_mutex_lock(&lock);
+    while (done.empty())
+        pthread_cond_wait(&work_done, &lock);
+    request = done.front();
+    done.pop_front();
+    pthread_mutex_unlock(&lock);
+
+    --outstanding;
+    return request;
+}
+
+#endif
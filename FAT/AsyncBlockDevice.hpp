@@ -0,0 +1,85 @@
+/*! \file    AsyncBlockDevice.hpp
+    \brief   Simulated block device that supports asynchronous operations.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+Like BlockDevice this class simulates a raw block device using a file in the hosting file
+system. However, it allows many operations to be in progress at once (see submit() and
+complete() in BlockDevice). This keeps fast storage busy.
+
+On Linux the operations are done using io_uring when the kernel allows it. Otherwise a pool of
+threads does the operations with pread() and pwrite(). This class is only available on POSIX
+systems.
+*/
+
+#ifndef ASYNCBLOCKDEVICE_HPP
+#define ASYNCBLOCKDEVICE_HPP
+
+#include "environ.hpp"
+#include "BlockDevice.hpp"
+
+#if eOPSYS == ePOSIX
+
+#include <pthread.h>
+
+class AsyncBlockDevice : public BlockDevice {
+public:
+
+    enum backend_type { IO_URING, THREAD_POOL };
+
+private:
+    int          fd;             // The backing file.
+    int          depth;          // Maximum number of operations in progress.
+    int          outstanding;    // Number of operations submitted but not yet completed.
+    backend_type backend;
+
+    // Information needed by the io_uring backend. The details are private to the .cpp file.
+    struct ring_state;
+    ring_state *ring;
+
+    // Information needed by the thread pool backend.
+    pthread_t       *workers;
+    int              worker_count;
+    pthread_mutex_t  lock;
+    pthread_cond_t   work_ready;       // Signaled when pending gets a request (or on shutdown).
+    pthread_cond_t   work_done;        // Signaled when done gets a request.
+    std::deque<io_request *> pending;  // Submitted but not yet started.
+    std::deque<io_request *> done;     // Finished but not yet returned by complete().
+    bool             shutting_down;
+
+    AsyncBlockDevice &operator=(const AsyncBlockDevice &);
+    AsyncBlockDevice(const AsyncBlockDevice &);
+      // Make these members private so that we disable copying.
+
+    bool start_ring();
+    void stop_ring();
+    void start_pool();
+    void stop_pool();
+    void do_operation(io_request *request);
+    static void *worker(void *);
+
+public:
+    AsyncBlockDevice(const char *name, int size, int count, int queue_size = 32,
+                     bool allow_io_uring = true);
+      // The name is the name of the backing file. It is treated as for BlockDevice. The
+      // queue_size is the maximum number of operations that can be in progress at once. If
+      // allow_io_uring is false the thread pool is used even if io_uring is available.
+
+   ~AsyncBlockDevice();
+      // Waits for any operations that are still in progress.
+
+    void read(int block_number, char *block_buffer);
+    void write(int block_number, const char *block_buffer);
+      // These are synchronous. They are done directly and do not use the queue.
+
+    void submit(io_request *request);
+    io_request *complete();
+    int  queue_depth() { return depth; }
+
+    backend_type which_backend() const { return backend; }
+      // Returns the mechanism being used for asynchronous operations.
+};
+
+#endif
+
+#endif
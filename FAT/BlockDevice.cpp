@@ -21,6 +21,12 @@ This module simulates a raw block device by creating a file in the hosting file
 #include <windows.h>
 #endif
 
+#if eOPSYS == ePOSIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#endif
+
 #include "BlockDevice.hpp"
 
 #if eOPSYS == eOS2
@@ -72,6 +78,29 @@ static long check_file(const char *name)
 
 #endif
 
+#if eOPSYS == ePOSIX
+
+//
+// Check_Size
+//
+// This helper function finds out if the given file exists. If so, it returns the file's size.
+// It will return -1 if the file does not exist.
+//
+static long check_file(const char *name)
+{
+    // We need to figure out how big the file is. This is the way it's done using POSIX.
+
+    struct stat file_info;
+
+    if (stat(name, &file_info) == -1) {
+        if (errno == ENOENT) return -1;
+        throw "Unexpected error occured when searching for the backing file";
+    }
+    return static_cast<long>(file_info.st_size);
+}
+
+#endif
+
 
 //
 // BlockDevice::BlockDevice
@@ -143,3 +172,36 @@ void BlockDevice::write(int block_number, const char *block_buffer)
     backing_file.seekp(block_number * block_size);
     backing_file.write(block_buffer, block_size);
 }
+
+
+//
+// BlockDevice::submit
+//
+// There is nothing asynchronous here. The operation is done at once and the request is put
+// aside to be picked up by complete().
+//
+void BlockDevice::submit(io_request *request)
+{
+    request->failed = false;
+    try {
+        if (request->is_write) write(request->block_number, request->buffer);
+        else read(request->block_number, request->buffer);
+    }
+    catch (const char *) {
+        request->failed = true;
+    }
+    finished.push_back(request);
+}
+
+
+//
+// BlockDevice::complete
+//
+BlockDevice::io_request *BlockDevice::complete()
+{
+    if (finished.empty()) return 0;
+
+    io_request *result = finished.front();
+    finished.pop_front();
+    return result;
+}
@@ -7,24 +7,48 @@ This module simulates a raw block device by creating a file in the hosting file
 
 This class should really be an abstract base class with derived classes supporting different
 backing methods. Doing that would be too much like work, so I'm not going to bother right now.
-Maybe later.
+Maybe later. For now read() and write() are virtual so that derived classes can wrap another
+device and add behavior to it (see SlowBlockDevice for an example). Such derived classes use the
+protected constructor, which does not create a backing file.
 */
 
 #ifndef BLOCKDEVICE_HPP
 #define BLOCKDEVICE_HPP
 
+#include <deque>
 #include <fstream>
 
 class BlockDevice {
+public:
+
+    // This structure describes an asynchronous operation. The caller owns both the request and
+    // the buffer. Both must remain valid until the request is handed back by complete().
+    //
+    struct io_request {
+        int   block_number;
+        char *buffer;
+        bool  is_write;   // =true for a write, =false for a read.
+        bool  failed;     // Set when the operation completes. =true if it did not work.
+        void *tag;        // For the caller's use. The device does not look at it.
+    };
+
 private:
     std::fstream backing_file; // We will simulate our block device in a file.
     const int block_size;      // How large are the blocks?
     const int block_count;     // How many blocks?
 
+    std::deque<io_request *> finished;
+      // Requests done by the default submit() but not yet returned by complete().
+
     BlockDevice &operator=(const BlockDevice &);
     BlockDevice(const BlockDevice &);
       // Make these members private so that we disable copying.
 
+protected:
+    BlockDevice(int size, int count) : block_size(size), block_count(count) { }
+      // For use by derived classes that wrap another device or that manage their own storage.
+      // No backing file is opened.
+
 public:
     BlockDevice(const char *name, int size, int count);
       // The name will be used as the file name for the backing file. If the file already
@@ -32,15 +56,31 @@ public:
       // count bytes), the block_ device object will put itself into an error state. In that
       // case, read() and write() will always fail.
 
+    virtual ~BlockDevice() { }
+
     int  blk_size() { return block_size; }
     int  blk_count() { return block_count; }
       // These two functions allow clients to find out our dimensions.
 
-    void read(int block_number, char *block_buffer);
-    void write(int block_number, const char *block_buffer);
+    virtual void read(int block_number, char *block_buffer);
+    virtual void write(int block_number, const char *block_buffer);
       // These two operations are basically the only ones a BlockDevice needs to worry about. It
       // is not concerned with the meaning of the data in the blocks that it is manipulating. It
       // never reads or writes data in units with a size different than one block.
+
+    virtual void submit(io_request *request);
+      // Start an operation without waiting for it to finish. The default implementation just
+      // does the operation immediately using read() or write(). Devices that can really have
+      // several operations in progress at once override this. Errors are reported by setting
+      // the request's failed flag, not by throwing.
+
+    virtual io_request *complete();
+      // Wait for a submitted operation to finish and return its request. Operations might
+      // finish in any order. Returns a null pointer if no operations are outstanding.
+
+    virtual int queue_depth() { return 1; }
+      // The number of operations that can usefully be in progress at once. Clients must not
+      // have more than this many requests outstanding.
 };
 
 #endif
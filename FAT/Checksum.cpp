@@ -0,0 +1,150 @@
+/*! \file    Checksum.cpp
+    \brief   Implementation of the CRC-32C checksum function.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include "environ.hpp"
+
+#include <cstring>
+
+#if eCOMPILER == eGCC && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE42_CRC
+#include <nmmintrin.h>
+#endif
+
+#if eCOMPILER == eGCC && defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define HAVE_ARM_CRC
+#include <arm_acle.h>
+#endif
+
+#include "Checksum.hpp"
+
+//=======================================
+//           Table Driven CRC
+//=======================================
+
+namespace {
+
+    // The Castagnoli polynomial in reversed bit order.
+    const unsigned int POLYNOMIAL = 0x82F63B78U;
+
+    unsigned int crc_table[256];
+    bool         crc_table_ready = false;
+
+    void build_table()
+    {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value & 1) ? (value >> 1) ^ POLYNOMIAL : (value >> 1);
+            }
+            crc_table[i] = value;
+        }
+        crc_table_ready = true;
+    }
+
+
+    unsigned int crc32c_table(const unsigned char *data, std::size_t length, unsigned int crc)
+    {
+        if (!crc_table_ready) build_table();
+        while (length-- > 0) {
+            crc = crc_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+
+//=========================================
+//           Hardware Assisted CRC
+//=========================================
+
+    #if defined(HAVE_SSE42_CRC)
+
+    // The target attribute lets this function use SSE 4.2 without requiring it elsewhere. It is
+    // only called after checking that the processor supports it.
+    __attribute__((target("sse4.2")))
+    unsigned int crc32c_sse42(const unsigned char *data, std::size_t length, unsigned int crc)
+    {
+        #if defined(__x86_64__)
+        unsigned long long wide = crc;
+        while (length >= 8) {
+            unsigned long long word;
+            std::memcpy(&word, data, 8);
+            wide    = _mm_crc32_u64(wide, word);
+            data   += 8;
+            length -= 8;
+        }
+        crc = static_cast<unsigned int>(wide);
+        #endif
+        while (length >= 4) {
+            unsigned int word;
+            std::memcpy(&word, data, 4);
+            crc     = _mm_crc32_u32(crc, word);
+            data   += 4;
+            length -= 4;
+        }
+        while (length-- > 0) {
+            crc = _mm_crc32_u8(crc, *data++);
+        }
+        return crc;
+    }
+
+    #endif
+
+    #if defined(HAVE_ARM_CRC)
+
+    unsigned int crc32c_arm(const unsigned char *data, std::size_t length, unsigned int crc)
+    {
+        while (length >= 8) {
+            unsigned long long word;
+            std::memcpy(&word, data, 8);
+            crc     = __crc32cd(crc, word);
+            data   += 8;
+            length -= 8;
+        }
+        while (length-- > 0) {
+            crc = __crc32cb(crc, *data++);
+        }
+        return crc;
+    }
+
+    #endif
+}
+
+
+//
+// crc32c_hardware
+//
+bool crc32c_hardware()
+{
+    #if defined(HAVE_SSE42_CRC)
+    return __builtin_cpu_supports("sse4.2");
+    #elif defined(HAVE_ARM_CRC)
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+
+//
+// crc32c
+//
+// The CRC is computed with the usual pre and post inversion so that leading and trailing zeros
+// affect the result.
+//
+unsigned int crc32c(const void *data, std::size_t length, unsigned int crc)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+
+    crc = ~crc;
+    #if defined(HAVE_SSE42_CRC)
+    static const bool sse42 = crc32c_hardware();
+    if (sse42) return ~crc32c_sse42(bytes, length, crc);
+    #elif defined(HAVE_ARM_CRC)
+    return ~crc32c_arm(bytes, length, crc);
+    #endif
+    return ~crc32c_table(bytes, length, crc);
+}
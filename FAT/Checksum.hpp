@@ -0,0 +1,24 @@
+/*! \file    Checksum.hpp
+    \brief   Interface to the CRC-32C checksum function.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+CRC-32C (the Castagnoli polynomial) is the checksum used by many real file systems and storage
+protocols. Recent x86 processors compute it with a dedicated instruction, as do ARMv8
+processors with the CRC extension. When the compiler and processor support those instructions
+they are used. Otherwise a table driven implementation is used. Both give the same results.
+*/
+
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstddef>
+
+unsigned int crc32c(const void *data, std::size_t length, unsigned int crc = 0);
+  // Returns the CRC-32C of the given data. To checksum data in pieces, pass the result of one
+  // call as the crc of the next. The result is 32 bits on every system we support.
+
+bool crc32c_hardware();
+  // Returns true if crc32c() is using processor instructions.
+
+#endif
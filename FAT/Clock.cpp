@@ -0,0 +1,65 @@
+/*! \file    Clock.cpp
+    \brief   Implementation of a high resolution monotonic clock.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include "environ.hpp"
+
+#include <ctime>
+
+#if eOPSYS == eWIN32
+#include <windows.h>
+#endif
+
+#if eOPSYS == ePOSIX
+#include <time.h>
+#endif
+
+#include "Clock.hpp"
+
+//
+// clock_microseconds
+//
+// If the system doesn't offer anything better, fall back on the standard clock() function.
+// That measures processor time rather than elapsed time, but it is better than nothing.
+//
+double clock_microseconds()
+{
+    #if eOPSYS == ePOSIX
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+
+    #elif eOPSYS == eWIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (static_cast<double>(now.QuadPart) * 1000000.0) / frequency.QuadPart;
+
+    #else
+    return (static_cast<double>(std::clock()) * 1000000.0) / CLOCKS_PER_SEC;
+    #endif
+}
+
+
+//
+// clock_delay
+//
+void clock_delay(double microseconds)
+{
+    if (microseconds <= 0.0) return;
+
+    #if eOPSYS == ePOSIX
+    struct timespec request;
+    request.tv_sec  = static_cast<time_t>(microseconds / 1000000.0);
+    request.tv_nsec = static_cast<long>((microseconds - request.tv_sec * 1000000.0) * 1000.0);
+    nanosleep(&request, 0);
+    #endif
+
+    #if eOPSYS == eWIN32
+    Sleep(static_cast<DWORD>(microseconds / 1000.0));
+    #endif
+}
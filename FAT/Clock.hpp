@@ -0,0 +1,22 @@
+/*! \file    Clock.hpp
+    \brief   Interface to a high resolution monotonic clock.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+The standard clock() function measures processor time and is too coarse for timing individual
+file system operations. This module provides wall clock time with (at least) microsecond
+resolution on the systems where I know how to get it.
+*/
+
+#ifndef CLOCK_HPP
+#define CLOCK_HPP
+
+double clock_microseconds();
+  // Returns the current time in microseconds measured from an arbitrary origin. The returned
+  // values never decrease. Only differences between values are meaningful.
+
+void clock_delay(double microseconds);
+  // Suspends the caller for (about) the given number of microseconds. On systems where I don't
+  // know how to do that it does nothing.
+
+#endif
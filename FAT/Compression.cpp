@@ -0,0 +1,179 @@
+/*! \file    Compression.cpp
+    \brief   Implementation of a small LZ77 style compressor.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include <cstring>
+
+#include "Compression.hpp"
+
+namespace {
+
+    const int MIN_MATCH     = 4;
+    const int LAST_LITERALS = 5;       // The data always ends with at least this many literals.
+    const int MAX_OFFSET    = 65535;
+    const int HASH_BITS     = 12;
+
+    unsigned int read32(const unsigned char *p)
+    {
+        unsigned int value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    unsigned int hash(unsigned int sequence)
+    {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    //
+    // put_length
+    //
+    // Writes the extension bytes for a count that didn't fit into its half of the token.
+    // Returns false if there is no room.
+    //
+    bool put_length(unsigned char *&out, unsigned char *end, int count)
+    {
+        for (count -= 15; count >= 255; count -= 255) {
+            if (out == end) return false;
+            *out++ = 255;
+        }
+        if (out == end) return false;
+        *out++ = static_cast<unsigned char>(count);
+        return true;
+    }
+
+    //
+    // put_sequence
+    //
+    // Writes literals followed by a match. A match length of zero means there is no match
+    // (this is only done at the end of the data).
+    //
+    bool put_sequence(unsigned char *&out, unsigned char *end,
+                      const unsigned char *literals, int literal_count, int offset, int match)
+    {
+        int match_code = (match == 0) ? 0 : match - MIN_MATCH;
+
+        if (out == end) return false;
+        *out++ = static_cast<unsigned char>(((literal_count < 15 ? literal_count : 15) << 4) |
+                                             (match_code < 15 ? match_code : 15));
+        if (literal_count >= 15 && !put_length(out, end, literal_count)) return false;
+
+        if (end - out < literal_count) return false;
+        std::memcpy(out, literals, literal_count);
+        out += literal_count;
+
+        if (match == 0) return true;
+        if (end - out < 2) return false;
+        *out++ = static_cast<unsigned char>( offset       & 0xFF);
+        *out++ = static_cast<unsigned char>((offset >> 8) & 0xFF);
+        if (match_code >= 15 && !put_length(out, end, match_code)) return false;
+        return true;
+    }
+}
+
+
+//
+// lz_compress
+//
+int lz_compress(const char *source, int length, char *destination, int capacity)
+{
+    const unsigned char *in    = reinterpret_cast<const unsigned char *>(source);
+    unsigned char       *out   = reinterpret_cast<unsigned char *>(destination);
+    unsigned char       *end   = out + capacity;
+    int                  limit = length - LAST_LITERALS;
+    int                  table[1 << HASH_BITS];
+    int                  anchor = 0;
+    int                  position = 0;
+
+    for (int i = 0; i < (1 << HASH_BITS); ++i) table[i] = -1;
+
+    while (position + MIN_MATCH <= limit) {
+        unsigned int sequence  = read32(in + position);
+        unsigned int slot      = hash(sequence);
+        int          candidate = table[slot];
+        table[slot] = position;
+
+        if (candidate < 0 || position - candidate > MAX_OFFSET ||
+            read32(in + candidate) != sequence) {
+            ++position;
+            continue;
+        }
+
+        int match = MIN_MATCH;
+        while (position + match < limit && in[candidate + match] == in[position + match])
+            ++match;
+
+        int literal_count = position - anchor;
+        if (!put_sequence(out, end, in + anchor, literal_count, position - candidate, match))
+            return 0;
+        position += match;
+        anchor    = position;
+    }
+
+    if (!put_sequence(out, end, in + anchor, length - anchor, 0, 0)) return 0;
+    return out - reinterpret_cast<unsigned char *>(destination);
+}
+
+
+//
+// lz_decompress
+//
+// Everything read from the source is checked so that damaged data can't cause a buffer
+// overrun.
+//
+int lz_decompress(const char *source, int length, char *destination, int capacity)
+{
+    const unsigned char *in      = reinterpret_cast<const unsigned char *>(source);
+    const unsigned char *in_end  = in + length;
+    unsigned char       *out     = reinterpret_cast<unsigned char *>(destination);
+    unsigned char       *start   = out;
+    unsigned char       *out_end = out + capacity;
+
+    while (in < in_end) {
+        int token = *in++;
+
+        // The literals.
+        int literal_count = token >> 4;
+        if (literal_count == 15) {
+            int extra;
+            do {
+                if (in == in_end) return -1;
+                extra = *in++;
+                literal_count += extra;
+            } while (extra == 255);
+        }
+        if (in_end - in < literal_count || out_end - out < literal_count) return -1;
+        std::memcpy(out, in, literal_count);
+        in  += literal_count;
+        out += literal_count;
+
+        // The last sequence has no match.
+        if (in == in_end) break;
+
+        // The match.
+        if (in_end - in < 2) return -1;
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out - start) return -1;
+
+        int match = token & 0x0F;
+        if (match == 15) {
+            int extra;
+            do {
+                if (in == in_end) return -1;
+                extra = *in++;
+                match += extra;
+            } while (extra == 255);
+        }
+        match += MIN_MATCH;
+        if (out_end - out < match) return -1;
+
+        // The match might overlap the bytes being written so copy one byte at a time.
+        const unsigned char *from = out - offset;
+        while (match-- > 0) *out++ = *from++;
+    }
+    return out - start;
+}
@@ -0,0 +1,28 @@
+/*! \file    Compression.hpp
+    \brief   Interface to a small LZ77 style compressor.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+The compressed format is modeled on the LZ4 block format. The data is a sequence of tokens.
+Each token is a byte holding a literal count (high four bits) and a match length (low four
+bits, biased by the minimum match of four). A count of 15 is extended by following bytes that
+are added to it until a byte other than 255 is found. The literal bytes follow the token and
+then a two byte (little endian) offset back into the output for the match. The last token has
+only literals.
+
+The compressor favors speed over compression ratio. It finds matches using a small hash table
+of recent positions and does not search any further than that.
+*/
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+int lz_compress(const char *source, int length, char *destination, int capacity);
+  // Compresses length bytes from source into destination. Returns the size of the compressed
+  // data or zero if it would not fit in capacity bytes.
+
+int lz_decompress(const char *source, int length, char *destination, int capacity);
+  // Decompresses length bytes from source into destination. Returns the size of the
+  // decompressed data or -1 if the source is not valid or would not fit in capacity bytes.
+
+#endif
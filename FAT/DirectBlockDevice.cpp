@@ -0,0 +1,228 @@
+/*! \file    DirectBlockDevice.cpp
+    \brief   Simulated block device that bypasses the host's cache.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include "environ.hpp"
+
+#if eOPSYS == ePOSIX
+
+#include <cstdlib>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include "DirectBlockDevice.hpp"
+
+// The pool buffers are aligned at least this strictly. No device we know of needs more.
+static const int POOL_ALIGNMENT = 4096;
+
+
+//
+// DirectBlockDevice::enable_direct
+//
+// The logical block size of a real block device can be asked for directly. For an ordinary
+// file there is no portable way to find it, so we try direct reads of increasing size until
+// one is accepted. A read beyond the end of the file returns a short count rather than EINVAL
+// so this works even if the file is small.
+//
+bool DirectBlockDevice::enable_direct(const char *name)
+{
+    #if defined(O_DIRECT)
+    int direct_fd = open(name, O_RDWR | O_DIRECT);
+    if (direct_fd == -1) return false;   // Typically EINVAL: the file system doesn't allow it.
+
+    struct stat file_info;
+    int         logical_size = 0;
+
+    if (fstat(direct_fd, &file_info) == 0 && S_ISBLK(file_info.st_mode)) {
+        #if defined(BLKSSZGET)
+        if (ioctl(direct_fd, BLKSSZGET, &logical_size) == -1) logical_size = 0;
+        #endif
+    }
+    else {
+        char *probe = acquire_buffer();
+        for (int size = 512; size <= POOL_ALIGNMENT && logical_size == 0; size *= 2) {
+            if (pread(direct_fd, probe, size, 0) != -1) logical_size = size;
+            else if (errno != EINVAL) break;
+        }
+        release_buffer(probe);
+    }
+
+    if (logical_size == 0 || logical_size > POOL_ALIGNMENT || blk_size() % logical_size != 0) {
+        ::close(direct_fd);
+        return false;
+    }
+
+    ::close(fd);
+    fd        = direct_fd;
+    alignment = logical_size;
+    return true;
+
+    #elif defined(F_NOCACHE)
+    // Mac OS X has no O_DIRECT. This flag has the same effect and no alignment requirements.
+    if (fcntl(fd, F_NOCACHE, 1) == -1) return false;
+    alignment = 1;
+    return true;
+
+    #else
+    return false;
+    #endif
+}
+
+
+//
+// DirectBlockDevice::acquire_buffer
+//
+char *DirectBlockDevice::acquire_buffer()
+{
+    if (free_buffers.empty())
+        throw "DirectBlockDevice -- No aligned buffers available";
+
+    char *buffer = free_buffers.back();
+    free_buffers.pop_back();
+    return buffer;
+}
+
+
+//
+// DirectBlockDevice::release_buffer
+//
+void DirectBlockDevice::release_buffer(char *buffer)
+{
+    free_buffers.push_back(buffer);
+}
+
+
+//
+// DirectBlockDevice::aligned
+//
+bool DirectBlockDevice::aligned(const void *buffer) const
+{
+    return reinterpret_cast<unsigned long>(buffer) % alignment == 0;
+}
+
+
+//
+// DirectBlockDevice::DirectBlockDevice
+//
+// The backing file is first opened (or created) normally so that its size can be set up the
+// same way as for AsyncBlockDevice. Only then do we try to switch to direct I/O.
+//
+DirectBlockDevice::DirectBlockDevice(const char *name, int size, int count, int pool_size) :
+    BlockDevice(size, count), fd(-1), direct(false), alignment(1), pool(0)
+{
+    struct stat file_info;
+    off_t       required_size = static_cast<off_t>(size) * count;
+
+    if (pool_size < 1) pool_size = 1;
+
+    // Round each buffer up so that all of them are aligned.
+    size_t stride = (size + POOL_ALIGNMENT - 1) / POOL_ALIGNMENT * POOL_ALIGNMENT;
+    void  *memory;
+    if (posix_memalign(&memory, POOL_ALIGNMENT, stride * pool_size) != 0)
+        throw "DirectBlockDevice -- Unable to allocate aligned buffers";
+    pool = static_cast<char *>(memory);
+    for (int i = 0; i < pool_size; ++i) {
+        free_buffers.push_back(pool + i * stride);
+    }
+
+    if (stat(name, &file_info) == 0) {
+        if (file_info.st_size != required_size) {
+            std::free(pool);
+            throw "Bad backing file selected. Size of file is wrong";
+        }
+        if ((fd = open(name, O_RDWR)) == -1) {
+            std::free(pool);
+            throw "Unable to open the backing file. Cause unknown";
+        }
+    }
+    else {
+        if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+            std::free(pool);
+            throw "Unable to create the backing file. Cause unknown";
+        }
+        if (ftruncate(fd, required_size) == -1) {
+            ::close(fd);
+            std::free(pool);
+            throw "Unable to create the backing file. Insufficient disk space?";
+        }
+    }
+
+    direct = enable_direct(name);
+}
+
+
+//
+// DirectBlockDevice::~DirectBlockDevice
+//
+DirectBlockDevice::~DirectBlockDevice()
+{
+    ::close(fd);
+    std::free(pool);
+}
+
+
+//
+// DirectBlockDevice::read
+//
+void DirectBlockDevice::read(int block_number, char *block_buffer)
+{
+    // Is this block on the disk?
+    if (block_number < 0 || block_number >= blk_count())
+        throw "Attempt to read an invalid block by a block device";
+
+    off_t offset = static_cast<off_t>(block_number) * blk_size();
+
+    if (aligned(block_buffer)) {
+        if (pread(fd, block_buffer, blk_size(), offset) != blk_size())
+            throw "Unable to read a block from the backing file";
+        return;
+    }
+
+    char   *bounce = acquire_buffer();
+    ssize_t result = pread(fd, bounce, blk_size(), offset);
+    if (result == blk_size()) std::memcpy(block_buffer, bounce, blk_size());
+    release_buffer(bounce);
+    if (result != blk_size())
+        throw "Unable to read a block from the backing file";
+}
+
+
+//
+// DirectBlockDevice::write
+//
+void DirectBlockDevice::write(int block_number, const char *block_buffer)
+{
+    // Is this block on the disk?
+    if (block_number < 0 || block_number >= blk_count())
+        throw "Attempt to write an invalid block by a block device";
+
+    off_t offset = static_cast<off_t>(block_number) * blk_size();
+
+    if (aligned(block_buffer)) {
+        if (pwrite(fd, block_buffer, blk_size(), offset) != blk_size())
+            throw "Unable to write a block to the backing file";
+        return;
+    }
+
+    char *bounce = acquire_buffer();
+    std::memcpy(bounce, block_buffer, blk_size());
+    ssize_t result = pwrite(fd, bounce, blk_size(), offset);
+    release_buffer(bounce);
+    if (result != blk_size())
+        throw "Unable to write a block to the backing file";
+}
+
+#endif
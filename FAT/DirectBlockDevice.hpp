@@ -0,0 +1,76 @@
+/*! \file    DirectBlockDevice.hpp
+    \brief   Simulated block device that bypasses the host's cache.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+Like BlockDevice this class simulates a raw block device using a file in the hosting file
+system. However, the file is opened with O_DIRECT (or the equivalent) so that blocks are not
+also held in the host's page cache. This keeps the memory used by the simulation predictable
+and avoids caching the same block twice when the file system does its own caching.
+
+Direct I/O requires that the buffer, the file offset, and the transfer size all be multiples
+of the device's logical block size. The block size given to the constructor is checked against
+that requirement. Buffers that are not suitably aligned are handled by copying through a small
+pool of aligned buffers allocated when the device is constructed. If direct I/O is not
+possible (for example because the hosting file system doesn't support it or because the block
+size is not a multiple of the logical block size) the device falls back to ordinary buffered
+I/O. This class is only available on POSIX systems.
+*/
+
+#ifndef DIRECTBLOCKDEVICE_HPP
+#define DIRECTBLOCKDEVICE_HPP
+
+#include <vector>
+
+#include "environ.hpp"
+#include "BlockDevice.hpp"
+
+#if eOPSYS == ePOSIX
+
+class DirectBlockDevice : public BlockDevice {
+private:
+    int    fd;                         // The backing file.
+    bool   direct;                     // =true if the backing file is really using direct I/O.
+    int    alignment;                  // Required alignment of buffers, offsets, and sizes.
+    char  *pool;                       // Storage for all the aligned buffers.
+    std::vector<char *> free_buffers;  // Aligned buffers not currently in use.
+
+    DirectBlockDevice &operator=(const DirectBlockDevice &);
+    DirectBlockDevice(const DirectBlockDevice &);
+      // Make these members private so that we disable copying.
+
+    bool enable_direct(const char *name);
+      // Reopen the backing file for direct I/O and work out the alignment it requires.
+      // Returns false (leaving the file in buffered mode) if that can't be done.
+
+    char *acquire_buffer();
+    void  release_buffer(char *buffer);
+      // Manage the pool of aligned buffers.
+
+    bool aligned(const void *buffer) const;
+
+public:
+    static const int DEFAULT_POOL_SIZE = 4;
+
+    DirectBlockDevice(const char *name, int size, int count, int pool_size = DEFAULT_POOL_SIZE);
+      // The name is the name of the backing file. It is treated as for BlockDevice. The
+      // pool_size is the number of aligned buffers to allocate. All memory used by the device
+      // is allocated by the constructor.
+
+   ~DirectBlockDevice();
+
+    void read(int block_number, char *block_buffer);
+    void write(int block_number, const char *block_buffer);
+
+    bool is_direct() const { return direct; }
+      // Returns true if direct I/O is being used. Returns false if the device fell back to
+      // buffered I/O.
+
+    int required_alignment() const { return alignment; }
+      // Returns the alignment required for direct I/O. Callers that provide buffers aligned
+      // this way avoid a copy.
+};
+
+#endif
+
+#endif
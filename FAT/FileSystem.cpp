@@ -4,9 +4,13 @@
 
 */
 
+#include "environ.hpp"
+
+#include <cstdlib>
 #include <cstring>
 
 #include "BlockDevice.hpp"
+#include "Checksum.hpp"
 #include "FileSystem.hpp"
 
 //========================================
@@ -16,37 +20,548 @@
 //
 // FileSystem::flush()
 //
-// This function updates the disk so that all cached data structures are saved.
+// This function updates the disk so that all cached data structures are saved. The checksums
+// are written last since writing the FAT and directories changes them. Only then is the boot
+// block told that the checksums are up to date. A mounted snapshot can't change so there is
+// nothing to save.
 //
 void FileSystem::flush()
 {
-    if (formatted_flag) {
-        the_disk.write(FAT_BLOCK, reinterpret_cast<char *>(FAT));
-        the_disk.write(ROOT_BLOCK, reinterpret_cast<char *>(root_directory));
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+
+    if (formatted_flag && mounted_index < 0) {
+        write_structure(FAT_BLOCK, FAT, sizeof(FAT));
+        for (int i = 0; i < table_size; i++) {
+            if (directory_table[i] != 0 && directory_table[i]->dirty) save_directory(i);
+        }
+        save_checksums();
+        if (checksums_stale) {
+            checksums_stale = false;
+            write_boot_block();
+        }
+    }
+}
+
+
+//
+// FileSystem::write_boot_block
+//
+void FileSystem::write_boot_block()
+{
+    block_buffer *boot   = borrow_buffer();
+    char         *buffer = boot->data;
+    int           i;
+
+    for (i = 0; i < block_size; i++) {
+        buffer[i] = 0;
+    }
+
+    buffer[0] = FORMATTED;
+    buffer[5] = block_shift;
+    if (checksum_blocks != 0) {
+        buffer[1] |= CHECKSUMS_OPTION;
+        buffer[2]  = checksum_blocks;
+        if (checksums_stale) buffer[1] |= CHECKSUMS_STALE;
+    }
+    if (snapshot_table != 0) {
+        buffer[1] |= SNAPSHOTS_OPTION;
+        buffer[3]  = static_cast<char>( snapshot_table       & 0xFF);
+        buffer[4]  = static_cast<char>((snapshot_table >> 8) & 0xFF);
+    }
+
+    // Compute a checksum.
+    unsigned char sum = 0;
+    for (i = 0; i < block_size - 1; i++) {
+        sum += buffer[i];
+    }
+    buffer[block_size-1] = -sum;
+
+    the_disk.write(BOOT_BLOCK, buffer);
+    release(boot);
+}
+
+
+//
+// FileSystem::load_checksums
+//
+// The checksum region holds the checksum array from its start. With large blocks the array
+// doesn't fill the region. The region isn't covered by the checksums so it is read directly.
+//
+void FileSystem::load_checksums()
+{
+    block_buffer *region = borrow_buffer();
+    char         *target = reinterpret_cast<char *>(block_checksums);
+
+    for (int i = 0; i < checksum_blocks; i++) {
+        int offset = i * block_size;
+        int amount = sizeof(block_checksums) - offset;
+        if (amount > block_size) amount = block_size;
+
+        the_disk.read(ROOT_BLOCK + 1 + i, region->data);
+        std::memcpy(target + offset, region->data, amount);
+    }
+    release(region);
+}
+
+
+//
+// FileSystem::save_checksums
+//
+void FileSystem::save_checksums()
+{
+    block_buffer *region = borrow_buffer();
+    const char   *source = reinterpret_cast<const char *>(block_checksums);
+
+    for (int i = 0; i < checksum_blocks; i++) {
+        int offset = i * block_size;
+        int amount = sizeof(block_checksums) - offset;
+        if (amount > block_size) amount = block_size;
+
+        std::memset(region->data, 0, block_size);
+        std::memcpy(region->data, source + offset, amount);
+        the_disk.write(ROOT_BLOCK + 1 + i, region->data);
+    }
+    release(region);
+}
+
+
+//
+// FileSystem::mark_checksums_stale
+//
+// The boot block is written synchronously so the mark is on disk before the block that makes
+// the checksum region out of date.
+//
+void FileSystem::mark_checksums_stale()
+{
+    if (checksum_blocks != 0 && !checksums_stale) {
+        checksums_stale = true;
+        write_boot_block();
+    }
+}
+
+
+//
+// FileSystem::rebuild_checksums
+//
+// The FAT on disk is trusted because there is nothing to check it against. It is loaded here
+// only to find the allocated blocks; the constructor reads it again in the normal way. The
+// checksum region itself isn't covered by checksums so it is skipped.
+//
+void FileSystem::rebuild_checksums()
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+    int       limit    = (the_disk.blk_count() < FAT_size) ? the_disk.blk_count() : FAT_size;
+
+    block_buffer *buffer = borrow_buffer();
+    the_disk.read(FAT_BLOCK, buffer->data);
+    std::memcpy(FAT, buffer->data, sizeof(FAT));
+    block_checksums[FAT_BLOCK] = crc32c(buffer->data, block_size);
+
+    for (int block = ROOT_BLOCK; block < limit; block++) {
+        if (block > ROOT_BLOCK && block < first_data_block()) continue;
+        if (block > ROOT_BLOCK && FAT[block] == FREE_FAT_ENTRY) continue;
+        the_disk.read(block, buffer->data);
+        block_checksums[block] = crc32c(buffer->data, block_size);
+    }
+    release(buffer);
+
+    save_checksums();
+    checksums_stale   = false;
+    checksums_rebuilt = true;
+    write_boot_block();
+}
+
+
+//
+// FileSystem::update_checksum
+//
+void FileSystem::update_checksum(block_number block, const char *data)
+{
+    if (checksum_blocks != 0) {
+        mark_checksums_stale();
+        block_checksums[block] = crc32c(data, block_size);
+    }
+}
+
+
+//
+// FileSystem::checksum_ok
+//
+bool FileSystem::checksum_ok(block_number block, const char *data)
+{
+    return checksum_blocks == 0 || block_checksums[block] == crc32c(data, block_size);
+}
+
+
+//==========================================
+//           Buffer Pool Functions
+//==========================================
+
+//
+// FileSystem::cache_limit
+//
+// There is no point in reading ahead or writing behind if the device does everything
+// synchronously.
+//
+int FileSystem::cache_limit()
+{
+    int depth = the_disk.queue_depth();
+    if (depth <= 1) return 0;
+    return (depth < POOL_SIZE) ? depth : POOL_SIZE;
+}
+
+
+//
+// FileSystem::wait_one
+//
+// Completed reads that failed (or that have bad checksums) are simply not valid. The data will
+// be read again synchronously (and the error reported) if it is actually needed. A failed
+// write can't be ignored.
+//
+void FileSystem::wait_one()
+{
+    BlockDevice::io_request *request = the_disk.complete();
+    if (request == 0)
+        throw "FileSystem -- Block device lost a request";
+
+    --in_flight;
+    block_buffer *buffer = static_cast<block_buffer *>(request->tag);
+    buffer->pending = false;
+    buffer->valid   = !request->failed;
+    if (!request->is_write && !checksum_ok(buffer->block, buffer->data)) buffer->valid = false;
+    if (request->failed && request->is_write)
+        throw "FileSystem -- Unable to write a block";
+}
+
+
+//
+// FileSystem::drain
+//
+void FileSystem::drain()
+{
+    while (in_flight > 0) wait_one();
+}
+
+
+//
+// FileSystem::find_buffer
+//
+FileSystem::block_buffer *FileSystem::find_buffer(block_number block)
+{
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if ((pool[i].valid || pool[i].pending) && pool[i].block == block) {
+            while (pool[i].pending) wait_one();
+            return pool[i].valid ? &pool[i] : 0;
+        }
+    }
+    return 0;
+}
+
+
+//
+// FileSystem::claim_buffer
+//
+// Buffers are reused in rotation. This is crude, but blocks are normally used in the order they
+// were read ahead so the oldest buffer is usually the one we are done with.
+//
+FileSystem::block_buffer *FileSystem::claim_buffer()
+{
+    while (1) {
+        for (int i = 0; i < POOL_SIZE; i++) {
+            block_buffer *buffer = &pool[next_victim];
+            next_victim = (next_victim + 1) % POOL_SIZE;
+            if (!buffer->pending && buffer->users == 0) {
+                buffer->valid = false;
+                return buffer;
+            }
+        }
+        if (in_flight == 0)
+            throw "FileSystem -- All block buffers are borrowed";
+        wait_one();
+    }
+}
+
+
+//
+// FileSystem::borrow_buffer
+//
+FileSystem::block_buffer *FileSystem::borrow_buffer()
+{
+    block_buffer *buffer = claim_buffer();
+    buffer->users = 1;
+    return buffer;
+}
+
+
+//
+// FileSystem::borrow_block
+//
+// If the block isn't in the pool the device reads it straight into the buffer that will hold
+// it.
+//
+FileSystem::block_buffer *FileSystem::borrow_block(block_number block)
+{
+    block_buffer *buffer = find_buffer(block);
+    if (buffer == 0) {
+        buffer = claim_buffer();
+        the_disk.read(block, buffer->data);
+        if (!checksum_ok(block, buffer->data))
+            throw "FileSystem -- Checksum error reading a block";
+        buffer->block = block;
+        buffer->valid = true;
+    }
+    buffer->users++;
+    return buffer;
+}
+
+
+//
+// FileSystem::release
+//
+void FileSystem::release(block_buffer *buffer)
+{
+    buffer->users--;
+}
+
+
+//
+// FileSystem::invalidate
+//
+void FileSystem::invalidate(block_number block)
+{
+    block_buffer *buffer = find_buffer(block);
+    if (buffer != 0) buffer->valid = false;
+}
+
+
+//
+// FileSystem::invalidate_all
+//
+void FileSystem::invalidate_all()
+{
+    drain();
+    for (int i = 0; i < POOL_SIZE; i++) {
+        pool[i].valid = false;
     }
 }
 
 
+//
+// FileSystem::read_block
+//
+void FileSystem::read_block(block_number block, char *buffer)
+{
+    block_buffer *pooled = find_buffer(block);
+    if (pooled != 0) std::memcpy(buffer, pooled->data, block_size);
+    else {
+        the_disk.read(block, buffer);
+        if (!checksum_ok(block, buffer))
+            throw "FileSystem -- Checksum error reading a block";
+    }
+}
+
+
+//
+// FileSystem::write_block
+//
+void FileSystem::write_block(block_number block, const char *buffer)
+{
+    invalidate(block);
+    update_checksum(block, buffer);
+    the_disk.write(block, buffer);
+}
+
+
+//
+// FileSystem::read_structure
+//
+void FileSystem::read_structure(block_number block, void *structure, int size)
+{
+    block_buffer *buffer = borrow_block(block);
+    std::memcpy(structure, buffer->data, size);
+    release(buffer);
+}
+
+
+//
+// FileSystem::write_structure
+//
+// The write is synchronous since the order in which structures reach the disk often matters.
+//
+void FileSystem::write_structure(block_number block, const void *structure, int size)
+{
+    block_buffer *buffer = borrow_buffer();
+    std::memcpy(buffer->data, structure, size);
+    std::memset(buffer->data + size, 0, block_size - size);
+    write_block(block, buffer->data);
+    release(buffer);
+}
+
+
+//
+// FileSystem::read_ahead
+//
+// The blocks to read are found by following the FAT chain. The walk stops at the end of the
+// chain or at anything that isn't a data block (which can only happen if the FAT is damaged).
+//
+void FileSystem::read_ahead(block_number current)
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    int limit  = cache_limit();
+    int window = (limit < POOL_SIZE/2) ? limit : POOL_SIZE/2;
+
+    for (int i = 0; i < window; i++) {
+        current = FAT[current];
+        if (current <= EOF_FAT_ENTRY || current >= FAT_size) break;
+
+        // Skip blocks that are in the pool or on their way. Don't wait for them, though.
+        bool present = false;
+        for (int j = 0; j < POOL_SIZE; j++) {
+            if ((pool[j].valid || pool[j].pending) && pool[j].block == current)
+                present = true;
+        }
+        if (present) continue;
+
+        // If the device is busy, we already have enough reads going.
+        if (in_flight >= limit) break;
+
+        block_buffer *buffer = claim_buffer();
+        buffer->block                = current;
+        buffer->pending              = true;
+        buffer->request.block_number = current;
+        buffer->request.buffer       = buffer->data;
+        buffer->request.is_write     = false;
+        buffer->request.tag          = buffer;
+        ++in_flight;
+        the_disk.submit(&buffer->request);
+    }
+}
+
+
+//
+// FileSystem::write_behind
+//
+// The block is copied into a pool buffer so the caller can continue filling its own buffer
+// while the device works. There is no need for the copy if the device is synchronous.
+//
+void FileSystem::write_behind(block_number block, const char *buffer)
+{
+    if (cache_limit() == 0) {
+        write_block(block, buffer);
+        return;
+    }
+
+    block_buffer *pooled = borrow_buffer();
+    std::memcpy(pooled->data, buffer, block_size);
+    write_behind(block, pooled);
+    release(pooled);
+}
+
+
+//
+// FileSystem::write_behind
+//
+// The buffer might have been borrowed holding some other block (for example one that a
+// snapshot shares) so whatever it held before is forgotten. The buffer remains a valid copy of
+// the block afterward. If the device does everything synchronously the write is done at once.
+//
+void FileSystem::write_behind(block_number block, block_buffer *buffer)
+{
+    buffer->valid = false;
+    invalidate(block);
+    update_checksum(block, buffer->data);
+    buffer->block = block;
+
+    int limit = cache_limit();
+    if (limit == 0) {
+        the_disk.write(block, buffer->data);
+        buffer->valid = true;
+        return;
+    }
+
+    while (in_flight >= limit) wait_one();
+    buffer->pending              = true;
+    buffer->request.block_number = block;
+    buffer->request.buffer       = buffer->data;
+    buffer->request.is_write     = true;
+    buffer->request.tag          = buffer;
+    ++in_flight;
+    the_disk.submit(&buffer->request);
+}
+
+
 //
 // FileSystem::FileSystem
 //
 // The constructor verifies that the given block device is proper and it checks to see if the
 // file system is formatted.
 //
-FileSystem::FileSystem(BlockDevice &disk) : the_disk(disk)
+FileSystem::FileSystem(BlockDevice &disk) :
+    the_disk(disk), block_size(disk.blk_size()), block_shift(0), root_block(ROOT_BLOCK),
+    checksum_blocks(0), checksums_stale(false), checksums_rebuilt(false),
+    next_victim(0), in_flight(0), next_cluster_victim(0),
+    compress_new_files(false), snapshot_table(0), mounted_index(-1)
 {
-    // For now, let's insure that we are dealing with BLOCK_SIZE sized blocks. This version of
-    // the FileSystem class will assume that size. Perhaps in a future version we can lift that
-    // assumption and have the code work with whatever sized blocks it happens to find.
+    // The file system uses the device's block size. It must be a power of two so that offsets
+    // can be split with shifts and masks.
     // 
-    if (the_disk.blk_size() != BLOCK_SIZE)
+    while ((1 << block_shift) < block_size) block_shift++;
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (1 << block_shift) != block_size)
         throw "Can't manage a file system on this disk. The block size is wrong!";
+    block_mask = block_size - 1;
 
     if (the_disk.blk_count() < 4)
         throw "Can't manage a file system on this disk. Not enough blocks!";
 
-    // Is this file system formatted? Read the boot block and find out.
-    char buffer[BLOCK_SIZE];
+    // Frames are limited in size by their header.
+    frame_blocks = CLUSTER_BLOCKS;
+    while (frame_blocks > 1 && frame_blocks * block_size > MAX_FRAME_SIZE) frame_blocks--;
+    cluster_size = frame_blocks * block_size - FRAME_HEADER_SIZE;
+
+    // The buffers are allocated once, now that we know how big they need to be. The block size
+    // is a multiple of any alignment a device needs for direct I/O (see DirectBlockDevice).
+    #if eOPSYS == ePOSIX
+    void *memory;
+    if (posix_memalign(&memory, block_size, POOL_SIZE * block_size) == 0)
+        pool_memory.address = static_cast<char *>(memory);
+    #else
+    pool_memory.address = static_cast<char *>(std::malloc(POOL_SIZE * block_size));
+    #endif
+    if (pool_memory.address == 0)
+        throw "Can't manage a file system on this disk. Unable to allocate block buffers!";
+    cluster_memory.resize(CLUSTER_CACHE_SIZE * cluster_size);
+    frame_buffer.resize(frame_blocks * block_size);
+    cluster_buffer.resize(cluster_size);
+
+    // The caches start out empty.
+    for (int i = 0; i < POOL_SIZE; i++) {
+        pool[i].valid   = false;
+        pool[i].pending = false;
+        pool[i].users   = 0;
+        pool[i].data    = pool_memory.address + i * block_size;
+    }
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++) {
+        cluster_cache[i].data = &cluster_memory[i * cluster_size];
+    }
+    invalidate_clusters();
+    std::memset(&compression, 0, sizeof(compression));
+    std::memset(snapshot_refs, 0, sizeof(snapshot_refs));
+    std::memset(snapshots, 0, sizeof(snapshots));
+    clear_path_cache();
+
+    // Until we know better the root directory is empty.
+    for (int i = 0; i < sizeof(directory_table)/sizeof(directory_block *); i++) {
+        directory_table[i] = 0;
+    }
+    free_directories();
+    new_directory_block(ROOT_BLOCK);
+
+    // Is this file system formatted? Read the boot block and find out. The boot block isn't
+    // kept in the pool since it is written without going through the pool.
+    block_buffer *boot   = borrow_buffer();
+    char         *buffer = boot->data;
     the_disk.read(BOOT_BLOCK, buffer);
 
     // Assume it is not formatted.
@@ -57,17 +572,48 @@ FileSystem::FileSystem(BlockDevice &disk) : the_disk(disk)
       
         // Looks good so far. Let's verify the checksum.
         unsigned char sum = 0;
-        for (int i = 0; i < BLOCK_SIZE; i++) {
+        for (int i = 0; i < block_size; i++) {
             sum += buffer[i];
         }
         if (sum == 0) formatted_flag = true;
     }
 
-    // If the file system is formatted, get the important data structures.
+    // A disk formatted with different blocks is unlikely to get this far since the checksum
+    // covers the whole block. It would be a mess if it did.
+    if (formatted_flag) {
+        int shift = (buffer[5] == 0) ? DEFAULT_BLOCK_SHIFT : buffer[5];
+        if (shift != block_shift)
+            throw "Can't manage a file system on this disk. It has a different block size!";
+    }
+
+    // If the file system is formatted, get the important data structures. The checksums must
+    // come first so that the others can be verified, and the FAT is needed to find the
+    // directories. If the file system was interrupted while its checksums were out of date
+    // they can't be used to verify anything, so they are rebuilt from the disk.
     if (formatted_flag) {
-        the_disk.read(FAT_BLOCK, reinterpret_cast<char *>(FAT));
-        the_disk.read(ROOT_BLOCK, reinterpret_cast<char *>(root_directory));
+        if (buffer[1] & SNAPSHOTS_OPTION) {
+            snapshot_table = static_cast<unsigned char>(buffer[3]) |
+                            (static_cast<unsigned char>(buffer[4]) << 8);
+            if (snapshot_table >= sizeof(FAT)/sizeof(block_number))
+                throw "Can't manage a file system on this disk. Bad snapshot table!";
+        }
+        if (buffer[1] & CHECKSUMS_OPTION) {
+            checksum_blocks = static_cast<unsigned char>(buffer[2]);
+            if ((checksum_blocks - 1) * block_size >= sizeof(block_checksums))
+                throw "Can't manage a file system on this disk. Checksum region is too large!";
+            if (buffer[1] & CHECKSUMS_STALE) rebuild_checksums();
+            else load_checksums();
+        }
+        read_structure(FAT_BLOCK, FAT, sizeof(FAT));
+        load_directories();
+
+        if (snapshot_table != 0) {
+            read_block(snapshot_table, buffer);
+            std::memcpy(snapshot_refs, buffer, sizeof(snapshot_refs));
+            std::memcpy(snapshots, buffer + sizeof(snapshot_refs), sizeof(snapshots));
+        }
     }
+    release(boot);
 
     // Finally, let's initialize the handle_table to make sure that all slots in it are
     // available for use.
@@ -82,60 +628,149 @@ FileSystem::FileSystem(BlockDevice &disk) : the_disk(disk)
 // FileSystem::~FileSystem
 //
 // The destructor flushes the FAT and root directory out to disk. This insures that the
-// information on disk agrees with what it is supposed to be.
+// information on disk agrees with what it is supposed to be. Any blocks still being written
+// must finish first since the buffer pool is about to go away.
 //
 FileSystem::~FileSystem()
 {
+    drain();
     flush();
+    free_directories();
 }
 
 
 //
 // FileSystem::format
 //
-// This function formats the file system by initializing the various data structures.
+// This function formats the file system by initializing the various data structures. The
+// checksum region needs one entry for every block the FAT can describe.
 // 
-void FileSystem::format()
+void FileSystem::format(bool checksums)
 {
-    char buffer[BLOCK_SIZE];
-    int  i;
-
-    // Create a valid boot block.
-    for (i = 0; i < BLOCK_SIZE; i++) {
-        buffer[i] = 0;
-    }
-
-    buffer[0] = FORMATTED;
-
-    // Compute a checksum.
-    unsigned char sum = 0;
-    for (i = 0; i < BLOCK_SIZE - 1; i++) {
-        sum += buffer[i];
-    }
-    buffer[BLOCK_SIZE-1] = -sum;
-
-    // Save the new boot block to disk.
-    the_disk.write(BOOT_BLOCK, buffer);
+    int i;
+
+    // Nothing in the caches is meaningful any more.
+    invalidate_all();
+    invalidate_clusters();
+
+    // There are no snapshots on a new file system.
+    snapshot_table = 0;
+    mounted_index  = -1;
+    root_block     = ROOT_BLOCK;
+    std::memset(snapshot_refs, 0, sizeof(snapshot_refs));
+    std::memset(snapshots, 0, sizeof(snapshots));
+
+    // Create a valid boot block and save it to disk. Nothing else is on disk until the first
+    // flush() so the checksum region starts out stale.
+    checksum_blocks = 0;
+    if (checksums) checksum_blocks = (sizeof(block_checksums) + block_mask) >> block_shift;
+    checksums_stale = (checksum_blocks != 0);
+    write_boot_block();
 
     // Build a valid FAT.
     std::memset(FAT, 0, sizeof(FAT));
-    for (i = 0; i < BLOCK_SIZE/sizeof(block_number); i++) {
+    for (i = 0; i < MAX_BLOCKS; i++) {
         FAT[i] = FREE_FAT_ENTRY;
     }
     FAT[BOOT_BLOCK] = RESERVED_FAT_ENTRY;
     FAT[FAT_BLOCK]  = RESERVED_FAT_ENTRY;
     FAT[ROOT_BLOCK] = RESERVED_FAT_ENTRY;
-
-    // Build a valid root directory.
-    std::memset(root_directory, 0, sizeof(root_directory));
-    for (i = 0; i < BLOCK_SIZE/sizeof(directory_entry); i++) {
-        root_directory[i].in_use = 0;
+    for (i = 0; i < checksum_blocks; i++) {
+        FAT[ROOT_BLOCK + 1 + i] = RESERVED_FAT_ENTRY;
     }
+    std::memset(block_checksums, 0, sizeof(block_checksums));
+
+    // Build a valid (empty) root directory.
+    free_directories();
+    directory_table[new_directory_block(ROOT_BLOCK)]->dirty = true;
+    clear_path_cache();
 
     formatted_flag = true;
 }
 
 
+//
+// FileSystem::verify_checksums
+//
+// The blocks are read in batches using submit() so that a device that can do several reads at
+// once is kept busy. The cache is drained first so that its requests don't get mixed up with
+// ours. The last block of a file that ends on a block (or for compressed files, a cluster)
+// boundary holds no data. It might never have been written so it is skipped. Directories
+// don't have such a block.
+//
+int FileSystem::verify_checksums()
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    if (formatted_flag == false)
+        throw "FileSystem::verify_checksums() -- Unformatted file system";
+    if (checksum_blocks == 0)
+        throw "FileSystem::verify_checksums() -- File system has no checksums";
+
+    block_buffer *buffers[POOL_SIZE];
+    int           batch_size = the_disk.queue_depth();
+    int           bad_count  = 0;
+    int           block      = first_data_block();
+
+    if (batch_size > POOL_SIZE) batch_size = POOL_SIZE;
+    drain();
+    flush();
+
+    bool skip[FAT_size];
+    for (int i = 0; i < FAT_size; i++) {
+        skip[i] = (FAT[i] == FREE_FAT_ENTRY || FAT[i] == RESERVED_FAT_ENTRY);
+    }
+    for (int i = next_entry(-1); i != NOT_FOUND; i = next_entry(i)) {
+        int unit = (entry(i).flags & COMPRESSED_FLAG) ? cluster_size : block_size;
+        if ((entry(i).flags & DIRECTORY_FLAG) || entry(i).size % unit != 0)
+            continue;
+        block_number current = entry(i).starting_block;
+        while (FAT[current] != EOF_FAT_ENTRY) current = FAT[current];
+        skip[current] = true;
+    }
+
+    // The pool's buffers are borrowed for the scan. What they held is forgotten since they
+    // are read without going through the pool.
+    for (int i = 0; i < batch_size; i++) {
+        buffers[i] = borrow_buffer();
+    }
+
+    // The FAT and directories are in memory but their copies on disk are checked too.
+    char *buffer = buffers[0]->data;
+    the_disk.read(FAT_BLOCK, buffer);
+    if (!checksum_ok(FAT_BLOCK, buffer)) bad_count++;
+    the_disk.read(root_block, buffer);
+    if (!checksum_ok(root_block, buffer)) bad_count++;
+
+    while (block < FAT_size) {
+        int count = 0;
+        while (count < batch_size && block < FAT_size) {
+            if (!skip[block]) {
+                BlockDevice::io_request &request = buffers[count]->request;
+                request.block_number = block;
+                request.buffer       = buffers[count]->data;
+                request.is_write     = false;
+                request.tag          = 0;
+                the_disk.submit(&request);
+                count++;
+            }
+            block++;
+        }
+
+        for (int i = 0; i < count; i++) {
+            BlockDevice::io_request *request = the_disk.complete();
+            if (request->failed || !checksum_ok(request->block_number, request->buffer))
+                bad_count++;
+        }
+    }
+
+    for (int i = 0; i < batch_size; i++) {
+        release(buffers[i]);
+    }
+    return bad_count;
+}
+
+
 //
 // FileSystem::close
 //
@@ -177,7 +812,7 @@ long FileSystem::free_space()
         if (FAT[i] == FREE_FAT_ENTRY) count++;
     }
 
-    return count*BLOCK_SIZE;
+    return count*block_size;
 }
 
 
@@ -188,7 +823,6 @@ long FileSystem::free_space()
 int FileSystem::read(int handle, char *buffer, int count)
 {
     const int han_size = sizeof(handle_table)/sizeof(handletable_entry);
-    const int dir_size = sizeof(root_directory)/sizeof(directory_entry);
     const int FAT_size = sizeof(FAT)/sizeof(block_number);
 
     // Validate the handle.
@@ -198,30 +832,38 @@ int FileSystem::read(int handle, char *buffer, int count)
     if (!handle_table[handle].in_use || handle_table[handle].mode != READ)
         throw "FileSystem::read() -- Handle not opened for reading";
 
+    if (entry(handle_table[handle].directory_index).flags & COMPRESSED_FLAG)
+        return read_compressed(handle, buffer, count);
+
     // Adjust the count.
-    int file_size = root_directory[handle_table[handle].directory_index].size;
+    int file_size = entry(handle_table[handle].directory_index).size;
     if (file_size - handle_table[handle].offset < count)
         count = file_size - handle_table[handle].offset;
     
     // Are we already at the EOF?
     if (count == 0) return 0;
 
-    // Now let's loop to get 'count' bytes. We know they have to be there.
-    char block_buffer[BLOCK_SIZE];
-    int  block_offset = handle_table[handle].offset % BLOCK_SIZE;
-    int  block_count  = BLOCK_SIZE - block_offset;
-    the_disk.read(handle_table[handle].current_block, block_buffer);
-    for (int i = 0; i < count; i++) {
-        *buffer++ = block_buffer[block_offset++];
-        handle_table[handle].offset++;
-
-        // If that's the last byte in this block, fetch the next one.
-        if (--block_count == 0) {
+    // Now let's loop to get 'count' bytes. We know they have to be there. The data is copied
+    // straight out of the pool. The next block is only fetched if we need some of it.
+    int done         = 0;
+    int block_offset = handle_table[handle].offset & block_mask;
+    while (done < count) {
+        block_buffer *block = borrow_block(handle_table[handle].current_block);
+        int           amount = block_size - block_offset;
+        if (amount > count - done) amount = count - done;
+
+        std::memcpy(buffer + done, block->data + block_offset, amount);
+        release(block);
+        read_ahead(handle_table[handle].current_block);
+        done                        += amount;
+        block_offset                += amount;
+        handle_table[handle].offset += amount;
+
+        // If that's the end of this block, move to the next one.
+        if (block_offset == block_size) {
             handle_table[handle].current_block =
                 FAT[handle_table[handle].current_block];
-            the_disk.read(handle_table[handle].current_block, block_buffer);
             block_offset = 0;
-            block_count  = BLOCK_SIZE;
         }
     }
 
@@ -232,7 +874,6 @@ int FileSystem::read(int handle, char *buffer, int count)
 int FileSystem::write(int handle, const char *buffer, int count)
 {
     const int han_size = sizeof(handle_table)/sizeof(handletable_entry);
-    const int dir_size = sizeof(root_directory)/sizeof(directory_entry);
     const int FAT_size = sizeof(FAT)/sizeof(block_number);
     
     // Validate the handle.
@@ -242,28 +883,43 @@ int FileSystem::write(int handle, const char *buffer, int count)
     if (!handle_table[handle].in_use || handle_table[handle].mode != WRITE)
         throw "FileSystem::write() -- Handle not opened for writing";
 
-    // Adjust the count.
-    int file_size   = root_directory[handle_table[handle].directory_index].size;
-    int slack_space = BLOCK_SIZE - (file_size % BLOCK_SIZE);
+    if (entry(handle_table[handle].directory_index).flags & COMPRESSED_FLAG)
+        return write_compressed(handle, buffer, count);
+
+    // Adjust the count. If the current block is shared with a snapshot, the file will need a
+    // block of its own to replace it.
+    int file_size   = entry(handle_table[handle].directory_index).size;
+    int slack_space = block_size - (file_size & block_mask);
     int open_space  = free_space() + slack_space - 1;
+    if (snapshot_refs[handle_table[handle].current_block] != 0) open_space -= block_size;
     if (open_space < count) count = open_space;
     
     // Is there any more space?
-    if (count == 0) return 0;
-
-    // Now let's loop to put 'count' bytes. We know there is space.
-    char block_buffer[BLOCK_SIZE];
-    int  block_offset = handle_table[handle].offset % BLOCK_SIZE;
-    int  block_count  = BLOCK_SIZE - block_offset;
-    the_disk.read(handle_table[handle].current_block, block_buffer);
-    for (int i = 0; i < count; i++) {
-        block_buffer[block_offset++] = *buffer++;
-        handle_table[handle].offset++;
-        root_directory[handle_table[handle].directory_index].size++;
-
-        // If that's the last byte in this block, get a new one.
-        if (--block_count == 0) {
-            the_disk.write(handle_table[handle].current_block, block_buffer);
+    if (count <= 0) return 0;
+
+    // Now let's loop to put 'count' bytes. We know there is space. The data is copied straight
+    // into a pool buffer that is then written. If the file ends exactly at a block boundary the
+    // current block holds no data yet, so there is no need to read it.
+    int           done         = 0;
+    int           block_offset = handle_table[handle].offset & block_mask;
+    block_buffer *block;
+    if (block_offset == 0) block = borrow_buffer();
+    else block = borrow_block(handle_table[handle].current_block);
+    handle_table[handle].current_block = unshare_block(handle_table[handle].current_block);
+    while (done < count) {
+        int amount = block_size - block_offset;
+        if (amount > count - done) amount = count - done;
+
+        std::memcpy(block->data + block_offset, buffer + done, amount);
+        done                        += amount;
+        block_offset                += amount;
+        handle_table[handle].offset += amount;
+        entry(handle_table[handle].directory_index).size += amount;
+
+        // If that's the end of this block, get a new one.
+        if (block_offset == block_size) {
+            write_behind(handle_table[handle].current_block, block);
+            release(block);
             
             // Find a free block. There must be one.
             int j;
@@ -276,13 +932,19 @@ int FileSystem::write(int handle, const char *buffer, int count)
             FAT[handle_table[handle].current_block] = j;
             FAT[j] = EOF_FAT_ENTRY;
             handle_table[handle].current_block = j;
+            block        = borrow_buffer();
             block_offset = 0;
-            block_count  = BLOCK_SIZE;
         }
     }
 
-    // Put the last, partially filled block back on the disk.
-    the_disk.write(handle_table[handle].current_block, block_buffer);
+    // Put the last, partially filled block back on the disk. The rest of it is cleared since
+    // the buffer might have held anything. The full blocks must be on the disk before we return
+    // since the caller might remove the file and reuse its blocks.
+    std::memset(block->data + block_offset, 0, block_size - block_offset);
+    write_behind(handle_table[handle].current_block, block);
+    release(block);
+    entry_changed(handle_table[handle].directory_index);
+    drain();
     return count;
 }
 
@@ -294,7 +956,6 @@ int FileSystem::write(int handle, const char *buffer, int count)
 int FileSystem::open(const char *name, open_mode mode)
 {
     const int han_size = sizeof(handle_table)/sizeof(handletable_entry);
-    const int dir_size = sizeof(root_directory)/sizeof(directory_entry);
     const int FAT_size = sizeof(FAT)/sizeof(block_number);
 
     int handle;
@@ -309,25 +970,28 @@ int FileSystem::open(const char *name, open_mode mode)
     if (handle == han_size)
         throw "FileSystem::open() -- Out of available handles";
 
-    // Now locate the proper root directory entry. Search for an existing entry.
-    for (dir_index = 0; dir_index < dir_size; dir_index++) {
-        if (root_directory[dir_index].in_use == 0) continue;
-        
-        if (std::strcmp(root_directory[dir_index].name, name) == 0) break;
-    }
+    // Now locate the proper directory entry. Search for an existing entry.
+    dir_index = lookup(name, std::strlen(name));
+    if (is_directory(dir_index))
+        throw "FileSystem::open() -- Name is a directory";
 
     // If we didn't find the name, take appropriate action.
-    if (dir_index == dir_size) {
+    if (dir_index == NOT_FOUND) {
         if (mode == READ) throw "FileSystem::open() -- File does not exist";
+        if (mounted_index >= 0) throw "FileSystem::open() -- Snapshots are read only";
 
-        // mode is write. Try to create the file.
-        for (dir_index = 0; dir_index < dir_size; dir_index++) {
-            if (root_directory[dir_index].in_use == 0) break;
-        }
+        // mode is write. Try to create the file in the directory named by the path.
+        const char *leaf;
+        int         parent = find_parent(name, &leaf);
+        if (parent == NOT_FOUND)
+            throw "FileSystem::open() -- Unable to create file. Directory does not exist";
+        if (*leaf == '\0' || std::strlen(leaf) >= sizeof(entry(0).name))
+            throw "FileSystem::open() -- Unable to create file. Invalid name";
+        dir_index = add_entry(parent);
 
         // Can't find a free slot.
-        if (dir_index == dir_size)
-            throw "FileSystem::open() -- Unable to create file. No space in root directory";
+        if (dir_index == NOT_FOUND)
+            throw "FileSystem::open() -- Unable to create file. No space in directory";
 
         // Find a free slot in the FAT for the file's first block.
         for (FAT_index = 0; FAT_index < FAT_size; FAT_index++) {
@@ -342,10 +1006,14 @@ int FileSystem::open(const char *name, open_mode mode)
         // 
         FAT[FAT_index] = EOF_FAT_ENTRY;
 
-        root_directory[dir_index].in_use         = 1;
-        root_directory[dir_index].starting_block = FAT_index;
-        root_directory[dir_index].size           = 0;
-        std::strcpy(root_directory[dir_index].name, name);
+        directory_entry &new_entry = entry(dir_index);
+        new_entry.in_use         = 1;
+        new_entry.starting_block = FAT_index;
+        new_entry.size           = 0;
+        new_entry.flags          = compress_new_files ? COMPRESSED_FLAG : 0;
+        std::strcpy(new_entry.name, leaf);
+        entry_changed(dir_index);
+        index_entry(parent, dir_index);
 
         handle_table[handle].offset          = 0;
         handle_table[handle].directory_index = dir_index;
@@ -360,20 +1028,27 @@ int FileSystem::open(const char *name, open_mode mode)
         if (mode == READ) {
             handle_table[handle].offset          = 0;
             handle_table[handle].directory_index = dir_index;
-            handle_table[handle].current_block   = root_directory[dir_index].starting_block;
+            handle_table[handle].current_block   = entry(dir_index).starting_block;
             handle_table[handle].in_use          = true;
             handle_table[handle].mode            = READ;
         }
         else {
-            handle_table[handle].offset          = root_directory[dir_index].size;
+            if (mounted_index >= 0) throw "FileSystem::open() -- Snapshots are read only";
+
+            handle_table[handle].offset          = entry(dir_index).size;
             handle_table[handle].directory_index = dir_index;
             handle_table[handle].in_use          = true;
             handle_table[handle].mode            = WRITE;
 
-            // We have to locate the last block in the file.
-            block_number current = root_directory[dir_index].starting_block;
-            while (FAT[current] != EOF_FAT_ENTRY) {
-                current = FAT[current];
+            // We have to locate the last block in the file. For a compressed file we need the
+            // first block of the last frame instead.
+            block_number current = entry(dir_index).starting_block;
+            if (entry(dir_index).flags & COMPRESSED_FLAG)
+                current = tail_frame(dir_index);
+            else {
+                while (FAT[current] != EOF_FAT_ENTRY) {
+                    current = FAT[current];
+                }
             }
             handle_table[handle].current_block   = current;
         }
@@ -383,53 +1058,48 @@ int FileSystem::open(const char *name, open_mode mode)
 
 void FileSystem::truncate(const char *name)
 {
-    int index;
-
-    // Locate the file in the root directory.
-    for (index = 0; index < sizeof(root_directory)/sizeof(directory_entry); index++) {
-        if (root_directory[index].in_use == 0) continue;
-        
-        // If we found it...
-        if (std::strcmp(root_directory[index].name, name) == 0) {
-
-            // Scan the FAT and mark all the blocks as free.
-            block_number current_block = root_directory[index].starting_block;
-            while (FAT[current_block] != EOF_FAT_ENTRY) {
-                block_number next  = FAT[current_block];
-                FAT[current_block] = FREE_FAT_ENTRY;
-                current_block      = next;
-            }
-            FAT[current_block] = FREE_FAT_ENTRY;
-            FAT[root_directory[index].starting_block] = EOF_FAT_ENTRY;
-            root_directory[index].size = 0;
-            break;
-        }
+    if (mounted_index >= 0) throw "FileSystem::truncate() -- Snapshots are read only";
+
+    // Locate the file.
+    int index = lookup(name, std::strlen(name));
+    if (index == NOT_FOUND) return;
+    if (is_directory(index)) throw "FileSystem::truncate() -- Name is a directory";
+
+    // Scan the FAT and mark all the blocks as free (unless a snapshot uses them).
+    block_number current_block = entry(index).starting_block;
+    while (FAT[current_block] != EOF_FAT_ENTRY) {
+        block_number next = FAT[current_block];
+        release_block(current_block);
+        current_block     = next;
     }
+    release_block(current_block);
+    FAT[entry(index).starting_block] = EOF_FAT_ENTRY;
+    entry(index).size = 0;
+    entry_changed(index);
+    invalidate_clusters();
 }
 
 void FileSystem::remove(const char *name)
 {
-    int index;
-
-    // Locate the file in the root directory.
-    for (index = 0; index < sizeof(root_directory)/sizeof(directory_entry); index++) {
-        if (root_directory[index].in_use == 0) continue;
-        
-        // If we found it...
-        if (std::strcmp(root_directory[index].name, name) == 0) {
-
-            // Scan the FAT and mark all the blocks as free.
-            block_number current_block = root_directory[index].starting_block;
-            while (FAT[current_block] != EOF_FAT_ENTRY) {
-                block_number next  = FAT[current_block];
-                FAT[current_block] = FREE_FAT_ENTRY;
-                current_block      = next;
-            }
-            FAT[current_block] = FREE_FAT_ENTRY;
-            root_directory[index].in_use = 0;
-            break;
-        }
+    if (mounted_index >= 0) throw "FileSystem::remove() -- Snapshots are read only";
+
+    // Locate the file.
+    int index = lookup(name, std::strlen(name));
+    if (index == NOT_FOUND) return;
+    if (is_directory(index)) throw "FileSystem::remove() -- Name is a directory";
+
+    // Scan the FAT and mark all the blocks as free (unless a snapshot uses them).
+    block_number current_block = entry(index).starting_block;
+    while (FAT[current_block] != EOF_FAT_ENTRY) {
+        block_number next = FAT[current_block];
+        release_block(current_block);
+        current_block     = next;
     }
+    release_block(current_block);
+    entry(index).in_use = 0;
+    entry_changed(index);
+    forget_entry(index);
+    invalidate_clusters();
 }
 
 
@@ -439,20 +1109,37 @@ void FileSystem::remove(const char *name)
 
 bool FileSystem::next_dir(directory_info *info)
 {
-    while (scan_index < sizeof(root_directory)/sizeof(directory_entry)) {
+    while (scan_position != -1) {
+        directory_entry &current_entry = directory_table[scan_position]->entries[scan_index];
 
         // Is this directory entry actually being used?
-        if (root_directory[scan_index].in_use == 0) {
+        if (current_entry.in_use == 0) {
 
             // If not, just advance to the next one.
-            scan_index++;
+            if (++scan_index == DIRECTORY_SIZE) {
+                scan_position = next_position(scan_position);
+                scan_index    = 0;
+            }
         }
         else {
 
             // It was! Copy the good information out of it for the caller.
-            std::strcpy(info->name, root_directory[scan_index].name);
-            info->size = root_directory[scan_index].size;
-            scan_index++;
+            std::strcpy(info->name, current_entry.name);
+            info->size       = current_entry.size;
+            info->compressed = (current_entry.flags & COMPRESSED_FLAG) != 0;
+            info->directory  = (current_entry.flags & DIRECTORY_FLAG) != 0;
+
+            // Count the blocks in the file's chain.
+            block_number current = current_entry.starting_block;
+            info->stored = block_size;
+            while (FAT[current] != EOF_FAT_ENTRY) {
+                current = FAT[current];
+                info->stored += block_size;
+            }
+            if (++scan_index == DIRECTORY_SIZE) {
+                scan_position = next_position(scan_position);
+                scan_index    = 0;
+            }
             return true;
         }
     }
@@ -8,12 +8,56 @@ hypothetical mass storage device. It then manipulates those bytes the way a real
 module might and provides services like opening files, reading files, scanning directories, and
 so forth.
 
+File data moves through a small pool of block buffers. The block device reads and writes the
+buffers directly and read() and write() borrow them rather than copying blocks into buffers of
+their own, so a block is copied only once on its way between the disk and the caller. A buffer
+that isn't borrowed remembers the block it holds, so the pool is also a small cache. If the
+block device can have several operations in progress at once (see BlockDevice::submit()) blocks
+that will soon be needed by a reader are read into the pool ahead of time, and full blocks
+produced by a writer are written behind the writer's back.
+
+The block size is that of the block device. Any power of two from 1K to 64K can be used and
+the boot block records which one the file system was formatted with. The fixed data structures
+(the FAT, directory blocks and the snapshot table) have the same layout whatever the block size
+and only use the first 1K of their blocks, so large blocks give larger disks and faster
+transfers rather than more files. Because the size is a power of two, file offsets are split
+into a block and a position within it with a shift and a mask.
+
+A file system can optionally be formatted with a CRC-32C checksum for every block. The
+checksums are kept in a region just after the root directory (its size is decided by format())
+and are verified whenever a block is read. This detects blocks that were corrupted by the
+device or by something else writing into the backing file.
+
+Files can also be compressed. The data of a compressed file is divided into clusters that would
+fill a few blocks. Each cluster is compressed separately and stored as a frame that starts on a
+block boundary. The frame begins with a small header giving the size of the compressed data
+and of the cluster. Frames that don't compress are stored as is. A few recently used clusters
+are kept decompressed in memory.
+
+Directories can contain subdirectories. A subdirectory is stored like a file except that its
+blocks hold directory entries in the same layout as the root directory block. Every directory
+block is held in memory while the file system is mounted. Paths use '/' to separate names. A
+small cache maps recently used paths to their directory entries, and directories that have
+grown to several blocks are given an in memory hash index, so looking up a path does not get
+slower as the directory tree grows.
+
+A snapshot is a read only copy of the file system as it was at some moment. Creating one copies
+only the FAT and the directories; the data blocks are shared with the live file system. A
+table of reference counts records how many snapshots use each block. When the live file system
+writes a block that is shared, it first moves to a block of its own (copy on write), and when it
+frees a shared block the block stays reserved until the last snapshot using it is deleted. A
+mounted snapshot uses its own FAT and directories in place of the live ones so reading it is no
+different from reading live files.
+
 This code throws (char *) exceptions when it encounters errors.
 */
 
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <cstdlib>
+#include <vector>
+
 #include "BlockDevice.hpp"
 
 class FileSystem {
@@ -24,17 +68,47 @@ public:
     // Public types.
     // +++++
 
-    // This structure is used by clients when they try to scan the root directory. Information
-    // about each file is returned into an object of this type.
+    // This structure is used by clients when they try to scan a directory. Information about
+    // each file is returned into an object of this type.
     // 
     struct directory_info {
         char name[24];
         long size;
+        long stored;       // Number of bytes of disk space used by the file.
+        bool compressed;
+        bool directory;
+    };
+
+    // This structure is used by clients to list the snapshots.
+    //
+    struct snapshot_info {
+        char name[24];
+        int  files;        // Number of files in the snapshot.
+        long size;         // Total size of those files.
+        long exclusive;    // Number of bytes of disk space that only this snapshot uses.
+    };
+
+    // This structure holds statistics about compression. The byte counts are the sizes before
+    // compression ("raw") and after ("stored"). Times are in microseconds. The written counts
+    // describe the data added to files: rewriting the partial cluster at the end of a file
+    // costs compression time but its bytes are only counted once.
+    //
+    struct compression_statistics {
+        double raw_written;
+        double stored_written;
+        double compress_time;
+        double raw_read;
+        double stored_read;
+        double decompress_time;
     };
 
     enum open_mode { READ, WRITE };
       // A real file system will support more modes than just this.
 
+    typedef void (*progress_function)(int done, int total, void *context);
+      // Used to report the progress of long operations. The context pointer is passed through
+      // unchanged from the caller.
+
   private:
 
     // +++++
@@ -53,7 +127,7 @@ public:
         long         size;            // The exact size of the file.
         block_number starting_block;  // Where the file is on disk.
         char         in_use;          // =1 if this directory entry is used.
-        char         pad;             // To make this structure 32 bytes.
+        char         flags;           // File attributes (see COMPRESSED_FLAG below).
 
         // In general it would be nice to support various date/times and file attributes as
         // well.
@@ -64,23 +138,45 @@ public:
     // 
     struct handletable_entry {
         long         offset;          // The current file pointer position.
-        int          directory_index; // Index into the root directory.
+        int          directory_index; // Entry number of the file's directory entry.
         block_number current_block;   // The file pointer points into this block.
         bool         in_use;          // =true if this entry is used.
         open_mode    mode;            // File open for reading or writing?
     };
 
+    // The following structure describes a snapshot. It's size is 32 bytes so that the
+    // snapshot table and the reference counts fit in one block together.
+    //
+    struct snapshot_entry {
+        char         name[24];        // The name of the snapshot.
+        block_number FAT_copy;        // Block holding the snapshot's FAT.
+        block_number root_copy;       // Block holding the snapshot's root directory.
+        char         in_use;          // =1 if this entry is used.
+        char         pad[3];
+    };
+
     // +++++
     // Class specific global data.
     // +++++
 
-    static const int BLOCK_SIZE = 1024;
+    static const int MIN_BLOCK_SIZE = 1024;
+    static const int MAX_BLOCK_SIZE = 65536;
+      // The range of supported block sizes. The fixed data structures are laid out to fit into
+      // the smallest size.
+
+    static const int MAX_BLOCKS = MIN_BLOCK_SIZE/sizeof(block_number);
+      // The FAT fills the first MIN_BLOCK_SIZE bytes of its block so it can describe this many
+      // blocks.
+
+    static const int POOL_SIZE = 8;
+      // The number of buffers in the block buffer pool. At most half of these are used for
+      // reading ahead so that a reader does not evict the blocks it is about to use.
 
     static const block_number BOOT_BLOCK = 0;
     static const block_number FAT_BLOCK = 1;
     static const block_number ROOT_BLOCK = 2;
       // These values are the block numbers of the fixed data structures. In this version, these
-      // structures are all exactly one block in size.
+      // structures each occupy one block.
 
     static const block_number FREE_FAT_ENTRY = 0;
     static const block_number RESERVED_FAT_ENTRY = 1;
@@ -94,9 +190,66 @@ public:
       // reduces the chance that random data on an unformatted disk will cause us to think that
       // the file system is formatted.
 
+    static const unsigned char CHECKSUMS_OPTION = 0x01;
+      // The second byte of the boot block holds option flags. If this flag is set the third
+      // byte holds the number of blocks in the checksum region. Disks formatted before options
+      // existed have zeros there.
+
+    static const unsigned char SNAPSHOTS_OPTION = 0x02;
+      // If this option flag is set the fourth and fifth bytes of the boot block hold the
+      // number of the block containing the snapshot table (low byte first).
+
+    static const unsigned char CHECKSUMS_STALE = 0x04;
+      // If this option flag is set the checksum region may be out of date. It is set before
+      // the first block is written after a flush() and cleared once flush() has saved the
+      // checksums. A file system mounted with it set was not shut down cleanly.
+
+    static const int DEFAULT_BLOCK_SHIFT = 10;
+      // The sixth byte of the boot block holds the base two logarithm of the block size. Disks
+      // formatted before the block size was recorded have a zero there; their blocks are 1K.
+
     static const int HANDLETABLE_SIZE = 16;
       // The maximum number of files that can be open at once.
 
+    static const char COMPRESSED_FLAG = 0x01;
+      // Set in the flags of a directory entry if the file is compressed. The flags were once
+      // just padding, but they were always zero.
+
+    static const char DIRECTORY_FLAG = 0x02;
+      // Set in the flags of a directory entry if the entry is for a subdirectory. The size of
+      // a subdirectory is the number of bytes in its blocks. Unlike a file, it has no extra
+      // block at the end of its chain.
+
+    static const int DIRECTORY_SIZE = MIN_BLOCK_SIZE/sizeof(directory_entry);
+      // The number of directory entries in a directory block.
+
+    static const int ROOT_DIRECTORY = -1;
+    static const int NOT_FOUND = -2;
+      // Directories are identified by the entry number of their directory entry. The root
+      // directory has no entry so it uses this special value instead. NOT_FOUND is returned
+      // by functions that look for entries or directories when there are none.
+
+    static const int LARGE_DIRECTORY = 2;
+      // Directories with at least this many blocks are given a hash index.
+
+    static const int PATH_CACHE_SIZE = 64;
+    static const int MAX_CACHED_PATH = 128;
+      // The number of slots in the path cache and the longest path that it can hold.
+
+    static const int FRAME_HEADER_SIZE = 4;
+    static const int CLUSTER_BLOCKS = 4;
+    static const int MAX_FRAME_SIZE = 65536;
+      // A frame spans CLUSTER_BLOCKS blocks, or fewer if that would be more than MAX_FRAME_SIZE
+      // bytes. A cluster is sized so that it fits into its frame even if it doesn't compress.
+      // The frame header holds the compressed size and the cluster size as 16 bit little endian
+      // values. If the two are equal the cluster is stored uncompressed.
+
+    static const int CLUSTER_CACHE_SIZE = 4;
+      // The number of decompressed clusters held in memory.
+
+    static const int MAX_SNAPSHOTS = 16;
+      // The number of snapshot table entries that fit in a block after the reference counts.
+
     // +++++
     // Private data members.
     // +++++
@@ -108,27 +261,321 @@ public:
       // =true if the file system appears to be formatted. This is set by the constructor and
       // updated by the format() member function.
 
-    block_number FAT[BLOCK_SIZE/sizeof(block_number)];
-    directory_entry root_directory[BLOCK_SIZE/sizeof(directory_entry)];
-      // The two critical data structures will be held in memory all the time. This would be
-      // impractical for any realistically sized file system.
+    int block_size;
+    int block_shift;
+    int block_mask;
+      // The size of a block, its base two logarithm, and the mask that extracts the position
+      // within a block from a file offset.
+
+    int frame_blocks;
+    int cluster_size;
+      // The number of blocks in a compressed frame and the size of a cluster. These depend on
+      // the block size.
+
+    // This structure holds one directory block in memory. The hash index is only used in the
+    // first block of a large directory. It is a table of entry numbers (-1 for empty slots)
+    // that is built when first needed. Entries are added to it as they are created but never
+    // removed; a lookup checks the name of the entry it finds anyway. The index is discarded
+    // (to be built again later) when it gets too full or the directory grows.
+    //
+    struct directory_block {
+        block_number     block;       // Where this block is on the disk.
+        bool             dirty;       // =true if the block has changed since it was written.
+        directory_entry  entries[DIRECTORY_SIZE];
+        std::vector<int> index;
+        int              index_used;  // Number of slots in the index that are in use.
+    };
+
+    block_number FAT[MAX_BLOCKS];
+    directory_block *directory_table[MAX_BLOCKS];
+      // The critical data structures will be held in memory all the time. This would be
+      // impractical for any realistically sized file system. The root directory is always in
+      // the first position of the directory table; unused positions are null. An entry is
+      // identified by its "entry number": the table position of its block times DIRECTORY_SIZE
+      // plus its index in the block. Entry numbers don't change when blocks are moved.
+
+    int directory_position[MAX_BLOCKS];
+      // The directory table position of each disk block, or -1 if the block is not part of a
+      // directory.
+
+    block_number root_block;
+      // The block holding the root directory. This is ROOT_BLOCK except when a snapshot is
+      // mounted.
+
+    // This structure holds one slot of the path cache. The cache is direct mapped: a path can
+    // only be in the slot selected by its hash value.
+    //
+    struct path_cache_slot {
+        char path[MAX_CACHED_PATH];
+        int  length;
+        int  entry;                   // Entry number or NOT_FOUND if the slot is not in use.
+    };
+
+    path_cache_slot path_cache[PATH_CACHE_SIZE];
 
     handletable_entry handle_table[HANDLETABLE_SIZE];
       // This array holds information about all open files.
 
+    int checksum_blocks;
+    unsigned int block_checksums[MAX_BLOCKS];
+      // The number of blocks in the checksum region (zero if checksums are not being used) and
+      // the CRC-32C of each block. Like the FAT, the checksums are held in memory and written
+      // to disk by flush(). The entries for free blocks are meaningless.
+
+    bool checksums_stale;             // =true if the boot block has CHECKSUMS_STALE set.
+    bool checksums_rebuilt;           // =true if the constructor had to rebuild the checksums.
+
+    // This structure holds one buffer of the block buffer pool. While the request is pending,
+    // the data belongs to the block device. A buffer with users is never reused for a
+    // different block.
+    //
+    struct block_buffer {
+        BlockDevice::io_request request;
+        block_number block;           // The block held (or being transferred) by this buffer.
+        bool         valid;           // =true if data holds the current contents of block.
+        bool         pending;         // =true if request has been submitted but not completed.
+        int          users;           // Number of borrowers that have not released the buffer.
+        char        *data;            // Points into pool_memory.
+    };
+
+    // This structure owns the memory of the buffer pool. The constructor allocates it aligned
+    // to the block size so that a device doing direct I/O can transfer to and from the buffers
+    // without copying them.
+    //
+    struct pool_storage {
+        char *address;
+        pool_storage() : address(0) { }
+       ~pool_storage() { std::free(address); }
+    };
+
+    block_buffer      pool[POOL_SIZE];
+    pool_storage      pool_memory;    // The buffers' data.
+    int               next_victim;    // Where to start looking for a buffer to reuse.
+    int               in_flight;      // Number of requests submitted but not yet completed.
+
+    // This structure holds one decompressed cluster. Clusters are identified by the first
+    // block of their frame.
+    //
+    struct cluster_slot {
+        block_number first;
+        bool         valid;
+        int          length;          // Number of bytes in the cluster.
+        int          stored;          // Number of bytes the cluster occupies in its frame.
+        int          blocks;          // Number of blocks in the cluster's frame.
+        char        *data;            // Points into cluster_memory.
+    };
+
+    cluster_slot      cluster_cache[CLUSTER_CACHE_SIZE];
+    int               next_cluster_victim;
+    std::vector<char> cluster_memory;
+    std::vector<char> frame_buffer;
+    std::vector<char> cluster_buffer;
+      // The data of the cached clusters, a frame being read or written, and the cluster being
+      // filled by write_compressed(). They are sized by the constructor.
+
+    bool compress_new_files;
+      // =true if files created by open() are compressed.
+
+    compression_statistics compression;
+
+    block_number snapshot_table;
+    unsigned char snapshot_refs[MAX_BLOCKS];
+    snapshot_entry snapshots[MAX_SNAPSHOTS];
+      // The block holding the snapshot table (zero if no snapshot was ever created), the
+      // number of snapshots using each block, and the snapshots themselves. On the disk the
+      // reference counts come first, followed by the snapshot entries.
+
+    int mounted_index;
+      // The snapshot table index of the mounted snapshot or -1 if the live file system is
+      // mounted. While a snapshot is mounted FAT and the directory table hold its copies and
+      // the live versions are only on the disk.
+
+    int snapshot_scan;
+      // Used during a scan of the snapshot table in the same way as scan_index.
+
+    int scan_position;
     int scan_index;
-      // Used during a directory scan. This object holds the index into the root directory of
+      // Used during a directory scan. These objects hold the directory table position of the
+      // block being scanned (-1 at the end of the directory) and the index into that block of
       // the next directory entry to consider when next_dir() is called. Because there is only
-      // one of these scan_index objects per filesystem, only a single scan can be going on at
-      // any one time. This is not realistic, but it will do for now.
+      // one of these scans per filesystem, only a single scan can be going on at any one time.
+      // This is not realistic, but it will do for now.
 
     // +++++
     // Private member functions.
     // +++++
 
+    FileSystem(const FileSystem &);
+    FileSystem &operator=(const FileSystem &);
+      // Make these members private so that we disable copying.
+
     void flush();
       // Write cached data to disk.
 
+    void write_boot_block();
+      // Writes a boot block describing the current options.
+
+    block_number first_data_block()
+      { return ROOT_BLOCK + 1 + checksum_blocks; }
+      // The first block that can be allocated to a file.
+
+    void update_checksum(block_number block, const char *data);
+    bool checksum_ok(block_number block, const char *data);
+      // Record or check the checksum of a block. These do nothing if checksums aren't in use.
+
+    void load_checksums();
+    void save_checksums();
+      // Read or write the checksum region.
+
+    void mark_checksums_stale();
+      // Called before a block is written. Records in the boot block that the checksum region
+      // no longer agrees with the disk (if that hasn't been done since the last flush()).
+
+    void rebuild_checksums();
+      // Recomputes the checksums of the FAT and every allocated block from what is on disk.
+      // Used when mounting a file system that was not shut down cleanly.
+
+    int  cache_limit();
+      // Returns the number of requests that can be in flight at once. Zero if the device does
+      // everything synchronously.
+
+    void wait_one();
+    void drain();
+      // Wait for one (or all) requests in flight to complete.
+
+    block_buffer *find_buffer(block_number block);
+    block_buffer *claim_buffer();
+      // Find the buffer holding a block or pick a buffer to reuse. Neither returns a pending
+      // buffer and claim_buffer() never returns a borrowed one.
+
+    block_buffer *borrow_buffer();
+    block_buffer *borrow_block(block_number block);
+    void          release(block_buffer *buffer);
+      // Borrow a buffer with undefined contents or one holding the given block, and give it
+      // back. A borrowed buffer that has been changed must be written with write_behind()
+      // before it is released.
+
+    void invalidate(block_number block);
+    void invalidate_all();
+      // Forget about cached copies of one (or all) blocks.
+
+    void read_block(block_number block, char *buffer);
+    void write_block(block_number block, const char *buffer);
+      // Read or write a block synchronously, using or updating the pool as appropriate.
+
+    void read_structure(block_number block, void *structure, int size);
+    void write_structure(block_number block, const void *structure, int size);
+      // Read or write a data structure stored at the start of a block. When the structure is
+      // written the rest of the block is cleared.
+
+    void read_ahead(block_number current);
+      // Start reading the blocks that follow current in its FAT chain.
+
+    void write_behind(block_number block, const char *buffer);
+    void write_behind(block_number block, block_buffer *buffer);
+      // Start writing a block. A plain buffer is copied and can be reused as soon as this
+      // function returns. A borrowed buffer is written directly and becomes the pool's copy
+      // of the block; it must not be changed again until it has been released.
+
+    void relocate(block_number from, block_number to);
+      // Move a block of some file to a free block, updating the file's chain on the disk.
+
+    block_number allocate_block();
+      // Finds a free block and marks it as the end of a chain. Throws if there are none.
+
+    void free_after(block_number last);
+      // Frees the blocks in the chain after the given one, making it the end of the chain.
+
+    cluster_slot *load_cluster(block_number first);
+      // Returns the decompressed cluster stored in the frame starting at the given block.
+
+    block_number store_cluster(block_number first, const char *data, int length);
+      // Compresses a cluster into the frame starting at the given block. If the cluster is
+      // full, returns the first block of the following frame (allocating it if necessary).
+      // Otherwise the frame is the last in the file, any blocks after it are freed, and the
+      // first block of the frame is returned (it changes if it was shared with a snapshot).
+
+    void invalidate_clusters();
+      // Forget all decompressed clusters.
+
+    directory_entry &entry(int number)
+      { return directory_table[number / DIRECTORY_SIZE]->entries[number % DIRECTORY_SIZE]; }
+      // Returns the directory entry with the given entry number.
+
+    void entry_changed(int number)
+      { directory_table[number / DIRECTORY_SIZE]->dirty = true; }
+      // Notes that a directory entry has been modified so its block needs to be written.
+
+    int next_entry(int number);
+      // Returns the entry number of the first entry in use after the given one, or NOT_FOUND
+      // if there are no more. Start with -1 to visit every file and directory.
+
+    bool is_directory(int number)
+      { return number == ROOT_DIRECTORY ||
+               (number != NOT_FOUND && (entry(number).flags & DIRECTORY_FLAG) != 0); }
+      // Returns true if the result of a lookup is a directory.
+
+    int new_directory_block(block_number block);
+      // Puts an empty directory block into the directory table and returns its position.
+
+    void load_directories();
+    void free_directories();
+      // Read every directory starting at root_block (using the FAT in memory), or discard them.
+
+    void save_directory(int position);
+      // Writes the directory block at the given directory table position.
+
+    int first_position(int directory);
+    int next_position(int position);
+      // Walk the directory table positions of a directory's blocks. The end is -1.
+
+    int find_in_directory(int directory, const char *name, int length);
+      // Returns the entry number of the named entry in a directory, or NOT_FOUND.
+
+    void index_entry(int directory, int number);
+    void build_index(int directory);
+      // Add an entry to a directory's hash index (if it has one) or build a new index.
+
+    int add_entry(int directory);
+      // Returns the entry number of an unused entry in the directory, adding a block to the
+      // directory if necessary. Returns NOT_FOUND if that isn't possible.
+
+    int lookup(const char *path, int length);
+      // Returns the entry number of the entry named by a path, ROOT_DIRECTORY for the root
+      // directory, or NOT_FOUND.
+
+    int find_parent(const char *path, const char **leaf);
+      // Returns the directory that should contain the entry named by path, or NOT_FOUND if
+      // there is no such directory. Leaf is set to the last name in the path.
+
+    void cache_path(const char *path, int length, int number);
+    void forget_entry(int number);
+    void clear_path_cache();
+      // Maintain the path cache.
+
+    int find_snapshot(const char *name);
+      // Returns the snapshot table index of the named snapshot or -1 if there is none.
+
+    void save_snapshot_table();
+      // Writes the reference counts and the snapshot table to disk.
+
+    void release_block(block_number block)
+      { FAT[block] = (snapshot_refs[block] != 0) ? RESERVED_FAT_ENTRY : FREE_FAT_ENTRY; }
+      // Frees a block that the live file system no longer uses. A block that a snapshot still
+      // uses stays reserved.
+
+    block_number unshare_block(block_number block);
+      // If the block is shared with a snapshot, moves the live file using it to a new block
+      // and returns that block. The caller must write the new block in full. Otherwise just
+      // returns the block.
+
+    block_number tail_frame(int directory_index);
+      // Returns the first block of the last (partial or empty) frame of a compressed file.
+
+    int read_compressed(int handle, char *buffer, int count);
+    int write_compressed(int handle, const char *buffer, int count);
+      // Implement read() and write() for compressed files.
+
 
   public:
 
@@ -147,15 +594,31 @@ public:
       { return formatted_flag; }
       // Returns true if the file system appears to be properly formatted.
 
-    void format();
-      // Formats the file system. This is called "making a file system" in some cultures.
+    void format(bool checksums = false);
+      // Formats the file system. This is called "making a file system" in some cultures. If
+      // checksums is true every block is protected by a checksum.
+
+    bool has_checksums()
+      { return checksum_blocks != 0; }
+      // Returns true if the file system was formatted with checksums.
+
+    bool rebuilt_checksums()
+      { return checksums_rebuilt; }
+      // Returns true if the file system was not shut down cleanly and its checksums were
+      // rebuilt when it was mounted. Damage done by the interruption is not detected.
+
+    int verify_checksums();
+      // Reads every allocated block and checks its checksum. Several blocks are read at once
+      // if the device allows it. Returns the number of blocks with bad checksums. Throws an
+      // exception if the file system has no checksums.
 
     int open(const char *name, open_mode mode);
       // Open a file with the given name. Returns the file's handle. If a file is opened for
       // writing, it should be opened in "append" mode (new material goes on the end). It should
       // be created if it does not exist. Only sequential access is supported. This version of
       // the FileSystem class does not support random access files. This function will throw an
-      // exception if an error occurs.
+      // exception if an error occurs. The name can be a path, but the directories in it must
+      // already exist.
 
     void truncate(const char *name);
       // Truncates an existing file to zero size. If the file does not exist, this function does
@@ -176,11 +639,10 @@ public:
 
     void remove(const char *name);
       // Probably should support deleting files too. If this function is applied to a file that
-      // is open, the effect is undefined.
+      // is open, the effect is undefined. Directories are removed with remove_directory().
 
-    void open_dir()
-      { scan_index = 0; }
-      // Prepares the root directory for a scan.
+    void open_dir(const char *path = "");
+      // Prepares a directory for a scan. By default the root directory is scanned.
 
     bool next_dir(directory_info *);
       // Returns information about the "next" directory entry in a directory scan. If open_dir()
@@ -191,10 +653,63 @@ public:
     long free_space();
       // Returns the number of free bytes on the disk.
 
+    void make_directory(const char *path);
+      // Creates a directory. The directory containing it must already exist.
+
+    void remove_directory(const char *path);
+      // Removes an empty directory. Throws an exception if the directory is not empty.
+
+    void set_compression(bool enabled)
+      { compress_new_files = enabled; }
+      // Controls whether files created from now on are compressed. Existing files keep their
+      // mode. Initially new files are not compressed.
+
+    bool compression_enabled()
+      { return compress_new_files; }
+
+    const compression_statistics &compression_stats()
+      { return compression; }
+      // Returns statistics about compression since the file system object was created.
+
     void check();
       // This function checks the file system for consistency. It throws an exception if it
       // finds a problem (is that really a good idea?), otherwise it just returns without
       // comment.
+
+    double average_run_length();
+      // Returns the average number of blocks in a run of consecutive blocks in the files. A
+      // file system with no fragmentation has one run per file. Returns zero if there are no
+      // files.
+
+    int defragment(progress_function progress = 0, void *context = 0);
+      // Rearranges the blocks of every file so that each file is contiguous and all the free
+      // blocks are at the end of the disk. If progress is not null it is called after each
+      // block is put into place. Returns the number of blocks that had to be moved. No files
+      // can be open. If the operation is interrupted (for example by a crash) no data is lost
+      // although check() might find lost chains. Throws an exception if there are snapshots.
+
+    void create_snapshot(const char *name);
+      // Creates a snapshot of the live file system with the given name. Only the FAT and the
+      // directories are copied so the cost does not depend on the amount of data. Files can be
+      // open; data written to them later is not part of the snapshot.
+
+    void delete_snapshot(const char *name);
+      // Deletes a snapshot and frees the blocks that nothing else uses. No snapshot can be
+      // mounted.
+
+    void open_snapshots()
+      { snapshot_scan = 0; }
+    bool next_snapshot(snapshot_info *);
+      // Scan the snapshots in the same way as open_dir() and next_dir() scan the directory.
+
+    void mount_snapshot(const char *name);
+      // Makes the named snapshot visible in place of the live file system. The snapshot is
+      // read only: files can't be opened for writing, truncated, or removed. A null name
+      // mounts the live file system again. No files can be open.
+
+    const char *mounted_snapshot()
+      { return (mounted_index < 0) ? 0 : snapshots[mounted_index].name; }
+      // Returns the name of the mounted snapshot or null if the live file system is mounted.
 };
 
 #endif
@@ -30,31 +30,35 @@ void FileSystem::check()
             throw "file_system::check() -- Files open for writing";
     }
 
-    // For each file in the root directory, let's verify it's size.
-    for (i = 0; i < sizeof(root_directory)/sizeof(directory_entry); i++) {
-
-      // If we have a file, then count the number of blocks allocated to it.
-        if (root_directory[i].in_use == 1) {
-            long         size          = root_directory[i].size;
-            long         block_count   = 0;
-            block_number current_block = root_directory[i].starting_block;
-
-            while (FAT[current_block] != EOF_FAT_ENTRY) {
-                
-                // The blocks are either reserved or EOF. If we come to a free block, then we
-                // have a problem.
-                //
-                if (FAT[current_block] == FREE_FAT_ENTRY)
-                    throw "file_system::check() -- Unreserved FAT block in a file's chain";
-
-                block_count++;
-                current_block = FAT[current_block];
-            }
-
-            // Does the number of blocks allocated to this file make sense?
-            if (size/BLOCK_SIZE != block_count)
-                throw "file_system::check() -- A file has an invalid size";
+    // For each file in every directory, let's verify it's size.
+    for (i = next_entry(-1); i != NOT_FOUND; i = next_entry(i)) {
+
+        // Count the number of blocks allocated to the file.
+        long         size          = entry(i).size;
+        long         block_count   = 0;
+        block_number current_block = entry(i).starting_block;
+
+        while (FAT[current_block] != EOF_FAT_ENTRY) {
+
+            // The blocks are either reserved or EOF. If we come to a free block, then we have a
+            // problem.
+            //
+            if (FAT[current_block] == FREE_FAT_ENTRY)
+                throw "file_system::check() -- Unreserved FAT block in a file's chain";
+
+            block_count++;
+            current_block = FAT[current_block];
         }
+
+        // Does the number of blocks allocated to this file make sense? There is no simple
+        // relationship between the size of a compressed file and its number of blocks. A
+        // directory has no extra block at the end.
+        if (entry(i).flags & DIRECTORY_FLAG) {
+            if ((size & block_mask) != 0 || (size >> block_shift) != block_count + 1)
+                throw "file_system::check() -- A directory has an invalid size";
+        }
+        else if (!(entry(i).flags & COMPRESSED_FLAG) && (size >> block_shift) != block_count)
+            throw "file_system::check() -- A file has an invalid size";
     }
 
     // Now let's see if we can locate lost chains and cross linked files.
@@ -67,25 +71,21 @@ void FileSystem::check()
         if (FAT[i] == FREE_FAT_ENTRY)     check_off[i] = true;
     }
 
-    // Scan over all the files again
-    for (i = 0; i < sizeof(root_directory)/sizeof(directory_entry); i++) {
-
-        // If we have a file, then check off all the blocks used by that file.
-        if (root_directory[i].in_use == 1) {
-            block_number current_block = root_directory[i].starting_block;
+    // Scan over all the files again, checking off all the blocks used by each one.
+    for (i = next_entry(-1); i != NOT_FOUND; i = next_entry(i)) {
+        block_number current_block = entry(i).starting_block;
 
-            while (FAT[current_block] != EOF_FAT_ENTRY) {
-                if (check_off[current_block] == true)
-                    throw "file_system::check() -- Cross linked files detected";
-                check_off[current_block] = true;
-                current_block = FAT[current_block];
-            }
-
-            // The EOF block is also being used.
+        while (FAT[current_block] != EOF_FAT_ENTRY) {
             if (check_off[current_block] == true)
-                throw "file_system::check() -- Cross linked files detected on a file EOF";
+                throw "file_system::check() -- Cross linked files detected";
             check_off[current_block] = true;
+            current_block = FAT[current_block];
         }
+
+        // The EOF block is also being used.
+        if (check_off[current_block] == true)
+            throw "file_system::check() -- Cross linked files detected on a file EOF";
+        check_off[current_block] = true;
     }
 
     // Any unchecked blocks? If so, they are lost.
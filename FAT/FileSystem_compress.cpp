@@ -0,0 +1,341 @@
+/*! \file    FileSystem_compress.cpp
+    \brief   Support for compressed files.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+A compressed file is a chain of frames. Each frame holds one cluster and starts on a block
+boundary. Every cluster except the last is full. The chain always ends with the block where the
+next frame would start: if the last cluster is partial that is the first block of its frame,
+otherwise it is an extra block holding no data (like the last block of an ordinary file whose
+size is a multiple of the block size).
+
+The size recorded in the directory is the size of the uncompressed data. The handle's current
+block is the first block of the frame holding the cluster that contains the file pointer.
+*/
+
+#include <cstring>
+
+#include "Clock.hpp"
+#include "Compression.hpp"
+#include "FileSystem.hpp"
+
+namespace {
+
+    int get_u16(const char *p)
+    {
+        return  static_cast<unsigned char>(p[0]) |
+               (static_cast<unsigned char>(p[1]) << 8);
+    }
+
+    void put_u16(char *p, int value)
+    {
+        p[0] = static_cast<char>( value       & 0xFF);
+        p[1] = static_cast<char>((value >> 8) & 0xFF);
+    }
+}
+
+
+//
+// FileSystem::allocate_block
+//
+FileSystem::block_number FileSystem::allocate_block()
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    for (int i = first_data_block(); i < FAT_size; i++) {
+        if (FAT[i] == FREE_FAT_ENTRY) {
+            FAT[i] = EOF_FAT_ENTRY;
+            return i;
+        }
+    }
+    throw "FileSystem -- Can't locate a free block, but one expected";
+}
+
+
+//
+// FileSystem::free_after
+//
+void FileSystem::free_after(block_number last)
+{
+    block_number current = FAT[last];
+    FAT[last] = EOF_FAT_ENTRY;
+    while (current != EOF_FAT_ENTRY) {
+        block_number next = FAT[current];
+        release_block(current);
+        current = next;
+    }
+}
+
+
+//
+// FileSystem::invalidate_clusters
+//
+void FileSystem::invalidate_clusters()
+{
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++) {
+        cluster_cache[i].valid = false;
+    }
+}
+
+
+//
+// FileSystem::load_cluster
+//
+// The first block of the frame contains the header. Once it has been read we know how many
+// more blocks to read. Reading ahead from the first block fetches the rest of the frame (and
+// perhaps the start of the next) on devices that can do several reads at once.
+//
+FileSystem::cluster_slot *FileSystem::load_cluster(block_number first)
+{
+    for (int i = 0; i < CLUSTER_CACHE_SIZE; i++) {
+        if (cluster_cache[i].valid && cluster_cache[i].first == first) return &cluster_cache[i];
+    }
+
+    cluster_slot *slot = &cluster_cache[next_cluster_victim];
+    next_cluster_victim = (next_cluster_victim + 1) % CLUSTER_CACHE_SIZE;
+    slot->valid = false;
+
+    char *frame = &frame_buffer[0];
+    read_block(first, frame);
+    read_ahead(first);
+
+    int stored = get_u16(frame);
+    int length = get_u16(frame + 2);
+    if (length > cluster_size || stored > cluster_size || (stored == 0 && length != 0))
+        throw "FileSystem -- Corrupt compressed cluster";
+
+    // Read the rest of the frame.
+    int          blocks  = (FRAME_HEADER_SIZE + stored + block_mask) >> block_shift;
+    block_number current = first;
+    for (int i = 1; i < blocks; i++) {
+        current = FAT[current];
+        if (current == EOF_FAT_ENTRY)
+            throw "FileSystem -- Compressed cluster extends past the end of the file";
+        read_block(current, frame + i * block_size);
+    }
+
+    if (stored == length)
+        std::memcpy(slot->data, frame + FRAME_HEADER_SIZE, length);
+    else {
+        double start = clock_microseconds();
+        int    size  =
+            lz_decompress(frame + FRAME_HEADER_SIZE, stored, slot->data, cluster_size);
+        compression.decompress_time += clock_microseconds() - start;
+        if (size != length)
+            throw "FileSystem -- Corrupt compressed cluster";
+    }
+    compression.raw_read    += length;
+    compression.stored_read += stored;
+
+    slot->first  = first;
+    slot->length = length;
+    slot->stored = stored;
+    slot->blocks = blocks;
+    slot->valid  = true;
+    return slot;
+}
+
+
+//
+// FileSystem::store_cluster
+//
+// The frame reuses the blocks already in the chain starting at first and adds blocks to the
+// chain as needed. Blocks shared with a snapshot are replaced rather than reused. A copy of the
+// cluster is kept in the cluster cache since it is likely to be needed again (a partial cluster
+// is reloaded by the next write).
+//
+FileSystem::block_number FileSystem::store_cluster(
+    block_number first, const char *data, int length)
+{
+    char *frame = &frame_buffer[0];
+
+    double start  = clock_microseconds();
+    int    stored = lz_compress(data, length, frame + FRAME_HEADER_SIZE, length - 1);
+    compression.compress_time += clock_microseconds() - start;
+
+    // If compression didn't help, store the cluster as is.
+    if (stored == 0) {
+        std::memcpy(frame + FRAME_HEADER_SIZE, data, length);
+        stored = length;
+    }
+    put_u16(frame, stored);
+    put_u16(frame + 2, length);
+    compression.stored_written += stored;
+
+    int frame_size = FRAME_HEADER_SIZE + stored;
+    int blocks     = (frame_size + block_mask) >> block_shift;
+    std::memset(frame + frame_size, 0, blocks * block_size - frame_size);
+
+    block_number current = first;
+    for (int i = 0; i < blocks; i++) {
+        if (i != 0) {
+            if (FAT[current] == EOF_FAT_ENTRY) FAT[current] = allocate_block();
+            current = FAT[current];
+        }
+        current = unshare_block(current);
+        if (i == 0) first = current;
+        write_behind(current, frame + i * block_size);
+    }
+
+    // Update the cluster cache.
+    cluster_slot *slot = 0;
+    for (int i = 0; i < CLUSTER_CACHE_SIZE && slot == 0; i++) {
+        if (cluster_cache[i].valid && cluster_cache[i].first == first) slot = &cluster_cache[i];
+    }
+    if (slot == 0) {
+        slot = &cluster_cache[next_cluster_victim];
+        next_cluster_victim = (next_cluster_victim + 1) % CLUSTER_CACHE_SIZE;
+    }
+    std::memcpy(slot->data, data, length);
+    slot->first  = first;
+    slot->length = length;
+    slot->stored = stored;
+    slot->blocks = blocks;
+    slot->valid  = true;
+
+    if (length < cluster_size) {
+        free_after(current);
+        return first;
+    }
+    if (FAT[current] == EOF_FAT_ENTRY) FAT[current] = allocate_block();
+    return FAT[current];
+}
+
+
+//
+// FileSystem::tail_frame
+//
+// Skips over the full clusters. Only the first block of each frame needs to be read.
+//
+FileSystem::block_number FileSystem::tail_frame(int directory_index)
+{
+    block_number current = entry(directory_index).starting_block;
+    long         full    = entry(directory_index).size / cluster_size;
+
+    for (long i = 0; i < full; i++) {
+        block_buffer *header = borrow_block(current);
+        int           blocks =
+            (FRAME_HEADER_SIZE + get_u16(header->data) + block_mask) >> block_shift;
+        release(header);
+
+        for (int j = 0; j < blocks; j++) {
+            if (FAT[current] == EOF_FAT_ENTRY)
+                throw "FileSystem -- Compressed file is shorter than its size";
+            current = FAT[current];
+        }
+    }
+    return current;
+}
+
+
+//
+// FileSystem::read_compressed
+//
+int FileSystem::read_compressed(int handle, char *buffer, int count)
+{
+    handletable_entry &file = handle_table[handle];
+
+    // Adjust the count.
+    long file_size = entry(file.directory_index).size;
+    if (file_size - file.offset < count) count = file_size - file.offset;
+
+    int done = 0;
+    while (done < count) {
+        cluster_slot *cluster  = load_cluster(file.current_block);
+        int           position = file.offset % cluster_size;
+        int           amount   = cluster->length - position;
+
+        if (amount <= 0)
+            throw "FileSystem::read() -- Compressed file is shorter than its size";
+        if (amount > count - done) amount = count - done;
+
+        std::memcpy(buffer + done, cluster->data + position, amount);
+        done        += amount;
+        file.offset += amount;
+
+        // If that's the end of the cluster, move to the next frame.
+        if (position + amount == cluster_size) {
+            for (int i = 0; i < cluster->blocks; i++) {
+                file.current_block = FAT[file.current_block];
+            }
+        }
+    }
+    return count;
+}
+
+
+//
+// FileSystem::write_compressed
+//
+// The amount written is limited so that the data would fit even if it doesn't compress at
+// all. This might refuse data that would really fit, but it ensures we never run out of space
+// in the middle of a cluster.
+//
+int FileSystem::write_compressed(int handle, const char *buffer, int count)
+{
+    handletable_entry &file      = handle_table[handle];
+    directory_entry   &directory = entry(file.directory_index);
+    const int          FAT_size  = sizeof(FAT)/sizeof(block_number);
+
+    // How many blocks could we use? The tail frame's blocks will be rewritten, except for
+    // those shared with a snapshot.
+    long available = 0;
+    for (int i = 0; i < FAT_size; i++) {
+        if (FAT[i] == FREE_FAT_ENTRY) available++;
+    }
+    block_number current = file.current_block;
+    if (snapshot_refs[current] == 0) available++;
+    while (FAT[current] != EOF_FAT_ENTRY) {
+        current = FAT[current];
+        if (snapshot_refs[current] == 0) available++;
+    }
+
+    // Work out the most data that fits in that many blocks if it doesn't compress.
+    long full_frames = (available - 1) / frame_blocks;
+    long leftover    = available - full_frames * frame_blocks;
+    long partial     = leftover * block_size - FRAME_HEADER_SIZE;
+    if (partial > cluster_size - 1) partial = cluster_size - 1;
+
+    int  tail_length = directory.size % cluster_size;
+    long room        = full_frames * cluster_size + partial - tail_length;
+    if (room < count) count = (room < 0) ? 0 : room;
+    if (count == 0) return 0;
+
+    // Start with the partial cluster at the end of the file, if there is one. Its frame is
+    // replaced below, so only the growth in stored size is counted. That way a file built by
+    // many small writes is not counted again each time its tail is rewritten.
+    char *cluster = &cluster_buffer[0];
+    int   fill    = tail_length;
+    if (fill != 0) {
+        cluster_slot *tail = load_cluster(file.current_block);
+        std::memcpy(cluster, tail->data, fill);
+        compression.stored_written -= tail->stored;
+    }
+    compression.raw_written += count;
+
+    int done = 0;
+    while (done < count) {
+        int amount = cluster_size - fill;
+        if (amount > count - done) amount = count - done;
+
+        std::memcpy(cluster + fill, buffer + done, amount);
+        fill           += amount;
+        done           += amount;
+        file.offset    += amount;
+        directory.size += amount;
+
+        if (fill == cluster_size) {
+            file.current_block = store_cluster(file.current_block, cluster, fill);
+            fill = 0;
+        }
+    }
+
+    // Store the last, partial cluster. If there isn't one, the current block is where the next
+    // frame will start and nothing should follow it.
+    if (fill != 0) file.current_block = store_cluster(file.current_block, cluster, fill);
+    else free_after(file.current_block);
+    entry_changed(file.directory_index);
+
+    // As for ordinary files, the data must be on the disk before we return.
+    drain();
+    return count;
+}
@@ -0,0 +1,181 @@
+/*! \file    FileSystem_defrag.cpp
+    \brief   Implementation of FileSystem::defragment() and related functions.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+Because write() always takes the first free block it finds, files that are written at the same
+time (or that are extended after other files have been created) end up with their blocks
+interleaved. Reading such a file sequentially requires many seeks. The defragmenter moves
+blocks so that each file occupies consecutive blocks, in directory order, starting just after
+the root directory.
+*/
+
+#include "FileSystem.hpp"
+
+//
+// FileSystem::relocate
+//
+// The order of the disk writes matters. The data is copied first; since the destination is
+// free nothing refers to it yet. If the block is not the first block in its file, the FAT
+// entries that change are all in the one FAT block so a single write switches the file over
+// to the new block. If it is the first block, the directory holding the file's entry must also
+// be updated. In that case the new block is linked into the FAT before the directory is changed
+// and the old block is only freed afterward. An interruption between those writes leaves a lost
+// chain behind but every file still has all of its data.
+//
+// If the block belongs to a directory, the directory's copy in memory moves with it. Its entry
+// numbers stay the same.
+//
+// The block's checksum (if any) moves with it. The data is not verified here because a block
+// that holds no data might never have been written. The final flush() also saves the
+// checksums of the new FAT and directory blocks.
+//
+void FileSystem::relocate(block_number from, block_number to)
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    block_buffer *buffer = borrow_buffer();
+    the_disk.read(from, buffer->data);
+    invalidate(to);
+    mark_checksums_stale();
+    the_disk.write(to, buffer->data);
+    release(buffer);
+    block_checksums[to] = block_checksums[from];
+    invalidate_clusters();
+
+    int position = directory_position[from];
+    if (position != -1) {
+        directory_table[position]->block = to;
+        directory_position[to]   = position;
+        directory_position[from] = -1;
+    }
+
+    // Who refers to this block? Either a directory entry or another FAT entry.
+    int owner;
+    for (owner = next_entry(-1); owner != NOT_FOUND; owner = next_entry(owner)) {
+        if (entry(owner).starting_block == from) break;
+    }
+
+    FAT[to] = FAT[from];
+    if (owner != NOT_FOUND) {
+        write_structure(FAT_BLOCK, FAT, sizeof(FAT));
+        entry(owner).starting_block = to;
+        save_directory(owner / DIRECTORY_SIZE);
+    }
+    else {
+        int previous;
+        for (previous = 0; previous < FAT_size; previous++) {
+            if (FAT[previous] == from) break;
+        }
+        if (previous == FAT_size)
+            throw "FileSystem::relocate() -- Block is not part of any file";
+        FAT[previous] = to;
+    }
+    FAT[from] = FREE_FAT_ENTRY;
+    flush();
+}
+
+
+//
+// FileSystem::average_run_length
+//
+// A run ends wherever the next block in a file's chain is not the physically next block. The
+// block marked with EOF is counted since it is allocated to the file.
+//
+double FileSystem::average_run_length()
+{
+    if (formatted_flag == false)
+        throw "FileSystem::average_run_length() -- Unformatted file system";
+
+    long blocks = 0;
+    long runs   = 0;
+
+    for (int i = next_entry(-1); i != NOT_FOUND; i = next_entry(i)) {
+        block_number current = entry(i).starting_block;
+        runs++;
+        blocks++;
+        while (FAT[current] != EOF_FAT_ENTRY) {
+            if (FAT[current] != current + 1) runs++;
+            current = FAT[current];
+            blocks++;
+        }
+    }
+
+    return (runs == 0) ? 0.0 : static_cast<double>(blocks) / runs;
+}
+
+
+//
+// FileSystem::defragment
+//
+// Each position on the disk after the fixed structures is filled in turn with the block that
+// belongs there. If the position is occupied by some other block, that block is first moved
+// out of the way to a free block near the end of the disk. Every position before the current
+// one already holds its final block so there is no danger of disturbing work that has been
+// done. At least one free block is needed unless the disk happens to be in order already.
+//
+int FileSystem::defragment(progress_function progress, void *context)
+{
+    const int han_size = sizeof(handle_table)/sizeof(handletable_entry);
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    if (formatted_flag == false)
+        throw "FileSystem::defragment() -- Unformatted file system";
+
+    for (int i = 0; i < han_size; i++) {
+        if (handle_table[i].in_use)
+            throw "FileSystem::defragment() -- Files are open";
+    }
+
+    // Moving a block would require updating the FAT of every snapshot using it.
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].in_use)
+            throw "FileSystem::defragment() -- Snapshots exist";
+    }
+
+    // Make sure the disk is up to date before we start moving things around on it.
+    drain();
+    flush();
+
+    int total = 0;
+    for (int i = 0; i < FAT_size; i++) {
+        if (FAT[i] != FREE_FAT_ENTRY && FAT[i] != RESERVED_FAT_ENTRY) total++;
+    }
+
+    int          done   = 0;
+    int          moved  = 0;
+    block_number target = first_data_block();
+
+    for (int i = next_entry(-1); i != NOT_FOUND; i = next_entry(i)) {
+        block_number current = entry(i).starting_block;
+        while (1) {
+            // Reserved blocks (such as the snapshot table) stay where they are.
+            while (FAT[target] == RESERVED_FAT_ENTRY) target++;
+
+            if (current != target) {
+
+                // Clear the target position if necessary.
+                if (FAT[target] != FREE_FAT_ENTRY) {
+                    int spare;
+                    for (spare = FAT_size - 1; spare > target; spare--) {
+                        if (FAT[spare] == FREE_FAT_ENTRY) break;
+                    }
+                    if (spare == target)
+                        throw "FileSystem::defragment() -- No free block to work with";
+                    relocate(target, spare);
+                    moved++;
+                }
+                relocate(current, target);
+                moved++;
+                current = target;
+            }
+
+            done++;
+            if (progress != 0) progress(done, total, context);
+
+            target++;
+            if (FAT[current] == EOF_FAT_ENTRY) break;
+            current = FAT[current];
+        }
+    }
+    return moved;
+}
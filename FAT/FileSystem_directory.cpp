@@ -0,0 +1,489 @@
+/*! \file    FileSystem_directory.cpp
+    \brief   Implementation of subdirectories and path lookup.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+A path is looked up one name at a time, from the right. The path cache is checked for the whole
+path first. If it isn't there, the directory holding the last name is looked up in the same way
+(so it is probably found in the cache too) and then the last name is found in that directory.
+Once a path has been used it is normally found with one probe of the cache no matter how deep it
+is. Within a directory, small directories are searched directly and large ones use their hash
+index, so the cost of finding a name does not grow with the size of the directory.
+*/
+
+#include <cstring>
+
+#include "FileSystem.hpp"
+
+namespace {
+
+    // The FNV-1a hash function. The shell uses the same function for its command table.
+    unsigned int hash_name(const char *name, int length)
+    {
+        unsigned int value = 2166136261U;
+        for (int i = 0; i < length; ++i) {
+            value ^= static_cast<unsigned char>(name[i]);
+            value *= 16777619U;
+        }
+        return value;
+    }
+
+    bool same_name(const char *entry_name, const char *name, int length)
+    {
+        return std::strncmp(entry_name, name, length) == 0 && entry_name[length] == '\0';
+    }
+}
+
+
+//===========================================
+//           Directory Table Functions
+//===========================================
+
+//
+// FileSystem::next_entry
+//
+int FileSystem::next_entry(int number)
+{
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+
+    for (number++; number < table_size * DIRECTORY_SIZE; number++) {
+        directory_block *block = directory_table[number / DIRECTORY_SIZE];
+
+        // Skip over unused table positions a whole block at a time.
+        if (block == 0) number += DIRECTORY_SIZE - 1 - number % DIRECTORY_SIZE;
+        else if (block->entries[number % DIRECTORY_SIZE].in_use == 1) return number;
+    }
+    return NOT_FOUND;
+}
+
+
+//
+// FileSystem::new_directory_block
+//
+int FileSystem::new_directory_block(block_number block)
+{
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+
+    int position;
+    for (position = 0; position < table_size; position++) {
+        if (directory_table[position] == 0) break;
+    }
+    if (position == table_size)
+        throw "FileSystem -- Directory table is full";
+
+    directory_block *new_block = new directory_block;
+    new_block->block      = block;
+    new_block->dirty      = false;
+    new_block->index_used = 0;
+    std::memset(new_block->entries, 0, sizeof(new_block->entries));
+
+    directory_table[position] = new_block;
+    directory_position[block] = position;
+    return position;
+}
+
+
+//
+// FileSystem::load_directories
+//
+// Positions in the directory table are handed out in order so the loop over the table reaches
+// the blocks of each subdirectory after the block that contains its entry. The checks guard
+// against a damaged FAT sending us around in circles.
+//
+void FileSystem::load_directories()
+{
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+    const int FAT_size   = sizeof(FAT)/sizeof(block_number);
+
+    free_directories();
+    int root = new_directory_block(root_block);
+    read_structure(root_block, directory_table[root]->entries,
+                   sizeof(directory_table[root]->entries));
+
+    for (int position = 0;
+         position < table_size && directory_table[position] != 0; position++) {
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            directory_entry &subdirectory = directory_table[position]->entries[i];
+            if (subdirectory.in_use != 1 || !(subdirectory.flags & DIRECTORY_FLAG)) continue;
+
+            block_number current = subdirectory.starting_block;
+            while (1) {
+                if (current <= EOF_FAT_ENTRY || current >= FAT_size ||
+                    directory_position[current] != -1)
+                    throw "FileSystem -- Damaged directory";
+
+                int added = new_directory_block(current);
+                read_structure(current, directory_table[added]->entries,
+                               sizeof(directory_table[added]->entries));
+
+                if (FAT[current] == EOF_FAT_ENTRY) break;
+                current = FAT[current];
+            }
+        }
+    }
+}
+
+
+//
+// FileSystem::free_directories
+//
+void FileSystem::free_directories()
+{
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+    const int FAT_size   = sizeof(FAT)/sizeof(block_number);
+
+    for (int i = 0; i < table_size; i++) {
+        delete directory_table[i];
+        directory_table[i] = 0;
+    }
+    for (int i = 0; i < FAT_size; i++) {
+        directory_position[i] = -1;
+    }
+}
+
+
+//
+// FileSystem::save_directory
+//
+void FileSystem::save_directory(int position)
+{
+    directory_block *block = directory_table[position];
+
+    write_structure(block->block, block->entries, sizeof(block->entries));
+    block->dirty = false;
+}
+
+
+//
+// FileSystem::first_position
+//
+int FileSystem::first_position(int directory)
+{
+    if (directory == ROOT_DIRECTORY) return 0;
+    return directory_position[entry(directory).starting_block];
+}
+
+
+//
+// FileSystem::next_position
+//
+// The root directory's block is reserved in the FAT so it looks like the end of a chain.
+//
+int FileSystem::next_position(int position)
+{
+    block_number next = FAT[directory_table[position]->block];
+    if (next <= EOF_FAT_ENTRY) return -1;
+    return directory_position[next];
+}
+
+
+//======================================
+//           Lookup Functions
+//======================================
+
+//
+// FileSystem::find_in_directory
+//
+int FileSystem::find_in_directory(int directory, const char *name, int length)
+{
+    if (length <= 0 || length >= static_cast<int>(sizeof(entry(0).name))) return NOT_FOUND;
+
+    int              position = first_position(directory);
+    directory_block *head     = directory_table[position];
+
+    // Large directories use their hash index.
+    if (directory != ROOT_DIRECTORY &&
+        (entry(directory).size >> block_shift) >= LARGE_DIRECTORY) {
+        if (head->index.empty()) build_index(directory);
+
+        unsigned int mask = head->index.size() - 1;
+        unsigned int slot = hash_name(name, length) & mask;
+        while (head->index[slot] != -1) {
+            directory_entry &candidate = entry(head->index[slot]);
+            if (candidate.in_use == 1 && same_name(candidate.name, name, length))
+                return head->index[slot];
+            slot = (slot + 1) & mask;
+        }
+        return NOT_FOUND;
+    }
+
+    for ( ; position != -1; position = next_position(position)) {
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            directory_entry &candidate = directory_table[position]->entries[i];
+            if (candidate.in_use == 1 && same_name(candidate.name, name, length))
+                return position * DIRECTORY_SIZE + i;
+        }
+    }
+    return NOT_FOUND;
+}
+
+
+//
+// FileSystem::index_entry
+//
+// Entries are never taken out of the index so it fills up with entries that have been removed
+// (or that have been reused under a different name). When it is half full it is thrown away.
+//
+void FileSystem::index_entry(int directory, int number)
+{
+    directory_block *head = directory_table[first_position(directory)];
+    if (head->index.empty()) return;
+
+    if (2 * (head->index_used + 1) > static_cast<int>(head->index.size())) {
+        head->index.clear();
+        return;
+    }
+
+    const char  *name = entry(number).name;
+    unsigned int mask = head->index.size() - 1;
+    unsigned int slot = hash_name(name, std::strlen(name)) & mask;
+    while (head->index[slot] != -1) slot = (slot + 1) & mask;
+    head->index[slot] = number;
+    head->index_used++;
+}
+
+
+//
+// FileSystem::build_index
+//
+// The index starts out at most a quarter full so that many entries can be added before it has
+// to be built again.
+//
+void FileSystem::build_index(int directory)
+{
+    int              position = first_position(directory);
+    directory_block *head     = directory_table[position];
+    int              capacity = (entry(directory).size >> block_shift) * DIRECTORY_SIZE;
+    int              size     = 1;
+
+    while (size < 4 * capacity) size *= 2;
+    head->index.assign(size, -1);
+    head->index_used = 0;
+
+    for ( ; position != -1; position = next_position(position)) {
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            if (directory_table[position]->entries[i].in_use == 1)
+                index_entry(directory, position * DIRECTORY_SIZE + i);
+        }
+    }
+}
+
+
+//
+// FileSystem::add_entry
+//
+// A new block is added at the end of the directory. The root directory is a single block that
+// can't grow.
+//
+int FileSystem::add_entry(int directory)
+{
+    int position = first_position(directory);
+    int last     = position;
+
+    for ( ; position != -1; position = next_position(position)) {
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            if (directory_table[position]->entries[i].in_use == 0)
+                return position * DIRECTORY_SIZE + i;
+        }
+        last = position;
+    }
+
+    if (directory == ROOT_DIRECTORY || free_space() < block_size) return NOT_FOUND;
+
+    block_number block = allocate_block();
+    FAT[directory_table[last]->block] = block;
+    position = new_directory_block(block);
+    directory_table[position]->dirty = true;
+
+    entry(directory).size += block_size;
+    entry_changed(directory);
+    directory_table[first_position(directory)]->index.clear();
+    return position * DIRECTORY_SIZE;
+}
+
+
+//
+// FileSystem::lookup
+//
+int FileSystem::lookup(const char *path, int length)
+{
+    if (length > 0 && path[0] == '/') return lookup(path + 1, length - 1);
+    if (length == 0) return ROOT_DIRECTORY;
+
+    // Is the whole path in the cache?
+    path_cache_slot &slot = path_cache[hash_name(path, length) % PATH_CACHE_SIZE];
+    if (slot.entry != NOT_FOUND && slot.length == length &&
+        std::memcmp(slot.path, path, length) == 0)
+        return slot.entry;
+
+    // Find the directory holding the last name.
+    int split = length;
+    while (split > 0 && path[split - 1] != '/') split--;
+
+    int directory = ROOT_DIRECTORY;
+    if (split > 0) {
+        directory = lookup(path, split - 1);
+        if (!is_directory(directory)) return NOT_FOUND;
+    }
+
+    int number = find_in_directory(directory, path + split, length - split);
+    if (number != NOT_FOUND) cache_path(path, length, number);
+    return number;
+}
+
+
+//
+// FileSystem::find_parent
+//
+int FileSystem::find_parent(const char *path, const char **leaf)
+{
+    if (*path == '/') path++;
+
+    const char *slash = std::strrchr(path, '/');
+    if (slash == 0) {
+        *leaf = path;
+        return ROOT_DIRECTORY;
+    }
+
+    *leaf = slash + 1;
+    int directory = lookup(path, slash - path);
+    return is_directory(directory) ? directory : NOT_FOUND;
+}
+
+
+//
+// FileSystem::cache_path
+//
+void FileSystem::cache_path(const char *path, int length, int number)
+{
+    if (length >= MAX_CACHED_PATH) return;
+
+    path_cache_slot &slot = path_cache[hash_name(path, length) % PATH_CACHE_SIZE];
+    std::memcpy(slot.path, path, length);
+    slot.length = length;
+    slot.entry  = number;
+}
+
+
+//
+// FileSystem::forget_entry
+//
+void FileSystem::forget_entry(int number)
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        if (path_cache[i].entry == number) path_cache[i].entry = NOT_FOUND;
+    }
+}
+
+
+//
+// FileSystem::clear_path_cache
+//
+void FileSystem::clear_path_cache()
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        path_cache[i].entry = NOT_FOUND;
+    }
+}
+
+
+//========================================
+//           Directory Operations
+//========================================
+
+//
+// FileSystem::open_dir
+//
+void FileSystem::open_dir(const char *path)
+{
+    int directory = lookup(path, std::strlen(path));
+    if (!is_directory(directory))
+        throw "FileSystem::open_dir() -- No such directory";
+
+    scan_position = first_position(directory);
+    scan_index    = 0;
+}
+
+
+//
+// FileSystem::make_directory
+//
+void FileSystem::make_directory(const char *path)
+{
+    if (formatted_flag == false)
+        throw "FileSystem::make_directory() -- Unformatted file system";
+    if (mounted_index >= 0)
+        throw "FileSystem::make_directory() -- Snapshots are read only";
+
+    const char *leaf;
+    int         parent = find_parent(path, &leaf);
+    int         length = std::strlen(leaf);
+
+    if (parent == NOT_FOUND)
+        throw "FileSystem::make_directory() -- Directory does not exist";
+    if (length == 0 || length >= static_cast<int>(sizeof(entry(0).name)))
+        throw "FileSystem::make_directory() -- Invalid name";
+    if (find_in_directory(parent, leaf, length) != NOT_FOUND)
+        throw "FileSystem::make_directory() -- Name already exists";
+
+    // The parent might need a new block as well as the new directory.
+    int number = add_entry(parent);
+    if (number == NOT_FOUND || free_space() < block_size)
+        throw "FileSystem::make_directory() -- Not enough space";
+
+    block_number block = allocate_block();
+    directory_table[new_directory_block(block)]->dirty = true;
+
+    directory_entry &new_entry = entry(number);
+    std::memset(&new_entry, 0, sizeof(directory_entry));
+    std::strcpy(new_entry.name, leaf);
+    new_entry.size           = block_size;
+    new_entry.starting_block = block;
+    new_entry.in_use         = 1;
+    new_entry.flags          = DIRECTORY_FLAG;
+    entry_changed(number);
+    index_entry(parent, number);
+}
+
+
+//
+// FileSystem::remove_directory
+//
+void FileSystem::remove_directory(const char *path)
+{
+    if (formatted_flag == false)
+        throw "FileSystem::remove_directory() -- Unformatted file system";
+    if (mounted_index >= 0)
+        throw "FileSystem::remove_directory() -- Snapshots are read only";
+
+    int number = lookup(path, std::strlen(path));
+    if (number == ROOT_DIRECTORY)
+        throw "FileSystem::remove_directory() -- Can't remove the root directory";
+    if (!is_directory(number))
+        throw "FileSystem::remove_directory() -- No such directory";
+
+    for (int position = first_position(number); position != -1;
+         position = next_position(position)) {
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            if (directory_table[position]->entries[i].in_use == 1)
+                throw "FileSystem::remove_directory() -- Directory is not empty";
+        }
+    }
+
+    block_number current = entry(number).starting_block;
+    while (1) {
+        block_number next     = FAT[current];
+        int          position = directory_position[current];
+
+        delete directory_table[position];
+        directory_table[position]  = 0;
+        directory_position[current] = -1;
+        release_block(current);
+
+        if (next == EOF_FAT_ENTRY) break;
+        current = next;
+    }
+
+    entry(number).in_use = 0;
+    entry_changed(number);
+    forget_entry(number);
+}
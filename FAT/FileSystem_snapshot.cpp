@@ -0,0 +1,333 @@
+/*! \file    FileSystem_snapshot.cpp
+    \brief   Implementation of snapshots.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+A snapshot consists of a copy of the FAT and a copy of every directory block. The copies are
+ordinary blocks marked as reserved in the live FAT. The snapshot's FAT chains the copies of each
+subdirectory together in place of the originals. The snapshot table (one block, created when the
+first snapshot is made) records where the FAT and root directory copies are and how many
+snapshots use each block.
+
+The live FAT never describes a block in a way that a snapshot can see. Only the data blocks of
+files are shared, and the live file system never writes a shared block. Instead unshare_block()
+gives the file a new block and leaves the old one reserved for the snapshots. Directory blocks
+are changed in place all the time, which is why the snapshot has copies of them.
+*/
+
+#include <cstring>
+
+#include "FileSystem.hpp"
+
+//
+// FileSystem::find_snapshot
+//
+int FileSystem::find_snapshot(const char *name)
+{
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i].in_use && std::strcmp(snapshots[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+
+//
+// FileSystem::save_snapshot_table
+//
+void FileSystem::save_snapshot_table()
+{
+    char table[sizeof(snapshot_refs) + sizeof(snapshots)];
+
+    std::memcpy(table, snapshot_refs, sizeof(snapshot_refs));
+    std::memcpy(table + sizeof(snapshot_refs), snapshots, sizeof(snapshots));
+    write_structure(snapshot_table, table, sizeof(table));
+}
+
+
+//
+// FileSystem::unshare_block
+//
+// Nothing is copied. The caller either has the block's data already or is about to replace
+// it. Open files that are positioned on the old block are moved to the new one.
+//
+FileSystem::block_number FileSystem::unshare_block(block_number block)
+{
+    const int han_size = sizeof(handle_table)/sizeof(handletable_entry);
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    if (snapshot_refs[block] == 0) return block;
+
+    block_number copy = allocate_block();
+    FAT[copy]  = FAT[block];
+    FAT[block] = RESERVED_FAT_ENTRY;
+
+    // Who refers to this block? Either a directory entry or another FAT entry.
+    int owner;
+    for (owner = next_entry(-1); owner != NOT_FOUND; owner = next_entry(owner)) {
+        if (entry(owner).starting_block == block) break;
+    }
+    if (owner != NOT_FOUND) {
+        entry(owner).starting_block = copy;
+        entry_changed(owner);
+    }
+    else {
+        int previous;
+        for (previous = 0; previous < FAT_size; previous++) {
+            if (FAT[previous] == block) break;
+        }
+        if (previous == FAT_size)
+            throw "FileSystem::unshare_block() -- Block is not part of any file";
+        FAT[previous] = copy;
+    }
+
+    for (int i = 0; i < han_size; i++) {
+        if (handle_table[i].in_use && handle_table[i].current_block == block)
+            handle_table[i].current_block = copy;
+    }
+    return copy;
+}
+
+
+//
+// FileSystem::create_snapshot
+//
+// The new blocks are reserved on the disk before anything refers to them. If the operation is
+// interrupted the worst that can happen is that they are never used.
+//
+void FileSystem::create_snapshot(const char *name)
+{
+    const int table_size = sizeof(directory_table)/sizeof(directory_block *);
+    const int FAT_size   = sizeof(FAT)/sizeof(block_number);
+
+    if (formatted_flag == false)
+        throw "FileSystem::create_snapshot() -- Unformatted file system";
+    if (mounted_index >= 0)
+        throw "FileSystem::create_snapshot() -- A snapshot is mounted";
+    if (std::strlen(name) >= sizeof(snapshots[0].name))
+        throw "FileSystem::create_snapshot() -- Name is too long";
+    if (find_snapshot(name) >= 0)
+        throw "FileSystem::create_snapshot() -- Snapshot already exists";
+
+    int index;
+    for (index = 0; index < MAX_SNAPSHOTS; index++) {
+        if (!snapshots[index].in_use) break;
+    }
+    if (index == MAX_SNAPSHOTS)
+        throw "FileSystem::create_snapshot() -- Too many snapshots";
+
+    // We need a block for the FAT and one for each directory block.
+    int needed = (snapshot_table == 0) ? 2 : 1;
+    for (int i = 0; i < table_size; i++) {
+        if (directory_table[i] != 0) needed++;
+    }
+    if (free_space() < needed * block_size)
+        throw "FileSystem::create_snapshot() -- Not enough disk space";
+
+    // Data still being written belongs in the snapshot.
+    drain();
+
+    bool new_table = (snapshot_table == 0);
+    if (new_table) {
+        snapshot_table = allocate_block();
+        FAT[snapshot_table] = RESERVED_FAT_ENTRY;
+    }
+    block_number FAT_copy = allocate_block();
+    block_number copy_of[sizeof(FAT)/sizeof(block_number)];
+    FAT[FAT_copy] = RESERVED_FAT_ENTRY;
+    for (int i = 0; i < table_size; i++) {
+        if (directory_table[i] == 0) continue;
+        block_number copy = allocate_block();
+        FAT[copy] = RESERVED_FAT_ENTRY;
+        copy_of[directory_table[i]->block] = copy;
+    }
+    flush();
+
+    // In the snapshot's FAT the copies of each subdirectory take the place of the originals.
+    // The root directory is not chained.
+    block_number snapshot_FAT[sizeof(FAT)/sizeof(block_number)];
+    std::memcpy(snapshot_FAT, FAT, sizeof(FAT));
+    for (int i = 1; i < table_size; i++) {
+        if (directory_table[i] == 0) continue;
+        block_number original = directory_table[i]->block;
+        block_number next     = FAT[original];
+        snapshot_FAT[copy_of[original]] = (next == EOF_FAT_ENTRY) ? next : copy_of[next];
+        snapshot_FAT[original]          = RESERVED_FAT_ENTRY;
+    }
+    write_structure(FAT_copy, snapshot_FAT, sizeof(snapshot_FAT));
+
+    // The copied directories refer to the copies of their subdirectories.
+    for (int i = 0; i < table_size; i++) {
+        if (directory_table[i] == 0) continue;
+
+        directory_entry entries[DIRECTORY_SIZE];
+        std::memcpy(entries, directory_table[i]->entries, sizeof(entries));
+        for (int j = 0; j < DIRECTORY_SIZE; j++) {
+            if (entries[j].in_use == 1 && (entries[j].flags & DIRECTORY_FLAG))
+                entries[j].starting_block = copy_of[entries[j].starting_block];
+        }
+        write_structure(copy_of[directory_table[i]->block], entries, sizeof(entries));
+    }
+
+    // Every block in a live file is now used by the snapshot as well.
+    for (int i = first_data_block(); i < FAT_size; i++) {
+        if (FAT[i] != FREE_FAT_ENTRY && FAT[i] != RESERVED_FAT_ENTRY &&
+            directory_position[i] == -1)
+            snapshot_refs[i]++;
+    }
+
+    std::memset(&snapshots[index], 0, sizeof(snapshot_entry));
+    std::strcpy(snapshots[index].name, name);
+    snapshots[index].FAT_copy  = FAT_copy;
+    snapshots[index].root_copy = copy_of[root_block];
+    snapshots[index].in_use    = 1;
+    save_snapshot_table();
+    if (new_table) write_boot_block();
+
+    // This saves the checksums of the new blocks.
+    flush();
+}
+
+
+//
+// FileSystem::delete_snapshot
+//
+// The snapshot table is updated before any blocks are freed so that an interruption can't
+// leave the snapshot referring to blocks that have been reused.
+//
+void FileSystem::delete_snapshot(const char *name)
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    if (formatted_flag == false)
+        throw "FileSystem::delete_snapshot() -- Unformatted file system";
+    if (mounted_index >= 0)
+        throw "FileSystem::delete_snapshot() -- A snapshot is mounted";
+
+    int index = find_snapshot(name);
+    if (index < 0)
+        throw "FileSystem::delete_snapshot() -- No such snapshot";
+
+    block_number snapshot_FAT[sizeof(FAT)/sizeof(block_number)];
+    read_structure(snapshots[index].FAT_copy, snapshot_FAT, sizeof(snapshot_FAT));
+
+    // Blocks without references are the snapshot's own copies of directory blocks.
+    for (int i = first_data_block(); i < FAT_size; i++) {
+        if (snapshot_FAT[i] == FREE_FAT_ENTRY || snapshot_FAT[i] == RESERVED_FAT_ENTRY)
+            continue;
+        if (snapshot_refs[i] != 0) snapshot_refs[i]--;
+    }
+    snapshots[index].in_use = 0;
+    save_snapshot_table();
+
+    // Free the blocks that were only kept for this snapshot, and the snapshot itself.
+    for (int i = first_data_block(); i < FAT_size; i++) {
+        if (FAT[i] == RESERVED_FAT_ENTRY && snapshot_refs[i] == 0 &&
+            snapshot_FAT[i] != FREE_FAT_ENTRY && snapshot_FAT[i] != RESERVED_FAT_ENTRY)
+            FAT[i] = FREE_FAT_ENTRY;
+    }
+    FAT[snapshots[index].FAT_copy]  = FREE_FAT_ENTRY;
+    FAT[snapshots[index].root_copy] = FREE_FAT_ENTRY;
+    flush();
+}
+
+
+//
+// FileSystem::next_snapshot
+//
+// The snapshot's directories are read from the disk to count its files. Finding the space used
+// only by the snapshot requires the live FAT. If a snapshot is mounted the live FAT is only on
+// the disk.
+//
+bool FileSystem::next_snapshot(snapshot_info *info)
+{
+    const int FAT_size = sizeof(FAT)/sizeof(block_number);
+
+    while (snapshot_scan < MAX_SNAPSHOTS && !snapshots[snapshot_scan].in_use) snapshot_scan++;
+    if (snapshot_scan == MAX_SNAPSHOTS) return false;
+
+    snapshot_entry &snapshot = snapshots[snapshot_scan++];
+    block_number    snapshot_FAT[sizeof(FAT)/sizeof(block_number)];
+    block_number    live_FAT[sizeof(FAT)/sizeof(block_number)];
+
+    read_structure(snapshot.FAT_copy, snapshot_FAT, sizeof(snapshot_FAT));
+    if (mounted_index < 0) std::memcpy(live_FAT, FAT, sizeof(FAT));
+    else read_structure(FAT_BLOCK, live_FAT, sizeof(live_FAT));
+
+    std::strcpy(info->name, snapshot.name);
+    info->files     = 0;
+    info->size      = 0;
+    info->exclusive = 0;
+
+    std::vector<block_number> pending(1, snapshot.root_copy);
+    while (!pending.empty()) {
+        directory_entry entries[DIRECTORY_SIZE];
+
+        read_structure(pending.back(), entries, sizeof(entries));
+        pending.pop_back();
+
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            if (entries[i].in_use != 1) continue;
+            if (!(entries[i].flags & DIRECTORY_FLAG)) {
+                info->files++;
+                info->size += entries[i].size;
+                continue;
+            }
+
+            block_number current = entries[i].starting_block;
+            while (1) {
+                if (current <= EOF_FAT_ENTRY || current >= FAT_size)
+                    throw "FileSystem::next_snapshot() -- Damaged directory";
+                pending.push_back(current);
+                if (snapshot_FAT[current] == EOF_FAT_ENTRY) break;
+                current = snapshot_FAT[current];
+            }
+        }
+    }
+
+    // Blocks without references are the snapshot's copies of directory blocks.
+    for (int i = first_data_block(); i < FAT_size; i++) {
+        if (snapshot_FAT[i] == FREE_FAT_ENTRY || snapshot_FAT[i] == RESERVED_FAT_ENTRY)
+            continue;
+        if (snapshot_refs[i] <= 1 && live_FAT[i] == RESERVED_FAT_ENTRY)
+            info->exclusive += block_size;
+    }
+    return true;
+}
+
+
+//
+// FileSystem::mount_snapshot
+//
+void FileSystem::mount_snapshot(const char *name)
+{
+    if (formatted_flag == false)
+        throw "FileSystem::mount_snapshot() -- Unformatted file system";
+
+    for (int i = 0; i < HANDLETABLE_SIZE; i++) {
+        if (handle_table[i].in_use)
+            throw "FileSystem::mount_snapshot() -- Files are open";
+    }
+
+    int index = -1;
+    if (name != 0) {
+        index = find_snapshot(name);
+        if (index < 0)
+            throw "FileSystem::mount_snapshot() -- No such snapshot";
+    }
+
+    // Save the live file system before replacing it in memory.
+    drain();
+    flush();
+
+    mounted_index = index;
+    if (index < 0) {
+        root_block = ROOT_BLOCK;
+        read_structure(FAT_BLOCK, FAT, sizeof(FAT));
+    }
+    else {
+        root_block = snapshots[index].root_copy;
+        read_structure(snapshots[index].FAT_copy, FAT, sizeof(FAT));
+    }
+    load_directories();
+    clear_path_cache();
+    invalidate_clusters();
+}
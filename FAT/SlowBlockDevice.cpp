@@ -0,0 +1,127 @@
+/*! \file    SlowBlockDevice.cpp
+    \brief   Simulated block device with the performance of a slow disk.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include "Clock.hpp"
+#include "SlowBlockDevice.hpp"
+
+//
+// SlowBlockDevice::hard_disk
+//
+// These numbers are loosely based on a 5400 RPM laptop drive, scaled down to a disk that only
+// has a few hundred blocks. The seek cost per block is set so that a full stroke across a 512
+// block device costs roughly what a full stroke costs on the real drive.
+//
+SlowBlockDevice::timing_model SlowBlockDevice::hard_disk()
+{
+    timing_model result;
+    result.latency        = 5500.0;      // Half a rotation at 5400 RPM.
+    result.seek_settle    = 2000.0;
+    result.seek_per_block = 20.0;
+    result.bandwidth      = 60000000.0;  // 60 MB/s.
+    return result;
+}
+
+
+//
+// SlowBlockDevice::SlowBlockDevice
+//
+SlowBlockDevice::SlowBlockDevice(BlockDevice &device, const timing_model &timing, bool wait) :
+    BlockDevice(device.blk_size(), device.blk_count()),
+    underlying(device), model(timing), real_time(wait)
+{
+    reset();
+}
+
+
+//
+// SlowBlockDevice::reset
+//
+// The head position is also returned to the start of the disk so that a sequence of operations
+// costs the same no matter what came before it.
+//
+void SlowBlockDevice::reset()
+{
+    head_position = 0;
+    clock         = 0.0;
+    read_count    = 0;
+    write_count   = 0;
+    seek_distance = 0;
+}
+
+
+//
+// SlowBlockDevice::charge
+//
+// Accessing the block just after the previous one is considered sequential and costs no seek
+// time. Any other block costs the settle time plus the per block cost of the distance moved.
+//
+void SlowBlockDevice::charge(int block_number)
+{
+    double cost     = model.latency;
+    int    distance = block_number - head_position;
+
+    if (distance < 0) distance = -distance;
+    if (distance != 0) {
+        cost          += model.seek_settle + model.seek_per_block * distance;
+        seek_distance += distance;
+    }
+
+    if (model.bandwidth > 0.0)
+        cost += (blk_size() * 1000000.0) / model.bandwidth;
+
+    head_position = block_number + 1;
+    clock += cost;
+    if (real_time) clock_delay(cost);
+}
+
+
+//
+// SlowBlockDevice::read
+//
+void SlowBlockDevice::read(int block_number, char *block_buffer)
+{
+    // Let the underlying device complain about bad block numbers before charging for them.
+    underlying.read(block_number, block_buffer);
+    charge(block_number);
+    ++read_count;
+}
+
+
+//
+// SlowBlockDevice::write
+//
+void SlowBlockDevice::write(int block_number, const char *block_buffer)
+{
+    underlying.write(block_number, block_buffer);
+    charge(block_number);
+    ++write_count;
+}
+
+
+//
+// SlowBlockDevice::submit
+//
+// Blocks that are not on the disk are not charged. The underlying device marks them failed.
+//
+void SlowBlockDevice::submit(io_request *request)
+{
+    if (request->block_number >= 0 && request->block_number < blk_count()) {
+        charge(request->block_number);
+        if (request->is_write) ++write_count;
+        else ++read_count;
+    }
+    underlying.submit(request);
+}
+
+
+//
+// SlowBlockDevice::complete
+//
+BlockDevice::io_request *SlowBlockDevice::complete()
+{
+    return underlying.complete();
+}
@@ -0,0 +1,81 @@
+/*! \file    SlowBlockDevice.hpp
+    \brief   Simulated block device with the performance of a slow disk.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+This module wraps another block device and charges each operation a cost computed from a simple
+model of a mechanical disk: a fixed latency per operation, a seek cost that depends on how far
+the "head" has to move, and a limited transfer rate.
+
+The costs are accumulated on a simulated clock. This makes the results deterministic and
+independent of the speed of the host. Optionally the device can also really wait for the
+computed time so that it feels slow to an interactive user.
+*/
+
+#ifndef SLOWBLOCKDEVICE_HPP
+#define SLOWBLOCKDEVICE_HPP
+
+#include "BlockDevice.hpp"
+
+class SlowBlockDevice : public BlockDevice {
+public:
+
+    // This structure describes the performance of the simulated disk. All times are in
+    // microseconds.
+    //
+    struct timing_model {
+        double latency;         // Fixed cost of every operation (overhead and rotation).
+        double seek_settle;     // Extra cost of any operation that moves the head at all.
+        double seek_per_block;  // Additional cost per block of head movement.
+        double bandwidth;       // Transfer rate in bytes per second. Zero means unlimited.
+    };
+
+    static timing_model hard_disk();
+      // Returns a model resembling a small, slow hard disk. A convenient default.
+
+private:
+    BlockDevice &underlying;   // The device that actually holds the data.
+    timing_model model;
+    bool         real_time;    // =true if we should actually wait for each operation.
+
+    int    head_position;      // Block after the last one accessed.
+    double clock;              // Simulated time consumed so far (microseconds).
+    long   read_count;
+    long   write_count;
+    long   seek_distance;      // Total number of blocks the head has moved.
+
+    SlowBlockDevice &operator=(const SlowBlockDevice &);
+    SlowBlockDevice(const SlowBlockDevice &);
+      // Make these members private so that we disable copying.
+
+    void charge(int block_number);
+      // Account for an operation on the given block.
+
+public:
+    SlowBlockDevice(BlockDevice &device, const timing_model &timing, bool wait = false);
+      // The given device must exist for as long as this object exists. If wait is true each
+      // operation delays the caller for the simulated time it takes.
+
+    void read(int block_number, char *block_buffer);
+    void write(int block_number, const char *block_buffer);
+      // Charge for the operation and then pass it along to the underlying device.
+
+    void submit(io_request *request);
+    io_request *complete();
+    int  queue_depth() { return underlying.queue_depth(); }
+      // Asynchronous operations are charged when they are submitted, in submission order, and
+      // then passed along so that the underlying device can still overlap them.
+
+    double elapsed() const { return clock; }
+      // Returns the simulated time consumed so far in microseconds.
+
+    long reads() const { return read_count; }
+    long writes() const { return write_count; }
+    long seeks() const { return seek_distance; }
+      // Statistics about the operations done so far.
+
+    void reset();
+      // Set the simulated clock and the statistics back to zero.
+};
+
+#endif
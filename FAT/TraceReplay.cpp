@@ -0,0 +1,253 @@
+/*! \file    TraceReplay.cpp
+    \brief   Replays a trace of file operations against a FileSystem.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Clock.hpp"
+#include "TraceReplay.hpp"
+
+namespace {
+
+    enum operation_type {
+        OPEN_READ, OPEN_WRITE, CLOSE, READ, WRITE, TRUNCATE, REMOVE, OPERATION_COUNT
+    };
+
+    const char *operation_names[OPERATION_COUNT] = {
+        "open (read)", "open (write)", "close", "read", "write", "truncate", "remove"
+    };
+
+    const char          REPLAY_MAGIC[]  = "FOPS";
+    const unsigned long REPLAY_VERSION  = 1;
+    const int           TRANSFER_SIZE   = 4096;
+      // Reads and writes are done in pieces no larger than this.
+
+    // One operation from the trace file.
+    struct replay_record {
+        double        time;
+        unsigned long operation;
+        unsigned long name_index;
+        unsigned long size;
+    };
+
+    // What we learn about each kind of operation.
+    struct operation_statistics {
+        std::vector<double> latencies;   // Microseconds.
+        unsigned long       errors;
+        double              bytes;
+
+        operation_statistics() : errors(0), bytes(0.0) { }
+    };
+
+
+    unsigned long get_u32(std::istream &is)
+    {
+        unsigned char bytes[4];
+        is.read(reinterpret_cast<char *>(bytes), 4);
+        return  static_cast<unsigned long>(bytes[0])        |
+               (static_cast<unsigned long>(bytes[1]) <<  8) |
+               (static_cast<unsigned long>(bytes[2]) << 16) |
+               (static_cast<unsigned long>(bytes[3]) << 24);
+    }
+
+
+    //
+    // percentile
+    //
+    // Uses the nearest rank method. The latencies must be sorted.
+    //
+    double percentile(const std::vector<double> &latencies, int percent)
+    {
+        if (latencies.empty()) return 0.0;
+        std::vector<double>::size_type rank = (latencies.size() * percent + 99) / 100;
+        if (rank == 0) rank = 1;
+        return latencies[rank - 1];
+    }
+
+
+    //
+    // read_trace
+    //
+    // The whole trace is read into memory before the replay starts so that parsing the file
+    // doesn't disturb the timing.
+    //
+    void read_trace(const char *file_name,
+                    std::vector<std::string> &names, std::vector<replay_record> &records)
+    {
+        std::ifstream trace_file(file_name, std::ios::in | std::ios::binary);
+        if (!trace_file)
+            throw "replay_trace() -- Unable to open the trace file";
+
+        char magic[4];
+        trace_file.read(magic, 4);
+        if (!trace_file || !std::equal(magic, magic + 4, REPLAY_MAGIC))
+            throw "replay_trace() -- Not an operation trace file";
+        if (get_u32(trace_file) != REPLAY_VERSION)
+            throw "replay_trace() -- Unsupported trace file version";
+
+        unsigned long name_count   = get_u32(trace_file);
+        unsigned long record_count = get_u32(trace_file);
+
+        for (unsigned long i = 0; i < name_count && trace_file; ++i) {
+            unsigned long length = get_u32(trace_file);
+            std::string   name;
+            for (unsigned long j = 0; j < length && trace_file; ++j) {
+                name += static_cast<char>(trace_file.get());
+            }
+            names.push_back(name);
+        }
+
+        for (unsigned long i = 0; i < record_count && trace_file; ++i) {
+            replay_record  record;
+            unsigned long  low  = get_u32(trace_file);
+            unsigned long  high = get_u32(trace_file);
+            record.time         = high * 4294967296.0 + low;
+            record.operation    = get_u32(trace_file);
+            record.name_index   = get_u32(trace_file);
+            record.size         = get_u32(trace_file);
+
+            if (record.operation >= OPERATION_COUNT)
+                throw "replay_trace() -- Unknown operation in trace file";
+            if (record.name_index >= name_count)
+                throw "replay_trace() -- Invalid name index in trace file";
+            records.push_back(record);
+        }
+
+        if (!trace_file)
+            throw "replay_trace() -- Trace file is truncated";
+    }
+}
+
+
+//
+// replay_trace
+//
+// An operation on a name that isn't open (or an open of a name that is) can't be done. It is
+// counted as an error. So is any operation for which the file system throws an exception.
+//
+void replay_trace(const char *file_name, FileSystem &files, bool paced, std::ostream &report)
+{
+    std::vector<std::string>   names;
+    std::vector<replay_record> records;
+    read_trace(file_name, names, records);
+
+    std::vector<int>     handles(names.size(), -1);
+    operation_statistics statistics[OPERATION_COUNT];
+    char                 transfer_buffer[TRANSFER_SIZE];
+    double               worst_lag = 0.0;
+
+    for (int i = 0; i < TRANSFER_SIZE; ++i) {
+        transfer_buffer[i] = static_cast<char>('A' + i % 26);
+    }
+
+    double start = clock_microseconds();
+    for (std::vector<replay_record>::size_type i = 0; i < records.size(); ++i) {
+        const replay_record &record = records[i];
+        operation_statistics &stats = statistics[record.operation];
+        int  &handle = handles[record.name_index];
+        const char *name = names[record.name_index].c_str();
+
+        if (paced) {
+            double lag = (clock_microseconds() - start) - record.time;
+            if (lag < 0.0) clock_delay(-lag);
+            else if (lag > worst_lag) worst_lag = lag;
+        }
+
+        double before = clock_microseconds();
+        try {
+            switch (record.operation) {
+            case OPEN_READ:
+            case OPEN_WRITE:
+                if (handle != -1) throw "already open";
+                handle = files.open(name,
+                    record.operation == OPEN_READ ? FileSystem::READ : FileSystem::WRITE);
+                break;
+
+            case CLOSE:
+                if (handle == -1) throw "not open";
+                files.close(handle);
+                handle = -1;
+                break;
+
+            case READ:
+            case WRITE: {
+                if (handle == -1) throw "not open";
+                unsigned long remaining = record.size;
+                while (remaining > 0) {
+                    int count  = (remaining < TRANSFER_SIZE) ? remaining : TRANSFER_SIZE;
+                    int result = (record.operation == READ) ?
+                        files.read(handle, transfer_buffer, count) :
+                        files.write(handle, transfer_buffer, count);
+                    stats.bytes += result;
+                    if (result < count) break;   // End of file or disk full.
+                    remaining -= count;
+                }
+                break;
+            }
+
+            case TRUNCATE:
+                files.truncate(name);
+                break;
+
+            case REMOVE:
+                files.remove(name);
+                break;
+            }
+        }
+        catch (const char *) {
+            stats.errors++;
+        }
+        stats.latencies.push_back(clock_microseconds() - before);
+    }
+    double elapsed = clock_microseconds() - start;
+
+    // Don't leave files open behind the trace's back.
+    for (std::vector<int>::size_type i = 0; i < handles.size(); ++i) {
+        if (handles[i] != -1) files.close(handles[i]);
+    }
+
+    // Now print the report.
+    report << std::fixed << std::setprecision(2);
+    report << "Trace file   : " << file_name << (paced ? " (paced)" : " (full speed)") << "\n";
+    report << "Operations   : " << records.size() << " in " << elapsed / 1000.0 << " ms";
+    if (elapsed > 0.0) report << " (" << records.size() / (elapsed / 1000000.0) << " ops/s)";
+    report << "\n";
+    if (paced) report << "Worst lag    : " << worst_lag / 1000.0 << " ms behind schedule\n";
+
+    report << "\n" << std::setw(13) << std::left << "operation" << std::right
+           << std::setw(8)  << "count" << std::setw(8) << "errors"
+           << std::setw(10) << "MB/s"
+           << std::setw(10) << "p50 us" << std::setw(10) << "p90 us"
+           << std::setw(10) << "p99 us" << std::setw(10) << "max us" << "\n";
+
+    for (int i = 0; i < OPERATION_COUNT; ++i) {
+        operation_statistics &stats = statistics[i];
+        if (stats.latencies.empty()) continue;
+
+        double total = 0.0;
+        for (std::vector<double>::size_type j = 0; j < stats.latencies.size(); ++j) {
+            total += stats.latencies[j];
+        }
+        std::sort(stats.latencies.begin(), stats.latencies.end());
+
+        report << std::setw(13) << std::left << operation_names[i] << std::right
+               << std::setw(8) << stats.latencies.size() << std::setw(8) << stats.errors;
+        if ((i == READ || i == WRITE) && total > 0.0)
+            report << std::setw(10) << stats.bytes / total;   // Bytes per microsecond is MB/s.
+        else
+            report << std::setw(10) << "-";
+        report << std::setw(10) << percentile(stats.latencies, 50)
+               << std::setw(10) << percentile(stats.latencies, 90)
+               << std::setw(10) << percentile(stats.latencies, 99)
+               << std::setw(10) << stats.latencies.back() << "\n";
+    }
+    report << std::flush;
+}
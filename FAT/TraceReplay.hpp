@@ -0,0 +1,43 @@
+/*! \file    TraceReplay.hpp
+    \brief   Replays a trace of file operations against a FileSystem.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+This module reads a trace of file level operations (open, close, read, write, truncate, and
+remove) that was captured elsewhere and performs the same operations on a FileSystem object.
+It measures how long each operation takes and reports throughput and latency percentiles for
+each kind of operation. This makes it possible to compare different versions of the file
+system (or different block devices) using realistic workloads.
+
+The trace file format is as follows. All integers are unsigned, little endian, and 32 bits.
+
+    Header : magic ("FOPS"), version (1), name count, record count
+    Name   : length, characters (not null terminated)
+    Record : time (low 32 bits), time (high 32 bits), operation, name index, size
+
+The names are listed once after the header and records refer to them by index. The time of
+each record is in microseconds relative to the start of the trace. The operations are:
+
+    0 = open for reading  1 = open for writing  2 = close  3 = read  4 = write
+    5 = truncate          6 = remove
+
+The size is the number of bytes for reads and writes and is ignored otherwise. Only one open
+of each name can be in effect at a time; reads, writes, and closes apply to that open. The data
+written is a fixed pattern since traces do not record file contents.
+*/
+
+#ifndef TRACEREPLAY_HPP
+#define TRACEREPLAY_HPP
+
+#include <iosfwd>
+
+#include "FileSystem.hpp"
+
+void replay_trace(const char *file_name, FileSystem &files, bool paced, std::ostream &report);
+  // Replays the named trace file against the given file system and writes a report to the
+  // given stream. If paced is true each operation is started at the time recorded in the trace
+  // (or as soon afterward as possible). Otherwise operations are done as quickly as possible.
+  // Operations that fail are counted but do not stop the replay. Throws an exception if the
+  // trace file can't be read. Any files left open by the trace are closed at the end.
+
+#endif
@@ -0,0 +1,304 @@
+/*! \file    TracingBlockDevice.cpp
+    \brief   Block device wrapper that records every operation.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "Clock.hpp"
+#include "TracingBlockDevice.hpp"
+
+//=======================================
+//           Support Functions
+//=======================================
+
+//
+// The trace file is written a byte at a time in a fixed order so that it can be moved between
+// machines with different byte orders and integer sizes.
+//
+static void put_u32(std::ostream &os, unsigned long value)
+{
+    os.put(static_cast<char>( value        & 0xFF));
+    os.put(static_cast<char>((value >>  8) & 0xFF));
+    os.put(static_cast<char>((value >> 16) & 0xFF));
+    os.put(static_cast<char>((value >> 24) & 0xFF));
+}
+
+
+static unsigned long get_u32(std::istream &is)
+{
+    unsigned char bytes[4];
+    is.read(reinterpret_cast<char *>(bytes), 4);
+    return  static_cast<unsigned long>(bytes[0])        |
+           (static_cast<unsigned long>(bytes[1]) <<  8) |
+           (static_cast<unsigned long>(bytes[2]) << 16) |
+           (static_cast<unsigned long>(bytes[3]) << 24);
+}
+
+
+static const char TRACE_MAGIC[] = "FTRC";
+static const unsigned long TRACE_VERSION = 1;
+
+
+//===============================================
+//           TracingBlockDevice Members
+//===============================================
+
+//
+// TracingBlockDevice::TracingBlockDevice
+//
+TracingBlockDevice::TracingBlockDevice(BlockDevice &device, unsigned long size) :
+    BlockDevice(device.blk_size(), device.blk_count()),
+    underlying(device), ring(0), capacity(1), next_index(0)
+{
+    // The index arithmetic in record() needs a power of two.
+    while (capacity < size) capacity <<= 1;
+    ring = new trace_record[capacity];
+}
+
+
+//
+// TracingBlockDevice::~TracingBlockDevice
+//
+TracingBlockDevice::~TracingBlockDevice()
+{
+    delete [] ring;
+}
+
+
+//
+// TracingBlockDevice::record
+//
+// Claiming a slot is a single (atomic) increment so no lock is needed. If the buffer has
+// wrapped around the slot's old contents are simply overwritten.
+//
+void TracingBlockDevice::record(int block_number, operation_type operation)
+{
+    unsigned long index = next_index++;
+    trace_record &slot  = ring[index & (capacity - 1)];
+
+    slot.time         = clock_microseconds();
+    slot.block_number = block_number;
+    slot.operation    = operation;
+}
+
+
+//
+// TracingBlockDevice::read
+//
+void TracingBlockDevice::read(int block_number, char *block_buffer)
+{
+    record(block_number, READ_OPERATION);
+    underlying.read(block_number, block_buffer);
+}
+
+
+//
+// TracingBlockDevice::write
+//
+void TracingBlockDevice::write(int block_number, const char *block_buffer)
+{
+    record(block_number, WRITE_OPERATION);
+    underlying.write(block_number, block_buffer);
+}
+
+
+//
+// TracingBlockDevice::submit
+//
+void TracingBlockDevice::submit(io_request *request)
+{
+    record(request->block_number, request->is_write ? WRITE_OPERATION : READ_OPERATION);
+    underlying.submit(request);
+}
+
+
+//
+// TracingBlockDevice::complete
+//
+BlockDevice::io_request *TracingBlockDevice::complete()
+{
+    return underlying.complete();
+}
+
+
+//
+// TracingBlockDevice::clear
+//
+void TracingBlockDevice::clear()
+{
+    next_index = 0;
+}
+
+
+//
+// TracingBlockDevice::dump
+//
+void TracingBlockDevice::dump(const char *file_name)
+{
+    std::ofstream trace_file(file_name, std::ios::out | std::ios::binary);
+    if (!trace_file)
+        throw "TracingBlockDevice::dump() -- Unable to create the trace file";
+
+    unsigned long total = next_index;
+    unsigned long count = (total < capacity) ? total : capacity;
+    unsigned long first = total - count;
+
+    trace_file.write(TRACE_MAGIC, 4);
+    put_u32(trace_file, TRACE_VERSION);
+    put_u32(trace_file, blk_size());
+    put_u32(trace_file, count);
+    put_u32(trace_file, first);
+
+    double origin = (count == 0) ? 0.0 : ring[first & (capacity - 1)].time;
+    for (unsigned long i = first; i < total; ++i) {
+        const trace_record &slot = ring[i & (capacity - 1)];
+
+        // Split the relative time into two 32 bit halves.
+        double        relative = slot.time - origin;
+        if (relative < 0.0) relative = 0.0;
+        unsigned long high     = static_cast<unsigned long>(relative / 4294967296.0);
+        unsigned long low      = static_cast<unsigned long>(relative - high * 4294967296.0);
+
+        put_u32(trace_file, low);
+        put_u32(trace_file, high);
+        put_u32(trace_file, static_cast<unsigned long>(slot.block_number));
+        put_u32(trace_file, static_cast<unsigned long>(slot.operation));
+    }
+
+    if (!trace_file)
+        throw "TracingBlockDevice::dump() -- Error writing the trace file";
+}
+
+
+//=====================================
+//           Trace Analysis
+//=====================================
+
+namespace {
+
+    // Access counts for one block.
+    struct block_counts {
+        unsigned long reads;
+        unsigned long writes;
+
+        block_counts() : reads(0), writes(0) { }
+    };
+
+    typedef std::pair<unsigned long, unsigned long> hot_block;   // (accesses, block number)
+
+    bool hotter(const hot_block &left, const hot_block &right)
+    {
+        if (left.first != right.first) return left.first > right.first;
+        return left.second < right.second;
+    }
+
+    double ratio(unsigned long top, unsigned long bottom)
+    {
+        return (bottom == 0) ? 0.0 : static_cast<double>(top) / bottom;
+    }
+}
+
+
+//
+// trace_report
+//
+// An access is "sequential" if it is to the block just after the block used by the previous
+// access. An access to the same block as the previous access is counted separately as a
+// "repeat" since that usually indicates a caching opportunity rather than good layout.
+//
+void trace_report(const char *file_name, std::ostream &report)
+{
+    const int HOT_BLOCK_COUNT = 10;
+
+    std::ifstream trace_file(file_name, std::ios::in | std::ios::binary);
+    if (!trace_file)
+        throw "trace_report() -- Unable to open the trace file";
+
+    char magic[4];
+    trace_file.read(magic, 4);
+    if (!trace_file || !std::equal(magic, magic + 4, TRACE_MAGIC))
+        throw "trace_report() -- Not a trace file";
+    if (get_u32(trace_file) != TRACE_VERSION)
+        throw "trace_report() -- Unsupported trace file version";
+
+    unsigned long block_size = get_u32(trace_file);
+    unsigned long count      = get_u32(trace_file);
+    unsigned long lost       = get_u32(trace_file);
+
+    std::map<unsigned long, block_counts> blocks;
+    unsigned long reads       = 0;
+    unsigned long writes      = 0;
+    unsigned long sequential  = 0;
+    unsigned long repeats     = 0;
+    unsigned long distinct_read    = 0;
+    unsigned long distinct_written = 0;
+    unsigned long previous    = 0;
+    double        last_time   = 0.0;
+
+    for (unsigned long i = 0; i < count; ++i) {
+        unsigned long low       = get_u32(trace_file);
+        unsigned long high      = get_u32(trace_file);
+        unsigned long block     = get_u32(trace_file);
+        unsigned long operation = get_u32(trace_file);
+        if (!trace_file)
+            throw "trace_report() -- Trace file is truncated";
+
+        last_time = high * 4294967296.0 + low;
+
+        block_counts &counts = blocks[block];
+        if (operation == TracingBlockDevice::READ_OPERATION) {
+            if (counts.reads++ == 0) ++distinct_read;
+            ++reads;
+        }
+        else {
+            if (counts.writes++ == 0) ++distinct_written;
+            ++writes;
+        }
+
+        if (i != 0) {
+            if (block == previous + 1) ++sequential;
+            else if (block == previous) ++repeats;
+        }
+        previous = block;
+    }
+
+    // Find the hottest blocks.
+    std::vector<hot_block> ranking;
+    std::map<unsigned long, block_counts>::const_iterator p;
+    for (p = blocks.begin(); p != blocks.end(); ++p) {
+        ranking.push_back(hot_block(p->second.reads + p->second.writes, p->first));
+    }
+    int shown = (ranking.size() < HOT_BLOCK_COUNT) ? ranking.size() : HOT_BLOCK_COUNT;
+    std::partial_sort(ranking.begin(), ranking.begin() + shown, ranking.end(), hotter);
+
+    // Now print the report.
+    unsigned long transitions = (count == 0) ? 0 : count - 1;
+    report << std::fixed << std::setprecision(2);
+    report << "Trace file          : " << file_name << "\n";
+    report << "Operations          : " << count << " (" << lost << " lost to buffer wrap)\n";
+    report << "Elapsed time        : " << last_time / 1000.0 << " ms\n";
+    report << "Reads               : " << reads << " blocks, "
+           << reads * block_size << " bytes, " << distinct_read << " distinct\n";
+    report << "Writes              : " << writes << " blocks, "
+           << writes * block_size << " bytes, " << distinct_written << " distinct\n";
+    report << "Read amplification  : " << ratio(reads, distinct_read) << "\n";
+    report << "Write amplification : " << ratio(writes, distinct_written) << "\n";
+    report << "Sequential accesses : " << 100.0 * ratio(sequential, transitions) << "%\n";
+    report << "Repeated accesses   : " << 100.0 * ratio(repeats, transitions) << "%\n";
+    report << "Hottest blocks      :\n";
+    for (int i = 0; i < shown; ++i) {
+        const block_counts &counts = blocks[ranking[i].second];
+        report << "    block " << std::setw(6) << ranking[i].second
+               << ": " << std::setw(8) << counts.reads << " reads, "
+               << std::setw(8) << counts.writes << " writes\n";
+    }
+    report << std::flush;
+}
@@ -0,0 +1,96 @@
+/*! \file    TracingBlockDevice.hpp
+    \brief   Block device wrapper that records every operation.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+This module wraps another block device and records the time, block number, and kind of each
+read and write into a ring buffer. The buffer can be saved to a binary trace file, and a trace
+file can be analyzed to show how a file system uses its device.
+
+The ring buffer has a fixed size. If more operations occur than it can hold the oldest records
+are overwritten (the number lost is remembered). Recording an operation does not take a lock.
+When the compiler supports C++ 2011 the buffer index is atomic so several threads can record
+operations at once. However, dump() should only be called when no operations are in progress.
+
+The trace file format is as follows. All integers are unsigned, little endian, and 32 bits.
+
+    Header : magic ("FTRC"), version (1), block size, record count, records lost
+    Record : time (low 32 bits), time (high 32 bits), block number, operation (0=read, 1=write)
+
+The time of each record is in microseconds relative to the first record in the file.
+*/
+
+#ifndef TRACINGBLOCKDEVICE_HPP
+#define TRACINGBLOCKDEVICE_HPP
+
+#include <iosfwd>
+
+#include "environ.hpp"
+#include "BlockDevice.hpp"
+
+#if defined(eCPP11)
+#include <atomic>
+#endif
+
+class TracingBlockDevice : public BlockDevice {
+public:
+
+    enum operation_type { READ_OPERATION, WRITE_OPERATION };
+
+    // One entry in the trace.
+    struct trace_record {
+        double         time;          // Microseconds (see Clock.hpp).
+        int            block_number;
+        operation_type operation;
+    };
+
+    static const int DEFAULT_CAPACITY = 65536;
+      // The default number of records in the ring buffer. Must be a power of two.
+
+private:
+    BlockDevice  &underlying;
+    trace_record *ring;
+    unsigned long capacity;      // A power of two.
+    #if defined(eCPP11)
+    std::atomic<unsigned long> next_index;
+    #else
+    unsigned long next_index;    // Total number of records ever made.
+    #endif
+
+    TracingBlockDevice &operator=(const TracingBlockDevice &);
+    TracingBlockDevice(const TracingBlockDevice &);
+      // Make these members private so that we disable copying.
+
+    void record(int block_number, operation_type operation);
+
+public:
+    TracingBlockDevice(BlockDevice &device, unsigned long size = DEFAULT_CAPACITY);
+      // The given device must exist for as long as this object exists. The size is the number
+      // of records in the ring buffer. It is rounded up to a power of two.
+
+   ~TracingBlockDevice();
+
+    void read(int block_number, char *block_buffer);
+    void write(int block_number, const char *block_buffer);
+      // Record the operation and then pass it along to the underlying device.
+
+    void submit(io_request *request);
+    io_request *complete();
+    int  queue_depth() { return underlying.queue_depth(); }
+      // Asynchronous operations are recorded when they are submitted.
+
+    void dump(const char *file_name);
+      // Write the contents of the ring buffer to the named trace file, oldest record first.
+      // Throws an exception if the file can't be written.
+
+    void clear();
+      // Discard all records.
+};
+
+void trace_report(const char *file_name, std::ostream &report);
+  // Reads the named trace file and writes a summary of it to the given stream. The summary
+  // includes operation counts, read and write amplification (total operations divided by the
+  // number of distinct blocks involved), the fraction of sequential accesses, and the blocks
+  // accessed most often. Throws an exception if the file can't be read.
+
+#endif
@@ -0,0 +1,162 @@
+/*! \file    checksum_bench.cpp
+    \brief   Measures the cost of block checksums on sequential throughput.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+For several block sizes a file that nearly fills the disk is written through a FileSystem and
+then read back, once on a file system formatted without checksums and once on one formatted
+with them. The best of several passes is shown. The speed of crc32c() by itself is shown first
+since it bounds what the checksums can cost.
+
+The backing file is named checksum_bench.dev and is created in the current directory. It is
+removed at the end.
+
+Usage: checksum_bench [passes]
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "BlockDevice.hpp"
+#include "Checksum.hpp"
+#include "Clock.hpp"
+#include "FileSystem.hpp"
+
+namespace {
+
+    const char *const DEVICE_NAME = "checksum_bench.dev";
+    const int         BLOCK_COUNT = 512;
+
+    // Rates in MB/s.
+    struct rates {
+        double write;
+        double read;
+    };
+
+
+    //
+    // crc_rate
+    //
+    // Returns the speed of crc32c() in MB/s on 64 KiB pieces.
+    //
+    double crc_rate()
+    {
+        std::vector<char> data(65536, 'x');
+        const int    rounds = 4096;
+        unsigned int crc    = 0;
+
+        double start = clock_microseconds();
+        for (int i = 0; i < rounds; ++i) {
+            crc = crc32c(&data[0], data.size(), crc);
+        }
+        double elapsed = clock_microseconds() - start;
+
+        // Use the result so the loop can't be discarded.
+        if (crc == 0) std::cout << " ";
+        return rounds * static_cast<double>(data.size()) / elapsed;
+    }
+
+
+    //
+    // file_pass
+    //
+    rates file_pass(int block_size, bool checksums)
+    {
+        std::vector<char> data(block_size, 'x');
+        const int blocks = BLOCK_COUNT - 16;
+        double    bytes  = static_cast<double>(blocks) * block_size;
+        double    start;
+        rates     result;
+
+        std::remove(DEVICE_NAME);
+        BlockDevice disk(DEVICE_NAME, block_size, BLOCK_COUNT);
+
+        {
+            FileSystem files(disk);
+            files.format(checksums);
+
+            start = clock_microseconds();
+            int handle = files.open("bench", FileSystem::WRITE);
+            for (int i = 0; i < blocks; ++i) {
+                if (files.write(handle, &data[0], block_size) != block_size)
+                    throw "checksum_bench -- The disk is full";
+            }
+            files.close(handle);
+        }
+        result.write = bytes / (clock_microseconds() - start);
+
+        {
+            FileSystem files(disk);
+
+            start = clock_microseconds();
+            int handle = files.open("bench", FileSystem::READ);
+            while (files.read(handle, &data[0], block_size) > 0) ;
+            files.close(handle);
+        }
+        result.read = bytes / (clock_microseconds() - start);
+        return result;
+    }
+
+
+    //
+    // best_pass
+    //
+    rates best_pass(int block_size, bool checksums, int passes)
+    {
+        rates best = file_pass(block_size, checksums);
+        for (int i = 1; i < passes; ++i) {
+            rates current = file_pass(block_size, checksums);
+            if (current.write > best.write) best.write = current.write;
+            if (current.read  > best.read ) best.read  = current.read;
+        }
+        return best;
+    }
+
+
+    double overhead(double plain, double checked)
+    {
+        return 100.0 * (plain - checked) / plain;
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    const int block_sizes[] = { 1024, 4096, 16384, 65536 };
+    int passes = (argc > 1) ? std::atoi(argv[1]) : 5;
+
+    if (passes <= 0) {
+        std::cerr << "Usage: checksum_bench [passes]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::cout << std::fixed << std::setprecision(1);
+        std::cout << "crc32c (" << (crc32c_hardware() ? "hardware" : "table") << "): "
+                  << crc_rate() << " MB/s\n\n";
+
+        std::cout << "Sequential file through FileSystem, MB/s (best of " << passes << ")\n";
+        std::cout << " block     write  checked  overhead      read  checked  overhead\n";
+        for (int i = 0; i < static_cast<int>(sizeof(block_sizes)/sizeof(int)); ++i) {
+            rates plain   = best_pass(block_sizes[i], false, passes);
+            rates checked = best_pass(block_sizes[i], true,  passes);
+
+            std::cout << std::setw(6) << block_sizes[i]
+                      << std::setw(10) << plain.write << std::setw(9) << checked.write
+                      << std::setw(9) << overhead(plain.write, checked.write) << "%"
+                      << std::setw(10) << plain.read << std::setw(9) << checked.read
+                      << std::setw(9) << overhead(plain.read, checked.read) << "%\n";
+        }
+    }
+    catch (const char *message) {
+        std::cerr << "FATAL ERROR: " << message << std::endl;
+        std::remove(DEVICE_NAME);
+        return 1;
+    }
+
+    std::remove(DEVICE_NAME);
+    return 0;
+}
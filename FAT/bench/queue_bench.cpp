@@ -0,0 +1,233 @@
+/*! \file    queue_bench.cpp
+    \brief   Measures AsyncBlockDevice and FileSystem throughput at several queue depths.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+The first table reads random blocks directly from an AsyncBlockDevice, keeping as many reads in
+progress as the queue depth allows. The second table writes a file through a FileSystem and
+reads it back. A depth of "sync" means a plain BlockDevice.
+
+Before each pass the backing file is pushed out of the host's cache (when the host allows it)
+so that the device really does I/O. The backing file is named queue_bench.dev and is created in
+the current directory. It is removed at the end.
+
+Usage: queue_bench [operations per pass]
+*/
+
+#include "environ.hpp"
+
+#if eOPSYS != ePOSIX
+#error queue_bench needs a POSIX system (AsyncBlockDevice is only available there).
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "AsyncBlockDevice.hpp"
+#include "BlockDevice.hpp"
+#include "Clock.hpp"
+#include "FileSystem.hpp"
+
+namespace {
+
+    const char *const DEVICE_NAME = "queue_bench.dev";
+    const int         BLOCK_SIZE  = 65536;
+    const int         BLOCK_COUNT = 512;
+    const int         MAX_DEPTH   = 64;
+
+    //
+    // forget_cache
+    //
+    // Asks the host to drop its cached copy of the backing file. Dirty pages are written first
+    // since the host only drops clean ones.
+    //
+    void forget_cache()
+    {
+        int fd = open(DEVICE_NAME, O_RDWR);
+        if (fd == -1) return;
+        fsync(fd);
+        #if defined(POSIX_FADV_DONTNEED)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        #endif
+        close(fd);
+    }
+
+
+    //
+    // make_device
+    //
+    // A depth of zero means a plain (synchronous) BlockDevice.
+    //
+    BlockDevice *make_device(int depth, bool allow_io_uring)
+    {
+        if (depth == 0) return new BlockDevice(DEVICE_NAME, BLOCK_SIZE, BLOCK_COUNT);
+        return new AsyncBlockDevice(
+            DEVICE_NAME, BLOCK_SIZE, BLOCK_COUNT, depth, allow_io_uring);
+    }
+
+
+    //
+    // random_reads
+    //
+    // Returns the throughput in MB/s. The same pseudo-random sequence of blocks is used at
+    // every depth.
+    //
+    double random_reads(BlockDevice &disk, long operations)
+    {
+        int depth = disk.queue_depth();
+        std::vector<char> buffers(static_cast<size_t>(depth) * BLOCK_SIZE);
+        std::vector<BlockDevice::io_request> requests(depth);
+        unsigned long seed = 12345;
+
+        long submitted = 0;
+        long finished  = 0;
+
+        double start = clock_microseconds();
+        while (finished < operations) {
+            BlockDevice::io_request *request;
+
+            // Fill the queue first. After that a slot becomes free each time a read finishes.
+            if (submitted < depth && submitted < operations) request = &requests[submitted];
+            else {
+                request = disk.complete();
+                if (request->failed) throw "queue_bench -- A read failed";
+                ++finished;
+                if (submitted == operations) continue;
+            }
+
+            seed = seed * 1103515245UL + 12345UL;
+            request->block_number = static_cast<int>((seed >> 8) % BLOCK_COUNT);
+            request->buffer       = &buffers[(request - &requests[0]) * BLOCK_SIZE];
+            request->is_write     = false;
+            request->tag          = 0;
+            disk.submit(request);
+            ++submitted;
+        }
+        double elapsed = clock_microseconds() - start;
+
+        return operations * static_cast<double>(BLOCK_SIZE) / elapsed;
+    }
+
+
+    //
+    // file_pass
+    //
+    // Writes a file that nearly fills the disk and then reads it back. The two throughputs (in
+    // MB/s) are returned through the reference parameters.
+    //
+    void file_pass(BlockDevice &disk, double &write_rate, double &read_rate)
+    {
+        std::vector<char> data(BLOCK_SIZE, 'x');
+        const int blocks = BLOCK_COUNT - 16;
+        double    start;
+        double    bytes  = static_cast<double>(blocks) * BLOCK_SIZE;
+
+        {
+            FileSystem files(disk);
+            files.format();
+
+            start = clock_microseconds();
+            int handle = files.open("bench", FileSystem::WRITE);
+            for (int i = 0; i < blocks; ++i) {
+                if (files.write(handle, &data[0], BLOCK_SIZE) != BLOCK_SIZE)
+                    throw "queue_bench -- The disk is full";
+            }
+            files.close(handle);
+        }
+        write_rate = bytes / (clock_microseconds() - start);
+
+        forget_cache();
+        {
+            FileSystem files(disk);
+
+            start = clock_microseconds();
+            int handle = files.open("bench", FileSystem::READ);
+            while (files.read(handle, &data[0], BLOCK_SIZE) > 0) ;
+            files.close(handle);
+        }
+        read_rate = bytes / (clock_microseconds() - start);
+    }
+
+
+    void show_depth(int depth)
+    {
+        if (depth == 0) std::cout << std::setw(6) << "sync";
+        else std::cout << std::setw(6) << depth;
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    long operations = (argc > 1) ? std::atol(argv[1]) : 4096L;
+
+    if (operations <= 0) {
+        std::cerr << "Usage: queue_bench [operations per pass]" << std::endl;
+        return 1;
+    }
+
+    try {
+        std::remove(DEVICE_NAME);
+        std::cout << std::fixed << std::setprecision(1);
+
+        {
+            AsyncBlockDevice probe(DEVICE_NAME, BLOCK_SIZE, BLOCK_COUNT);
+            std::cout << "io_uring is "
+                      << (probe.which_backend() == AsyncBlockDevice::IO_URING ? "" : "not ")
+                      << "available\n\n";
+        }
+
+        std::cout << "Random " << BLOCK_SIZE / 1024 << " KiB reads (" << operations
+                  << " per pass), MB/s\n";
+        std::cout << " depth  io_uring  threads\n";
+        for (int depth = 0; depth <= MAX_DEPTH; depth = (depth == 0) ? 1 : depth * 2) {
+            show_depth(depth);
+            for (int pass = 0; pass < 2; ++pass) {
+                int          width = (pass == 0) ? 10 : 9;
+                BlockDevice *disk  = make_device(depth, pass == 0);
+
+                // A synchronous device has no backends. Otherwise skip the io_uring column if
+                // the device fell back on the thread pool.
+                AsyncBlockDevice::backend_type backend =
+                    (pass == 0) ? AsyncBlockDevice::IO_URING : AsyncBlockDevice::THREAD_POOL;
+                bool wanted = (depth == 0) ? (pass == 0) :
+                    static_cast<AsyncBlockDevice *>(disk)->which_backend() == backend;
+
+                if (wanted) {
+                    forget_cache();
+                    std::cout << std::setw(width) << random_reads(*disk, operations);
+                }
+                else std::cout << std::setw(width) << "-";
+                delete disk;
+            }
+            std::cout << "\n";
+        }
+
+        std::cout << "\nSequential file of " << (BLOCK_COUNT - 16) * (BLOCK_SIZE / 1024)
+                  << " KiB through FileSystem, MB/s\n";
+        std::cout << " depth     write     read\n";
+        for (int depth = 0; depth <= MAX_DEPTH; depth = (depth == 0) ? 1 : depth * 2) {
+            BlockDevice *disk = make_device(depth, true);
+            double write_rate, read_rate;
+
+            file_pass(*disk, write_rate, read_rate);
+            delete disk;
+            show_depth(depth);
+            std::cout << std::setw(10) << write_rate << std::setw(9) << read_rate << "\n";
+        }
+    }
+    catch (const char *message) {
+        std::cerr << "FATAL ERROR: " << message << std::endl;
+        std::remove(DEVICE_NAME);
+        return 1;
+    }
+
+    std::remove(DEVICE_NAME);
+    return 0;
+}
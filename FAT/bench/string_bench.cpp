@@ -0,0 +1,109 @@
+/*! \file    string_bench.cpp
+    \brief   Measures spica::String and std::string when copies are shared between threads.
+    \author  Peter C. Chapin <PChapin@vtc.vsc.edu>
+
+This software is part of a file system simulation package for use at Vermont Technical College.
+Every thread repeatedly copies one shared string. Copying a spica::String only touches the
+shared (atomic) reference count, so all threads contend for one cache line. Copying a
+std::string copies the characters into private memory instead. The "modify" test appends a
+character to each copy, which forces spica::String to detach (copy on write).
+
+Usage: string_bench [iterations per thread] [maximum threads]
+
+The thread count doubles from one up to the maximum (default: eight, or the number of hardware
+threads if that is more).
+*/
+
+#include "environ.hpp"
+
+#if !defined(eCPP11)
+#error string_bench needs a C++ 2011 compiler (for std::thread).
+#endif
+
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Clock.hpp"
+#include "str.hpp"
+
+namespace {
+
+    const char TEXT[] = "A string long enough that std::string must allocate to copy it.";
+
+    spica::String     shared_spica( TEXT );
+    std::string       shared_standard( TEXT );
+    std::atomic<bool> go( false );
+
+    // Keeps the compiler from discarding the work.
+    std::atomic<long> checksum( 0 );
+
+    template<typename S>
+    void copy_worker( const S *shared, long iterations, bool modify )
+    {
+        long total = 0;
+
+        while( !go.load( ) ) std::this_thread::yield( );
+        for( long i = 0; i < iterations; ++i ) {
+            S copy( *shared );
+            if( modify ) copy.append( "x" );
+            total += copy.length( );
+        }
+        checksum += total;
+    }
+
+
+    //
+    // run
+    //
+    // Returns the number of millions of copies per second done by all threads together.
+    //
+    template<typename S>
+    double run( const S &shared, int threads, long iterations, bool modify )
+    {
+        std::vector<std::thread> workers;
+
+        go = false;
+        for( int i = 0; i < threads; ++i ) {
+            workers.push_back( std::thread( copy_worker<S>, &shared, iterations, modify ) );
+        }
+
+        double start = clock_microseconds( );
+        go = true;
+        for( int i = 0; i < threads; ++i ) workers[i].join( );
+        double elapsed = clock_microseconds( ) - start;
+
+        return threads * iterations / elapsed;
+    }
+}
+
+
+int main( int argc, char **argv )
+{
+    long iterations = ( argc > 1 ) ? std::atol( argv[1] ) : 1000000L;
+    int  max_threads = ( argc > 2 ) ? std::atoi( argv[2] ) : 8;
+
+    if( argc <= 2 && (int)std::thread::hardware_concurrency( ) > max_threads ) {
+        max_threads = std::thread::hardware_concurrency( );
+    }
+    if( iterations <= 0 || max_threads <= 0 ) {
+        std::cerr << "Usage: string_bench [iterations per thread] [maximum threads]\n";
+        return 1;
+    }
+
+    std::cout << "Millions of copies per second (" << iterations << " per thread)\n\n";
+    std::cout << "threads  spica copy  std copy  spica modify  std modify\n";
+    for( int threads = 1; threads <= max_threads; threads *= 2 ) {
+        std::cout << std::setw( 7 ) << threads << std::fixed << std::setprecision( 2 )
+                  << std::setw( 12 ) << run( shared_spica,    threads, iterations, false )
+                  << std::setw( 10 ) << run( shared_standard, threads, iterations, false )
+                  << std::setw( 14 ) << run( shared_spica,    threads, iterations, true  )
+                  << std::setw( 12 ) << run( shared_standard, threads, iterations, true  )
+                  << std::endl;
+    }
+    return checksum == 0;
+}
@@ -76,6 +76,23 @@ other libraries.
 
 // It might make sense to encode the compiler version also.
 
+//-----------------------------------
+//           Language Level
+//-----------------------------------
+
+// The symbol eCPP11 is defined when the compiler supports C++ 2011 or later. Code that wants to
+// use the newer library facilities (for example <atomic>) should check for it and provide a
+// fallback for older compilers. Visual C++ does not set __cplusplus properly, so check its
+// version instead.
+
+#if __cplusplus >= 201103L
+#define eCPP11
+#endif
+
+#if eCOMPILER == eMICROSOFT && _MSC_VER >= 1900
+#define eCPP11
+#endif
+
 //-------------------------------------
 //           Operating System
 //-------------------------------------
@@ -202,6 +219,10 @@ other libraries.
 #define eMULTITHREADED
 #endif
 
+#if eCOMPILER == eGCC && defined(_REENTRANT)
+#define eMULTITHREADED
+#endif
+
 #if eCOMPILER == eIBM && defined(_MT)
 #define eMULTITHREADED
 #endif
@@ -13,10 +13,17 @@ sort of way).
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <cstdlib>
+#include <cstring>
 
+#include "AsyncBlockDevice.hpp"
 #include "BlockDevice.hpp"
+#include "DirectBlockDevice.hpp"
 #include "FileSystem.hpp"
+#include "SlowBlockDevice.hpp"
+#include "TraceReplay.hpp"
+#include "TracingBlockDevice.hpp"
 #include "str.hpp"
 
 
@@ -35,19 +42,11 @@ static void error(const char *message)
 //=======================================
 
 //
-// The following stuff defines functions for each supported command and sets up a jump table to
-// make it easier to run them.
+// The following stuff defines functions for each supported command and a table that maps
+// command names to those functions.
 //
 typedef bool (*operation)(const spica::String &, FileSystem &);
 
-struct command_definition {
-    spica::String command_name;
-    operation   command_function;
-
-    command_definition(const spica::String &s, operation o) :
-        command_name(s), command_function(o) { }
-};
-
 bool dir_op     (const spica::String &, FileSystem &);
 bool quit_op    (const spica::String &, FileSystem &);
 bool format_op  (const spica::String &, FileSystem &);
@@ -56,18 +55,143 @@ bool vcopyin_op (const spica::String &, FileSystem &);
 bool vcopyout_op(const spica::String &, FileSystem &);
 bool vdel_op    (const spica::String &, FileSystem &);
 bool vdir_op    (const spica::String &, FileSystem &);
+bool vmkdir_op  (const spica::String &, FileSystem &);
+bool vrmdir_op  (const spica::String &, FileSystem &);
+bool tracestat_op(const spica::String &, FileSystem &);
+bool vdefrag_op (const spica::String &, FileSystem &);
+bool vfrag_op   (const spica::String &, FileSystem &);
+bool replay_op  (const spica::String &, FileSystem &);
+bool vscrub_op  (const spica::String &, FileSystem &);
+bool vcompress_op(const spica::String &, FileSystem &);
+bool vsnap_op   (const spica::String &, FileSystem &);
+bool vsnapdel_op(const spica::String &, FileSystem &);
+bool vmount_op  (const spica::String &, FileSystem &);
+
+
+//
+// CommandTable
+//
+// This class maps command names to command functions. It is a small open addressing hash table
+// so the cost of dispatching a command does not depend on how many commands there are. This
+// matters when the shell is driven by scripts containing many thousands of commands. Commands
+// are registered when the program starts (see register_commands) rather than being fixed at
+// compile time. Lookups are done with a WordView so no temporary strings are created.
+//
+class CommandTable {
+public:
+    CommandTable() : used(0) { }
+
+    void register_command(const char *name, operation function);
+      // Add a command to the table. Registering an existing name replaces its function.
+
+    operation lookup(const spica::WordView &name) const;
+      // Returns the function for the named command or a null pointer if there is none.
+
+private:
+    static const int TABLE_SIZE = 64;
+      // Must be a power of two. Keep it at least twice the number of commands.
+
+    struct slot {
+        spica::String name;
+        operation     function;   // Null if the slot is empty.
 
-command_definition jump_table[] = {
-    command_definition(spica::String("dir"),      dir_op     ),
-    command_definition(spica::String("exit"),     quit_op    ),
-    command_definition(spica::String("format"),   format_op  ),
-    command_definition(spica::String("vcopy"),    vcopy_op   ),
-    command_definition(spica::String("vcopyin"),  vcopyin_op ),
-    command_definition(spica::String("vcopyout"), vcopyout_op),
-    command_definition(spica::String("vdel"),     vdel_op    ),
-    command_definition(spica::String("vdir"),     vdir_op    )
+        slot() : function(0) { }
+    };
+
+    slot table[TABLE_SIZE];
+    int  used;
+
+    static unsigned hash(const char *name, int length);
 };
-const int command_count = sizeof(jump_table)/sizeof(command_definition);
+
+
+//
+// CommandTable::hash
+//
+// This is the FNV-1a hash function. It is simple and does a fine job on short strings.
+//
+unsigned CommandTable::hash(const char *name, int length)
+{
+    unsigned result = 2166136261U;
+    for (int i = 0; i < length; ++i) {
+        result ^= static_cast<unsigned char>(name[i]);
+        result *= 16777619U;
+    }
+    return result;
+}
+
+
+//
+// CommandTable::register_command
+//
+void CommandTable::register_command(const char *name, operation function)
+{
+    unsigned index = hash(name, std::strlen(name)) & (TABLE_SIZE - 1);
+
+    // Probe until we find the name or an empty slot.
+    while (table[index].function != 0) {
+        if (std::strcmp(table[index].name, name) == 0) {
+            table[index].function = function;
+            return;
+        }
+        index = (index + 1) & (TABLE_SIZE - 1);
+    }
+
+    // Don't let the table get more than half full or probe sequences get long.
+    if (2 * (used + 1) > TABLE_SIZE)
+        throw "CommandTable::register_command() -- Too many commands";
+
+    table[index].name     = name;
+    table[index].function = function;
+    ++used;
+}
+
+
+//
+// CommandTable::lookup
+//
+operation CommandTable::lookup(const spica::WordView &name) const
+{
+    // A blank command line produces an empty view with no characters behind it.
+    if (name.length() == 0) return 0;
+
+    unsigned index = hash(name.data(), name.length()) & (TABLE_SIZE - 1);
+
+    while (table[index].function != 0) {
+        if (name == table[index].name) return table[index].function;
+        index = (index + 1) & (TABLE_SIZE - 1);
+    }
+    return 0;
+}
+
+
+//
+// register_commands
+//
+// Installs the shell's built in commands into the given table.
+//
+static void register_commands(CommandTable &commands)
+{
+    commands.register_command("dir",      dir_op     );
+    commands.register_command("exit",     quit_op    );
+    commands.register_command("format",   format_op  );
+    commands.register_command("vcompress", vcompress_op);
+    commands.register_command("vcopy",    vcopy_op   );
+    commands.register_command("vcopyin",  vcopyin_op );
+    commands.register_command("vcopyout", vcopyout_op);
+    commands.register_command("vdefrag",  vdefrag_op );
+    commands.register_command("vdel",     vdel_op    );
+    commands.register_command("vdir",     vdir_op    );
+    commands.register_command("vfrag",    vfrag_op   );
+    commands.register_command("vmkdir",   vmkdir_op  );
+    commands.register_command("vmount",   vmount_op  );
+    commands.register_command("vrmdir",   vrmdir_op  );
+    commands.register_command("vscrub",   vscrub_op  );
+    commands.register_command("vsnap",    vsnap_op   );
+    commands.register_command("vsnapdel", vsnapdel_op);
+    commands.register_command("replay",   replay_op  );
+    commands.register_command("tracestat", tracestat_op);
+}
 
 
 //
@@ -92,9 +216,15 @@ bool quit_op(const spica::String &, FileSystem &)
 //
 // format_op
 //
-bool format_op(const spica::String &, FileSystem &files)
+bool format_op(const spica::String &command_line, FileSystem &files)
 {
-    files.format();
+    int  count     = command_line.words();
+    bool checksums = (count == 2 && std::strcmp(command_line.word(2), "checksums") == 0);
+
+    if (count != 1 && !checksums) error("usage: format [checksums]");
+    else {
+        files.format(checksums);
+    }
     return false;
 }
 
@@ -188,6 +318,39 @@ bool vcopyout_op(const spica::String &command_line, FileSystem &files)
 }
 
 
+//
+// show_progress
+//
+// Displays a percentage that is updated in place. Only changes are displayed.
+//
+static void show_progress(int done, int total, void *context)
+{
+    int &last_percent = *static_cast<int *>(context);
+    int  percent      = (total == 0) ? 100 : (100 * done) / total;
+
+    if (percent != last_percent) {
+        std::cout << "\r" << std::setw(3) << percent << "% complete" << std::flush;
+        last_percent = percent;
+    }
+}
+
+
+//
+// vdefrag_op
+//
+bool vdefrag_op(const spica::String &, FileSystem &files)
+{
+    int last_percent = -1;
+
+    std::cout << "Average run length before: " << files.average_run_length() << std::endl;
+    int moved = files.defragment(show_progress, &last_percent);
+    if (last_percent != -1) std::cout << std::endl;
+    std::cout << "Blocks moved: " << moved << std::endl;
+    std::cout << "Average run length after: " << files.average_run_length() << std::endl;
+    return false;
+}
+
+
 //
 // vdel_op
 //
@@ -204,14 +367,200 @@ bool vdel_op(const spica::String &command_line, FileSystem &files)
 //
 // vdir_op
 //
-bool vdir_op(const spica::String &, FileSystem &files)
+bool vdir_op(const spica::String &command_line, FileSystem &files)
 {
+    int count = command_line.words();
+
+    if (count > 2) {
+        error("usage: vdir [directory]");
+        return false;
+    }
+
     FileSystem::directory_info info;
-    files.open_dir();
+    files.open_dir(count == 2 ? command_line.word(2) : "");
     while (files.next_dir(&info)) {
-        std::cout
-            << std::setw(24) << info.name
-            << std::setw(10) << info.size << std::endl;
+        std::cout << std::setw(24) << info.name;
+        if (info.directory)
+            std::cout << std::setw(10) << "<DIR>" << std::endl;
+        else
+            std::cout
+                << std::setw(10) << info.size
+                << std::setw(10) << info.stored
+                << (info.compressed ? "  compressed" : "") << std::endl;
+    }
+    return false;
+}
+
+
+//
+// vmkdir_op
+//
+bool vmkdir_op(const spica::String &command_line, FileSystem &files)
+{
+    if (command_line.words() != 2) error("usage: vmkdir directory");
+    else {
+        files.make_directory(command_line.word(2));
+    }
+    return false;
+}
+
+
+//
+// vrmdir_op
+//
+bool vrmdir_op(const spica::String &command_line, FileSystem &files)
+{
+    if (command_line.words() != 2) error("usage: vrmdir directory");
+    else {
+        files.remove_directory(command_line.word(2));
+    }
+    return false;
+}
+
+
+//
+// vcompress_op
+//
+// With an argument, controls whether new files are compressed. Without one, shows compression
+// statistics. The rates are for the compressor itself and don't include disk time. The write
+// rate is per byte added to files so it includes the cost of recompressing partial clusters.
+//
+bool vcompress_op(const spica::String &command_line, FileSystem &files)
+{
+    int count = command_line.words();
+
+    if (count == 2 && std::strcmp(command_line.word(2), "on") == 0)
+        files.set_compression(true);
+    else if (count == 2 && std::strcmp(command_line.word(2), "off") == 0)
+        files.set_compression(false);
+    else if (count != 1)
+        error("usage: vcompress [on | off]");
+    else {
+        const FileSystem::compression_statistics &stats = files.compression_stats();
+
+        std::cout << "New files are " << (files.compression_enabled() ? "" : "not ")
+                  << "compressed" << std::endl;
+        std::cout << "Written: " << stats.raw_written << " bytes stored in "
+                  << stats.stored_written << " bytes";
+        if (stats.stored_written > 0)
+            std::cout << " (ratio " << stats.raw_written / stats.stored_written << ")";
+        if (stats.compress_time > 0)
+            std::cout << ", " << stats.raw_written / stats.compress_time << " MB/s";
+        std::cout << std::endl;
+        std::cout << "Read: " << stats.raw_read << " bytes from "
+                  << stats.stored_read << " bytes";
+        if (stats.stored_read > 0)
+            std::cout << " (ratio " << stats.raw_read / stats.stored_read << ")";
+        if (stats.decompress_time > 0)
+            std::cout << ", " << stats.raw_read / stats.decompress_time << " MB/s";
+        std::cout << std::endl;
+    }
+    return false;
+}
+
+
+//
+// vscrub_op
+//
+bool vscrub_op(const spica::String &, FileSystem &files)
+{
+    if (!files.has_checksums()) error("file system was not formatted with checksums");
+    else {
+        std::cout << "Blocks with bad checksums: " << files.verify_checksums() << std::endl;
+    }
+    return false;
+}
+
+
+//
+// vfrag_op
+//
+bool vfrag_op(const spica::String &, FileSystem &files)
+{
+    std::cout << "Average run length: " << files.average_run_length() << " blocks" << std::endl;
+    return false;
+}
+
+
+//
+// vsnap_op
+//
+// With an argument, creates a snapshot. Without one, lists the snapshots.
+//
+bool vsnap_op(const spica::String &command_line, FileSystem &files)
+{
+    int count = command_line.words();
+
+    if (count == 2) files.create_snapshot(command_line.word(2));
+    else if (count != 1) error("usage: vsnap [name]");
+    else {
+        FileSystem::snapshot_info info;
+        files.open_snapshots();
+        while (files.next_snapshot(&info)) {
+            std::cout
+                << std::setw(24) << info.name
+                << std::setw(6)  << info.files << " files"
+                << std::setw(10) << info.size  << " bytes"
+                << std::setw(10) << info.exclusive << " bytes exclusive" << std::endl;
+        }
+    }
+    return false;
+}
+
+
+//
+// vsnapdel_op
+//
+bool vsnapdel_op(const spica::String &command_line, FileSystem &files)
+{
+    if (command_line.words() != 2) error("usage: vsnapdel name");
+    else {
+        files.delete_snapshot(command_line.word(2));
+    }
+    return false;
+}
+
+
+//
+// vmount_op
+//
+// With an argument, mounts a snapshot. Without one, mounts the live file system again.
+//
+bool vmount_op(const spica::String &command_line, FileSystem &files)
+{
+    int count = command_line.words();
+
+    if (count == 2) files.mount_snapshot(command_line.word(2));
+    else if (count == 1) files.mount_snapshot(0);
+    else error("usage: vmount [snapshot]");
+    return false;
+}
+
+
+//
+// replay_op
+//
+bool replay_op(const spica::String &command_line, FileSystem &files)
+{
+    int  count = command_line.words();
+    bool paced = (count == 3 && std::strcmp(command_line.word(3), "paced") == 0);
+
+    if (count != 2 && !paced) error("usage: replay tracefile [paced]");
+    else {
+        replay_trace(command_line.word(2), files, paced, std::cout);
+    }
+    return false;
+}
+
+
+//
+// tracestat_op
+//
+bool tracestat_op(const spica::String &command_line, FileSystem &)
+{
+    if (command_line.words() != 2) error("usage: tracestat tracefile");
+    else {
+        trace_report(command_line.word(2), std::cout);
     }
     return false;
 }
@@ -220,63 +569,125 @@ bool vdir_op(const spica::String &, FileSystem &files)
 //           Main Program
 //==================================
 
+//
+// The command line options.
+//
+struct shell_options {
+    bool        slow;         // =true to run on a simulated slow disk.
+    bool        async;        // =true to use a disk that supports asynchronous operations.
+    bool        direct;       // =true to use a disk that bypasses the host's cache.
+    const char *trace_file;   // If not null, trace disk operations into this file.
+    int         block_size;   // The size of the disk's blocks.
+
+    shell_options() :
+        slow(false), async(false), direct(false), trace_file(0), block_size(1024) { }
+};
+
+
 //
 // my_main
 //
 // This is the real main() function. It is called by main(). This method of organization puts
-// the primary exception handler out of the way.
+// the primary exception handler out of the way. If requested, the file system runs on a
+// simulated slow disk (and the simulated time used by the disk is displayed with each prompt)
+// and/or has its disk operations traced.
 //
-int my_main()
+int my_main(const shell_options &options)
 {
     using namespace spica;
     
     bool done = false;
     // Becomes true when the user wants to quit.
 
-    BlockDevice disk("block.dev", 1024, 512);
+    const int size = options.block_size;
+
+    #if defined(eCPP11)
+    std::unique_ptr<BlockDevice> raw_disk;
+    #else
+    std::auto_ptr<BlockDevice> raw_disk;
+    #endif
+    #if eOPSYS == ePOSIX
+    if (options.async) raw_disk.reset(new AsyncBlockDevice("block.dev", size, 512));
+    else if (options.direct) {
+        DirectBlockDevice *direct_disk = new DirectBlockDevice("block.dev", size, 512);
+        raw_disk.reset(direct_disk);
+        if (!direct_disk->is_direct())
+            std::cout << "Direct I/O is not possible here. Using buffered I/O." << std::endl;
+    }
+    #endif
+    if (raw_disk.get() == 0) raw_disk.reset(new BlockDevice("block.dev", size, 512));
+    BlockDevice &disk = *raw_disk;
     // We need a "raw" disk here. The constructor creates space in the hosting file system and
     // does, in effect, a low level format. If the backing file already exists it is used as is.
 
-    FileSystem files(disk);
-    // Associate a file system with the block device we created above.
-
-    // Let's see what we've got.
-    if (files.is_formatted()) {
-        std::cout << "The file system appears to be formatted." << std::endl;
-    }
-    else {
-        std::cout << "The file system does not appear to be formatted." << std::endl;
-    }
-
-    // Now interact with the user.
-    while (!done) {
-        String command_line;
-
-        // Display the prompt.
-        std::cout << std::endl;
-        if (files.is_formatted())
-            std::cout << files.free_space() << " bytes available" << std::endl;
-        std::cout << "> " << std::flush;
-        std::cin  >> command_line;
-
-        // Process the command.
-        spica::String command_word = command_line.word(1);
-
-        int i;
-        for (i = 0; i < command_count; i++) {
-            if (jump_table[i].command_name == command_word) {
-                done = jump_table[i].command_function(command_line, files);
-                break;
-            }
+    SlowBlockDevice slow_disk(disk, SlowBlockDevice::hard_disk());
+    BlockDevice &base_disk = options.slow ? static_cast<BlockDevice &>(slow_disk) : disk;
+    // A simulated slow disk layered over the real one. It is only used if requested.
+
+    TracingBlockDevice traced_disk(base_disk);
+    BlockDevice &file_disk = options.trace_file ? traced_disk : base_disk;
+    // Records the disk operations done by the file system. It is only used if requested.
+
+    // The file system is in its own scope so that the final flush done by its destructor
+    // appears in the trace.
+    {
+        FileSystem files(file_disk);
+        // Associate a file system with the block device we created above.
+
+        CommandTable commands;
+        register_commands(commands);
+        // Set up the commands we understand.
+
+        // Let's see what we've got.
+        if (files.is_formatted()) {
+            std::cout << "The file system appears to be formatted." << std::endl;
+            if (files.rebuilt_checksums())
+                std::cout << "It was not shut down cleanly. Its checksums were rebuilt."
+                          << std::endl;
+        }
+        else {
+            std::cout << "The file system does not appear to be formatted." << std::endl;
         }
 
-        // If we didn't find it, print a "command unknown" message.
-        if (i == command_count) error("command unknown");
-
-        // Check the file system after every command.
-        files.check();
+        // Now interact with the user.
+        while (!done) {
+            String command_line;
+
+            // Display the prompt.
+            std::cout << std::endl;
+            if (files.is_formatted())
+                std::cout << files.free_space() << " bytes available" << std::endl;
+            if (files.mounted_snapshot() != 0)
+                std::cout << "snapshot " << files.mounted_snapshot() << " (read only)"
+                          << std::endl;
+            if (options.slow)
+                std::cout << "simulated disk time: " << slow_disk.elapsed() / 1000.0 << " ms ("
+                          << slow_disk.reads() << " reads, " << slow_disk.writes() << " writes)"
+                          << std::endl;
+            std::cout << "> " << std::flush;
+            std::cin  >> command_line;
+
+            // When commands come from a script, stop at the end of it.
+            if (!std::cin && command_line.length() == 0) break;
+
+            // Process the command. The command word is examined in place so that matching it
+            // against the command table does not build any temporary strings.
+            WordTokenizer tokens(command_line);
+            WordView      command_word;
+            tokens.next(command_word);
+
+            operation command_function = commands.lookup(command_word);
+
+            // If we didn't find it, print a "command unknown" message.
+            if (command_function == 0) error("command unknown");
+            else done = command_function(command_line, files);
+
+            // Check the file system after every command.
+            files.check();
+        }
     }
 
+    if (options.trace_file) traced_disk.dump(options.trace_file);
     return 0;
 }
 
@@ -286,13 +697,35 @@ int my_main()
 //
 // This function calls the real my_main() function. It encloses everything in a generic
 // exception handler so that no exceptions can escape from the program. (Well, not really, but
-// almost).
+// almost). The command line options are -slow, which runs the file system on a simulated slow
+// disk, -async, which uses a disk that can have several operations in progress, -direct,
+// which uses a disk that bypasses the host's cache (both POSIX only), -trace, which records
+// the disk operations into the given trace file, and -blocksize, which gives the size of the
+// disk's blocks. The backing file must be recreated (and formatted) to change its block size.
 //
-int main()
+int main(int argc, char **argv)
 {
+    shell_options options;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-slow") == 0) options.slow = true;
+        else if (std::strcmp(argv[i], "-async") == 0) options.async = true;
+        else if (std::strcmp(argv[i], "-direct") == 0) options.direct = true;
+        else if (std::strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+            options.trace_file = argv[++i];
+        else if (std::strcmp(argv[i], "-blocksize") == 0 && i + 1 < argc)
+            options.block_size = std::atoi(argv[++i]);
+        else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [-slow] [-async | -direct] [-trace tracefile] [-blocksize bytes]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
     // Let's try to execute the my_main() function. If it returns, the program is done.
     try {
-        return my_main();
+        return my_main(options);
     }
 
     // If my_main() throws an exception, then print a message and die. Let's not attempt to
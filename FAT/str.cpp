@@ -9,8 +9,8 @@ The 'rep' member should never be NULL. This is because if an exception is throw
 construction (that's the only time rep might become NULL), the object under construction can
 never be accessed in a well defined manner.
 
-This version is well behaved in a multi-threaded environment provided the symbol pMULTITHREADED
-is defined before compilation.
+This version is well behaved in a multi-threaded environment provided it is compiled with a
+C++ 2011 (or later) compiler. See the class documentation for details.
 
 TO DO
 
@@ -20,13 +20,8 @@ TO DO
 #include "environ.hpp"
 #include <cstring>
 #include <iostream>
-#include <memory>
 #include "str.hpp"
 
-#if defined(pMULTITHREADED)
-#include "sem.hpp"
-#endif
-
 /*! \class spica::String
  *
  * Class String has features that are similar to those offered by the strings built into the
@@ -62,29 +57,23 @@ TO DO
  * copying them are all low overhead, O(1) operations. A string's representation is only copied
  * when necessary (on demand).
  *
- * These strings are thread safe in the sense that multiple threads can manipulate the same
- * string without causing undefined behavior. If a thread reads a string's value while that
- * value is being updated by a mutating operation, it is unspecified if the first thread reads
- * the string's old value or new value. However, it will read one of those two values reliably.
- * It is important that no global strings are created in a multithreaded program. This is
- * because this class uses a global lock and C++ does not define the order in which global
- * static data is initialized across translation units. If you need a global string, create a
- * global pointer to a string and then give that pointer a value using operator new after main()
- * has started.
+ * Copy-on-write is used for mutating operations. A string that shares its representation
+ * with other strings is first given a private copy of that representation; the other strings
+ * are never affected. A string that owns its representation outright is updated in place when
+ * the existing space allows. Appending grows the space geometrically so that building a string
+ * one character at a time is a linear operation overall.
  *
- * To compile in multithreaded support the symbol pMULTITHREADED must be defined when this file
- * (and the header file) are compiled. The module sem.cpp from the spica library must also be
- * provided. This class assumes that spica::mutex_sem supports recursive locking. If that is not
- * the case, the non-mutating operations that return a new string will deadlock.
+ * When compiled with a C++ 2011 (or later) compiler the reference count is atomic. Strings
+ * that share a representation can then be copied, mutated, and destroyed in different threads
+ * without any external locking. As with the standard library strings, a single String object
+ * that is mutated by one thread must not be accessed by another thread at the same time
+ * without synchronization. There is no global lock so global strings may be created freely.
+ * Older compilers get a plain reference count and the class is then only suitable for single
+ * threaded programs.
  */
 
 namespace spica {
     
-    #if defined(pMULTITHREADED)
-    // This is the "BSL" (Big String Lock).
-    static mutex_sem string_lock;
-    #endif
-
     //-------------------------------------------------
     //           Internally Linked Functions
     //-------------------------------------------------
@@ -116,10 +105,6 @@ namespace spica {
      */
     bool operator==( const String &left, const String &right )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // Is this first comparison worthwhile?
         if( left.rep == right.rep ) return true;
         return ( std::strcmp( left.rep->workspace, right.rep->workspace ) == 0 );
@@ -132,10 +117,6 @@ namespace spica {
      */
     bool operator<( const String &left, const String &right )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         return ( std::strcmp( left.rep->workspace, right.rep->workspace ) < 0 );
     }
 
@@ -146,10 +127,6 @@ namespace spica {
      */
     std::ostream &operator<<( std::ostream &os, const String &right )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         os << right.rep->workspace;
         return os;
     }
@@ -166,7 +143,8 @@ namespace spica {
         char   ch;
         String temp;
 
-        // This is sort of inefficient. Do I care? Not right now.
+        // Appending one character at a time is fine since append() grows the space
+        // geometrically.
         while( is.get( ch ) ) {
             if( ch == '\n' ) break;
             temp.append( ch );
@@ -180,10 +158,59 @@ namespace spica {
     //           Methods
     //----------------------------
 
+    /*!
+     * If this was the last reference to the representation, the representation is deleted.
+     * With an atomic count only the thread that drops the count to zero does the deletion.
+     */
+    void String::release( string_node *node )
+    {
+        if( --node->count == 0 ) {
+            delete [] node->workspace;
+            delete    node;
+        }
+    }
+
+
+    /*!
+     * This is the common part of the append methods. If this string owns its representation
+     * and the representation has room, the text is copied into place. Otherwise a new
+     * representation is built with some extra space (so that repeated appends are cheap) and
+     * the old one is released. The new text is copied before the old representation is
+     * released so it is fine if text points into this string.
+     */
+    void String::append_text( const char *text, int length )
+    {
+        int current_length = std::strlen( rep->workspace );
+        int new_length     = current_length + length;
+
+        // Can we do it in place?
+        if( rep->count == 1 && new_length < rep->capacity ) {
+            std::memcpy( rep->workspace + current_length, text, length );
+            rep->workspace[new_length] = '\0';
+            return;
+        }
+
+        // No. Detach from the current representation.
+        int new_capacity = new_length + new_length / 2 + 1;
+        node_pointer new_node( new string_node );
+        new_node->workspace = new char[new_capacity];
+        new_node->capacity  = new_capacity;
+
+        std::memcpy( new_node->workspace, rep->workspace, current_length );
+        std::memcpy( new_node->workspace + current_length, text, length );
+        new_node->workspace[new_length] = '\0';
+
+        release( rep );
+        rep = new_node.get( );
+        new_node.release( );
+    }
+
+
     String::String( )
     {
-        std::auto_ptr< string_node > new_node( new string_node );
+        node_pointer new_node( new string_node );
         new_node->workspace = new char[1];
+        new_node->capacity  = 1;
         *new_node->workspace = '\0';
         rep = new_node.get( );
         new_node.release( );
@@ -192,10 +219,6 @@ namespace spica {
 
     String::String( const String &existing )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock(string_lock);
-        #endif
-  
         rep = existing.rep;
         rep->count++;
     }
@@ -203,8 +226,10 @@ namespace spica {
 
     String::String( const char *existing )
     {
-        std::auto_ptr< string_node > new_node( new string_node );
-        new_node->workspace = new char[std::strlen( existing ) + 1];
+        int length = std::strlen( existing );
+        node_pointer new_node( new string_node );
+        new_node->workspace = new char[length + 1];
+        new_node->capacity  = length + 1;
         std::strcpy( new_node->workspace, existing );
         rep = new_node.get( );
         new_node.release( );
@@ -213,8 +238,9 @@ namespace spica {
 
     String::String( char existing )
     {
-        std::auto_ptr< string_node > new_node( new string_node );
+        node_pointer new_node( new string_node );
         new_node->workspace = new char[2];
+        new_node->capacity  = 2;
         new_node->workspace[0] = existing;
         new_node->workspace[1] = '\0';
         rep = new_node.get( );
@@ -228,35 +254,21 @@ namespace spica {
      */
     String::~String( )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-  
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
-        }
+        release( rep );
     }
 
 
+    /*!
+     * The other string's representation is acquired before this string's representation is
+     * released. This makes assignment to self safe without a special test.
+     */
     String &String::operator=( const String &other )
     {
-        // Check for assignment to self.
-        if( &other == this ) return *this;
-
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
-        }
+        string_node *old_rep = rep;
 
+        other.rep->count++;
         rep = other.rep;
-        rep->count++;
+        release( old_rep );
 
         return *this;
     }
@@ -266,19 +278,22 @@ namespace spica {
     {
         if( other == 0 ) return *this;
 
-        std::auto_ptr< string_node > new_node( new string_node );
-        new_node->workspace = new char[std::strlen( other ) + 1];
-        std::strcpy( new_node->workspace, other );
-  
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
+        int length = std::strlen( other );
 
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
+        // If we own our representation and it is big enough, just overwrite it. The source
+        // might overlap our own text so use memmove.
+        //
+        if( rep->count == 1 && length < rep->capacity ) {
+            std::memmove( rep->workspace, other, length + 1 );
+            return *this;
         }
+
+        node_pointer new_node( new string_node );
+        new_node->workspace = new char[length + 1];
+        new_node->capacity  = length + 1;
+        std::strcpy( new_node->workspace, other );
+  
+        release( rep );
         rep = new_node.get( );
         new_node.release( );
 
@@ -292,83 +307,27 @@ namespace spica {
      */
     int String::length( ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         return std::strlen( rep->workspace );
     }
 
 
     String &String::append( const String &other )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
-        int count = std::strlen( rep->workspace ) + std::strlen( other.rep->workspace );
-        std::auto_ptr< string_node > new_node( new string_node );
-        new_node->workspace = new char[count + 1];
-
-        std::strcpy( new_node->workspace, rep->workspace );
-        std::strcat( new_node->workspace, other.rep->workspace );
-
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
-        }
-        rep = new_node.get( );
-        new_node.release( );
+        append_text( other.rep->workspace, std::strlen( other.rep->workspace ) );
         return *this;
     }
 
 
     String &String::append( const char *other )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
-        int count = std::strlen( rep->workspace ) + std::strlen( other );
-        std::auto_ptr< string_node > new_node( new string_node );
-        new_node->workspace = new char[count + 1];
-
-        std::strcpy( new_node->workspace, rep->workspace );
-        std::strcat( new_node->workspace, other );
-
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
-        }
-        rep = new_node.get( );
-        new_node.release( );
+        append_text( other, std::strlen( other ) );
         return *this;
     }
 
 
     String &String::append( char other )
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
-        int count = std::strlen( rep->workspace ) + 1;
-        std::auto_ptr< string_node > new_node( new string_node );
-        new_node->workspace = new char[count + 1];
-
-        std::strcpy( new_node->workspace, rep->workspace );
-        new_node->workspace[count - 1] = other;
-        new_node->workspace[count    ] = '\0';
-        
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete    rep;
-        }
-        rep = new_node.get( );
-        new_node.release( );
+        append_text( &other, 1 );
         return *this;
     }
 
@@ -379,19 +338,18 @@ namespace spica {
      */
     void String::erase( )
     {
-        std::auto_ptr< string_node > new_node( new string_node );
+        // If the representation is ours alone, keep it (and its space) for reuse.
+        if( rep->count == 1 ) {
+            *rep->workspace = '\0';
+            return;
+        }
+
+        node_pointer new_node( new string_node );
         new_node->workspace = new char[1];
+        new_node->capacity  = 1;
         *new_node->workspace = '\0';
 
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
-        if( rep->count > 1 ) rep->count--;
-        else {
-            delete [] rep->workspace;
-            delete rep;
-        }
+        release( rep );
         rep = new_node.get( );
         new_node.release( );
     }
@@ -408,10 +366,6 @@ namespace spica {
      */
     String String::right( int length, char pad ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -452,10 +406,6 @@ namespace spica {
      */
     String String::left( int length, char pad ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -499,10 +449,6 @@ namespace spica {
      */
     String String::center( int length, char pad ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -546,10 +492,6 @@ namespace spica {
      */
     String String::copy( int count ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -575,10 +517,6 @@ namespace spica {
      */
     String String::erase( int offset, int count ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -630,10 +568,6 @@ namespace spica {
      */
     String String::insert( const String &incoming, int offset, int count ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -675,10 +609,6 @@ namespace spica {
      */
     int String::pos( char needle, int offset ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         offset--;
 
         // If we are starting off the end of the string, then obviously we didn't find anything.
@@ -708,10 +638,6 @@ namespace spica {
      */
     int String::pos( const char *needle, int offset ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         offset--;
 
         // If we are starting off the end of the string, then obviously we didn't find anything.
@@ -741,10 +667,6 @@ namespace spica {
      */
     int String::last_pos( char needle, int offset ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         offset--;
 
         int current_length = std::strlen( rep->workspace );
@@ -778,10 +700,6 @@ namespace spica {
      */
     String String::strip( char mode, char kill_char ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -841,10 +759,6 @@ namespace spica {
      */
     String String::substr( int offset, int count ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -892,10 +806,6 @@ namespace spica {
      */
     String String::subword( int offset, int count, const char *white ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         // A place to put the answer.
         String result;
 
@@ -964,10 +874,6 @@ namespace spica {
      */
     int String::words( const char *white ) const
     {
-        #if defined(pMULTITHREADED)
-        mutex_sem::grabber lock( string_lock );
-        #endif
-
         int  word_count = 0;   // The number of words found.
         int  in_word    = 0;   // =1 When we are scanning a word.
         
@@ -1025,4 +931,60 @@ namespace spica {
     String operator+( char left, const String &right )
         { String temp( left ); temp.append( right ); return temp; }
 
+
+    //-------------------------------------------
+    //           WordView and WordTokenizer
+    //-------------------------------------------
+
+    /*!
+     * The comparison is done in a case sensitive manner. The view matches only if it has
+     * exactly the same characters as the null terminated string; a view is not equal to a
+     * string of which it is merely a prefix. An empty view (which may have a null data pointer)
+     * matches only the empty string.
+     */
+    bool operator==( const WordView &left, const char *right )
+    {
+        if( left.length( ) == 0 ) return right[0] == '\0';
+        if( std::strncmp( left.data( ), right, left.length( ) ) != 0 ) return false;
+        return right[left.length( )] == '\0';
+    }
+
+
+    /*!
+     * The delimiter set is decoded into a table indexed by character value. After this the
+     * classification of each character during scanning is a single array access instead of a
+     * call to std::strchr.
+     */
+    WordTokenizer::WordTokenizer( const char *text, const char *white ) : current( text )
+    {
+        std::memset( delimiter, 0, sizeof( delimiter ) );
+
+        // If the user is trying to use a special kind of whitespace...
+        if( white != 0 ) {
+            const unsigned char *p = reinterpret_cast< const unsigned char * >( white );
+            while( *p ) delimiter[*p++] = 1;
+        }
+
+        // Otherwise use the default (the same set used by is_white).
+        else {
+            delimiter[' ' ] = 1; delimiter['\t'] = 1; delimiter['\v'] = 1;
+            delimiter['\r'] = 1; delimiter['\n'] = 1; delimiter['\f'] = 1;
+        }
+    }
+
+
+    bool WordTokenizer::next( WordView &word )
+    {
+        // Skip leading delimiters.
+        while( *current && delimiter[static_cast< unsigned char >( *current )] ) ++current;
+        if( *current == '\0' ) return false;
+
+        // Find the end of this word.
+        const char *start = current;
+        while( *current && !delimiter[static_cast< unsigned char >( *current )] ) ++current;
+
+        word = WordView( start, static_cast< int >( current - start ) );
+        return true;
+    }
+
 }
@@ -12,6 +12,11 @@ that exist in the Rexx language.
 #include "environ.hpp"
 #include <iosfwd>
 #include <limits.h>
+#include <memory>
+
+#if defined(eCPP11)
+#include <atomic>
+#endif
 
 namespace spica {
 
@@ -34,17 +39,42 @@ namespace spica {
 
         // The text of a string is found through a string_node. There might be many String
         // objects pointing to any particular string_node. Strings share their representations
-        // when possible. Copying is done on demand.
+        // when possible. Copying is done on demand: a mutating operation first detaches the
+        // string from a shared representation. The reference count is atomic when the compiler
+        // supports it so that strings sharing a representation can live in different threads.
+        //
+        // The capacity is the size of the workspace array (including the null character). It
+        // is allowed to underestimate the real size; it is only used to decide if an unshared
+        // representation can be modified in place.
         //
         struct string_node {
+            #if defined(eCPP11)
+            std::atomic< int > count;
+            #else
             int   count;
+            #endif
+            int   capacity;
             char *workspace;
             
-            string_node( ) : count( 1 ), workspace( 0 ) { }
+            string_node( ) : count( 1 ), capacity( 0 ), workspace( 0 ) { }
         };
 
+        // Holds a new representation until it is installed, so that it is deleted if an
+        // exception is thrown first.
+        #if defined(eCPP11)
+        typedef std::unique_ptr< string_node > node_pointer;
+        #else
+        typedef std::auto_ptr< string_node > node_pointer;
+        #endif
+
         string_node *rep;
 
+        //! Drop a reference to a representation, deleting it if it is no longer used.
+        static void release( string_node * );
+
+        //! Append length characters from text to this string, detaching if necessary.
+        void append_text( const char *text, int length );
+
     public:
 
    
@@ -199,7 +229,83 @@ namespace spica {
 
     //! Concatenate a character and a string.
     String operator+( char left, const String &right );
-    
+
+    // +++++
+    // Word tokenizing without allocation.
+    // +++++
+
+    //! A non-owning reference to a run of characters.
+    /*!
+     * A WordView refers to characters held by some other object, typically a String. It does
+     * not own those characters and the characters are not null terminated. A WordView is
+     * invalidated by any operation that invalidates the underlying text (for example, by any
+     * mutating operation on the String that holds it).
+     */
+    class WordView {
+    public:
+        //! Construct an empty view.
+        WordView( ) : start( 0 ), count( 0 ) { }
+
+        //! Construct a view of size characters starting at text.
+        WordView( const char *text, int size ) : start( text ), count( size ) { }
+
+        //! Return a pointer to the first character of the view.
+        const char *data( ) const { return start; }
+
+        //! Return the number of characters in the view.
+        int length( ) const { return count; }
+
+        //! Return true if the view contains no characters.
+        bool empty( ) const { return count == 0; }
+
+    private:
+        const char *start;
+        int         count;
+    };
+
+    //! Compare a view with a null terminated string for equality.
+    bool operator==( const WordView &left, const char *right );
+
+    //! Compare a view with a null terminated string for inequality.
+    inline bool operator!=( const WordView &left, const char *right )
+        { return !( left == right ); }
+
+    //! Iterates over the words of a string in a single pass.
+    /*!
+     * Unlike String::word, which rescans the string from the beginning each time it is called,
+     * a WordTokenizer remembers its position. Stepping through all the words of a string is
+     * thus O(n) rather than O(n^2). The words are returned as WordView objects that point into
+     * the original text so no memory is allocated. The delimiter set is decoded into a lookup
+     * table once, when the tokenizer is constructed.
+     *
+     * The text being tokenized must outlive the tokenizer and must not be changed while the
+     * tokenizer is in use.
+     */
+    class WordTokenizer {
+    public:
+        //! Prepare to tokenize the given text.
+        /*!
+         * \param text The text to tokenize. Strings can be passed here directly.
+         * \param white Pointer to a string of word delimiter characters. If null the default
+         * white space characters are used, as with String::words.
+         */
+        explicit WordTokenizer( const char *text, const char *white = 0 );
+
+        //! Extract the next word.
+        /*!
+         * \param word Set to a view of the next word if there is one. Unchanged otherwise.
+         * \return true if a word was found; false if the text is exhausted.
+         */
+        bool next( WordView &word );
+
+        //! Return the text following the most recently extracted word.
+        const char *rest( ) const { return current; }
+
+    private:
+        const char    *current;
+        unsigned char  delimiter[UCHAR_MAX + 1];
+    };
+
 }
 
 #endif
@@ -0,0 +1,484 @@
+/*!
+ * \file commands.c
+ * \author Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * \brief Commands that can be run from the command line without the curses interface.
+ *
+ * Each command is given as `disktool command partition [arguments]`. The commands use the same
+ * functions as the menu options but never wait for the user. Output is meant to be read by
+ * programs: one record per line with fields separated by tabs or given as name=value pairs.
+ * Error messages go to the standard error. The exit status is zero on success and one
+ * otherwise.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tool.h"
+
+// Information about each command.
+struct command {
+    const char *name;
+    const char *options;   // The command's options in the form used by getopt.
+    int         min_args;  // Number of arguments after the partition name.
+    int         max_args;
+    int         writes;    // =1 if the command modifies the partition.
+    int       ( *function )( int fd, char **args );
+    const char *usage;
+};
+
+static const char *command_name;  // Name of the command being run (for error messages).
+
+// Command options.
+static int scrub_option;          // =1 if mkfs should overwrite every block.
+static const char *source_option; // Host directory to copy into a new file system (or NULL).
+
+
+static int fail( const char *format, ... )
+{
+    va_list args;
+
+    fprintf( stderr, "disktool %s: ", command_name );
+    va_start( args, format );
+    vfprintf( stderr, format, args );
+    va_end( args );
+    fprintf( stderr, "\n" );
+    return 1;
+}
+
+
+static const char *type_name( uint32_t mode )
+{
+    if( S_ISDIR( mode ) ) return "dir";
+    if( S_ISREG( mode ) ) return "file";
+    return "other";
+}
+
+
+// Splits a path into the inode number of the directory that should hold the last component and
+// the last component itself. The name buffer must have room for MAX_NAME_LENGTH + 1 characters.
+//
+static int find_parent( int fd, const char *path, uint32_t *parent, char *name )
+{
+    char  *copy = malloc( strlen( path ) + 1 );
+    char  *slash;
+    char  *last;
+    size_t length;
+    int    result;
+
+    if( copy == NULL ) return 0;
+    strcpy( copy, path );
+
+    // Ignore trailing slashes.
+    length = strlen( copy );
+    while( length > 0 && copy[length - 1] == '/' ) copy[--length] = '\0';
+
+    slash = strrchr( copy, '/' );
+    last  = ( slash == NULL ) ? copy : slash + 1;
+    if( !valid_filename( last ) ) {
+        free( copy );
+        return 0;
+    }
+    strcpy( name, last );
+    *last = '\0';
+    result = lookup_path( fd, copy, parent );
+    free( copy );
+    return result;
+}
+
+
+// Fills in a new inode. Unused block numbers must be zero.
+static void make_inode( struct gfs_inode *inode, uint32_t mode, uint32_t nlinks, time_t when )
+{
+    memset( inode, 0, sizeof( struct gfs_inode ) );
+    inode->nlinks = nlinks;
+    inode->mode   = mode;
+    inode->atime  = when;
+    inode->mtime  = when;
+    inode->ctime  = when;
+}
+
+
+//
+// The commands.
+//
+
+static int mkfs_command( int fd, char **args )
+{
+    if( !format_partition( fd, scrub_option ) ) return fail( "unable to initialize" );
+    if( source_option != NULL && !populate( fd, source_option ) )
+        return fail( "unable to copy %s", source_option );
+    return 0;
+}
+
+
+static int stat_command( int fd, char **args )
+{
+    struct gfs_inode inode;
+    uint32_t         inode_number;
+
+    if( args[0] == NULL ) {
+        printf( "total_blocks=%u\n", block_count );
+        printf( "block_size=%u\n", BLOCKSIZE );
+        printf( "inodefreemap_blocks=%u\n", freemap_blocksize );
+        printf( "blockfreemap_blocks=%u\n", freemap_blocksize );
+        printf( "inodetable_blocks=%u\n", inodetable_blocksize );
+        return 0;
+    }
+
+    if( !lookup_path( fd, args[0], &inode_number ) ) return fail( "%s not found", args[0] );
+    if( !read_inode( fd, inode_number, &inode ) ) return fail( "can't read inode" );
+    printf( "inode=%u\n", inode_number );
+    printf( "type=%s\n", type_name( inode.mode ) );
+    printf( "mode=%o\n", inode.mode );
+    printf( "nlinks=%u\n", inode.nlinks );
+    printf( "owner_id=%u\n", inode.owner_id );
+    printf( "group_id=%u\n", inode.group_id );
+    printf( "file_size=%u\n", inode.file_size );
+    printf( "atime=%u\n", inode.atime );
+    printf( "mtime=%u\n", inode.mtime );
+    printf( "ctime=%u\n", inode.ctime );
+    printf( "blocks=%u,%u,%u,%u\n",
+            inode.blocks[0], inode.blocks[1], inode.blocks[2], inode.blocks[3] );
+    printf( "first_indirect=%u\n", inode.first_indirect );
+    printf( "second_indirect=%u\n", inode.second_indirect );
+    return 0;
+}
+
+
+// Prints one line for each directory entry: inode, type, size, and name.
+static int list_entry( uint32_t inode_number, const char *name, uint32_t length, void *context )
+{
+    int fd = *(int *)context;
+    struct gfs_inode inode;
+
+    if( read_inode( fd, inode_number, &inode ) ) {
+        printf( "%u\t%s\t%u\t%.*s\n",
+                inode_number, type_name( inode.mode ), inode.file_size, (int)length, name );
+    }
+    else {
+        printf( "%u\t?\t0\t%.*s\n", inode_number, (int)length, name );
+    }
+    return 0;
+}
+
+
+static int ls_command( int fd, char **args )
+{
+    const char *path = ( args[0] == NULL ) ? "/" : args[0];
+    uint32_t    inode_number;
+
+    if( !lookup_path( fd, path, &inode_number ) ) return fail( "%s not found", path );
+    if( !walk_directory( fd, inode_number, list_entry, &fd ) )
+        return fail( "%s is not a directory or is damaged", path );
+    return 0;
+}
+
+
+static int cat_command( int fd, char **args )
+{
+    uint8_t          workspace[BLOCKSIZE];
+    const uint8_t   *data;
+    struct gfs_inode inode;
+    uint32_t         inode_number;
+    uint32_t         remaining;
+    uint32_t         index;
+
+    if( !lookup_path( fd, args[0], &inode_number ) ) return fail( "%s not found", args[0] );
+    if( !read_inode( fd, inode_number, &inode ) ) return fail( "can't read inode" );
+    if( S_ISDIR( inode.mode ) ) return fail( "%s is a directory", args[0] );
+
+    remaining = inode.file_size;
+    for( index = 0; remaining > 0; ++index ) {
+        uint32_t block  = file_block( fd, &inode, index );
+        uint32_t amount = ( remaining < BLOCKSIZE ) ? remaining : BLOCKSIZE;
+
+        // Missing blocks read as zeros.
+        if( block == 0 ) {
+            memset( workspace, 0, BLOCKSIZE );
+            data = workspace;
+        }
+        else if( ( data = image_block( fd, block, workspace ) ) == NULL ) {
+            return fail( "can't read block %u", block );
+        }
+        if( fwrite( data, 1, amount, stdout ) != amount ) return fail( "write error" );
+        remaining -= amount;
+    }
+    return 0;
+}
+
+
+static int put_command( int fd, char **args )
+{
+    char             name[MAX_NAME_LENGTH + 1];
+    struct stat      file_information;
+    struct gfs_inode inode;
+    uint32_t         parent;
+    uint32_t         inode_number;
+    int              source;
+
+    if( !find_parent( fd, args[1], &parent, name ) ) return fail( "bad path %s", args[1] );
+    if( name_exists( fd, parent, name ) ) return fail( "%s already exists", args[1] );
+
+    source = open( args[0], O_RDONLY );
+    if( source == -1 ) return fail( "can't open %s", args[0] );
+    if( fstat( source, &file_information ) != 0 || !S_ISREG( file_information.st_mode ) ) {
+        close( source );
+        return fail( "%s is not an ordinary file", args[0] );
+    }
+    if( file_information.st_size > UINT32_MAX ) {
+        close( source );
+        return fail( "%s is too large", args[0] );
+    }
+
+    if( ( inode_number = allocate_inode( fd ) ) == 0 ) {
+        close( source );
+        return fail( "no free inodes" );
+    }
+    make_inode( &inode,
+                S_IFREG | ( file_information.st_mode & 07777 ), 1, file_information.st_mtime );
+    if( !store_file( fd, source, NULL, file_information.st_size, &inode ) ) {
+        close( source );
+        return fail( "can't copy %s", args[0] );
+    }
+    close( source );
+
+    if( !write_inode( fd, inode_number, &inode ) ) return fail( "can't write inode" );
+    if( !add_entry( fd, parent, name, inode_number ) ) return fail( "can't add %s", args[1] );
+    return 0;
+}
+
+
+static int mkdir_command( int fd, char **args )
+{
+    uint8_t          workspace[BLOCKSIZE];
+    char             name[MAX_NAME_LENGTH + 1];
+    struct gfs_inode inode;
+    struct gfs_inode parent_inode;
+    uint32_t         parent;
+    uint32_t         inode_number;
+    uint32_t         block;
+
+    if( !find_parent( fd, args[0], &parent, name ) ) return fail( "bad path %s", args[0] );
+    if( name_exists( fd, parent, name ) ) return fail( "%s already exists", args[0] );
+    if( !read_inode( fd, parent, &parent_inode ) ) return fail( "can't read parent inode" );
+
+    if( ( inode_number = allocate_inode( fd ) ) == 0 ) return fail( "no free inodes" );
+    if( ( block = allocate_block( fd ) ) == 0 ) return fail( "no free blocks" );
+
+    // The new directory holds only the "." and ".." entries.
+    memset( workspace, 0, BLOCKSIZE );
+    *( (uint32_t *)( workspace +  0 ) ) = htod32( 10 );
+    *( (uint32_t *)( workspace +  4 ) ) = htod32( inode_number );
+    *( workspace + 8 ) = 1;
+    *( workspace + 9 ) = '.';
+    *( (uint32_t *)( workspace + 10 ) ) = htod32( 0 );
+    *( (uint32_t *)( workspace + 14 ) ) = htod32( parent );
+    *( workspace + 18 ) = 2;
+    *( workspace + 19 ) = '.';
+    *( workspace + 20 ) = '.';
+    lseek( fd, (off_t)block * BLOCKSIZE, SEEK_SET );
+    if( write( fd, workspace, BLOCKSIZE ) != BLOCKSIZE ) return fail( "can't write block" );
+
+    make_inode( &inode, S_IFDIR|S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH, 2, time( NULL ) );
+    inode.file_size = BLOCKSIZE;
+    inode.blocks[0] = block;
+    if( !write_inode( fd, inode_number, &inode ) ) return fail( "can't write inode" );
+    if( !add_entry( fd, parent, name, inode_number ) ) return fail( "can't add %s", args[0] );
+
+    // The new directory is reachable now. Its allocations must be kept even if updating the
+    // parent fails below.
+    flush_freemaps( fd );
+
+    // The new directory's ".." entry is another link to the parent. The parent inode is read
+    // again since adding the entry might have changed its size.
+    if( !read_inode( fd, parent, &parent_inode ) ) return fail( "can't read parent inode" );
+    parent_inode.nlinks += 1;
+    if( !write_inode( fd, parent, &parent_inode ) ) return fail( "can't write parent inode" );
+    return 0;
+}
+
+
+static int fsck_command( int fd, char **args )
+{
+    int problems = check_file_system( fd );
+
+    if( problems < 0 ) return fail( "unable to check" );
+    printf( "problems=%d\n", problems );
+    return ( problems == 0 ) ? 0 : 1;
+}
+
+
+// Prints each run of allocated entries as its first entry number and its length.
+static int dump_freemap_command( int fd, char **args )
+{
+    uint8_t *map;
+    uint32_t start;
+    uint32_t i;
+    uint32_t run_start  = 0;
+    uint32_t run_length = 0;
+
+    if( strcmp( args[0], "inode" ) == 0 )
+        start = 1;
+    else if( strcmp( args[0], "block" ) == 0 )
+        start = 1 + freemap_blocksize;
+    else
+        return fail( "expected 'inode' or 'block', not '%s'", args[0] );
+
+    if( ( map = malloc( freemap_blocksize * BLOCKSIZE ) ) == NULL )
+        return fail( "out of memory" );
+    lseek( fd, (off_t)start * BLOCKSIZE, SEEK_SET );
+    if( read( fd, map, freemap_blocksize * BLOCKSIZE ) != freemap_blocksize * BLOCKSIZE ) {
+        free( map );
+        return fail( "can't read the freemap" );
+    }
+
+    for( i = 0; i < block_count; ++i ) {
+        if( map[i / 8] & ( 1 << ( i % 8 ) ) ) {
+            if( run_length == 0 ) run_start = i;
+            ++run_length;
+        }
+        else if( run_length != 0 ) {
+            printf( "%u\t%u\n", run_start, run_length );
+            run_length = 0;
+        }
+    }
+    if( run_length != 0 ) printf( "%u\t%u\n", run_start, run_length );
+    free( map );
+    return 0;
+}
+
+
+static const struct command commands[] = {
+    { "mkfs",         "+sd:", 0, 1, 1, mkfs_command,
+      "mkfs [-s] [-d directory] partition [blocks]" },
+    { "stat",         "+",  0, 1, 0, stat_command,  "stat partition [path]" },
+    { "ls",           "+",  0, 1, 0, ls_command,    "ls partition [path]" },
+    { "cat",          "+",  1, 1, 0, cat_command,   "cat partition path" },
+    { "put",          "+",  2, 2, 1, put_command,   "put partition host-file path" },
+    { "mkdir",        "+",  1, 1, 1, mkdir_command, "mkdir partition path" },
+    { "fsck",         "+",  0, 0, 0, fsck_command,  "fsck partition" },
+    { "dump-freemap", "+",  1, 1, 0, dump_freemap_command,
+      "dump-freemap partition inode|block" },
+    { NULL,           NULL, 0, 0, 0, NULL,          NULL }
+};
+
+
+static const struct command *find_command( const char *name )
+{
+    const struct command *p;
+
+    for( p = commands; p->name != NULL; ++p ) {
+        if( strcmp( p->name, name ) == 0 ) return p;
+    }
+    return NULL;
+}
+
+
+//! Checks if a name is the name of a command.
+int is_command( const char *name )
+{
+    return find_command( name ) != NULL;
+}
+
+
+//! Runs a command given on the command line.
+/*!
+ * \param argc The number of arguments, including the command name.
+ * \param argv The command name followed by the partition name and the command's arguments.
+ * The array is terminated by a NULL pointer.
+ * \return The program's exit status.
+ */
+int run_command( int argc, char **argv )
+{
+    const struct command *command = find_command( argv[0] );
+    uint8_t workspace[BLOCKSIZE];
+    const struct gfs_super_block *my_super;
+    int fd;
+    int option;
+    int status;
+
+    batch_mode   = 1;
+    command_name = command->name;
+
+    // Options come between the command name and the partition name.
+    while( ( option = getopt( argc, argv, command->options ) ) != -1 ) {
+        switch( option ) {
+        case 's':
+            scrub_option = 1;
+            break;
+        case 'd':
+            source_option = optarg;
+            break;
+        default:
+            fprintf( stderr, "Usage: disktool %s\n", command->usage );
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if( argc - 2 < command->min_args || argc - 2 > command->max_args ) {
+        fprintf( stderr, "Usage: disktool %s\n", command->usage );
+        return 1;
+    }
+
+    // Making a file system on an image file can also create the file.
+    if( command->function == mkfs_command && argc == 3 ) {
+        off_t blocks = strtoul( argv[2], NULL, 10 );
+
+        if( blocks == 0 ) return fail( "bad block count %s", argv[2] );
+        fd = open( argv[1], O_RDWR | O_CREAT, 0644 );
+        if( fd == -1 ) return fail( "can't open %s", argv[1] );
+        if( ftruncate( fd, blocks * BLOCKSIZE ) != 0 ) {
+            close( fd );
+            return fail( "can't set the size of %s", argv[1] );
+        }
+    }
+    else {
+        fd = open( argv[1], command->writes ? O_RDWR : O_RDONLY );
+        if( fd == -1 ) return fail( "can't open %s", argv[1] );
+    }
+
+    if( !set_sizes( fd ) ) {
+        close( fd );
+        return fail( "can't figure out partition size" );
+    }
+    map_image( fd );
+
+    // Everything except mkfs needs an existing file system that matches the partition.
+    if( command->function != mkfs_command ) {
+        my_super = image_super( fd, workspace );
+        if( my_super == NULL || my_super->magic_number != 0xDEADBEEF ) {
+            unmap_image( );
+            close( fd );
+            return fail( "%s does not have a valid GenericFS signature", argv[1] );
+        }
+        if( my_super->total_blocks != block_count ) {
+            status = fail( "%s has %u blocks but its superblock says %u",
+                           argv[1], block_count, my_super->total_blocks );
+            unmap_image( );
+            close( fd );
+            return status;
+        }
+    }
+
+    // A command that fails leaves nothing on the disk that refers to what it allocated, so
+    // its allocations are dropped rather than written. Where that isn't so the freemaps are
+    // flushed as soon as the disk refers to the allocations (see mkdir_command( ) and
+    // add_entry( )).
+    status = command->function( fd, argv + 2 );
+    if( status == 0 ) flush_freemaps( fd );
+    else discard_freemaps( );
+    unmap_image( );
+    if( close( fd ) != 0 && status == 0 ) status = fail( "error closing %s", argv[1] );
+    return status;
+}
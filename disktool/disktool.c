@@ -5,6 +5,9 @@
  * \brief This program can be used to manually create a generic file system on a partition and
  * for inspecting GenericFS data structures. It is useful for testing the GenericFS kernel
  * module.
+ *
+ * The program can also be run from scripts by giving a command name before the partition name
+ * (see commands.c). The interactive menu is used when only a partition name is given.
  */
 
 #include <ctype.h>
@@ -13,31 +16,11 @@
 
 #include <curses.h>
 #include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/mount.h>
 #include <sys/types.h>
-#include <sys/stat.h>
 #include <unistd.h>
 
 #include "tool.h"
 
-static void compute_sizes(long block_count)
-{
-    // Assume one inode for every 4 KBytes of disk space. Thus, inode count and block count are
-    // the same. This causes the block free map and the inode free map to be the same size. The
-    // code below assumes disk inodes are 64 bytes in size. That amount is hard coded.
-    //
-    freemap_bytesize = block_count / 8;
-    if( block_count % 8 != 0 ) ++freemap_bytesize;
-    freemap_blocksize = freemap_bytesize / BLOCKSIZE;
-    if( freemap_bytesize % BLOCKSIZE != 0 ) ++freemap_blocksize;
-
-    inodetable_bytesize = block_count * 64;
-    inodetable_blocksize = inodetable_bytesize / BLOCKSIZE;
-    if( inodetable_bytesize % BLOCKSIZE != 0 ) ++inodetable_blocksize;
-}
-
-
 static int menu( void )
 {
     // Define the menu.
@@ -104,12 +87,15 @@ static int menu( void )
 
 static void show_super( int fd )
 {
-    unsigned char workspace[BLOCKSIZE];
-    struct gfs_super_block *my_super = (struct gfs_super_block *)workspace;
+    uint8_t workspace[BLOCKSIZE];
+    const struct gfs_super_block *my_super = image_super( fd, workspace );
 
     clear( );
-    lseek( fd, 0, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
+    if( my_super == NULL ) {
+        mvprintw( 2, 1, "Unable to read the superblock" );
+        CONTINUE_MESSAGE;
+        return;
+    }
 
     mvprintw( 2, 1, "Magic Number:       0x%X", my_super->magic_number );
     mvprintw( 3, 1, "Total Blocks:       %d"  , my_super->total_blocks );
@@ -139,9 +125,7 @@ static int check_super( int fd )
 int main( int argc, char **argv )
 {
     int     fd;           // File descriptor of open device file.
-    long    size;         // Size of partition in sectors.
     int     choice;       // Item selected from menu.
-    struct stat file_information;  // Used when finding partition size.
 
     // The jump table contains a function for each menu option.
     static void ( *jump_table[] )( int ) = {
@@ -159,6 +143,11 @@ int main( int argc, char **argv )
         verify_file_system
     };
 
+    // Commands given on the command line don't use the menu.
+    if( argc > 1 && is_command( argv[1] ) ) {
+        return run_command( argc - 1, argv + 1 );
+    }
+
     printf( "GenericFS Disk Tool, v0.2, Compiled: %s at %s\n\n", __DATE__, __TIME__ );
 
     // Make sure I got the parameter I want.
@@ -184,20 +173,12 @@ int main( int argc, char **argv )
         while( getchar( ) != '\n' ) /* null */ ;
     }
 
-    // Determine the partition size in blocks.
-    if( ioctl( fd, BLKGETSIZE, &size ) >= 0 ) {
-        block_count = size / ( BLOCKSIZE / 512 );
-    }
-    else if( fstat( fd, &file_information ) == 0 ) {
-        block_count = file_information.st_size / BLOCKSIZE;
-    }
-    else {
+    // Determine the partition size in blocks and figure out how big things are.
+    if( !set_sizes( fd ) ) {
         printf( "Can't figure out partition size!\n" );
         return 1;
     }
-
-    // Figure out how big things are.
-    compute_sizes( block_count );
+    map_image( fd );
 
     // Initialize curses.
     initscr( ); cbreak( ); noecho( ); nonl( );
@@ -207,12 +188,14 @@ int main( int argc, char **argv )
         choice = menu( );
         if( choice == 0 ) break;
         jump_table[choice]( fd );
+        flush_freemaps( fd );
     }
 
     // Clean up curses.
     endwin( );
 
     // Close the file.
+    unmap_image( );
     close( fd );
     return 0;
 }
@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# FILE   : fsck-tests.sh
+# SUBJECT: Checks that disktool fsck reports each kind of damage once.
+#
+# An image is built from a small host directory holding, among other things, a 6,000,000 byte
+# file (it needs a second indirection block). Each case below copies the image, damages the
+# copy in one place and compares the number of problems fsck finds with the number expected.
+# Run it from this directory after building disktool (or use "make check").
+#
+
+DISKTOOL=${DISKTOOL:-./disktool}
+BLOCKS=20000
+WORK=$(mktemp -d) || exit 1
+FAILED=0
+
+trap 'rm -rf "$WORK"' EXIT
+
+# Writes a 32 bit little endian value into an image: put32 image offset value
+put32() {
+    printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+        $(( $3 & 255 )) $(( $3 >> 8 & 255 )) $(( $3 >> 16 & 255 )) $(( $3 >> 24 & 255 )))" |
+        dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# Prints one field of "disktool stat": field image [path]
+field() {
+    name=$1
+    shift
+    $DISKTOOL stat "$@" | sed -n "s/^$name=//p"
+}
+
+# Runs fsck on an image and compares the problem count: check name image expected
+check() {
+    found=$($DISKTOOL fsck "$2" | sed -n 's/^problems=//p')
+    if [ "$found" = "$3" ]; then
+        echo "PASS: $1"
+    else
+        echo "FAIL: $1 (expected $3 problems, found ${found:-none})"
+        $DISKTOOL fsck "$2" | head -20
+        FAILED=1
+    fi
+}
+
+# Build the image.
+mkdir -p "$WORK/source/docs"
+yes "The quick brown fox jumps over the lazy dog." | head -c 6000000 > "$WORK/source/big"
+for i in 1 2 3 4 5 6 7 8; do
+    yes "File $i." | head -c $(( i * 9000 )) > "$WORK/source/docs/file$i"
+done
+$DISKTOOL mkfs -d "$WORK/source" "$WORK/clean" $BLOCKS > /dev/null || exit 1
+
+INODE_TABLE=$(( ( 1 + 2 * $(field inodefreemap_blocks "$WORK/clean") ) * 4096 ))
+BIG=$(( INODE_TABLE + $(field inode "$WORK/clean" /big) * 64 ))
+FIRST=$(field first_indirect "$WORK/clean" /big)
+SECOND=$(field second_indirect "$WORK/clean" /big)
+
+check "clean image" "$WORK/clean" 0
+
+# One entry of the first indirection block is out of range.
+cp "$WORK/clean" "$WORK/image"
+put32 "$WORK/image" $(( FIRST * 4096 + 5 * 4 )) 4294967040
+check "bad indirect entry" "$WORK/image" 1
+
+# The second indirection block is full of block numbers that are in range but meaningless.
+cp "$WORK/clean" "$WORK/image"
+printf "$(awk -v blocks=$BLOCKS 'BEGIN {
+    seed = 12345
+    for( i = 0; i < 1024; ++i ) {
+        seed = ( seed * 1103515245 + 12345 ) % 2147483648
+        value = blocks / 2 + seed % ( blocks / 2 )
+        for( j = 0; j < 4; ++j ) {
+            printf "\\%03o", value % 256
+            value = int( value / 256 )
+        }
+    }
+}')" | dd of="$WORK/image" bs=4096 seek="$SECOND" conv=notrunc 2>/dev/null
+check "garbage second indirect block" "$WORK/image" 1
+
+# The inode's first indirect pointer is out of range.
+cp "$WORK/clean" "$WORK/image"
+put32 "$WORK/image" $(( BIG + 48 )) 4294967040
+check "bad first_indirect" "$WORK/image" 1
+
+# The file's size is far too small for its blocks.
+cp "$WORK/clean" "$WORK/image"
+put32 "$WORK/image" $(( BIG + 16 )) 5000
+check "short file size" "$WORK/image" 1
+
+# The root directory's size is garbage. The damaged directory is reported, and so (once, as a
+# count) are the inodes that can't be reached without it.
+cp "$WORK/clean" "$WORK/image"
+put32 "$WORK/image" $(( INODE_TABLE + 16 )) 2147483647
+check "garbage root directory size" "$WORK/image" 2
+
+exit $FAILED
@@ -0,0 +1,122 @@
+/*!
+ * \file image.c
+ * \author Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * \brief Read access to the partition through a memory map.
+ *
+ * The partition is mapped read only when it is opened. The functions here hand out typed
+ * pointers straight into the mapping so looking at the superblock, an inode or a directory
+ * block costs no system call. Changes are still made with write( ); the mapping is shared with
+ * the page cache so it sees them at once.
+ *
+ * If the partition can't be mapped the same functions read the data into a workspace supplied
+ * by the caller and return a pointer to that instead. Callers never need to know which
+ * happened, but they must not keep a pointer after the workspace goes away.
+ */
+
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tool.h"
+
+static const uint8_t *image;       // The mapped partition (NULL if not mapped).
+static size_t         image_size;  // The size of the mapping in bytes.
+
+
+//! Maps the partition into memory.
+/*!
+ * The partition geometry must already be known (see set_sizes( )). Any previous mapping is
+ * removed first.
+ *
+ * \param fd The handle of the partition file.
+ * \return Non-zero if the partition was mapped. If it wasn't the functions here still work but
+ * read from the file instead.
+ */
+int map_image( int fd )
+{
+    void *address;
+
+    unmap_image( );
+    if( block_count == 0 ) return 0;
+
+    image_size = (size_t)block_count * BLOCKSIZE;
+    address    = mmap( NULL, image_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if( address == MAP_FAILED ) return 0;
+    image = address;
+    return 1;
+}
+
+
+//! Removes the mapping made by map_image( ).
+void unmap_image( void )
+{
+    if( image == NULL ) return;
+    munmap( (void *)image, image_size );
+    image = NULL;
+}
+
+
+//! Gives access to a run of blocks.
+/*!
+ * \param fd The handle of the partition file.
+ * \param first The first block of the run.
+ * \param count The number of blocks in the run.
+ * \param workspace Space for count blocks. Used only if the partition is not mapped.
+ * \return A pointer to the blocks or NULL if they are outside the partition or could not be
+ * read.
+ */
+const uint8_t *image_blocks( int fd, uint32_t first, uint32_t count, uint8_t *workspace )
+{
+    size_t size = (size_t)count * BLOCKSIZE;
+
+    if( first >= block_count || count > block_count - first ) return NULL;
+    if( image != NULL ) return image + (size_t)first * BLOCKSIZE;
+
+    if( pread( fd, workspace, size, (off_t)first * BLOCKSIZE ) != (ssize_t)size ) return NULL;
+    return workspace;
+}
+
+
+//! Gives access to one block. See image_blocks( ).
+const uint8_t *image_block( int fd, uint32_t block_number, uint8_t *workspace )
+{
+    return image_blocks( fd, block_number, 1, workspace );
+}
+
+
+//! Gives access to the superblock.
+/*!
+ * \param fd The handle of the partition file.
+ * \param workspace Space for one block. Used only if the partition is not mapped.
+ * \return A pointer to the superblock or NULL if it could not be read.
+ */
+const struct gfs_super_block *image_super( int fd, uint8_t *workspace )
+{
+    return (const struct gfs_super_block *)image_block( fd, 0, workspace );
+}
+
+
+//! Gives access to an inode in the inode table.
+/*!
+ * \param fd The handle of the partition file.
+ * \param inode_number The inode wanted.
+ * \param workspace Space for one inode. Used only if the partition is not mapped.
+ * \return A pointer to the inode or NULL if the inode number is out of range or the inode could
+ * not be read.
+ */
+const struct gfs_inode *image_inode(
+    int fd, uint32_t inode_number, struct gfs_inode *workspace )
+{
+    off_t position;
+
+    if( inode_number >= block_count ) return NULL;
+    position = (off_t)( 1 + 2 * freemap_blocksize ) * BLOCKSIZE +
+               (off_t)inode_number * sizeof( struct gfs_inode );
+    if( image != NULL ) return (const struct gfs_inode *)( image + position );
+
+    if( pread( fd, workspace, sizeof( struct gfs_inode ), position ) !=
+        sizeof( struct gfs_inode ) ) return NULL;
+    return workspace;
+}
@@ -3,19 +3,93 @@
  * \author Peter Chapin <spicacality@kelseymountain.org>
  *
  * \brief Functions that initialize a partition with GenericFS.
+ *
+ * Normally only the file system structures are written. The inode table is zeroed and the rest
+ * of the partition is discarded, using the partition's own facilities for this where possible
+ * (punching a hole in an image file or asking a block device to zero or discard a range). That
+ * way initialization takes about the same time no matter how large the partition is. The whole
+ * partition can also be scrubbed, as was always done in the past.
  */
 
-#include <stdlib.h>
+#define _GNU_SOURCE  // For fallocate.
+
+#include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 
 #include <curses.h>
-#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "tool.h"
 
 #define UNUSED_SPACE 0x55
+#define FILL_BLOCKS  256   // Number of blocks written at once when filling a region.
+
+// Shows how far the initialization has progressed. Nothing is shown in batch mode.
+static void progress( int row, const char *message )
+{
+    if( !batch_mode ) {
+        mvaddstr( row, 1, message );
+        refresh( );
+    }
+}
+
+
+// Writes count blocks starting at the given block, all filled with the given byte value.
+static int fill_blocks( int fd, uint32_t first, uint32_t count, int value )
+{
+    static unsigned char workspace[FILL_BLOCKS * BLOCKSIZE];
+
+    memset( workspace, value, sizeof( workspace ) );
+    lseek( fd, (off_t)first * BLOCKSIZE, SEEK_SET );
+    while( count > 0 ) {
+        uint32_t amount = ( count < FILL_BLOCKS ) ? count : FILL_BLOCKS;
+
+        if( write( fd, workspace, amount * BLOCKSIZE ) != amount * BLOCKSIZE ) return 0;
+        count -= amount;
+    }
+    return 1;
+}
+
+
+// Makes a range of blocks read as zeros without writing them, if the partition can do that.
+// Returns zero if it can't.
+//
+static int zero_blocks( int fd, uint32_t first, uint32_t count )
+{
+    off_t    start  = (off_t)first * BLOCKSIZE;
+    off_t    length = (off_t)count * BLOCKSIZE;
+    uint64_t range[2];
+
+    if( fallocate( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, length ) == 0 )
+        return 1;
+    range[0] = start;
+    range[1] = length;
+    return ioctl( fd, BLKZEROOUT, range ) == 0;
+}
+
+
+// Tells the partition that a range of blocks holds nothing of value. What the blocks contain
+// afterward depends on the partition. This is only a hint so failure is ignored.
+//
+static void discard_blocks( int fd, uint32_t first, uint32_t count )
+{
+    off_t    start  = (off_t)first * BLOCKSIZE;
+    off_t    length = (off_t)count * BLOCKSIZE;
+    uint64_t range[2];
+
+    if( fallocate( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, length ) == 0 )
+        return;
+    range[0] = start;
+    range[1] = length;
+    ioctl( fd, BLKDISCARD, range );
+}
+
 
 /*! Erase every byte on the partition.
  *
@@ -26,72 +100,63 @@
  * testing purposes. Any left over data on a partition from earlier tests is thrown away when
  * the partition is re-initialized.
  */
-static void clear_partition( int fd )
+static int clear_partition( int fd )
 {
-    int i;
-    unsigned char workspace[BLOCKSIZE];
+    progress( 1, "Clearing partition..." );
+    return fill_blocks( fd, 0, block_count, UNUSED_SPACE );
+}
 
-    mvaddstr( 1, 1, "Clearing partition..." ); refresh( );
 
-    lseek( fd, 0, SEEK_SET );
-    memset( workspace, UNUSED_SPACE, BLOCKSIZE );
-    for( i = 0; i < block_count; ++i ) {
-        write( fd, workspace, BLOCKSIZE );
-    }
+// Zeros the inode table and discards everything after the root directory.
+static int clear_structures( int fd )
+{
+    uint32_t inode_table = 1 + 2*freemap_blocksize;
+    uint32_t data_start  = inode_table + inodetable_blocksize + 1;
+
+    progress( 1, "Clearing inode table..." );
+    if( !zero_blocks( fd, inode_table, inodetable_blocksize ) &&
+        !fill_blocks( fd, inode_table, inodetable_blocksize, 0 ) ) return 0;
+    discard_blocks( fd, data_start, block_count - data_start );
+    return 1;
 }
 
 
-static void write_freemaps( int fd )
+static int write_freemaps( int fd )
 {
-    long i;
-    long total_preallocated;
-    long leftovers;
-    int  mask;
+    uint32_t total_preallocated;
+    uint32_t full_blocks;
     unsigned char workspace[BLOCKSIZE];
 
-    mvaddstr( 2, 1, "Writing free maps..." ); refresh( );
+    progress( 2, "Writing free maps..." );
 
-    // Skip over the super block.
-    lseek( fd, 1*BLOCKSIZE, SEEK_SET );
+    // Zero bits in the free maps mean "not allocated". Start with both maps empty.
+    if( !fill_blocks( fd, 1, 2*freemap_blocksize, 0 ) ) return 0;
 
-    // Zero bits in the free maps mean "not allocated". Set bit zero in the first entry of the
-    // inode freemap to account for the allocation of inode zero to the root directory.
-    // 
+    // Set bit zero in the first entry of the inode freemap to account for the allocation of
+    // inode zero to the root directory.
+    //
     memset( workspace, 0, BLOCKSIZE );
     workspace[0] |= 0x01;
-    write( fd, workspace, BLOCKSIZE );
-    memset( workspace, 0, BLOCKSIZE );
-    for( i = 0; i < freemap_blocksize - 1; ++i ) {
-        write( fd, workspace, BLOCKSIZE );
-    }
+    lseek( fd, 1*BLOCKSIZE, SEEK_SET );
+    if( write( fd, workspace, BLOCKSIZE ) != BLOCKSIZE ) return 0;
 
     // Now set bits in the block freemap to account for the various file system datastructures I
-    // have preallocated.
-    // 
+    // have preallocated. They might need more than one block of the freemap.
+    //
     total_preallocated = 1 + 2*freemap_blocksize + inodetable_blocksize + 1;
     // One for the superblock and one for the root directory.
 
-    // I'm not prepared to deal with the case where the preallocated blocks require more than
-    // one block of free map space.
-    // 
-    if( total_preallocated > BLOCKSIZE * 8 ) {
-        mvaddstr( 2, 1, "There are more preallocated blocks than I can handle!" );
-        CONTINUE_MESSAGE;
-        exit( 1 );
-    }
-    memset( workspace, 0xFF, total_preallocated / 8 );
-    leftovers = total_preallocated % 8;
-    mask = 0x01;
-    while(leftovers > 0 ) {
-        workspace[total_preallocated/8] |= mask;
-        mask <<= 1;
-        --leftovers;
-    }
-    write( fd, workspace, BLOCKSIZE );
+    full_blocks = total_preallocated / ( BLOCKSIZE * 8 );
+    if( !fill_blocks( fd, 1 + freemap_blocksize, full_blocks, 0xFF ) ) return 0;
+    total_preallocated -= full_blocks * BLOCKSIZE * 8;
+    if( total_preallocated == 0 ) return 1;
+
     memset( workspace, 0, BLOCKSIZE );
-    for( i = 0; i < freemap_blocksize - 1; ++i ) {
-        write( fd, workspace, BLOCKSIZE );
-    }
+    memset( workspace, 0xFF, total_preallocated / 8 );
+    if( total_preallocated % 8 != 0 )
+        workspace[total_preallocated / 8] = ( 1 << ( total_preallocated % 8 ) ) - 1;
+    lseek( fd, (off_t)( 1 + freemap_blocksize + full_blocks ) * BLOCKSIZE, SEEK_SET );
+    return write( fd, workspace, BLOCKSIZE ) == BLOCKSIZE;
 }
 
 
@@ -101,7 +166,7 @@ static void create_root( int fd )
     struct gfs_inode *root_node = (struct gfs_inode *)workspace;
     time_t now = time( NULL );
 
-    mvaddstr( 3, 1, "Creating root directory..." ); refresh( );
+    progress( 3, "Creating root directory..." );
 
     // Fill in the root directory's inode;
     memset(workspace, UNUSED_SPACE, BLOCKSIZE);
@@ -125,7 +190,7 @@ static void create_root( int fd )
     // Now write the block containing this inode. (The other inodes in this block are irrelevant
     // since they are all unallocated).
     // 
-    lseek( fd, ( 1 + 2*freemap_blocksize ) * BLOCKSIZE, SEEK_SET );
+    lseek( fd, (off_t)( 1 + 2*freemap_blocksize ) * BLOCKSIZE, SEEK_SET );
     write( fd, workspace, BLOCKSIZE );
 
 
@@ -142,7 +207,8 @@ static void create_root( int fd )
     *( workspace + 20 ) = '.';
 
     // Now write it out.
-    lseek( fd, ( 1 + 2 * freemap_blocksize + inodetable_blocksize) * BLOCKSIZE, SEEK_SET );
+    lseek( fd,
+           (off_t)( 1 + 2 * freemap_blocksize + inodetable_blocksize ) * BLOCKSIZE, SEEK_SET );
     write( fd, workspace, BLOCKSIZE );
 }
 
@@ -152,7 +218,7 @@ static void write_super( int fd )
     unsigned char workspace[BLOCKSIZE];
     struct gfs_super_block *my_super = (struct gfs_super_block *)workspace;
 
-    mvaddstr( 4, 1, "Writing super block..." ); refresh( );
+    progress( 4, "Writing super block..." );
 
     memset( workspace, UNUSED_SPACE, BLOCKSIZE );
     my_super->magic_number = 0xDEADBEEF;
@@ -167,13 +233,46 @@ static void write_super( int fd )
 }
 
 
+//! Creates an empty GenericFS file system on the partition.
+/*!
+ * The sizes of the file system structures are taken from the global size variables. This
+ * function does not wait for the user so it can be used from the command line as well as from
+ * the menu.
+ *
+ * \param fd An open file handle to the partition.
+ * \param scrub If non-zero every block of the partition is overwritten. Otherwise only the file
+ * system structures are written.
+ * \return Zero if the partition is too small or can't be written; non-zero otherwise.
+ */
+int format_partition( int fd, int scrub )
+{
+    // There must be room for the superblock, the freemaps, the inode table, and the root
+    // directory.
+    //
+    if( 1 + 2*freemap_blocksize + inodetable_blocksize + 1 > block_count ) return 0;
+
+    discard_freemaps( );
+    if( !( scrub ? clear_partition( fd ) : clear_structures( fd ) ) ) return 0;
+    if( !write_freemaps( fd ) ) return 0;
+    create_root( fd );
+    write_super( fd );
+    return 1;
+}
+
+
 void initialize( int fd )
 {
+    int scrub;
+
     clear( );
+    mvaddstr( 1, 1, "Erase every block of the partition (slow)? (y/n) " );
     refresh( );
-    clear_partition( fd );
-    write_freemaps( fd );
-    create_root( fd );
-    write_super( fd );
+    scrub = ( getch( ) == 'y' );
+
+    clear( );
+    refresh( );
+    if( !format_partition( fd, scrub ) ) {
+        mvaddstr( 5, 1, "Unable to initialize the partition!" );
+    }
     CONTINUE_MESSAGE;
 }
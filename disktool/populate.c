@@ -0,0 +1,418 @@
+/*!
+ * \file populate.c
+ * \author Peter Chapin <spicacality@kelseymountain.org>
+ *
+ * \brief Functions that copy files and directory trees from the host into a GenericFS
+ * partition.
+ *
+ * These functions are meant for building images quickly. Each file is given runs of
+ * consecutive blocks and its data is written in large sequential pieces. The block numbers are
+ * collected in memory and each indirection block is written once, when it is complete. A
+ * directory's entries are also built in memory and written in one piece, so nothing is read
+ * back from the partition while it is being populated.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "tool.h"
+
+#define COPY_BLOCKS 256  // Number of blocks copied with each read and write.
+
+// The largest number of blocks a file can have.
+#define MAX_FILE_BLOCKS \
+    ( DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK )
+
+// A directory being built in memory.
+struct directory_image {
+    uint8_t *data;
+    uint32_t size;      // Bytes used so far.
+    uint32_t capacity;  // Bytes allocated (always a multiple of BLOCKSIZE).
+    uint32_t last;      // Offset of the last entry.
+};
+
+
+static void populate_error( const char *message, const char *path )
+{
+    fprintf( stderr, "disktool: %s %s\n", message, path );
+}
+
+
+// Writes an indirection block holding the given block numbers. The rest of the block is zeros.
+// Returns the block used or zero if there are no free blocks.
+//
+static uint32_t write_indirect( int fd, const uint32_t *numbers, uint32_t count )
+{
+    uint32_t pointers[POINTERS_PER_BLOCK];
+    uint32_t block;
+    uint32_t i;
+
+    if( ( block = allocate_block( fd ) ) == 0 ) return 0;
+    memset( pointers, 0, sizeof( pointers ) );
+    for( i = 0; i < count; ++i ) pointers[i] = htod32( numbers[i] );
+    lseek( fd, (off_t)block * BLOCKSIZE, SEEK_SET );
+    if( write( fd, pointers, BLOCKSIZE ) != BLOCKSIZE ) return 0;
+    return block;
+}
+
+
+// Records a file's block numbers in its inode, writing whatever indirection blocks are needed.
+static int store_block_map(
+    int fd, struct gfs_inode *inode, const uint32_t *map, uint32_t count )
+{
+    uint32_t seconds[POINTERS_PER_BLOCK];
+    uint32_t used;
+    uint32_t i;
+
+    for( i = 0; i < DIRECT_BLOCKS && i < count; ++i ) inode->blocks[i] = map[i];
+    if( count <= DIRECT_BLOCKS ) return 1;
+    map   += DIRECT_BLOCKS;
+    count -= DIRECT_BLOCKS;
+
+    used = ( count < POINTERS_PER_BLOCK ) ? count : POINTERS_PER_BLOCK;
+    if( ( inode->first_indirect = write_indirect( fd, map, used ) ) == 0 ) return 0;
+    if( count == used ) return 1;
+    map   += used;
+    count -= used;
+
+    for( i = 0; count > 0; ++i ) {
+        used = ( count < POINTERS_PER_BLOCK ) ? count : POINTERS_PER_BLOCK;
+        if( ( seconds[i] = write_indirect( fd, map, used ) ) == 0 ) return 0;
+        map   += used;
+        count -= used;
+    }
+    return ( inode->second_indirect = write_indirect( fd, seconds, i ) ) != 0;
+}
+
+
+// Allocates count blocks in as few runs as possible, storing the block numbers in map. Each
+// time a run of the size wanted can't be found, a run half as large is tried.
+//
+static int allocate_runs( int fd, uint32_t *map, uint32_t count )
+{
+    uint32_t want = count;
+
+    while( count > 0 ) {
+        uint32_t first;
+        uint32_t i;
+
+        if( want > count ) want = count;
+        while( ( first = allocate_extent( fd, want ) ) == 0 ) {
+            if( want == 1 ) return 0;
+            want /= 2;
+        }
+        for( i = 0; i < want; ++i ) *map++ = first + i;
+        count -= want;
+    }
+    return 1;
+}
+
+
+// Does the work of store_file. If first is not zero it is used as the file's first block
+// instead of allocating a new one.
+//
+static int store_data(
+    int               fd,
+    int               source,
+    const uint8_t    *data,
+    uint32_t          size,
+    struct gfs_inode *inode,
+    uint32_t          first )
+{
+    static uint8_t buffer[COPY_BLOCKS * BLOCKSIZE];
+    uint32_t  count = size / BLOCKSIZE + ( size % BLOCKSIZE != 0 );
+    uint32_t *map;
+    uint32_t  done = 0;
+    int       result = 0;
+
+    inode->file_size = size;
+    if( count == 0 ) return 1;
+    if( count > MAX_FILE_BLOCKS ) return 0;
+    if( ( map = malloc( count * sizeof( uint32_t ) ) ) == NULL ) return 0;
+    if( first != 0 ) {
+        map[done++] = first;
+    }
+    if( !allocate_runs( fd, map + done, count - done ) ) goto finished;
+    done = 0;
+
+    // Copy as many consecutive blocks as possible with each write.
+    while( done < count ) {
+        uint32_t run = 1;
+        uint32_t bytes;
+
+        while( done + run < count && run < COPY_BLOCKS && map[done + run] == map[done] + run )
+            ++run;
+        bytes = ( done + run == count ) ? size - done * BLOCKSIZE : run * BLOCKSIZE;
+
+        if( source == -1 ) {
+            memcpy( buffer, data + (size_t)done * BLOCKSIZE, bytes );
+        }
+        else if( read( source, buffer, bytes ) != bytes ) {
+            goto finished;
+        }
+        memset( buffer + bytes, 0, run * BLOCKSIZE - bytes );
+        lseek( fd, (off_t)map[done] * BLOCKSIZE, SEEK_SET );
+        if( write( fd, buffer, run * BLOCKSIZE ) != run * BLOCKSIZE ) goto finished;
+        done += run;
+    }
+    result = store_block_map( fd, inode, map, count );
+
+ finished:
+    free( map );
+    return result;
+}
+
+
+//! Copies data into a new file.
+/*!
+ * The file's blocks are allocated, the data is written, and the inode's block numbers and size
+ * are filled in. The inode itself is not written. The source can be an open host file or, if
+ * it is -1, data can come from memory instead.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param source An open file handle to the data or -1.
+ * \param data The data to use if source is -1.
+ * \param size The number of bytes to copy.
+ * \param inode The new file's inode. Its block numbers must be zero.
+ * \return Zero if the data could not be read or there is not enough room; non-zero otherwise.
+ */
+int store_file(
+    int fd, int source, const uint8_t *data, uint32_t size, struct gfs_inode *inode )
+{
+    return store_data( fd, source, data, size, inode, 0 );
+}
+
+
+// Fills in a new inode from information about a host file.
+static void make_inode( struct gfs_inode *inode, const struct stat *information, uint32_t type )
+{
+    memset( inode, 0, sizeof( struct gfs_inode ) );
+    inode->nlinks   = 1;
+    inode->owner_id = information->st_uid;
+    inode->group_id = information->st_gid;
+    inode->mode     = type | ( information->st_mode & 07777 );
+    inode->atime    = information->st_atime;
+    inode->mtime    = information->st_mtime;
+    inode->ctime    = information->st_ctime;
+}
+
+
+// Adds an entry to a directory being built. Entries never cross a block boundary.
+static int append_entry( struct directory_image *image, const char *name, uint32_t inode )
+{
+    uint32_t length   = strlen( name );
+    uint32_t record   = 9 + length;
+    uint32_t position = image->size;
+
+    if( position / BLOCKSIZE != ( position + record - 1 ) / BLOCKSIZE )
+        position = ( position / BLOCKSIZE + 1 ) * BLOCKSIZE;
+
+    if( position + record > image->capacity ) {
+        uint32_t capacity = ( image->capacity == 0 ) ? BLOCKSIZE : 2 * image->capacity;
+        uint8_t *data     = realloc( image->data, capacity );
+
+        if( data == NULL ) return 0;
+        memset( data + image->capacity, 0, capacity - image->capacity );
+        image->data     = data;
+        image->capacity = capacity;
+    }
+
+    if( position != 0 ) *(uint32_t *)( image->data + image->last ) = htod32( position );
+    *(uint32_t *)( image->data + position + 0 ) = htod32( 0 );
+    *(uint32_t *)( image->data + position + 4 ) = htod32( inode );
+    image->data[position + 8] = (uint8_t)length;
+    memcpy( image->data + position + 9, name, length );
+    image->last = position;
+    image->size = position + record;
+    return 1;
+}
+
+
+static int compare_names( const void *left, const void *right )
+{
+    return strcmp( *(char * const *)left, *(char * const *)right );
+}
+
+
+// Reads the names in a host directory, other than "." and "..", sorted so that images are
+// built the same way every time. Returns NULL if the directory can't be read.
+//
+static char **read_names( const char *path, uint32_t *count )
+{
+    DIR           *directory = opendir( path );
+    struct dirent *entry;
+    char         **names    = NULL;
+    uint32_t       capacity = 0;
+
+    *count = 0;
+    if( directory == NULL ) return NULL;
+    while( ( entry = readdir( directory ) ) != NULL ) {
+        if( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 ) continue;
+        if( *count == capacity ) {
+            char **bigger;
+
+            capacity = ( capacity == 0 ) ? 64 : 2 * capacity;
+            if( ( bigger = realloc( names, capacity * sizeof( char * ) ) ) == NULL ) break;
+            names = bigger;
+        }
+        if( ( names[*count] = strdup( entry->d_name ) ) == NULL ) break;
+        ++*count;
+    }
+    closedir( directory );
+    if( entry != NULL ) {
+        while( *count > 0 ) free( names[--*count] );
+        free( names );
+        return NULL;
+    }
+    if( names == NULL ) names = malloc( sizeof( char * ) );
+    qsort( names, *count, sizeof( char * ), compare_names );
+    return names;
+}
+
+
+static int copy_tree( int fd, const char *path, uint32_t inode_number, uint32_t parent );
+
+// Copies one entry of a host directory. Its inode number is returned through inode_number.
+// Entries that are neither files nor directories are skipped; zero is returned for them.
+//
+static int copy_entry(
+    int fd, const char *path, uint32_t parent, uint32_t *inode_number, int *is_directory )
+{
+    struct stat      information;
+    struct gfs_inode inode;
+    int              source;
+    int              result;
+
+    *inode_number = 0;
+    *is_directory = 0;
+    if( lstat( path, &information ) != 0 ) {
+        populate_error( "can't examine", path );
+        return 0;
+    }
+
+    if( S_ISDIR( information.st_mode ) ) {
+        if( ( *inode_number = allocate_inode( fd ) ) == 0 ) {
+            populate_error( "no free inodes for", path );
+            return 0;
+        }
+        *is_directory = 1;
+        return copy_tree( fd, path, *inode_number, parent );
+    }
+
+    if( !S_ISREG( information.st_mode ) ) {
+        populate_error( "skipping", path );
+        return 1;
+    }
+    if( information.st_size > UINT32_MAX ) {
+        populate_error( "too large:", path );
+        return 0;
+    }
+    if( ( source = open( path, O_RDONLY ) ) == -1 ) {
+        populate_error( "can't open", path );
+        return 0;
+    }
+    if( ( *inode_number = allocate_inode( fd ) ) == 0 ) {
+        close( source );
+        populate_error( "no free inodes for", path );
+        return 0;
+    }
+    make_inode( &inode, &information, S_IFREG );
+    result = store_file( fd, source, NULL, information.st_size, &inode );
+    close( source );
+    if( !result ) {
+        populate_error( "can't copy", path );
+        return 0;
+    }
+    return write_inode( fd, *inode_number, &inode );
+}
+
+
+// Copies the contents of a host directory into the GenericFS directory with the given inode
+// number, creating the inode. The root directory already has its first block; any other
+// directory gets new blocks.
+//
+static int copy_tree( int fd, const char *path, uint32_t inode_number, uint32_t parent )
+{
+    struct stat            information;
+    struct gfs_inode       inode;
+    struct directory_image image;
+    char                 **names;
+    uint32_t               count;
+    uint32_t               subdirectories = 0;
+    uint32_t               size;
+    uint32_t               first;
+    uint32_t               i;
+    int                    result = 0;
+
+    if( stat( path, &information ) != 0 || ( names = read_names( path, &count ) ) == NULL ) {
+        populate_error( "can't read directory", path );
+        return 0;
+    }
+
+    memset( &image, 0, sizeof( image ) );
+    if( !append_entry( &image, ".", inode_number ) ||
+        !append_entry( &image, "..", parent ) ) goto finished;
+
+    for( i = 0; i < count; ++i ) {
+        char    *child = malloc( strlen( path ) + strlen( names[i] ) + 2 );
+        uint32_t child_inode;
+        int      is_directory;
+        int      copied;
+
+        if( child == NULL ) goto finished;
+        sprintf( child, "%s/%s", path, names[i] );
+        if( strlen( names[i] ) > MAX_NAME_LENGTH ) {
+            populate_error( "name too long:", child );
+            free( child );
+            goto finished;
+        }
+        copied = copy_entry( fd, child, inode_number, &child_inode, &is_directory );
+        free( child );
+        if( !copied ) goto finished;
+        if( child_inode == 0 ) continue;
+        if( is_directory ) ++subdirectories;
+        if( !append_entry( &image, names[i], child_inode ) ) goto finished;
+    }
+
+    // Write the directory in whole blocks. The root directory's first block is reused.
+    size = ( image.size + BLOCKSIZE - 1 ) / BLOCKSIZE * BLOCKSIZE;
+    first = 0;
+    if( inode_number == 0 ) {
+        if( !read_inode( fd, 0, &inode ) ) goto finished;
+        first = inode.blocks[0];
+    }
+    make_inode( &inode, &information, S_IFDIR );
+    if( !store_data( fd, -1, image.data, size, &inode, first ) ) goto finished;
+    inode.nlinks = 2 + subdirectories;
+    result = write_inode( fd, inode_number, &inode );
+
+ finished:
+    if( !result ) populate_error( "can't build directory", path );
+    for( i = 0; i < count; ++i ) free( names[i] );
+    free( names );
+    free( image.data );
+    return result;
+}
+
+
+//! Copies a host directory tree into the root directory of a newly initialized partition.
+/*!
+ * Ordinary files and directories are copied along with their permissions, owners, and times.
+ * Other kinds of files are skipped with a warning. Problems are reported on the standard
+ * error.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param path The host directory to copy.
+ * \return Zero if the tree could not be copied; non-zero otherwise.
+ */
+int populate( int fd, const char *path )
+{
+    return copy_tree( fd, path, 0, 0 );
+}
@@ -21,7 +21,8 @@
 
 void show_block( int fd )
 {
-    unsigned char workspace[BLOCKSIZE];
+    uint8_t workspace[BLOCKSIZE];
+    const uint8_t *data;   // The block being displayed.
     unsigned int choice;   // The block number to display.
     unsigned int offset;   // Offset into the block.
     unsigned int line_offset;  // Offset into the current line.
@@ -31,12 +32,9 @@ void show_block( int fd )
 
     clear( );
   
-    struct gfs_super_block *my_super = (struct gfs_super_block *)workspace;
+    const struct gfs_super_block *my_super = image_super( fd, workspace );
 
-    lseek( fd, 0, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
-
-    total = my_super->total_blocks;
+    total = ( my_super != NULL ) ? my_super->total_blocks : block_count;
     printables[16] = '\0';   // Be sure this array is null terminated.
 
     // Ask the user for a block number.
@@ -51,9 +49,13 @@ void show_block( int fd )
         CONTINUE_MESSAGE;
     }
 
-    // Read the block in question.
-    lseek( fd, choice * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
+    // Get the block in question.
+    data = image_block( fd, choice, workspace );
+    if( data == NULL ) {
+        mvprintw( 1, 1, "Error: Unable to read block %u\n", choice );
+        CONTINUE_MESSAGE;
+        return;
+    }
     
     // Loop over the entire block, printing bytes as we go.
     for( offset = 0; offset < BLOCKSIZE; offset += 16 ) {
@@ -76,8 +78,8 @@ void show_block( int fd )
         for( line_offset = 0; line_offset < 16; line_offset++ ) {
 
             // Put the printable version of this byte into the printables array.
-            if( isprint( workspace[offset + line_offset] ) ) {
-                printables[line_offset] = workspace[offset + line_offset];
+            if( isprint( data[offset + line_offset] ) ) {
+                printables[line_offset] = data[offset + line_offset];
             }
             else {
                 printables[line_offset] = '.';
@@ -85,7 +87,7 @@ void show_block( int fd )
 
             // Display the hex version of the bytes.
             if( line_offset % 8 == 0 ) printw( " " );
-            printw( "%02X ", (unsigned char)workspace[offset + line_offset] );
+            printw( "%02X ", (unsigned char)data[offset + line_offset] );
         }
 
         // Display the ASCII version of the bytes.
@@ -15,43 +15,31 @@
 
 void show_inode( int fd )
 {
-    unsigned char workspace[BLOCKSIZE];
-    int choice;
-    int blocknum;
-    int offset;
-    int total;
-    int freemap_size;
+    uint8_t workspace[BLOCKSIZE];
+    struct gfs_inode inode_workspace;
+    unsigned int choice;
+    unsigned int total;
     time_t temptime;
 
     clear( );
   
-    struct gfs_inode *my_inode;
-    struct gfs_super_block *my_super = (struct gfs_super_block *)workspace;
+    const struct gfs_inode *my_inode;
+    const struct gfs_super_block *my_super = image_super( fd, workspace );
 
-    lseek( fd, 0, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );  
-
-    total = my_super->total_blocks;
-    freemap_size = my_super->inodefreemap_blocks;
+    total = ( my_super != NULL ) ? my_super->total_blocks : block_count;
   
-    mvprintw( 1, 1, "Enter inode (0 - %d): ", total - 1 );
-    echo( ); scanw( "%d", &choice ); noecho( );
+    mvprintw( 1, 1, "Enter inode (0 - %u): ", total - 1 );
+    echo( ); scanw( "%u", &choice ); noecho( );
 
     clear( );
 
-    blocknum = choice / sizeof( struct gfs_inode );
-    offset = ( choice % sizeof( struct gfs_inode ) ) * sizeof( struct gfs_inode );
-  
-    // Add 1 for the superblock and 2 times the freemap size (one freemap for the inodes and one
-    // for the blocks).
-    // 
-    blocknum = blocknum + 1 + ( freemap_size * 2 );
-    // printf( "\n%d, %d\n", blocknum, offset );
-
-    lseek( fd, blocknum * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
-
-    my_inode = (struct gfs_inode *)( workspace + offset );
+    // The inode is located from the partition geometry found by set_sizes( ).
+    my_inode = image_inode( fd, choice, &inode_workspace );
+    if( my_inode == NULL ) {
+        mvprintw( 1, 1, "Error: Inode %u out of range or unreadable\n", choice );
+        CONTINUE_MESSAGE;
+        return;
+    }
 
     mvprintw( 1, 1, "nlinks        : %d\n", my_inode->nlinks );
     mvprintw( 2, 1, "Owner Id      : %d\n", my_inode->owner_id );
@@ -12,27 +12,35 @@
 
 void show_root_dir( int fd )
 { 
-    unsigned char workspace[BLOCKSIZE];
+    uint8_t workspace[BLOCKSIZE];
     char size;
     int i;
     int row;
     unsigned int local_freemap_blocksize;
     unsigned int local_inodetable_blocksize;
-    uint8_t *root_block;
+    const uint8_t *directory;
+    const uint8_t *root_block;
 
     clear( );
     
-    struct gfs_super_block *my_super = (struct gfs_super_block *)workspace;
-
-    lseek( fd, 0, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
+    const struct gfs_super_block *my_super = image_super( fd, workspace );
 
+    if( my_super == NULL ) {
+        mvprintw( 1, 1, "Unable to read the superblock" );
+        CONTINUE_MESSAGE;
+        return;
+    }
     local_freemap_blocksize = my_super->blockfreemap_blocks;
     local_inodetable_blocksize = my_super->inodetable_blocks;
      
-    lseek( fd, ( 1 + 2 * local_freemap_blocksize + local_inodetable_blocksize ) * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
-    root_block = workspace;
+    directory = image_block(
+        fd, 1 + 2 * local_freemap_blocksize + local_inodetable_blocksize, workspace );
+    if( directory == NULL ) {
+        mvprintw( 1, 1, "Unable to read the root directory" );
+        CONTINUE_MESSAGE;
+        return;
+    }
+    root_block = directory;
 
     mvprintw( 1, 1, "Root directory in block #%d",
              1 + 2 * local_freemap_blocksize + local_inodetable_blocksize );
@@ -44,22 +52,25 @@ void show_root_dir( int fd )
     while( 1 ) {
 
         // Print the offset.
-        mvprintw( row, 1, "%10ld ", root_block - workspace );
+        mvprintw( row, 1, "%10ld ", (long)( root_block - directory ) );
 
         // Print the next offset.
-        printw( "%10d ", ( *(unsigned int *)root_block ) );
+        printw( "%10d ", ( *(const unsigned int *)root_block ) );
 
         // Print I-node number.
-        printw( "%10d ", ( *(unsigned int *)(root_block + 4)));
+        printw( "%10d ", ( *(const unsigned int *)(root_block + 4)));
         size = *( root_block + 8 );
     
         // Print filename.
         for( i = 0; i < size; i++ )
             printw( "%c", *( root_block + i + 9 ) );          
 	
-        if( *(unsigned int *)root_block == 0 ) break;
+        if( *(const unsigned int *)root_block == 0 ) break;
+
+        // Stay inside the block even if the directory is damaged.
+        if( *(const unsigned int *)root_block > BLOCKSIZE - 9 ) break;
 
-        root_block = workspace + ( *(unsigned int*)root_block );
+        root_block = directory + ( *(const unsigned int *)root_block );
         ++row;
     }
 
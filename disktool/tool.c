@@ -12,3 +12,4 @@ uint32_t freemap_bytesize;      // Size of the freemap in bytes.
 uint32_t freemap_blocksize;     // Size of the freemap in blocks.
 uint32_t inodetable_bytesize;   // Size of the inode table in bytes.
 uint32_t inodetable_blocksize;  // Size of the inode table in blocks.
+int      batch_mode;            // =1 when running a command from the command line.
@@ -27,6 +27,10 @@
                            while( getch( ) != '\r' ) ; \
                          }
 
+#define DIRECT_BLOCKS       4    // Number of block numbers held in the inode itself.
+#define POINTERS_PER_BLOCK  ( BLOCKSIZE / sizeof( uint32_t ) )
+#define MAX_NAME_LENGTH     255  // Longest name disktool will create.
+
 // ===============================
 //           Global Data
 // ===============================
@@ -36,12 +40,14 @@ extern uint32_t freemap_bytesize;      // Size of the freemap in bytes.
 extern uint32_t freemap_blocksize;     // Size of the freemap in blocks.
 extern uint32_t inodetable_bytesize;   // Size of the inode table in bytes.
 extern uint32_t inodetable_blocksize;  // Size of the inode table in blocks.
+extern int      batch_mode;            // =1 when running a command from the command line.
 
 // ============================================
 //           Implementation Functions
 // ============================================
 
 void create_dir( int fd );
+int  format_partition( int fd, int scrub );
 void create_file( int fd );
 void initialize( int fd );
 void show_inode_freemap( int fd );
@@ -51,14 +57,49 @@ void show_block( int fd );
 void show_file( int fd );
 void show_root_dir( int fd );
 void verify_file_system( int fd );
+int  check_file_system( int fd );
+
+// Copying from the host.
+int store_file(
+    int fd, int source, const uint8_t *data, uint32_t size, struct gfs_inode *inode );
+int populate( int fd, const char *path );
+
+// Command line interface.
+int is_command( const char *name );
+int run_command( int argc, char **argv );
 
 // =====================================
 //           Utility Functions
 // =====================================
 
+// Partition geometry.
+int set_sizes( int fd );
+
+// Mapped access to the partition.
+int  map_image( int fd );
+void unmap_image( void );
+const uint8_t                *image_blocks(
+    int fd, uint32_t first, uint32_t count, uint8_t *workspace );
+const uint8_t                *image_block( int fd, uint32_t block_number, uint8_t *workspace );
+const struct gfs_super_block *image_super( int fd, uint8_t *workspace );
+const struct gfs_inode       *image_inode(
+    int fd, uint32_t inode_number, struct gfs_inode *workspace );
+
+// Reporting.
+void report( const char *format, ... );
+
 // Free map utilities.
 uint32_t allocate_block( int fd );
+uint32_t allocate_extent( int fd, uint32_t count );
 uint32_t allocate_inode( int fd );
+void     flush_freemaps( int fd );
+void     discard_freemaps( void );
+
+// Inode management.
+int      read_inode( int fd, uint32_t inode_number, struct gfs_inode *inode );
+int      write_inode( int fd, uint32_t inode_number, const struct gfs_inode *inode );
+uint32_t file_block( int fd, const struct gfs_inode *inode, uint32_t index );
+int      set_file_block( int fd, struct gfs_inode *inode, uint32_t index, uint32_t block );
 
 // File name checking.
 int valid_filename( const char *name );
@@ -68,6 +109,12 @@ uint32_t htod32( uint32_t value );
 uint32_t dtoh32( uint32_t value );
 
 // Directory management.
+typedef int ( *entry_visitor )(
+    uint32_t inode, const char *name, uint32_t length, void *context );
+
+int walk_directory( int fd, uint32_t dir_inode, entry_visitor visitor, void *context );
+int lookup_name( int fd, uint32_t dir_inode, const char *name, uint32_t *inode );
+int lookup_path( int fd, const char *path, uint32_t *inode );
 int name_exists( int fd, uint32_t dir_inode, const char *name );
 int add_entry( int fd, uint32_t dir_inode, const char *name, uint32_t inode );
 int check_consistency( int fd, uint32_t dir_inode );
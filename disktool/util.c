@@ -1,133 +1,514 @@
 /*!
- * \file tool.h
+ * \file util.c
  * \author Peter Chapin <spicacality@kelseymountain.org>
  *
  * \brief Utility functions.
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <curses.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "genericfs.h"
 #include "tool.h"
 
-// This function is due to Daron Hume
+// The freemaps are kept in memory while the tool runs. Each map is read from the disk the first
+// time it is needed and a dirty flag is kept for each of its blocks so that flush_freemaps()
+// only writes back the blocks that were changed. A count of the free entries described by each
+// block of the map is also kept so that searches can step over full blocks without looking at
+// them. Within a block, searching is done a 64 bit word at a time: a word with all bits set
+// has no free entries and the first free entry in any other word is found by counting its
+// trailing one bits. The words are loaded directly from the disk image, so (like htod32 and
+// dtoh32 below) this assumes a little endian host: bit n of the map is then bit n % 64 of word
+// n / 64.
 //
-//
-static void mark_freemap(
-    int      fd,
-    uint32_t start_block,
-    uint32_t end_block,
-    uint32_t block,
-    int      byte,
-    int      bit)
+#define BITS_PER_WORD   64
+#define BITS_PER_BLOCK  ( BLOCKSIZE * 8 )
+#define WORDS_PER_BLOCK ( BLOCKSIZE / sizeof( uint64_t ) )
+
+struct freemap {
+    uint32_t  start_block;  // First block of the map on the disk.
+    uint64_t *words;        // The map itself (NULL if not yet loaded).
+    uint8_t  *dirty;        // One flag for each block of the map.
+    uint32_t *free_counts;  // Number of free entries described by each block of the map.
+    uint32_t  next_free;    // No free entries exist before this one.
+};
+
+static struct freemap inode_map;
+static struct freemap block_map;
+
+
+// Returns the number of trailing zero bits in word. The word must not be zero.
+static int trailing_zeros( uint64_t word )
 {
-    uint8_t freemap_block[BLOCKSIZE];
+#if defined( __GNUC__ )
+    return __builtin_ctzll( word );
+#else
+    int count = 0;
 
-    lseek( fd, ( start_block + block ) * BLOCKSIZE, SEEK_SET );
-    read( fd, freemap_block, BLOCKSIZE );
+    while( !( word & 1 ) ) {
+        word >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
 
-    freemap_block[byte] |= ( 1 << bit );
 
-    lseek( fd, ( start_block + block ) * BLOCKSIZE, SEEK_SET );
-    write( fd, freemap_block, BLOCKSIZE );
+static int count_ones( uint64_t word )
+{
+#if defined( __GNUC__ )
+    return __builtin_popcountll( word );
+#else
+    int count = 0;
+
+    while( word != 0 ) {
+        word &= word - 1;
+        ++count;
+    }
+    return count;
+#endif
 }
 
 
-// This function is due to Daron Hume
+static void drop_freemap( struct freemap *map )
+{
+    free( map->words );
+    free( map->dirty );
+    free( map->free_counts );
+    map->words       = NULL;
+    map->dirty       = NULL;
+    map->free_counts = NULL;
+}
+
+
+// Entries past block_count don't exist. They are counted as allocated.
+static int load_freemap( int fd, struct freemap *map, uint32_t start_block )
+{
+    uint32_t i;
+    const uint8_t *data;
+
+    if( map->words != NULL ) return 1;
+
+    map->words       = malloc( freemap_blocksize * BLOCKSIZE );
+    map->dirty       = calloc( freemap_blocksize, 1 );
+    map->free_counts = calloc( freemap_blocksize, sizeof( uint32_t ) );
+    if( map->words == NULL || map->dirty == NULL || map->free_counts == NULL ) {
+        drop_freemap( map );
+        return 0;
+    }
+    data = image_blocks( fd, start_block, freemap_blocksize, (uint8_t *)map->words );
+    if( data == NULL ) {
+        drop_freemap( map );
+        return 0;
+    }
+    if( data != (uint8_t *)map->words ) {
+        memcpy( map->words, data, freemap_blocksize * BLOCKSIZE );
+    }
+    map->start_block = start_block;
+    map->next_free   = 0;
+
+    for( i = 0; i * BITS_PER_WORD < block_count; ++i ) {
+        uint64_t used = map->words[i];
+        uint32_t rest = block_count - i * BITS_PER_WORD;
+
+        if( rest < BITS_PER_WORD ) used |= ~(uint64_t)0 << rest;
+        map->free_counts[i / WORDS_PER_BLOCK] += BITS_PER_WORD - count_ones( used );
+    }
+    return 1;
+}
+
+
+// Finds the first run of count clear bits in the map and sets them. Only the first block_count
+// bits are considered. Returns the number of the first bit in the run or zero if there is no
+// such run.
 //
-static void scan_freemap(
-    int       fd,
-    uint32_t  start_block,
-    uint32_t  end_block,
-    uint32_t *block,
-    int      *byte,
-    int      *bit)
-{
-    uint8_t  freemap_block[BLOCKSIZE];
-    uint32_t current_block;
-    int      current_byte;
-    int      current_bit;
-
-    lseek( fd, BLOCKSIZE * start_block, SEEK_SET );
-
-    current_bit = 0;
-    for( current_block = 0; current_block < ( end_block - start_block ); ++current_block ) {
-        read( fd, freemap_block, BLOCKSIZE );
-
-        for( current_byte = 0; current_byte < BLOCKSIZE; ++current_byte ) {
-            if( !( freemap_block[current_byte] & 0x80 ) ) current_bit = 8;
-            if( !( freemap_block[current_byte] & 0x40 ) ) current_bit = 7;
-            if( !( freemap_block[current_byte] & 0x20 ) ) current_bit = 6;
-            if( !( freemap_block[current_byte] & 0x10 ) ) current_bit = 5;
-            if( !( freemap_block[current_byte] & 0x08 ) ) current_bit = 4;
-            if( !( freemap_block[current_byte] & 0x04 ) ) current_bit = 3;
-            if( !( freemap_block[current_byte] & 0x02 ) ) current_bit = 2;
-            if( !( freemap_block[current_byte] & 0x01 ) ) current_bit = 1;
-            if( current_bit ) break;
+static uint32_t take_clear_run( struct freemap *map, uint32_t count )
+{
+    uint32_t number = map->next_free;  // The bit being examined.
+    uint32_t first  = 0;               // Start of the current run of clear bits.
+    uint32_t run    = 0;               // Length of the current run of clear bits.
+    int      seen   = 0;               // =1 once a clear bit has been seen.
+    uint32_t i;
+
+    while( number < block_count && run < count ) {
+        uint64_t word = map->words[number / BITS_PER_WORD];
+        int      bit  = number % BITS_PER_WORD;
+
+        if( run == 0 ) {
+            uint64_t clear;
+
+            // Step over blocks of the map that have no free entries.
+            if( map->free_counts[number / BITS_PER_BLOCK] == 0 ) {
+                number = ( number / BITS_PER_BLOCK + 1 ) * BITS_PER_BLOCK;
+                continue;
+            }
+            clear = ~word >> bit;
+            if( clear == 0 ) {
+                number += BITS_PER_WORD - bit;
+                continue;
+            }
+            number += trailing_zeros( clear );
+            if( number >= block_count ) break;
+            if( !seen ) {
+                map->next_free = number;
+                seen = 1;
+            }
+            first = number;
+            run   = 1;
+            ++number;
+        }
+        else {
+            // Extend the run over the clear bits that follow.
+            uint64_t used   = word >> bit;
+            uint32_t length = ( used == 0 ) ? BITS_PER_WORD - bit : trailing_zeros( used );
+
+            if( length > count - run ) length = count - run;
+            run    += length;
+            number += length;
+            if( run < count && used != 0 && length == trailing_zeros( used ) ) run = 0;
         }
-        if( current_bit ) break;
     }
-    --current_bit;
+    if( !seen ) map->next_free = block_count;
+
+    // The run might have been cut short by the end of the map.
+    if( run > 0 && number > block_count ) run -= number - block_count;
+    if( run < count ) return 0;
+
+    for( i = first; i < first + count; ++i ) {
+        map->words[i / BITS_PER_WORD] |= (uint64_t)1 << ( i % BITS_PER_WORD );
+        map->dirty[i / BITS_PER_BLOCK] = 1;
+        --map->free_counts[i / BITS_PER_BLOCK];
+    }
+    if( map->next_free == first ) map->next_free = first + count;
+    return first;
+}
+
+
+static void write_freemap( int fd, struct freemap *map )
+{
+    uint32_t i;
+
+    if( map->words == NULL ) return;
+
+    for( i = 0; i < freemap_blocksize; ++i ) {
+        if( map->dirty[i] ) {
+            lseek( fd, (off_t)( map->start_block + i ) * BLOCKSIZE, SEEK_SET );
+            write( fd, (uint8_t *)map->words + i * BLOCKSIZE, BLOCKSIZE );
+            map->dirty[i] = 0;
+        }
+    }
+}
+
+
+//! Writes changed freemap blocks back to the disk.
+/*!
+ * The allocation functions only change the in-memory copies of the freemaps. This function
+ * must be called before anything reads the freemaps from the disk and before the program
+ * exits.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ */
+void flush_freemaps( int fd )
+{
+    write_freemap( fd, &inode_map );
+    write_freemap( fd, &block_map );
+}
+
 
-    // return something block, byte, bit?
-    *block = current_block;
-    *byte  = current_byte;
-    *bit   = current_bit;
+//! Discards the in-memory copies of the freemaps without writing them.
+/*!
+ * This function must be called when the freemaps on the disk are rewritten directly (for
+ * example when the partition is initialized). The maps are reloaded when next needed.
+ */
+void discard_freemaps( void )
+{
+    drop_freemap( &inode_map );
+    drop_freemap( &block_map );
 }
 
 
 //! Allocates a free block.
 /*!
  * This function locates a free block in the block freemap. It returns the block number
- * allocated and updates the free map to mark that block as allocated.
+ * allocated and updates the in-memory free map to mark that block as allocated.
  *
  * \param fd An open file handle to the GenericFS partition.
- * \return The block number of a newly allocated block.
- * \todo Add error reporting for the case when there are no available blocks.
+ * \return The block number of a newly allocated block or zero if there are no free blocks.
+ * Block zero is the superblock so it is never allocated.
  */
 uint32_t allocate_block( int fd )
 {
-    uint32_t block;
-    int      byte;
-    int      bit;
+    if( !load_freemap( fd, &block_map, 1 + freemap_blocksize ) ) return 0;
+    return take_clear_run( &block_map, 1 );
+}
 
-    scan_freemap( fd, 1 + freemap_blocksize, 1 + 2 * freemap_blocksize, &block, &byte, &bit );
-    mark_freemap( fd, 1 + freemap_blocksize, 1 + 2 * freemap_blocksize,  block,  byte,  bit );
-    return ( block * BLOCKSIZE * 8 ) + ( byte * 8 ) + bit;
+
+//! Allocates a run of consecutive free blocks.
+/*!
+ * This function locates the first run of count free blocks in the block freemap and marks them
+ * all as allocated.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param count The number of blocks wanted. It must not be zero.
+ * \return The number of the first block in the run or zero if there is no such run.
+ */
+uint32_t allocate_extent( int fd, uint32_t count )
+{
+    if( !load_freemap( fd, &block_map, 1 + freemap_blocksize ) ) return 0;
+    return take_clear_run( &block_map, count );
 }
 
 
 //! Allocates a free inode.
 /*!
  * This function locates a free inode in the inode freemap. It returns the inode number
- * allocated and updates the free map to mark that inode as allocated.
+ * allocated and updates the in-memory free map to mark that inode as allocated.
  *
  * \param fd An open file handle to the GenericFS partition.
- * \return The inode number of a newly allocated inode.
- * \todo Add error reporting for the case when there are no available inodes.
+ * \return The inode number of a newly allocated inode or zero if there are no free inodes.
+ * Inode zero belongs to the root directory so it is never allocated.
  */
 uint32_t allocate_inode( int fd )
 {
-    uint32_t block;
-    int      byte;
-    int      bit;
+    if( !load_freemap( fd, &inode_map, 1 ) ) return 0;
+    return take_clear_run( &inode_map, 1 );
+}
+
 
-    scan_freemap( fd, 1, 1 + freemap_blocksize, &block, &byte, &bit );
-    mark_freemap( fd, 1, 1 + freemap_blocksize,  block,  byte,  bit );
-    return ( block * BLOCKSIZE * 8 ) + ( byte * 8 ) + bit;
+// Partition geometry.
+
+//! Works out the size of the partition and of the structures on it.
+/*!
+ * The partition size comes from the block device if possible and from the file size otherwise
+ * (so that ordinary image files can be used). The global size variables are set from it.
+ *
+ * \param fd An open file handle to the partition.
+ * \return Zero if the size could not be determined; non-zero otherwise.
+ */
+int set_sizes( int fd )
+{
+    long size;                     // Size of partition in sectors.
+    struct stat file_information;  // Used when the partition is an ordinary file.
+
+    if( ioctl( fd, BLKGETSIZE, &size ) >= 0 ) {
+        block_count = size / ( BLOCKSIZE / 512 );
+    }
+    else if( fstat( fd, &file_information ) == 0 ) {
+        block_count = file_information.st_size / BLOCKSIZE;
+    }
+    else {
+        return 0;
+    }
+
+    // Assume one inode for every 4 KBytes of disk space. Thus, inode count and block count are
+    // the same. This causes the block free map and the inode free map to be the same size. The
+    // code below assumes disk inodes are 64 bytes in size. That amount is hard coded.
+    //
+    freemap_bytesize = block_count / 8;
+    if( block_count % 8 != 0 ) ++freemap_bytesize;
+    freemap_blocksize = freemap_bytesize / BLOCKSIZE;
+    if( freemap_bytesize % BLOCKSIZE != 0 ) ++freemap_blocksize;
+
+    // The table's size in bytes doesn't fit in 32 bits on large partitions. It is only
+    // displayed, but the size in blocks must be right.
+    //
+    inodetable_bytesize = block_count * 64;
+    inodetable_blocksize = ( (uint64_t)block_count * 64 + BLOCKSIZE - 1 ) / BLOCKSIZE;
+    return 1;
 }
 
 
-// File name checking.
-int valid_filename( const char *name )
+// Reporting.
+
+//! Displays a message on the screen or, in batch mode, on the standard output.
+/*!
+ * Functions used both from the menu and from the command line report what they find with this
+ * function so that the same code can serve both.
+ */
+void report( const char *format, ... )
+{
+    va_list args;
+
+    va_start( args, format );
+    if( batch_mode ) {
+        vprintf( format, args );
+    }
+    else {
+        vw_printw( stdscr, format, args );
+        refresh( );
+    }
+    va_end( args );
+}
+
+
+// Inode management.
+
+static off_t inode_position( uint32_t inode_number )
 {
-    // For now, all names are okay.
+    return (off_t)( 1 + 2*freemap_blocksize ) * BLOCKSIZE +
+           (off_t)inode_number * sizeof( struct gfs_inode );
+}
+
+
+//! Reads an inode from the inode table.
+/*!
+ * Like the other functions here that only read, this function does not use the file position
+ * so it can be called from several threads at once. The inode is copied out of the mapped
+ * partition when possible (see image.c).
+ *
+ * \return Zero if the inode number is out of range or the inode could not be read; non-zero
+ * otherwise.
+ */
+int read_inode( int fd, uint32_t inode_number, struct gfs_inode *inode )
+{
+    const struct gfs_inode *found = image_inode( fd, inode_number, inode );
+
+    if( found == NULL ) return 0;
+    if( found != inode ) *inode = *found;
     return 1;
 }
 
+
+//! Writes an inode to the inode table.
+/*!
+ * \return Zero if the inode number is out of range or the inode could not be written; non-zero
+ * otherwise.
+ */
+int write_inode( int fd, uint32_t inode_number, const struct gfs_inode *inode )
+{
+    if( inode_number >= block_count ) return 0;
+    lseek( fd, inode_position( inode_number ), SEEK_SET );
+    return write( fd, inode, sizeof( struct gfs_inode ) ) == sizeof( struct gfs_inode );
+}
+
+
+// Reads one block number from an indirection block.
+static uint32_t read_pointer( int fd, uint32_t block, uint32_t slot )
+{
+    uint8_t        workspace[BLOCKSIZE];
+    const uint8_t *pointers = image_block( fd, block, workspace );
+
+    if( pointers == NULL ) return 0;
+    return dtoh32( ( (const uint32_t *)pointers )[slot] );
+}
+
+
+// Writes one block number into an indirection block.
+static int write_pointer( int fd, uint32_t block, uint32_t slot, uint32_t value )
+{
+    value = htod32( value );
+    lseek( fd, (off_t)block * BLOCKSIZE + slot * sizeof( uint32_t ), SEEK_SET );
+    return write( fd, &value, sizeof( value ) ) == sizeof( value );
+}
+
+
+// Allocates a block and fills it with zeros. Returns zero if no block is available.
+static uint32_t allocate_zeroed_block( int fd )
+{
+    uint8_t  workspace[BLOCKSIZE];
+    uint32_t block = allocate_block( fd );
+
+    if( block == 0 ) return 0;
+    memset( workspace, 0, BLOCKSIZE );
+    lseek( fd, (off_t)block * BLOCKSIZE, SEEK_SET );
+    if( write( fd, workspace, BLOCKSIZE ) != BLOCKSIZE ) return 0;
+    return block;
+}
+
+
+//! Finds the block holding part of a file.
+/*!
+ * \param fd An open file handle to the GenericFS partition.
+ * \param inode The file's inode.
+ * \param index The position of the block in the file (zero for the file's first block).
+ * \return The block number or zero if the file has no block at that position.
+ */
+uint32_t file_block( int fd, const struct gfs_inode *inode, uint32_t index )
+{
+    uint32_t first;
+
+    if( index < DIRECT_BLOCKS ) return inode->blocks[index];
+    index -= DIRECT_BLOCKS;
+
+    if( index < POINTERS_PER_BLOCK ) {
+        if( inode->first_indirect == 0 ) return 0;
+        return read_pointer( fd, inode->first_indirect, index );
+    }
+    index -= POINTERS_PER_BLOCK;
+
+    if( index >= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK ) return 0;
+    if( inode->second_indirect == 0 ) return 0;
+    first = read_pointer( fd, inode->second_indirect, index / POINTERS_PER_BLOCK );
+    if( first == 0 ) return 0;
+    return read_pointer( fd, first, index % POINTERS_PER_BLOCK );
+}
+
+
+//! Records the block holding part of a file.
+/*!
+ * Indirection blocks are allocated as needed. The inode is updated in memory only; the caller
+ * is responsible for writing it.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param inode The file's inode.
+ * \param index The position of the block in the file (zero for the file's first block).
+ * \param block The block to put at that position.
+ * \return Zero if the position is beyond the largest possible file or if an indirection block
+ * could not be allocated; non-zero otherwise.
+ */
+int set_file_block( int fd, struct gfs_inode *inode, uint32_t index, uint32_t block )
+{
+    uint32_t first;
+
+    if( index < DIRECT_BLOCKS ) {
+        inode->blocks[index] = block;
+        return 1;
+    }
+    index -= DIRECT_BLOCKS;
+
+    if( index < POINTERS_PER_BLOCK ) {
+        if( inode->first_indirect == 0 ) {
+            inode->first_indirect = allocate_zeroed_block( fd );
+            if( inode->first_indirect == 0 ) return 0;
+        }
+        return write_pointer( fd, inode->first_indirect, index, block );
+    }
+    index -= POINTERS_PER_BLOCK;
+
+    if( index >= POINTERS_PER_BLOCK * POINTERS_PER_BLOCK ) return 0;
+    if( inode->second_indirect == 0 ) {
+        inode->second_indirect = allocate_zeroed_block( fd );
+        if( inode->second_indirect == 0 ) return 0;
+    }
+    first = read_pointer( fd, inode->second_indirect, index / POINTERS_PER_BLOCK );
+    if( first == 0 ) {
+        first = allocate_zeroed_block( fd );
+        if( first == 0 ) return 0;
+        if( !write_pointer( fd, inode->second_indirect, index / POINTERS_PER_BLOCK, first ) )
+            return 0;
+    }
+    return write_pointer( fd, first, index % POINTERS_PER_BLOCK, block );
+}
+
+
+// File name checking. Names are stored with an eight bit length and are separated by slashes
+// in paths.
+int valid_filename( const char *name )
+{
+    size_t length = strlen( name );
+
+    return length > 0 && length <= MAX_NAME_LENGTH && strchr( name, '/' ) == NULL;
+}
+
 // Endianness management. On IA-32 these functions do nothing.
 uint32_t htod32( uint32_t value )
 {
@@ -140,16 +521,219 @@ uint32_t dtoh32( uint32_t value )
 }
 
 // Directory management.
+
+// Directory entries are a linked list of variable sized records. Each record holds the offset
+// of the next record (zero in the last one), an inode number, an eight bit name length (zero
+// meaning 256) and the name itself. Records never cross a block boundary.
+//
+#define ENTRY_HEADER_SIZE 9
+
+static uint32_t entry_next( const uint8_t *raw, uint32_t offset )
+{
+    return dtoh32( *(const uint32_t *)( raw + offset ) );
+}
+
+static uint32_t entry_inode( const uint8_t *raw, uint32_t offset )
+{
+    return dtoh32( *(const uint32_t *)( raw + offset + 4 ) );
+}
+
+static uint32_t entry_length( const uint8_t *raw, uint32_t offset )
+{
+    return ( raw[offset + 8] == 0 ) ? 256 : raw[offset + 8];
+}
+
+
+//! Visits every entry in a directory.
+/*!
+ * The visitor is called for each entry with its inode number and its name (which is not null
+ * terminated). The walk stops early if the visitor returns non-zero.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param dir_inode The inode number of the directory.
+ * \param visitor The function to call for each entry.
+ * \param context Passed to the visitor unchanged.
+ * \return Zero if the directory could not be read or its entries are damaged; non-zero
+ * otherwise.
+ */
+int walk_directory( int fd, uint32_t dir_inode, entry_visitor visitor, void *context )
+{
+    struct gfs_inode directory;
+    uint8_t *raw;
+    uint32_t size;
+    uint32_t offset = 0;
+    int      result = 1;
+
+    if( !read_inode( fd, dir_inode, &directory ) || !S_ISDIR( directory.mode ) ) return 0;
+    if( ( raw = get_directory( fd, &directory ) ) == NULL ) return 0;
+    size = directory.file_size;
+
+    while( 1 ) {
+        uint32_t next;
+
+        if( offset + ENTRY_HEADER_SIZE > size ||
+            offset + ENTRY_HEADER_SIZE + entry_length( raw, offset ) > size ) {
+            result = 0;
+            break;
+        }
+        if( visitor( entry_inode( raw, offset ),
+                     (const char *)raw + offset + ENTRY_HEADER_SIZE,
+                     entry_length( raw, offset ),
+                     context ) ) break;
+
+        // The list only flows forward so a damaged directory can't make this loop forever.
+        next = entry_next( raw, offset );
+        if( next == 0 ) break;
+        if( next <= offset ) {
+            result = 0;
+            break;
+        }
+        offset = next;
+    }
+    free( raw );
+    return result;
+}
+
+
+struct name_search {
+    const char *name;
+    size_t      length;
+    uint32_t    inode;
+    int         found;
+};
+
+static int match_name( uint32_t inode, const char *name, uint32_t length, void *context )
+{
+    struct name_search *search = context;
+
+    if( length != search->length || memcmp( name, search->name, length ) != 0 ) return 0;
+    search->inode = inode;
+    search->found = 1;
+    return 1;
+}
+
+
+//! Looks up a name in a directory.
+/*!
+ * \param fd An open file handle to the GenericFS partition.
+ * \param dir_inode The inode number of the directory.
+ * \param name The name to look for.
+ * \param inode Set to the inode number of the entry if it is found.
+ * \return Non-zero if the name was found; zero otherwise.
+ */
+int lookup_name( int fd, uint32_t dir_inode, const char *name, uint32_t *inode )
+{
+    struct name_search search;
+
+    search.name   = name;
+    search.length = strlen( name );
+    search.found  = 0;
+    walk_directory( fd, dir_inode, match_name, &search );
+    if( search.found ) *inode = search.inode;
+    return search.found;
+}
+
+
+//! Looks up a path starting from the root directory.
+/*!
+ * Leading, trailing, and repeated slashes are ignored so "/", "" and "a//b/" are all accepted.
+ *
+ * \return Non-zero if every component of the path was found; zero otherwise.
+ */
+int lookup_path( int fd, const char *path, uint32_t *inode )
+{
+    char     component[MAX_NAME_LENGTH + 1];
+    uint32_t current = 0;
+
+    while( *path != '\0' ) {
+        size_t length = strcspn( path, "/" );
+
+        if( length > MAX_NAME_LENGTH ) return 0;
+        if( length > 0 ) {
+            memcpy( component, path, length );
+            component[length] = '\0';
+            if( !lookup_name( fd, current, component, &current ) ) return 0;
+        }
+        path += length;
+        if( *path == '/' ) ++path;
+    }
+    *inode = current;
+    return 1;
+}
+
+
 int name_exists( int fd, uint32_t dir_inode, const char *name )
 {
-    // For now, the name does not exist in the directory.
-    return 0;
+    uint32_t inode;
+
+    return lookup_name( fd, dir_inode, name, &inode );
 }
 
+
+//! Adds an entry to the end of a directory.
+/*!
+ * The new entry goes right after the last entry unless that would make it cross a block
+ * boundary, in which case it starts the next block. The directory is extended by one block if
+ * necessary. Once the directory's inode refers to the new block the freemaps are flushed, so
+ * the block stays allocated even if adding the entry then fails. The name is not checked
+ * against the names already in the directory.
+ *
+ * \return Zero if the entry could not be added; non-zero otherwise.
+ */
 int add_entry( int fd, uint32_t dir_inode, const char *name, uint32_t inode )
 {
-    // For now claim that we failed.
-    return 0;
+    struct gfs_inode directory;
+    uint8_t  *raw;
+    uint8_t   record[ENTRY_HEADER_SIZE + MAX_NAME_LENGTH];
+    uint32_t  length = strlen( name );
+    uint32_t  last   = 0;
+    uint32_t  position;
+    uint32_t  next;
+    uint32_t  block;
+
+    if( !valid_filename( name ) ) return 0;
+    if( !read_inode( fd, dir_inode, &directory ) || !S_ISDIR( directory.mode ) ) return 0;
+    if( ( raw = get_directory( fd, &directory ) ) == NULL ) return 0;
+
+    // Find the last entry.
+    while( ( next = entry_next( raw, last ) ) != 0 ) {
+        if( next <= last || next + ENTRY_HEADER_SIZE > directory.file_size ) {
+            free( raw );
+            return 0;
+        }
+        last = next;
+    }
+    position = last + ENTRY_HEADER_SIZE + entry_length( raw, last );
+    free( raw );
+
+    if( position / BLOCKSIZE != ( position + ENTRY_HEADER_SIZE + length - 1 ) / BLOCKSIZE )
+        position = ( position / BLOCKSIZE + 1 ) * BLOCKSIZE;
+
+    // Extend the directory if the entry doesn't fit.
+    if( position + ENTRY_HEADER_SIZE + length > directory.file_size ) {
+        if( ( block = allocate_zeroed_block( fd ) ) == 0 ) return 0;
+        if( !set_file_block( fd, &directory, directory.file_size / BLOCKSIZE, block ) )
+            return 0;
+        directory.file_size += BLOCKSIZE;
+        directory.mtime = directory.ctime = time( NULL );
+        if( !write_inode( fd, dir_inode, &directory ) ) return 0;
+        flush_freemaps( fd );
+    }
+
+    // Write the new entry first so the list is never linked to garbage.
+    *(uint32_t *)( record + 0 ) = htod32( 0 );
+    *(uint32_t *)( record + 4 ) = htod32( inode );
+    record[8] = (uint8_t)length;
+    memcpy( record + ENTRY_HEADER_SIZE, name, length );
+    block = file_block( fd, &directory, position / BLOCKSIZE );
+    lseek( fd, (off_t)block * BLOCKSIZE + position % BLOCKSIZE, SEEK_SET );
+    if( write( fd, record, ENTRY_HEADER_SIZE + length ) != ENTRY_HEADER_SIZE + length )
+        return 0;
+
+    block = file_block( fd, &directory, last / BLOCKSIZE );
+    next  = htod32( position );
+    lseek( fd, (off_t)block * BLOCKSIZE + last % BLOCKSIZE, SEEK_SET );
+    return write( fd, &next, sizeof( next ) ) == sizeof( next );
 }
 
 int check_consistency( int fd, uint32_t dir_inode )
@@ -158,21 +742,36 @@ int check_consistency( int fd, uint32_t dir_inode )
     return 1;
 }
 
+//! Reads a whole directory into memory.
+/*!
+ * Only the direct blocks and the blocks reached through the first indirect block are read, so
+ * a directory that claims to be larger than that is treated as damaged. This also keeps a
+ * corrupted size from overflowing the size of the allocation.
+ *
+ * \param fd An open file handle to the GenericFS partition.
+ * \param dir_inode The inode of the directory.
+ * \return A buffer holding the directory's blocks, which the caller must free, or NULL if
+ * the directory is damaged or could not be read.
+ */
 uint8_t *get_directory( int fd, struct gfs_inode *dir_inode )
 {
+    const uint32_t max_size = ( 4 + 1024 ) * BLOCKSIZE;
     uint32_t i;               // Loop index variable.
     uint32_t dir_blocks;      // Number of blocks in directory file.
     uint8_t *raw;             // Pointer to start of directory memory.
     uint8_t *block_stepper;   // Points at next memory for next block.
     uint32_t block_no;        // Current block number.
-    uint8_t *indirect = NULL; // Points at memory copy of 1st indirect.
+    uint8_t *indirect = NULL; // Workspace for the 1st indirect if the partition isn't mapped.
+    const uint32_t *pointers = NULL; // The block numbers in the 1st indirect.
+    const uint8_t  *data;     // The current block.
 
     // How many blocks are in the directory file?
+    if( dir_inode->file_size > max_size ) return NULL;
     dir_blocks = dir_inode->file_size / BLOCKSIZE;
     if( ( dir_inode->file_size % BLOCKSIZE ) != 0 ) dir_blocks++;
 
     // Allocate space for the required number of blocks.
-    raw = malloc( dir_blocks * BLOCKSIZE );
+    raw = malloc( (size_t)dir_blocks * BLOCKSIZE );
     if( raw == NULL ) return NULL;
     block_stepper = raw;
 
@@ -180,36 +779,32 @@ uint8_t *get_directory( int fd, struct gfs_inode *dir_inode )
     for( i = 0; i < dir_blocks; ++i ) {
         if( i < 4 ) {
             block_no = dir_inode->blocks[i];
-            lseek( fd, block_no * BLOCKSIZE, SEEK_SET );
-            read( fd, block_stepper, BLOCKSIZE );
         }
         else if( i < 4 + 1024 ) {
             // If this is the first time, load the 1st indirect block.
-            if( indirect == NULL ) {
-                block_no = dir_inode->first_indirect;
+            if( pointers == NULL ) {
                 indirect = malloc( BLOCKSIZE );
-                if( indirect == NULL ) {
-                    free( raw );
-                    return NULL;
-                }
-                lseek( fd, block_no * BLOCKSIZE, SEEK_SET );
-                read( fd, indirect, BLOCKSIZE );
+                if( indirect == NULL ||
+                    ( pointers = (const uint32_t *)image_block(
+                          fd, dir_inode->first_indirect, indirect ) ) == NULL ) break;
             }
             // Get block via 1st indirection pointer.
-            block_no = ( (uint32_t *)indirect )[i - 4];
-            lseek( fd, block_no * BLOCKSIZE, SEEK_SET );
-            read( fd, block_stepper, BLOCKSIZE );
+            block_no = pointers[i - 4];
         }
         else {
-            // Get block via 2nd indirection pointer.
-            // Bail for now. Who makes directories this large anyway?
-            free( raw );
-            free( indirect );
-            return NULL;
+            // The size was checked above, so this can't happen.
+            break;
         }
+
+        if( ( data = image_block( fd, block_no, block_stepper ) ) == NULL ) break;
+        if( data != block_stepper ) memcpy( block_stepper, data, BLOCKSIZE );
         block_stepper += BLOCKSIZE;
     }
 
     free( indirect );
+    if( i != dir_blocks ) {
+        free( raw );
+        return NULL;
+    }
     return raw;
 }
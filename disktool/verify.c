@@ -5,10 +5,17 @@
  * \brief Function to perform a file system check.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <curses.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "tool.h"
@@ -16,58 +23,804 @@
 // Because it looks nice...
 #define PRIVATE static
 
+#define MAX_THREADS   16          // Most worker threads used for any pass.
+#define CHUNK_BLOCKS  64          // Inode table blocks read by a worker at a time.
+#define INODES_PER_BLOCK ( BLOCKSIZE / sizeof( struct gfs_inode ) )
+#define PROGRESS_INTERVAL 250000000L // Nanoseconds between progress updates.
+#define PENDING_START 1024        // Initial size of the pending directory stack.
+#define SIDE_START    1024        // Initial size of a tally's side table.
+
+// Bitmaps are handled as 64 bit words. Like the freemap code in util.c this assumes a little
+// endian host so that bit n of a freemap is bit n % 64 of word n / 64.
+#define BITS_PER_WORD 64
+#define WORD_COUNT    ( ( block_count + BITS_PER_WORD - 1 ) / BITS_PER_WORD )
+
+// The number of problems found by the current check.
+PRIVATE uint32_t problem_count;
+
+// The first block after the file system metadata. Blocks in files must be at or after this.
+PRIVATE uint32_t first_data_block;
+
+// Serializes problem reports and progress updates coming from the worker threads.
+PRIVATE pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// When progress was last shown and whether the progress line is still the current line.
+PRIVATE struct timespec progress_time;
+PRIVATE int             progress_shown;
+
+
+//! Reports a problem with the file system and counts it.
+/*!
+ * This function can be called from any worker thread.
+ */
+PRIVATE void problem( const char *format, ... )
+{
+    char    message[128];
+    va_list args;
+
+    va_start( args, format );
+    vsnprintf( message, sizeof( message ), format, args );
+    va_end( args );
+
+    pthread_mutex_lock( &report_lock );
+    if( progress_shown ) report( "\n" );
+    progress_shown = 0;
+    report( "%s", message );
+    ++problem_count;
+    pthread_mutex_unlock( &report_lock );
+}
+
+
+// The kinds of damage found in an inode's block map.
+enum map_error_kind {
+    POINTER_OUT_OF_RANGE,  // The inode holds a block number outside the data area.
+    INDIRECT_DAMAGED,      // An indirection block holds a block number outside the data area.
+    PAST_END_OF_FILE,      // More blocks are mapped than the file's size needs.
+    INDIRECT_UNREADABLE    // An indirection block could not be read.
+};
+
+// A problem found in an inode's block map. The holder is the indirection block holding the bad
+// entry, or zero if the entry is in the inode itself. In an inode, slots 0 to 3 are the direct
+// blocks and slots 4 and 5 are the first and second indirect pointers.
+struct map_error {
+    enum map_error_kind kind;
+    uint32_t            inode;
+    uint32_t            holder;
+    uint32_t            slot;
+    uint32_t            value;  // The entry itself.
+};
+
+// Indexed by enum map_error_kind. Every format takes the fields in the same order.
+PRIVATE const char *map_error_formats[] = {
+    "Block number out of range: inode=%u, holder=%u, slot=%u, value=%u\n",
+    "Indirect block damaged: inode=%u, holder=%u, slot=%u, value=%u\n",
+    "Blocks mapped past end of file: inode=%u, holder=%u, slot=%u, value=%u\n",
+    "Unable to read indirect block: inode=%u, holder=%u, slot=%u, value=%u\n"
+};
+
+
+//! Reports a problem found in an inode's block map.
+PRIVATE void map_problem( const struct map_error *error )
+{
+    problem( map_error_formats[error->kind],
+             error->inode, error->holder, error->slot, error->value );
+}
+
+
+//! Shows how far a pass has got, but no more often than every PROGRESS_INTERVAL.
+/*!
+ * This function can be called from any worker thread. Nothing is shown in batch mode.
+ *
+ * \param label The name of the pass.
+ * \param done How much of the pass is finished.
+ * \param total The size of the whole pass.
+ */
+PRIVATE void show_progress( const char *label, uint32_t done, uint32_t total )
+{
+    struct timespec now;
+
+    if( batch_mode ) return;
+
+    // If another thread is reporting there's no need to wait for it.
+    if( pthread_mutex_trylock( &report_lock ) != 0 ) return;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    if( ( now.tv_sec - progress_time.tv_sec ) * 1000000000L +
+        ( now.tv_nsec - progress_time.tv_nsec ) >= PROGRESS_INTERVAL ) {
+        report( "\r%s: %u%%", label, (uint32_t)( (uint64_t)done * 100 / total ) );
+        progress_time  = now;
+        progress_shown = 1;
+    }
+    pthread_mutex_unlock( &report_lock );
+}
+
+
+//! Starts a pass that shows its progress.
+PRIVATE void start_progress( const char *label )
+{
+    if( batch_mode ) return;
+    clock_gettime( CLOCK_MONOTONIC, &progress_time );
+    report( "%s: 0%%", label );
+    progress_shown = 1;
+}
+
+
+//! Ends a pass that shows its progress.
+PRIVATE void finish_progress( const char *label )
+{
+    if( batch_mode ) return;
+    report( "\r%s: done\n", label );
+    progress_shown = 0;
+}
+
+
+//! Tells the kernel a block will be read soon.
+/*!
+ * The verifier follows block pointers around the partition. Announcing the blocks ahead of
+ * time lets the kernel fetch them while earlier ones are being processed instead of waiting
+ * for each read in turn.
+ */
+PRIVATE void read_ahead( int fd, uint32_t block_number )
+{
+    if( block_number == 0 || block_number >= block_count ) return;
+    posix_fadvise( fd, (off_t)block_number * BLOCKSIZE, BLOCKSIZE, POSIX_FADV_WILLNEED );
+}
+
+
+//! Runs a worker function on several threads and waits for them all to finish.
+/*!
+ * The workers are expected to share out their work among themselves, so the calling thread
+ * runs one copy too and it doesn't matter if fewer threads than hoped could be created.
+ *
+ * \param worker The function each thread runs.
+ * \param context Passed to every copy of the worker.
+ */
+PRIVATE void run_workers( void *( *worker )( void * ), void *context )
+{
+    pthread_t threads[MAX_THREADS - 1];
+    long      wanted = sysconf( _SC_NPROCESSORS_ONLN );
+    int       started;
+    int       i;
+
+    if( wanted < 1 ) wanted = 1;
+    if( wanted > MAX_THREADS ) wanted = MAX_THREADS;
+
+    for( started = 0; started < wanted - 1; ++started ) {
+        if( pthread_create( &threads[started], NULL, worker, context ) != 0 ) break;
+    }
+    worker( context );
+    for( i = 0; i < started; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+}
+
+
+//! Returns non-zero if the given inode is marked as allocated in the inode freemap.
+PRIVATE int inode_allocated( const uint64_t *inode_map, uint32_t inode_number )
+{
+    return ( inode_map[inode_number / BITS_PER_WORD] >> ( inode_number % BITS_PER_WORD ) ) & 1;
+}
+
+
+//! Sets a bit in a bitmap shared by several threads.
+/*!
+ * \return Non-zero if the bit was already set.
+ */
+PRIVATE int set_bit( _Atomic uint64_t *bitmap, uint32_t number )
+{
+    uint64_t bit = (uint64_t)1 << ( number % BITS_PER_WORD );
+
+    return ( atomic_fetch_or( &bitmap[number / BITS_PER_WORD], bit ) & bit ) != 0;
+}
+
+
+//! Returns non-zero if a bit is set in a bitmap shared by several threads.
+PRIVATE int test_bit( _Atomic uint64_t *bitmap, uint32_t number )
+{
+    return ( atomic_load( &bitmap[number / BITS_PER_WORD] ) >> ( number % BITS_PER_WORD ) ) & 1;
+}
+
+
+//! Reads a freemap into memory.
+/*!
+ * \param fd The handle of the partition file.
+ * \param start_block The first block of the freemap on the partition.
+ * \return A pointer to the freemap or NULL if it could not be read. The caller must free it.
+ */
+PRIVATE uint64_t *read_freemap( int fd, uint32_t start_block )
+{
+    size_t         size = (size_t)freemap_blocksize * BLOCKSIZE;
+    uint64_t      *map  = malloc( size );
+    const uint8_t *data;
+
+    if( map == NULL ) return NULL;
+    data = image_blocks( fd, start_block, freemap_blocksize, (uint8_t *)map );
+    if( data == NULL ) {
+        free( map );
+        return NULL;
+    }
+    if( data != (uint8_t *)map ) memcpy( map, data, size );
+    return map;
+}
+
+
+// A tally records how many times each block or inode is used. Each item has a two bit state
+// in a shared bitmap: unused, used once or used many times. Exact counts for the items used
+// many times are kept in a hash table on the side. On a healthy file system those are only the
+// directories (when counting inodes) so the tally takes about a sixteenth of the memory a 32
+// bit counter for each item would.
+//
+#define USED_NONE 0
+#define USED_ONCE 1
+#define USED_MANY 2
+#define EVEN_BITS 0x5555555555555555ULL
+
+struct side_entry {
+    uint32_t item;
+    uint32_t count;                // Zero if the entry is empty.
+};
+
+struct tally {
+    _Atomic uint64_t  *states;     // Two bits for each item, 32 items to a word.
+    pthread_mutex_t    lock;       // Protects the side table.
+    struct side_entry *side;
+    uint32_t           side_size;  // Always a power of two.
+    uint32_t           side_used;
+};
+
+
+//! Sets all items in a tally to unused.
+PRIVATE void clear_tally( struct tally *tally )
+{
+    uint32_t i;
+
+    for( i = 0; i < 2 * WORD_COUNT; ++i ) {
+        atomic_init( &tally->states[i], 0 );
+    }
+    memset( tally->side, 0, tally->side_size * sizeof( struct side_entry ) );
+    tally->side_used = 0;
+}
+
+
+//! Prepares a tally with an entry for each block.
+/*!
+ * \return Zero if there is not enough memory; non-zero otherwise.
+ */
+PRIVATE int create_tally( struct tally *tally )
+{
+    // Two state words are used for each freemap word.
+    tally->states    = malloc( 2 * WORD_COUNT * sizeof( uint64_t ) );
+    tally->side      = malloc( SIDE_START * sizeof( struct side_entry ) );
+    tally->side_size = SIDE_START;
+    if( tally->states == NULL || tally->side == NULL ) {
+        free( tally->states );
+        free( tally->side );
+        return 0;
+    }
+    pthread_mutex_init( &tally->lock, NULL );
+    clear_tally( tally );
+    return 1;
+}
+
+
+PRIVATE void destroy_tally( struct tally *tally )
+{
+    pthread_mutex_destroy( &tally->lock );
+    free( tally->states );
+    free( tally->side );
+}
+
+
+//! Finds the side table entry for an item, or the empty entry where it belongs.
+PRIVATE struct side_entry *find_side_entry(
+    struct side_entry *side, uint32_t side_size, uint32_t item )
+{
+    uint32_t slot = ( item * 2654435761U ) & ( side_size - 1 );
+
+    while( side[slot].count != 0 && side[slot].item != item ) {
+        slot = ( slot + 1 ) & ( side_size - 1 );
+    }
+    return &side[slot];
+}
+
+
+//! Adds to the exact count of an item that is used many times.
+/*!
+ * The side table is doubled in size when it becomes half full.
+ */
+PRIVATE void add_side_count( struct tally *tally, uint32_t item, uint32_t amount )
+{
+    struct side_entry *entry;
+
+    pthread_mutex_lock( &tally->lock );
+    if( 2 * tally->side_used >= tally->side_size && tally->side_size < block_count ) {
+        uint32_t           new_size = 2 * tally->side_size;
+        struct side_entry *new_side = calloc( new_size, sizeof( struct side_entry ) );
+        uint32_t           i;
+
+        if( new_side != NULL ) {
+            for( i = 0; i < tally->side_size; ++i ) {
+                if( tally->side[i].count == 0 ) continue;
+                *find_side_entry( new_side, new_size, tally->side[i].item ) = tally->side[i];
+            }
+            free( tally->side );
+            tally->side      = new_side;
+            tally->side_size = new_size;
+        }
+    }
+    entry = find_side_entry( tally->side, tally->side_size, item );
+    if( entry->count == 0 ) {
+        // Keep one entry empty so searches always end. The count is lost if memory is that
+        // short, but the item is still known to be used many times.
+        if( tally->side_used + 1 == tally->side_size ) {
+            pthread_mutex_unlock( &tally->lock );
+            return;
+        }
+        entry->item = item;
+        ++tally->side_used;
+    }
+    entry->count += amount;
+    pthread_mutex_unlock( &tally->lock );
+}
+
+
+//! Counts one use of an item.
+/*!
+ * This function can be called from any worker thread. The state is advanced with a compare
+ * and swap so it never carries into the neighbouring item. The first time an item becomes
+ * USED_MANY its side count starts at two.
+ */
+PRIVATE void count_use( struct tally *tally, uint32_t item )
+{
+    _Atomic uint64_t *word  = &tally->states[item / 32];
+    int               shift = 2 * ( item % 32 );
+    uint64_t          old   = atomic_load_explicit( word, memory_order_relaxed );
+    uint32_t          state;
+
+    do {
+        state = ( old >> shift ) & 3;
+        if( state == USED_MANY ) {
+            add_side_count( tally, item, 1 );
+            return;
+        }
+    } while( !atomic_compare_exchange_weak_explicit(
+                 word, &old, old + ( (uint64_t)1 << shift ),
+                 memory_order_relaxed, memory_order_relaxed ) );
+
+    if( state == USED_ONCE ) add_side_count( tally, item, 2 );
+}
+
+
+//! Returns the number of times an item has been used.
+/*!
+ * The side table is read without locking so this must only be called once counting is over.
+ */
+PRIVATE uint32_t use_count( struct tally *tally, uint32_t item )
+{
+    uint64_t word  = atomic_load_explicit( &tally->states[item / 32], memory_order_relaxed );
+    uint32_t state = ( word >> ( 2 * ( item % 32 ) ) ) & 3;
+
+    if( state != USED_MANY ) return state;
+    return find_side_entry( tally->side, tally->side_size, item )->count;
+}
+
+
+//! Packs the even bits of a word into the low 32 bits.
+PRIVATE uint64_t even_bits( uint64_t word )
+{
+    word &= EVEN_BITS;
+    word = ( word | ( word >> 1  ) ) & 0x3333333333333333ULL;
+    word = ( word | ( word >> 2  ) ) & 0x0F0F0F0F0F0F0F0FULL;
+    word = ( word | ( word >> 4  ) ) & 0x00FF00FF00FF00FFULL;
+    word = ( word | ( word >> 8  ) ) & 0x0000FFFF0000FFFFULL;
+    word = ( word | ( word >> 16 ) ) & 0x00000000FFFFFFFFULL;
+    return word;
+}
+
+
+//! Returns a bitmap of the items in a 64 item group that are used at all or used many times.
+/*!
+ * The result lines up with word index of a freemap so the two can be compared directly.
+ *
+ * \param tally The tally to examine.
+ * \param index The index of the group. It covers items 64 * index to 64 * index + 63.
+ * \param many Non-zero to find the items used many times instead of the items used at all.
+ */
+PRIVATE uint64_t used_bits( struct tally *tally, uint32_t index, int many )
+{
+    uint64_t low  = atomic_load_explicit( &tally->states[2 * index], memory_order_relaxed );
+    uint64_t high = atomic_load_explicit( &tally->states[2 * index + 1], memory_order_relaxed );
+
+    // The high bit of a state is only set for USED_MANY.
+    if( many ) {
+        low  >>= 1;
+        high >>= 1;
+    }
+    else {
+        low  |= low  >> 1;
+        high |= high >> 1;
+    }
+    return even_bits( low ) | ( even_bits( high ) << 32 );
+}
+
+
+//! Compares a tally with a freemap, 64 items at a time.
+/*!
+ * Every item marked as allocated in the freemap should be used and every item marked as free
+ * should not be. The formats are used to report each item where that isn't so.
+ *
+ * \param tally The tally with the final use counts.
+ * \param map The freemap as read by read_freemap( ).
+ * \param excluded Items that have already been reported as damaged, or NULL. They are skipped.
+ * \param unused_format Reports an allocated item that is not used.
+ * \param unallocated_format Reports a free item that is used.
+ * \param unused_count If not NULL, allocated items that are not used are counted here instead
+ * of being reported one by one.
+ */
+PRIVATE void compare_with_freemap( struct tally *tally,
+                                   const uint64_t *map,
+                                   _Atomic uint64_t *excluded,
+                                   const char *unused_format,
+                                   const char *unallocated_format,
+                                   uint32_t *unused_count )
+{
+    uint32_t index;
+    int      bit;
+
+    for( index = 0; index < WORD_COUNT; ++index ) {
+        uint64_t different = used_bits( tally, index, 0 ) ^ map[index];
+
+        if( excluded != NULL ) different &= ~atomic_load( &excluded[index] );
+
+        // Items past the end of the partition don't exist.
+        if( index == WORD_COUNT - 1 && block_count % BITS_PER_WORD != 0 ) {
+            different &= ~( ~(uint64_t)0 << ( block_count % BITS_PER_WORD ) );
+        }
+        if( different == 0 ) continue;
+
+        for( bit = 0; bit < BITS_PER_WORD; ++bit ) {
+            if( !( ( different >> bit ) & 1 ) ) continue;
+            if( ( ( map[index] >> bit ) & 1 ) && unused_count != NULL )
+                ++*unused_count;
+            else if( ( map[index] >> bit ) & 1 )
+                problem( unused_format, index * BITS_PER_WORD + bit );
+            else
+                problem( unallocated_format, index * BITS_PER_WORD + bit );
+        }
+    }
+}
+
+
+// The function applied to each allocated inode by scan_inode_table( ).
+typedef void ( *inode_visitor )(
+    int fd, uint32_t inode_number, const struct gfs_inode *inode, void *context );
+
+// Shared by the threads scanning the inode table.
+struct inode_scan {
+    int             fd;
+    const uint64_t *inode_map;
+    inode_visitor   visitor;
+    void           *context;
+    int             read_ahead;   // =1 if the visitor follows the inodes' indirect blocks.
+    const char     *label;        // The name of the pass for progress reports.
+    atomic_uint     next_chunk;   // The next chunk of the inode table to be claimed.
+    atomic_uint     chunks_done;
+    uint32_t        chunk_count;
+};
+
+PRIVATE void *inode_scan_worker( void *argument )
+{
+    struct inode_scan *scan = argument;
+    uint8_t       *workspace;
+    const uint8_t *chunk;
+    uint32_t       chunk_number;
+
+    if( ( workspace = malloc( CHUNK_BLOCKS * BLOCKSIZE ) ) == NULL ) return NULL;
+
+    while( ( chunk_number = atomic_fetch_add( &scan->next_chunk, 1 ) ) < scan->chunk_count ) {
+        uint32_t first_block = chunk_number * CHUNK_BLOCKS;
+        uint32_t blocks      = inodetable_blocksize - first_block;
+        uint32_t first_inode = first_block * INODES_PER_BLOCK;
+        uint32_t count;
+        uint32_t i;
+
+        if( blocks > CHUNK_BLOCKS ) blocks = CHUNK_BLOCKS;
+        chunk = image_blocks(
+            scan->fd, 1 + 2 * freemap_blocksize + first_block, blocks, workspace );
+        if( chunk == NULL ) {
+            problem( "Unable to read inode table block %u\n", first_block );
+            atomic_fetch_add( &scan->chunks_done, 1 );
+            continue;
+        }
+
+        // Announce every indirect block in the chunk before following any of them.
+        count = blocks * INODES_PER_BLOCK;
+        if( count > block_count - first_inode ) count = block_count - first_inode;
+        if( scan->read_ahead ) {
+            for( i = 0; i < count; ++i ) {
+                const struct gfs_inode *inode = (const struct gfs_inode *)chunk + i;
+
+                if( !inode_allocated( scan->inode_map, first_inode + i ) ) continue;
+                read_ahead( scan->fd, inode->first_indirect );
+                read_ahead( scan->fd, inode->second_indirect );
+            }
+        }
+
+        for( i = 0; i < count; ++i ) {
+            if( !inode_allocated( scan->inode_map, first_inode + i ) ) continue;
+            scan->visitor( scan->fd,
+                           first_inode + i,
+                           (const struct gfs_inode *)chunk + i,
+                           scan->context );
+        }
+        show_progress(
+            scan->label, atomic_fetch_add( &scan->chunks_done, 1 ) + 1, scan->chunk_count );
+    }
+    free( workspace );
+    return NULL;
+}
+
+
+//! Applies a function to every allocated inode.
+/*!
+ * The inode table is read in large sequential chunks. The chunks are shared out among several
+ * threads so the visitor may be called concurrently and in no particular order.
+ *
+ * \param fd The handle of the partition file.
+ * \param inode_map The inode freemap as read by read_freemap( ).
+ * \param label The name of the pass for progress reports.
+ * \param read_ahead Non-zero if the visitor follows the indirect blocks of each inode. Those
+ * blocks are then announced to the kernel before the chunk's inodes are visited.
+ * \param visitor The function to call for each allocated inode.
+ * \param context Passed to the visitor unchanged.
+ */
+PRIVATE void scan_inode_table( int fd,
+                               const uint64_t *inode_map,
+                               const char *label,
+                               int read_ahead,
+                               inode_visitor visitor,
+                               void *context )
+{
+    struct inode_scan scan;
+
+    scan.fd          = fd;
+    scan.inode_map   = inode_map;
+    scan.visitor     = visitor;
+    scan.context     = context;
+    scan.read_ahead  = read_ahead;
+    scan.label       = label;
+    scan.chunk_count = ( inodetable_blocksize + CHUNK_BLOCKS - 1 ) / CHUNK_BLOCKS;
+    atomic_init( &scan.next_chunk, 0 );
+    atomic_init( &scan.chunks_done, 0 );
+
+    // The table is read from start to end so the kernel may as well read it ahead too.
+    posix_fadvise( fd,
+                   (off_t)( 1 + 2 * freemap_blocksize ) * BLOCKSIZE,
+                   (off_t)inodetable_blocksize * BLOCKSIZE,
+                   POSIX_FADV_SEQUENTIAL );
+
+    start_progress( label );
+    run_workers( inode_scan_worker, &scan );
+    finish_progress( label );
+}
+
+
 //! Set the block counters to appropriate initial values.
 /*!
- * Most counters are initialized to zero. However the preallocated blocks used for file system
- * metadata need to have their counts initialized to one since they are, in effect, already
- * being used once.
+ * Most blocks start out unused. However the preallocated blocks used for file system metadata
+ * need to be counted once since they are, in effect, already being used once.
  *
- * \param block_counters Pointer to an array of counters with one counter for each block. The
- * array is assumed to be properly sized.
+ * \param block_counters The tally of block uses.
  */
-PRIVATE void initialize_block_counters( uint32_t *block_counters )
+PRIVATE void initialize_block_counters( struct tally *block_counters )
 {
     uint32_t i;
-    uint32_t preallocated_block_count;
 
-    memset( block_counters, 0, block_count * sizeof( uint32_t ) );
-    preallocated_block_count = 1 + 2 * freemap_blocksize + inodetable_blocksize;
-    for( i = 0; i < preallocated_block_count; ++i ) {
-	block_counters[i] = 1;
+    clear_tally( block_counters );
+    for( i = 0; i < first_data_block; ++i ) {
+        count_use( block_counters, i );
+    }
+}
+
+
+// What the block pass shares among its threads.
+struct block_pass {
+    struct tally     *block_counters;
+    _Atomic uint64_t *damaged;         // Inodes with a damaged block map.
+    _Atomic uint64_t *unsure;          // Blocks reached only through a damaged block map.
+    _Atomic uint64_t  lost;            // Most blocks damaged maps could be missing.
+};
+
+// The state of the walk over one inode's block map.
+struct map_walk {
+    int                fd;
+    uint32_t           inode_number;
+    struct block_pass *pass;
+    uint32_t           budget;   // The number of data blocks the file's size still allows.
+    uint32_t           counted;  // The number of blocks (data and indirection) counted so far.
+    uint32_t           skipped;  // At most this many blocks are below entries not followed.
+    int                damaged;  // Set once a problem is found. Later problems aren't reported.
+};
+
+// The most blocks an entry can lead to, itself included: the entries of a first indirection
+// block are data blocks, those of a second indirection block are first indirection blocks.
+#define FIRST_SPAN  ( 1 + POINTERS_PER_BLOCK )
+#define SECOND_SPAN ( 1 + POINTERS_PER_BLOCK * FIRST_SPAN )
+
+
+//! Returns non-zero if a block number is in the data area of the partition.
+/*!
+ * The comparison is unsigned so block numbers before the data area wrap around to large values
+ * and one test covers both ends.
+ */
+PRIVATE int in_data_area( uint32_t block_number )
+{
+    return block_number - first_data_block < block_count - first_data_block;
+}
+
+
+//! Checks the entries of an indirection block.
+/*!
+ * The first zero entry ends the list. The entries before it are checked without an early exit
+ * so the compiler can vectorize the loop; the block is only looked at again, to find which
+ * entry is bad, in the rare case that one is.
+ *
+ * \param block_numbers The entries of the indirection block.
+ * \param length Set to the number of entries before the first zero.
+ * \return The slot of the first entry out of range or POINTERS_PER_BLOCK if there is none.
+ */
+PRIVATE uint32_t check_pointers( const uint32_t *block_numbers, uint32_t *length )
+{
+    uint32_t count = 0;
+    uint32_t bad   = 0;
+    uint32_t i;
+
+    while( count < POINTERS_PER_BLOCK && block_numbers[count] != 0 ) ++count;
+    for( i = 0; i < count; ++i ) {
+        bad |= !in_data_area( block_numbers[i] );
+    }
+
+    *length = count;
+    if( !bad ) return POINTERS_PER_BLOCK;
+    for( i = 0; in_data_area( block_numbers[i] ); ++i ) ;
+    return i;
+}
+
+
+//! Records a problem with the block map being walked.
+/*!
+ * Only the first problem in each map is reported; the others are usually consequences of it.
+ */
+PRIVATE void walk_problem( struct map_walk *walk,
+                           enum map_error_kind kind,
+                           uint32_t holder,
+                           uint32_t slot,
+                           uint32_t value )
+{
+    struct map_error error;
+
+    if( walk->damaged ) return;
+    error.kind   = kind;
+    error.inode  = walk->inode_number;
+    error.holder = holder;
+    error.slot   = slot;
+    error.value  = value;
+    map_problem( &error );
+    walk->damaged = 1;
+}
+
+
+//! Counts a block of the file.
+/*!
+ * Once the map is known to be damaged the blocks it leads to may be garbage. They are marked as
+ * unsure instead of being counted, so they are reported neither as used twice nor as
+ * unallocated, and check_block_freemap( ) leaves them out.
+ */
+PRIVATE void count_block( struct map_walk *walk, uint32_t block_number )
+{
+    if( walk->damaged ) {
+        set_bit( walk->pass->unsure, block_number );
+        return;
+    }
+    count_use( walk->pass->block_counters, block_number );
+    ++walk->counted;
+}
+
+
+//! Checks that the file's size leaves room for an entry of its map.
+/*!
+ * Nothing is followed once the size is used up, so a garbage map can't lead the walk through
+ * more blocks than the file could hold.
+ *
+ * \param span The most blocks the entry can lead to, itself included.
+ * \return Non-zero if the entry may be followed.
+ */
+PRIVATE int within_size( struct map_walk *walk,
+                         uint32_t holder,
+                         uint32_t slot,
+                         uint32_t value,
+                         uint32_t span )
+{
+    if( walk->budget != 0 ) return 1;
+    walk_problem( walk, PAST_END_OF_FILE, holder, slot, value );
+    walk->skipped += span;
+    return 0;
+}
+
+
+//! Counts a data block of the file if the file's size allows it.
+PRIVATE void count_data_block(
+    struct map_walk *walk, uint32_t holder, uint32_t slot, uint32_t block_number )
+{
+    if( !within_size( walk, holder, slot, block_number, 1 ) ) return;
+    --walk->budget;
+    count_block( walk, block_number );
+}
+
+
+//! Gets an indirection block and checks its entries.
+/*!
+ * A block with an entry outside the data area is likely garbage, so the entries from there on
+ * are not followed.
+ *
+ * \param span The most blocks each entry can lead to, itself included.
+ * \param workspace Space for the block if the partition is not mapped (see image.c).
+ * \param block_numbers Set to point at the entries of the block.
+ * \return The number of entries to follow. Any problem has been recorded.
+ */
+PRIVATE uint32_t read_pointers( struct map_walk *walk,
+                                uint32_t holder,
+                                uint32_t slot,
+                                uint32_t indirect,
+                                uint32_t span,
+                                uint8_t *workspace,
+                                const uint32_t **block_numbers )
+{
+    uint32_t length;
+    uint32_t bad;
+
+    *block_numbers = (const uint32_t *)image_block( walk->fd, indirect, workspace );
+    if( *block_numbers == NULL ) {
+        walk_problem( walk, INDIRECT_UNREADABLE, holder, slot, indirect );
+        walk->skipped += POINTERS_PER_BLOCK * span;
+        return 0;
     }
+
+    bad = check_pointers( *block_numbers, &length );
+    if( bad != POINTERS_PER_BLOCK ) {
+        walk_problem( walk, INDIRECT_DAMAGED, indirect, bad, ( *block_numbers )[bad] );
+        walk->skipped += ( length - bad - 1 ) * span;
+        length = bad;
+    }
+    return length;
 }
 
 
 //! Locate and count each block accessible via a first indirection block.
 /*!
  * The first zero block number found in the indirection block indicates the end of the useful
- * data. No information about the file's size is used to verify this. This function assumes that
- * all block numbers are in range.
- *
- * \todo Check that block numbers are in range.
- * \todo Add error handling to the file I/O operations.
+ * data. The block number of the indirection block itself has already been checked.
  *
- * \param fd The handle of the partition file.
+ * \param walk The state of the walk over the inode's block map.
+ * \param holder The block holding the pointer to the indirection block (zero for the inode).
+ * \param slot Where the pointer is in the holder.
  * \param first_indirect The block number of the first indirection block.
- * \param block_counters Pointer to an array of counters with one counter for each block. The
- * array is assumed to be properly sized and initialized.
  */
-PRIVATE void find_first_indirection_blocks( int fd, uint32_t first_indirect, uint32_t *block_counters )
+PRIVATE void find_first_indirection_blocks(
+    struct map_walk *walk, uint32_t holder, uint32_t slot, uint32_t first_indirect )
 {
-    uint8_t   workspace[BLOCKSIZE];
-    uint32_t *block_numbers = ( uint32_t * )workspace;  // Treat array as an array of uint32_t.
-    int i;
+    uint8_t         workspace[BLOCKSIZE];
+    const uint32_t *block_numbers;
+    uint32_t        length;
+    uint32_t        i;
 
-    // The indirect block itself is being used, so count it.
-    block_counters[first_indirect]++;
+    length = read_pointers( walk, holder, slot, first_indirect, 1, workspace, &block_numbers );
 
-    lseek( fd, first_indirect * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
+    // The indirect block itself is being used, so count it.
+    count_block( walk, first_indirect );
 
     // For every non-zero block number in the indirect block, count it.
-    for( i = 0; i < BLOCKSIZE / sizeof( uint32_t ); ++i ) {
-	if( block_numbers[i] == 0 ) break;
-	block_counters[block_numbers[i]]++;
+    for( i = 0; i < length; ++i ) {
+        count_data_block( walk, first_indirect, i, block_numbers[i] );
     }
 }
 
@@ -75,87 +828,137 @@ PRIVATE void find_first_indirection_blocks( int fd, uint32_t first_indirect, uin
 //! Locate and count each block accessible via a second indirection block.
 /*!
  * The first zero block number found in the indirection block indicates the end of the useful
- * data. No information about the file's size is used to verify this. This function assumes that
- * all block numbers are in range.
+ * data. The block number of the indirection block itself has already been checked.
  *
- * \todo Check that block numbers are in range.
- * \todo Add error handling to the file I/O operations.
- *
- * \param fd The handle of the partition file.
+ * \param walk The state of the walk over the inode's block map.
  * \param second_indirect The block number of the second indirection block.
- * \param block_counters Pointer to an array of counters with one counter for each block. The
- * array is assumed to be properly sized and initialized.
  */
-PRIVATE void find_second_indirection_blocks( int fd, uint32_t second_indirect, uint32_t *block_counters )
+PRIVATE void find_second_indirection_blocks( struct map_walk *walk, uint32_t second_indirect )
 {
-    uint8_t   workspace[BLOCKSIZE];
-    uint32_t *block_numbers = ( uint32_t * )workspace; // Treat array as an array of uint32_t.
-    int i;
+    uint8_t         workspace[BLOCKSIZE];
+    const uint32_t *block_numbers;
+    uint32_t        length;
+    uint32_t        allowed;
+    uint32_t        i;
+
+    length = read_pointers(
+        walk, 0, DIRECT_BLOCKS + 1, second_indirect, FIRST_SPAN, workspace, &block_numbers );
+
+    // Each entry holds up to POINTERS_PER_BLOCK data blocks so the file's size limits how many
+    // entries there can be. This is checked first so that a garbage block costs one read.
+    allowed = ( walk->budget + POINTERS_PER_BLOCK - 1 ) / POINTERS_PER_BLOCK;
+    if( length > allowed ) {
+        walk_problem(
+            walk, PAST_END_OF_FILE, second_indirect, allowed, block_numbers[allowed] );
+        walk->skipped += ( length - allowed ) * FIRST_SPAN;
+        length = allowed;
+    }
 
     // The indirect block itself is being used, so count it.
-    block_counters[second_indirect]++;
+    count_block( walk, second_indirect );
 
-    lseek( fd, second_indirect * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
+    // Announce all the first indirection blocks before reading any of them.
+    for( i = 0; i < length; ++i ) {
+        read_ahead( walk->fd, block_numbers[i] );
+    }
 
     // For every non-zero block number, process the indicated first indirection block.
-    for( i = 0; i < BLOCKSIZE / sizeof( uint32_t ); ++i ) {
-	if( block_numbers[i] == 0 ) break;
-	find_first_indirection_blocks( fd, block_numbers[i], block_counters );
+    for( i = 0; i < length; ++i ) {
+        if( within_size( walk, second_indirect, i, block_numbers[i], FIRST_SPAN ) )
+            find_first_indirection_blocks( walk, second_indirect, i, block_numbers[i] );
+    }
+}
+
+
+//! Returns the number of blocks, data and indirection, a file with this many data blocks uses.
+PRIVATE uint32_t map_size( uint32_t data_blocks )
+{
+    uint32_t blocks = data_blocks;
+    uint32_t rest;
+
+    if( data_blocks > DIRECT_BLOCKS ) ++blocks;
+    if( data_blocks > DIRECT_BLOCKS + POINTERS_PER_BLOCK ) {
+        rest    = data_blocks - DIRECT_BLOCKS - POINTERS_PER_BLOCK;
+        blocks += 1 + ( rest + POINTERS_PER_BLOCK - 1 ) / POINTERS_PER_BLOCK;
     }
+    return blocks;
 }
 
 
 //! Finds and counts the blocks associated with a given inode.
 /*!
  * Scans over all the blocks "attached" to the given inode and increments their counts in the
- * given counter array. This function assumes block and inode numbers are all in range.
+ * given tally. It is called by scan_inode_table( ) for each allocated inode.
+ *
+ * Every block number is checked to be in the data area and the file may not map more data
+ * blocks than its size needs. The walk is bounded: nothing past the file's size is followed
+ * and neither is anything in an indirection block after an entry that is out of range.
  *
- * \todo Check that block and inode numbers are in range.
- * \todo Add error handling to the file I/O operations.
+ * Inodes with a damaged map are marked so the directory scan doesn't try to read them. The
+ * blocks reached after the damage is found are marked as unsure rather than counted. An upper
+ * bound on the blocks such a map should hold but doesn't reach is added to the pass's lost
+ * count: what the file's size calls for beyond the blocks counted, plus the most that the
+ * entries not followed could lead to.
  *
  * \param fd The handle of the partition file.
  * \param inode_number The inode number of the inode to analyze.
- * \param block_counters Pointer to an array of counters with one counter for each block. The
- * array is assumed to be properly sized and initialized.
+ * \param current_inode The inode to analyze.
+ * \param context The block pass.
  */
-PRIVATE void find_inode_blocks( int fd, uint32_t inode_number, uint32_t *block_counters )
+PRIVATE void find_inode_blocks(
+    int fd, uint32_t inode_number, const struct gfs_inode *current_inode, void *context )
 {
-    uint8_t  workspace[BLOCKSIZE];
-    struct gfs_inode *current_inode;
+    struct block_pass *pass = context;
+    struct map_walk    walk;
+    uint32_t           indirect;
+    uint32_t           expected;
     int i;
 
-    // Where is the inode in the inode table? Here "relative" means relative to the start of the
-    // inode table. The first block in the inode table is relative block zero. The inode offset
-    // is in terms of inode-sized unit. For example, an inode offset of 3 means a physical
-    // offset of 3 * sizeof( struct gfs_inode ).
-    
-    uint32_t relative_block = inode_number / ( BLOCKSIZE / sizeof( struct gfs_inode ) );
-    uint32_t inode_offset   = inode_number % ( BLOCKSIZE / sizeof( struct gfs_inode ) );
-
-    // Get the necessary block from the inode table and point at the right inode.
-    lseek( fd, ( 1 + 2*freemap_blocksize + relative_block ) * BLOCKSIZE, SEEK_SET );
-    read( fd, workspace, BLOCKSIZE );
-    current_inode =
-        ( struct gfs_inode * )( workspace + ( inode_offset * sizeof( struct gfs_inode ) ) );
+    walk.fd           = fd;
+    walk.inode_number = inode_number;
+    walk.pass         = pass;
+    walk.budget       = current_inode->file_size / BLOCKSIZE +
+                        ( current_inode->file_size % BLOCKSIZE != 0 );
+    walk.counted      = 0;
+    walk.skipped      = 0;
+    walk.damaged      = 0;
+    expected          = map_size( walk.budget );
 
     // In what follows we assume that block numbers and indirection pointers are explicity
-    // zeroed when they are not used (does the GenericFS specification require this?). No
-    // information about the file's size is considered.
+    // zeroed when they are not used (does the GenericFS specification require this?).
 
     // The direct blocks.
-    for( i = 0; i < 4; ++i ) {
-	if( current_inode->blocks[i] != 0 )
-	    block_counters[current_inode->blocks[i]]++;
+    for( i = 0; i < DIRECT_BLOCKS; ++i ) {
+	if( current_inode->blocks[i] == 0 ) continue;
+        if( !in_data_area( current_inode->blocks[i] ) )
+            walk_problem( &walk, POINTER_OUT_OF_RANGE, 0, i, current_inode->blocks[i] );
+        else
+            count_data_block( &walk, 0, i, current_inode->blocks[i] );
     }
 
     // The first indirect blocks.
-    if( current_inode->first_indirect != 0 )
-	find_first_indirection_blocks( fd, current_inode->first_indirect, block_counters );
+    indirect = current_inode->first_indirect;
+    if( indirect != 0 ) {
+        if( !in_data_area( indirect ) )
+            walk_problem( &walk, POINTER_OUT_OF_RANGE, 0, DIRECT_BLOCKS, indirect );
+        else if( within_size( &walk, 0, DIRECT_BLOCKS, indirect, FIRST_SPAN ) )
+            find_first_indirection_blocks( &walk, 0, DIRECT_BLOCKS, indirect );
+    }
 
     // The second indirect blocks.
-    if( current_inode->second_indirect != 0 )
-	find_second_indirection_blocks( fd, current_inode->second_indirect, block_counters );
+    indirect = current_inode->second_indirect;
+    if( indirect != 0 ) {
+        if( !in_data_area( indirect ) )
+            walk_problem( &walk, POINTER_OUT_OF_RANGE, 0, DIRECT_BLOCKS + 1, indirect );
+        else if( within_size( &walk, 0, DIRECT_BLOCKS + 1, indirect, SECOND_SPAN ) )
+            find_second_indirection_blocks( &walk, indirect );
+    }
+
+    if( walk.damaged ) {
+        set_bit( pass->damaged, inode_number );
+        if( walk.counted < expected ) walk.skipped += expected - walk.counted;
+        atomic_fetch_add( &pass->lost, walk.skipped );
+    }
 }
 
 
@@ -164,113 +967,100 @@ PRIVATE void find_inode_blocks( int fd, uint32_t inode_number, uint32_t *block_c
  * The unallocated inodes are skipped. Any blocks associated with them are irrelevant.
  *
  * \param fd The handle of the parition file.
- * \param block_counters Pointer to an array of counters with one counter for each block. The
- * array is assumed to be properly sized and initialized.
+ * \param inode_map The inode freemap.
+ * \param block_counters The tally of block uses.
+ * \param damaged A bitmap in which the inodes with a damaged block map are marked.
+ * \param unsure A bitmap in which the blocks reached only through damaged maps are marked.
+ * \return At most this many blocks are missing from damaged block maps.
  */
-PRIVATE void scan_inodes( int fd, uint32_t *block_counters )
+PRIVATE uint32_t scan_inodes( int fd,
+                              const uint64_t *inode_map,
+                              struct tally *block_counters,
+                              _Atomic uint64_t *damaged,
+                              _Atomic uint64_t *unsure )
 {
-    uint8_t  workspace[BLOCKSIZE];
-    uint32_t block_index;
-    int      block_offset;
-    uint32_t inode_number = 0;
-    int      bit_number;
-
-    printw( "Scanning inode " );
-
-    // Process all blocks in the block freemap.
-    for( block_index = 0; block_index < freemap_blocksize; ++block_index ) {
-
-        // Read the freemap block.
-        lseek( fd, (1 + block_index) * BLOCKSIZE, SEEK_SET );
-	read( fd, workspace, BLOCKSIZE );
-
-        // Process all bytes in the block. This loop bails out after all inodes are handled.
-	for( block_offset = 0; block_offset < BLOCKSIZE; ++block_offset ) {
+    struct block_pass pass;
+    uint64_t          lost;
 
-            // Look at every bit of this byte.
-	    for( bit_number = 0; bit_number < 8; ++bit_number ) {
-		if( workspace[block_offset] & ( 1 << bit_number ) ) {
-		    printw( "%u, ", inode_number );  // The inode we are considering.
-		    refresh( );
-		    find_inode_blocks( fd, inode_number, block_counters );
-		}
+    pass.block_counters = block_counters;
+    pass.damaged        = damaged;
+    pass.unsure         = unsure;
+    atomic_init( &pass.lost, 0 );
+    scan_inode_table( fd, inode_map, "Scanning inode table", 1, find_inode_blocks, &pass );
 
-                // Bail out once all blocks have been handled. This assumes the number of blocks
-                // on a partition equals the number of inodes on the partition.
-		++inode_number;
-		if( inode_number == block_count ) goto done;
-	    }
-	}
-    }
- done:
-    printw( "\n" );
+    // The bound adds up quickly over many damaged maps, but no more blocks than there are can
+    // be missing.
+    lost = atomic_load( &pass.lost );
+    return lost < block_count ? (uint32_t)lost : block_count;
 }
 
-
 //! Check block counters for appropriate values.
 /*!
  * Verify that each block has been counted either zero or one times. Report on counts larger
- * than one as "multiple use" errors.
+ * than one as "multiple use" errors. The tally is examined 64 blocks at a time so only the
+ * groups holding such blocks are looked at closely.
  *
- * \param block_counters Pointer to an array of counters. The value of each count reflects how
- * many times each block has been used in a file or in file system metadata.
+ * \param block_counters The tally of block uses. It reflects how many times each block has
+ * been used in a file or in file system metadata.
  */
-PRIVATE void check_block_counters( const uint32_t *block_counters )
+PRIVATE void check_block_counters( struct tally *block_counters )
 {
-    uint32_t i;
+    uint32_t index;
+    int      bit;
+
+    for( index = 0; index < WORD_COUNT; ++index ) {
+        uint64_t many = used_bits( block_counters, index, 1 );
 
-    for( i = 0; i < block_count; ++i ) {
-	if( block_counters[i] != 0 && block_counters[i] != 1 ) {
-	    printw( "Block used multiple times: block=%u, count=%u\n", i, block_counters[i] );
-	    refresh( );
-	}
+        if( many == 0 ) continue;
+        for( bit = 0; bit < BITS_PER_WORD; ++bit ) {
+            uint32_t block_number = index * BITS_PER_WORD + bit;
+
+            if( !( ( many >> bit ) & 1 ) ) continue;
+            problem( "Block used multiple times: block=%u, count=%u\n",
+                     block_number, use_count( block_counters, block_number ) );
+        }
     }
 }
 
 
 //! Compare block counters with the block free map.
 /*!
- * Verify that each allocated block has a count of exactly one and each unallocated block has a
- * count of exactly zero. Report on inconsistencies. This function assumes counts are either
- * zero or one (call check_counters() first).
+ * Verify that each allocated block is used and each unallocated block is not used. Report on
+ * inconsistencies. Blocks used more than once are reported by check_block_counters( ).
  *
- * \param block_counters Point to an array of counters. The value of each count is either zero
- * or one and reflects if the block is used in a file (via the file's inode) or in file system
- * metadata.
- */
-PRIVATE void check_block_freemap( int fd, const uint32_t *block_counters )
-{
-    uint8_t  workspace[BLOCKSIZE];
-    uint32_t block_index;
-    int      block_offset;
-    uint32_t block_number = 0;
-    int      bit_number;
-
-    lseek( fd, ( 1 + freemap_blocksize ) * BLOCKSIZE, SEEK_SET );
-    for( block_index = 0; block_index < freemap_blocksize; ++block_index ) {
-	read( fd, workspace, BLOCKSIZE );
-	for( block_offset = 0; block_offset < BLOCKSIZE; ++block_offset ) {
-	    for( bit_number = 0; bit_number < 8; ++bit_number ) {
-		if( workspace[block_offset] & ( 1 << bit_number ) ) {
-		    if( block_counters[block_number] != 1 ) {
-			printw( "Block allocated but not used: block=%u\n", block_number );
-			refresh( );
-		    }
-		}
-		else {
-		    if( block_counters[block_number] != 0 ) {
-			printw( "Unallocated block in use: block=%u\n", block_number );
-			refresh( );
-		    }
-		}
-		++block_number;
-		if( block_number == block_count ) goto done;
-	    }
-	}
-    }
- done: ;
-}
+ * Blocks reached only through damaged block maps are left out; the damage has already been
+ * reported. The blocks that damaged maps no longer reach still look allocated but unused.
+ * There is no telling which ones they are, so if any maps lost blocks the unused blocks are
+ * counted rather than reported one by one. The count is only reported if it is more than the
+ * damage already reported can account for.
+ *
+ * \param fd The handle of the partition file.
+ * \param block_counters The tally of block uses.
+ * \param unsure The blocks reached only through damaged block maps.
+ * \param lost At most this many blocks are missing from damaged block maps.
+ */
+PRIVATE void check_block_freemap(
+    int fd, struct tally *block_counters, _Atomic uint64_t *unsure, uint32_t lost )
+{
+    uint64_t *block_map = read_freemap( fd, 1 + freemap_blocksize );
+    uint32_t  unused    = 0;
 
+    if( block_map == NULL ) {
+        problem( "Unable to read the block freemap\n" );
+        return;
+    }
+    compare_with_freemap( block_counters,
+                          block_map,
+                          unsure,
+                          "Block allocated but not used: block=%u\n",
+                          "Unallocated block in use: block=%u\n",
+                          lost != 0 ? &unused : NULL );
+    if( unused > lost ) {
+        problem( "Blocks allocated but not used: count=%u, lost by damaged block maps<=%u\n",
+                 unused, lost );
+    }
+    free( block_map );
+}
 
 //! Set the inode counters to appropriate initial values.
 /*!
@@ -279,12 +1069,88 @@ PRIVATE void check_block_freemap( int fd, const uint32_t *block_counters )
  * will be discovered automatically during the file system scan and don't need to be accounted
  * for here.
  *
- * \param inode_counters Pointer to an array of counters with one counter for each inode. The
- * array is assumed to be properly sized.
+ * \param inode_counters The tally of inode uses.
+ */
+PRIVATE void initialize_inode_counters( struct tally *inode_counters )
+{
+    clear_tally( inode_counters );
+}
+
+
+// Shared by the threads crawling the directory tree. Directories waiting to be scanned are
+// kept on a stack. Each directory is pushed at most once: its bit in the visited bitmap is set
+// first.
+struct directory_scan {
+    int               fd;
+    struct tally     *inode_counters;
+    _Atomic uint64_t *visited;
+    _Atomic uint64_t *damaged;        // Inodes with a damaged block map. They aren't read.
+    atomic_uint       damaged_directories;
+    pthread_mutex_t   lock;
+    pthread_cond_t    changed;
+    uint32_t         *pending;
+    uint32_t          pending_count;
+    uint32_t          pending_size;
+    uint32_t          busy;           // The number of threads scanning a directory.
+};
+
+// What a directory entry visitor needs to know.
+struct entry_scan {
+    struct directory_scan *scan;
+    uint32_t               directory;
+};
+
+
+//! Adds a directory to the pending stack, growing it if necessary.
+/*!
+ * The caller must hold the scan's lock.
+ */
+PRIVATE void push_directory( struct directory_scan *scan, uint32_t inode_number )
+{
+    if( scan->pending_count == scan->pending_size ) {
+        uint32_t  new_size = 2 * scan->pending_size;
+        uint32_t *pending  = realloc( scan->pending, new_size * sizeof( uint32_t ) );
+
+        if( pending == NULL ) {
+            problem( "Unable to extend the directory stack: directory=%u not scanned\n",
+                     inode_number );
+            return;
+        }
+        scan->pending      = pending;
+        scan->pending_size = new_size;
+    }
+    scan->pending[scan->pending_count++] = inode_number;
+}
+
+
+//! Counts the inode mentioned in one directory entry.
+/*!
+ * Subdirectories not seen before are added to the pending stack. The `.` and `..` entries are
+ * counted but not followed.
  */
-PRIVATE void initialize_inode_counters( uint32_t *inode_counters )
+PRIVATE int count_entry(
+    uint32_t inode_number, const char *name, uint32_t length, void *context )
 {
-    printw( "INTERNAL ERROR: `initialize_inode_counters` is not implemented!\n" );
+    struct entry_scan     *entry = context;
+    struct directory_scan *scan  = entry->scan;
+    struct gfs_inode       inode;
+
+    if( inode_number >= block_count ) {
+        problem( "Directory entry out of range: directory=%u, inode=%u\n",
+                 entry->directory, inode_number );
+        return 0;
+    }
+    count_use( scan->inode_counters, inode_number );
+
+    if( name[0] == '.' && ( length == 1 || ( length == 2 && name[1] == '.' ) ) ) return 0;
+    if( !read_inode( scan->fd, inode_number, &inode ) || !S_ISDIR( inode.mode ) ) return 0;
+    if( set_bit( scan->visited, inode_number ) ) return 0;
+
+    pthread_mutex_lock( &scan->lock );
+    push_directory( scan, inode_number );
+    pthread_cond_signal( &scan->changed );
+    pthread_mutex_unlock( &scan->lock );
+    return 0;
 }
 
 
@@ -292,16 +1158,66 @@ PRIVATE void initialize_inode_counters( uint32_t *inode_counters )
 /*!
  * This function walks down the linked list of directory entries for a single directory
  * specified by the given inode number. It increments the inode counter for every file and
- * directory mentioned in the list. For directories, this function calls itself recursively.
+ * directory mentioned in the list. Subdirectories are queued to be scanned later, perhaps by
+ * another thread.
  *
- * \param fd The handle of the file system partition (already opened).
+ * \param scan The state shared by the threads crawling the directory tree.
  * \param inode_number The inode number corresponding to the directory to be scanned.
- * \param inode_counters A pointer to an array of counters with one counter for each inode. The
- * array is assumed to be properly sized and initialized.
  */
-PRIVATE void scan_directory( int fd, uint32_t inode_number, uint32_t *inode_counters )
+PRIVATE void scan_directory( struct directory_scan *scan, uint32_t inode_number )
 {
-    printw( "INTERNAL ERROR: `scan_directory` is not implemented!\n" );
+    struct entry_scan entry;
+
+    // The damage has already been reported by the block pass.
+    if( test_bit( scan->damaged, inode_number ) ) {
+        atomic_fetch_add( &scan->damaged_directories, 1 );
+        return;
+    }
+
+    // A damaged directory is marked like a damaged block map. What it links to can't be
+    // counted properly, so its own links aren't checked either.
+    entry.scan      = scan;
+    entry.directory = inode_number;
+    if( !walk_directory( scan->fd, inode_number, count_entry, &entry ) ) {
+        problem( "Damaged directory: inode=%u\n", inode_number );
+        set_bit( scan->damaged, inode_number );
+        atomic_fetch_add( &scan->damaged_directories, 1 );
+    }
+}
+
+
+//! Takes directories from the pending stack until the whole tree has been scanned.
+/*!
+ * The scan is finished when the stack is empty and no thread is scanning a directory (which
+ * might add more to the stack).
+ */
+PRIVATE void *directory_scan_worker( void *argument )
+{
+    struct directory_scan *scan = argument;
+
+    pthread_mutex_lock( &scan->lock );
+    while( 1 ) {
+        uint32_t inode_number;
+
+        while( scan->pending_count == 0 && scan->busy != 0 ) {
+            pthread_cond_wait( &scan->changed, &scan->lock );
+        }
+        if( scan->pending_count == 0 ) break;
+
+        inode_number = scan->pending[--scan->pending_count];
+        ++scan->busy;
+        pthread_mutex_unlock( &scan->lock );
+
+        scan_directory( scan, inode_number );
+
+        pthread_mutex_lock( &scan->lock );
+        --scan->busy;
+        if( scan->busy == 0 && scan->pending_count == 0 ) {
+            pthread_cond_broadcast( &scan->changed );
+        }
+    }
+    pthread_mutex_unlock( &scan->lock );
+    return NULL;
 }
 
 
@@ -310,31 +1226,100 @@ PRIVATE void scan_directory( int fd, uint32_t inode_number, uint32_t *inode_coun
  * This function crawls the enitre file system, directory by directory. For each directory, it
  * walks the linked list of directory entries noting which inode is referenced by the directory
  * entries. The counter for an inode is incremented whenever that inode is encountered.
+ * Directories are scanned by several threads at once.
  *
  * \param fd The handle to the file system partition (already opened).
- * \param inode_counters A pointer to an array of counters with one counter for each inode. The
- * array is assumed to be properly sized and initialized.
+ * \param inode_counters The tally of inode uses.
+ * \param damaged The inodes with a damaged block map, as found by scan_inodes( ). Damaged
+ * directories are added to it.
+ * \return The number of directories that could not be scanned because they are damaged.
  */
-PRIVATE void scan_filesystem( int fd, uint32_t *inode_counters )
+PRIVATE uint32_t scan_filesystem(
+    int fd, struct tally *inode_counters, _Atomic uint64_t *damaged )
 {
+    struct directory_scan scan;
+    uint32_t i;
+
+    if( !batch_mode ) report( "Scanning directories\n" );
+
+    scan.fd             = fd;
+    scan.inode_counters = inode_counters;
+    scan.visited        = malloc( WORD_COUNT * sizeof( uint64_t ) );
+    scan.damaged        = damaged;
+    scan.pending        = malloc( PENDING_START * sizeof( uint32_t ) );
+    scan.pending_count  = 0;
+    scan.pending_size   = PENDING_START;
+    scan.busy           = 0;
+    if( scan.visited == NULL || scan.pending == NULL ) {
+        problem( "Unable to allocate the directory stack\n" );
+        free( scan.visited );
+        free( scan.pending );
+        return 0;
+    }
+    for( i = 0; i < WORD_COUNT; ++i ) {
+        atomic_init( &scan.visited[i], 0 );
+    }
+    atomic_init( &scan.damaged_directories, 0 );
+    pthread_mutex_init( &scan.lock, NULL );
+    pthread_cond_init( &scan.changed, NULL );
+
     // Start the scan at the root directory, which is always inode number zero.
-    scan_directory( fd, 0, inode_counters );
+    set_bit( scan.visited, 0 );
+    push_directory( &scan, 0 );
+    run_workers( directory_scan_worker, &scan );
+
+    pthread_cond_destroy( &scan.changed );
+    pthread_mutex_destroy( &scan.lock );
+    free( scan.visited );
+    free( scan.pending );
+    return atomic_load( &scan.damaged_directories );
+}
+
+
+// What check_link_count( ) needs to know.
+struct link_check {
+    struct tally     *inode_counters;
+    _Atomic uint64_t *damaged;
+};
+
+
+//! Compares the nlinks field of one inode with its counter.
+PRIVATE void check_link_count(
+    int fd, uint32_t inode_number, const struct gfs_inode *inode, void *context )
+{
+    struct link_check *check = context;
+    uint32_t           count = use_count( check->inode_counters, inode_number );
+
+    // The `.` entry of a damaged directory and the `..` entries below it were never seen.
+    if( S_ISDIR( inode->mode ) && test_bit( check->damaged, inode_number ) ) return;
+
+    // Inodes that are never mentioned are reported by check_inode_freemap( ).
+    if( count != 0 && inode->nlinks != count ) {
+        problem( "Link count wrong: inode=%u, nlinks=%u, count=%u\n",
+                 inode_number, inode->nlinks, count );
+    }
 }
 
 
 //! Verifies that the inode counters are consistent with the nlinks field in each inode.
 /*!
- * This Function ensures the inode counter for every inode agrees with the nlinks field inside
- * the inode.
+ * This Function ensures the inode counter for every allocated inode agrees with the nlinks
+ * field inside the inode.
  *
  * \param fd The handle to the file system paritition (already opened).
- * \param inode_counters A pointer to an array of counters with one counter for each inode. The
- * array is assumed to be properly sized and with count values that reflect the number of times
- * each inode is mentioned in the directory lists.
+ * \param inode_map The inode freemap.
+ * \param inode_counters The tally of inode uses. It reflects the number of times each inode is
+ * mentioned in the directory lists.
+ * \param damaged The inodes already reported as damaged. Damaged directories are skipped.
  */
-PRIVATE void check_inode_counters( int fd, uint32_t *inode_counters )
+PRIVATE void check_inode_counters(
+    int fd, const uint64_t *inode_map, struct tally *inode_counters, _Atomic uint64_t *damaged )
 {
-    printw( "INTERNAL ERROR: `check_inode_counters` is not implemented!\n" );
+    struct link_check check;
+
+    check.inode_counters = inode_counters;
+    check.damaged        = damaged;
+    scan_inode_table( fd, inode_map, "Checking link counts", 0, check_link_count, &check );
 }
 
 
@@ -343,59 +1328,118 @@ PRIVATE void check_inode_counters( int fd, uint32_t *inode_counters )
  * This function compares the inode counters with the inode freemap to ensure that every free
  * inode has a count of zero (is not mentioned in any directory), and that ever allocated inode
  * has a positive count (is mentioned in at least one directory).
- 
- * \param fd The handle to the file system paritition (already opened).
- * \param inode_counters A pointer to an array of counters with one counter for each inode. The
- * array is assumed to be properly sized and with count values that reflect the number of times
- * each inode is mentioned in the directory lists.
+ *
+ * Inodes already reported as damaged are skipped. The inodes below damaged directories are
+ * never reached, so if there are any such directories the unreferenced inodes are reported
+ * together as one problem rather than one by one.
+ *
+ * \param inode_map The inode freemap.
+ * \param inode_counters The tally of inode uses. It reflects the number of times each inode is
+ * mentioned in the directory lists.
+ * \param damaged The inodes already reported as damaged.
+ * \param damaged_directories The number of directories that could not be scanned.
  */
-PRIVATE void check_inode_freemap( int fd, uint32_t *inode_counters )
+PRIVATE void check_inode_freemap( const uint64_t *inode_map,
+                                  struct tally *inode_counters,
+                                  _Atomic uint64_t *damaged,
+                                  uint32_t damaged_directories )
 {
-    printw( "INTERNAL ERROR: `check_inode_freemap` is not implemented!\n" );
+    uint32_t unreferenced = 0;
+
+    compare_with_freemap( inode_counters,
+                          inode_map,
+                          damaged,
+                          "Inode allocated but not referenced: inode=%u\n",
+                          "Unallocated inode referenced: inode=%u\n",
+                          damaged_directories != 0 ? &unreferenced : NULL );
+    if( unreferenced != 0 ) {
+        problem( "Inodes allocated but not referenced: count=%u, damaged directories=%u\n",
+                 unreferenced, damaged_directories );
+    }
 }
 
 
-//! Implements the 'verify' option on the main menu.
+//! Checks the file system for internal consistency.
 /*!
  * Checks the give file system, assumed to be GenericFS, for internal consistency. This function
  * assumes the number of blocks and the number of inodes on the parition are the same. This is
- * (currently) required for GenericFS, but might change in the future.
+ * (currently) required for GenericFS, but might change in the future. Each problem found is
+ * reported with report( ).
  *
  * \param fd The handle to the file system partition (previously opened).
+ * \return The number of problems found or -1 if the check could not be done.
  */
-void verify_file_system( int fd )
+int check_file_system( int fd )
 {
-    uint32_t *counters;
+    struct tally      counters;
+    uint64_t         *inode_map;
+    _Atomic uint64_t *damaged;
+    _Atomic uint64_t *unsure;
+    uint32_t          lost;                 // At most this many blocks are missing.
+    uint32_t          damaged_directories;
+    uint32_t          i;
+
+    // Allocate a tally for both block and inode checking.
+    if( !create_tally( &counters ) ) {
+        report( "FATAL ERROR: Unable to allocate counters!\n" );
+        return -1;
+    }
+    if( ( inode_map = read_freemap( fd, 1 ) ) == NULL ) {
+        report( "FATAL ERROR: Unable to read the inode freemap!\n" );
+        destroy_tally( &counters );
+        return -1;
+    }
+    damaged = malloc( WORD_COUNT * sizeof( uint64_t ) );
+    unsure  = malloc( WORD_COUNT * sizeof( uint64_t ) );
+    if( damaged == NULL || unsure == NULL ) {
+        report( "FATAL ERROR: Unable to allocate counters!\n" );
+        free( unsure );
+        free( damaged );
+        free( inode_map );
+        destroy_tally( &counters );
+        return -1;
+    }
+    for( i = 0; i < WORD_COUNT; ++i ) {
+        atomic_init( &damaged[i], 0 );
+        atomic_init( &unsure[i], 0 );
+    }
+    first_data_block = 1 + 2 * freemap_blocksize + inodetable_blocksize;
+    problem_count = 0;
+
+    if( !batch_mode ) report( "\nBLOCK CHECKING\n" );
+    initialize_block_counters( &counters );
+    lost = scan_inodes( fd, inode_map, &counters, damaged, unsure ); // Count block usage.
+    check_block_counters( &counters );                  // Verify blocks are used at most once.
+    check_block_freemap( fd, &counters, unsure, lost ); // Verify consistency of block freemap.
+
+    if( !batch_mode ) report( "\nINODE CHECKING\n" );
+    initialize_inode_counters( &counters );
+
+    // Count inode usage, then verify the counts agree with the nlinks field and with the inode
+    // freemap.
+    damaged_directories = scan_filesystem( fd, &counters, damaged );
+    check_inode_counters( fd, inode_map, &counters, damaged );
+    check_inode_freemap( inode_map, &counters, damaged, damaged_directories );
 
+    free( unsure );
+    free( damaged );
+    free( inode_map );
+    destroy_tally( &counters );
+    return problem_count;
+}
+
+
+//! Implements the 'verify' option on the main menu.
+void verify_file_system( int fd )
+{
     // Prepare the screen.
     clear( );
     move( 1, 1 );
 
-    // Allocate an array of counters for both block and inode checking.
-    counters = ( uint32_t * )malloc( block_count * sizeof( uint32_t ) );
-    if( counters == NULL ) {
-        printw( "FATAL ERROR: Unable to allocate counters!\n" );
-        CONTINUE_MESSAGE;
-        return;
-    }
-
-    printw( "\nBLOCK CHECKING\n" );
-    initialize_block_counters( counters );
-    scan_inodes( fd, counters );          // Count block usage.
-    check_block_counters( counters );     // Verify every block is used exactly zero or one times.
-    check_block_freemap( fd, counters );  // Verify consistency of the block freemap.
+    check_file_system( fd );
 
-    // TODO:
-    printw( "\nINODE CHECKING\n" );
-    initialize_inode_counters( counters );
-    scan_filesystem( fd, counters );      // Count inode usage.
-    check_inode_counters( fd, counters ); // Verify inode counts agree with nlinks field.
-    check_inode_freemap( fd, counters );  // Verify consistency of the inode freemap.
-
-    free( counters );
-    
     // Bump up the content of the screen so the continue message doesn't overwrite the last
     // line output by the checking process.
-    printw( "\n" );    
+    printw( "\n" );
     CONTINUE_MESSAGE;
 }